@@ -0,0 +1,138 @@
+/*
+ * digest-timing.c - time the MAC computation for symmetric keys
+ *
+ * Compares building a fresh digest context for every packet, hashing
+ * the key and then the packet, against reusing a context that has the
+ * key hashed in already (mac_keyctx_new() and mac_ctx_authencrypt()).
+ * For AES-CMAC "fresh" means expanding the key for every packet.
+ *
+ * usage: digest-timing [iterations]
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include "ntp.h"
+#include "ntp_stdlib.h"
+
+#define DEFAULT_ITERATIONS	1000000
+
+char	*progname;
+
+static const uint8_t key[20] = "0123456789abcdefghij";
+
+static double
+elapsed(
+	struct timespec *start
+	)
+{
+	struct timespec stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	return (stop.tv_sec - start->tv_sec)
+		+ (stop.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static size_t
+key_length(
+	int	type
+	)
+{
+	return (NID_cmac == type) ? CMAC_KEYLENGTH : sizeof(key);
+}
+
+/* what mac_authencrypt() did for every packet before key contexts */
+static int
+fresh_context(
+	int		type,
+	uint32_t *	pkt,
+	int		length
+	)
+{
+	uint8_t	digest[EVP_MAX_MD_SIZE];
+	u_int	len;
+	EVP_MD_CTX *ctx;
+	struct mac_ctx *keyctx;
+
+	if (NID_cmac == type) {
+		keyctx = mac_keyctx_new(type, key, key_length(type));
+		len = (u_int)mac_ctx_authencrypt(keyctx, pkt, length);
+		mac_keyctx_free(keyctx);
+		return (int)len;
+	}
+	ctx = EVP_MD_CTX_create();
+	EVP_DigestInit_ex(ctx, EVP_get_digestbynid(type), NULL);
+	EVP_DigestUpdate(ctx, key, sizeof(key));
+	EVP_DigestUpdate(ctx, (uint8_t *)pkt, (u_int)length);
+	EVP_DigestFinal_ex(ctx, digest, &len);
+	EVP_MD_CTX_destroy(ctx);
+	memmove((uint8_t *)pkt + length + 4, digest, len);
+	return (int)len + 4;
+}
+
+static void
+time_digest(
+	const char *	name,
+	int		type,
+	long		iterations
+	)
+{
+	uint32_t	pkt[(LEN_PKT_NOMAC + MAX_MAC_LEN) / sizeof(uint32_t)];
+	struct mac_ctx *keyctx;
+	struct timespec	start;
+	double		t_fresh, t_cached;
+	long		i;
+
+	memset(pkt, 0x5a, sizeof(pkt));
+
+	keyctx = mac_keyctx_new(type, key, key_length(type));
+	if (NULL == keyctx) {
+		printf("%-8s unsupported\n", name);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		fresh_context(type, pkt, LEN_PKT_NOMAC);
+	t_fresh = elapsed(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++)
+		mac_ctx_authencrypt(keyctx, pkt, LEN_PKT_NOMAC);
+	t_cached = elapsed(&start);
+	mac_keyctx_free(keyctx);
+
+	printf("%-8s fresh %7.1f ns/pkt  cached %7.1f ns/pkt  speedup %.2fx\n",
+	       name, t_fresh * 1e9 / iterations, t_cached * 1e9 / iterations,
+	       t_fresh / t_cached);
+}
+
+int
+main(
+	int	argc,
+	char *	argv[]
+	)
+{
+	long	iterations = DEFAULT_ITERATIONS;
+
+	progname = argv[0];
+	if (argc > 1)
+		iterations = atol(argv[1]);
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", progname);
+		exit(1);
+	}
+
+	init_lib();
+	ssl_init();
+
+	time_digest("MD5", NID_md5, iterations);
+	time_digest("SHA1", NID_sha1, iterations);
+	time_digest("AES-CMAC", NID_cmac, iterations);
+	return 0;
+}
@@ -160,6 +160,7 @@ typedef struct __endpt {
 	bool	ignore_packets; /* listen-read-drop this? */
 	struct peer *	peers;		/* list of peers using endpt */
 	u_int		peercnt;	/* count of same */
+	struct srvsock *srvsocks;	/* server thread sockets */
 } endpt;
 
 /*
@@ -628,19 +629,29 @@ struct pkt {
  */
 typedef struct mon_data	mon_entry;
 struct mon_data {
-	mon_entry *	hash_next;	/* next structure in hash list */
-	DECL_DLIST_LINK(mon_entry, mru);/* MRU list link pointers */
-	endpt *		lcladr;		/* address on which this arrived */
-	l_fp		first;		/* first time seen */
+	/* the key and what every packet updates, kept together */
+	sockaddr_u	rmtadr;		/* address of remote host */
 	l_fp		last;		/* last time seen */
 	int		leak;		/* leaky bucket accumulator */
 	int		count;		/* total packet count */
 	u_short		flags;		/* restrict flags */
 	uint8_t		vn_mode;	/* packet mode & version */
 	uint8_t		cast_flags;	/* flags MDF_?CAST */
-	sockaddr_u	rmtadr;		/* address of remote host */
+	DECL_DLIST_LINK(mon_entry, mru);/* MRU list link pointers */
+	endpt *		lcladr;		/* address on which this arrived */
+	l_fp		first;		/* first time seen */
+	uint64_t	seq;		/* when last moved to the MRU head */
 };
 
+/*
+ * An MRU entry and the key it is ranked by, for picking the top few
+ * entries of the list.
+ */
+typedef struct mon_rank_tag {
+	mon_entry *	mon;
+	double		key;
+} mon_rank;
+
 /*
  * Values for cast_flags in mon_entry and struct peer.  mon_entry uses
  * only MDF_UCAST and MDF_BCAST.
@@ -729,15 +740,15 @@ struct restrict_u_tag {
 				 RES_MSSNTP | RES_FLAKE |	\
 				 RES_NOMRULIST)
 
-/* pythonize-header: start ignoring */
-
 /*
- * Match flags
+ * Match flags.  These too are exposed, by binary reslist records.
  */
 #define	RESM_INTERFACE		0x1000	/* this is an interface */
 #define	RESM_NTPONLY		0x2000	/* match source port 123 */
 #define RESM_SOURCE		0x4000	/* from "restrict source" */
 
+/* pythonize-header: start ignoring */
+
 /*
  * Restriction configuration ops
  */
@@ -754,6 +765,19 @@ struct endpoint {
 	int	type;			/* interval entry/exit */
 };
 
+/*
+ * peer_select groups statistics for a peer used by clock_select() and
+ * select_cluster().
+ */
+typedef struct peer_select_tag {
+	struct peer *	peer;
+	double		synch;	/* sync distance */
+	double		error;	/* jitter */
+	double		seljit;	/* selection jitter */
+	double		sumsq;	/* squared offset differences */
+	double		sumsq_ref; /* sumsq when last added up */
+} peer_select;
+
 /*
  * Association matching AM[] return codes
  */
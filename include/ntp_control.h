@@ -160,6 +160,23 @@ struct ntp_control {
 #define	IFSTATS_FIELDS	12
 #define	RESLIST_FIELDS	4
 
+/*
+ * Binary bulk responses.  A READ_MRU request carrying bin=1, or a
+ * READ_ORDLIST_A request of "ifstats, bin=1" or
+ * "addr_restrictions, bin=1", is answered with records instead of a
+ * varlist.  Each record begins with its type and its length in octets
+ * and is never split across datagrams.  Fields are in network byte
+ * order.  Clients skip record types they do not know, and any octets
+ * past the fields they do.  The layouts are in docs/mode6.txt.
+ */
+#define	CTL_BIN_VERSION	1
+#define	CTL_BIN_NONCE	1	/* nonce text */
+#define	CTL_BIN_NOW	2	/* MRU walk reached the newest entry */
+#define	CTL_BIN_CURSOR	3	/* MRU entry the walk stopped at */
+#define	CTL_BIN_MRU	4	/* one MRU entry */
+#define	CTL_BIN_IFSTATS	5	/* one local address */
+#define	CTL_BIN_RESLIST	6	/* one restriction */
+
 /*
  * To prevent replay attacks, MRU list nonces age out. Time is in seconds.
  *
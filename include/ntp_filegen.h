@@ -8,6 +8,7 @@
  */
 
 #include "ntp_types.h"
+#include "ntp_stdlib.h"
 
 /*
  * supported file generation types
@@ -26,10 +27,39 @@
  */
 
 #define FGEN_FLAG_LINK		0x01 /* make a link to base name */
+#define FGEN_FLAG_BINARY	0x02 /* fixed-width records, see below */
 
 #define FGEN_FLAG_ENABLED	0x80 /* set this to really create files	  */
 				     /* without this, open is suppressed */
 
+/*
+ * A generation set which has a record layout can write its records
+ * in binary rather than as text lines. The file then starts with a
+ * header of text lines, a blank line ending it:
+ *
+ *	ntpstats-binary 1 <name> <record size>
+ *	<field name> <type> <size> <text format>
+ *	...
+ *
+ * followed by fixed-width little-endian records, one field after the
+ * other with no padding. The types are
+ *
+ *	I	uint32_t		i	int32_t
+ *	d	IEEE double		Q	l_fp, as uint64_t
+ *	s	string, NUL padded	A	address as IPv6, IPv4 mapped,
+ *					all zeros for none
+ *
+ * and the text format says how the text record shows the field. The
+ * first two fields are always day (MJD) and time (seconds past UTC
+ * midnight), so readers can find a time without decoding the rest.
+ */
+struct filegen_field {
+	const char *	name;
+	char		type;
+	uint8_t		size;
+	const char *	fmt;
+};
+
 typedef struct filegen_tag {
 	FILE *	fp;	/* file referring to current generation */
 	char *	dir;	/* currently always statsdir */
@@ -39,14 +69,34 @@ typedef struct filegen_tag {
 	u_long	id_hi;	/* upper bound of ident value */
 	uint8_t	type;	/* type of file generation */
 	uint8_t	flag;	/* flags modifying processing of file generation */
+	char *	buf;	/* records not yet handed to the writer */
+	size_t	buflen;
+	u_long	buftime; /* current_time of the oldest of them */
+	char *	wbuf;	/* records the writer thread is writing */
+	size_t	wlen;	/* nonzero while it is */
+	FILE *	wfp;	/* the file they go to */
+	u_long	dropped; /* records lost to a full buffer */
+	u_long	reported; /* dropped at the last complaint */
+	struct filegen_tag *wnext; /* next on the writer's queue */
+	const struct filegen_field *layout; /* binary records, if any */
+	int	nfields; /* in layout */
 } FILEGEN;
 
+extern	int	stats_flush_latency;	/* seconds records may wait */
+
 extern	void	filegen_setup	(FILEGEN *, uint32_t);
+extern	void	filegen_start	(FILEGEN *, uint32_t);
+extern	void	filegen_printf	(FILEGEN *, const char *, ...)
+				NTP_PRINTF(2, 3);
+extern	void	filegen_pack	(FILEGEN *, ...);
+extern	void	filegen_flush	(bool);
 extern	void	filegen_config	(FILEGEN *, const char *, const char *,
 				 u_int, u_int);
 extern	void	filegen_statsdir(void);
 extern	FILEGEN *filegen_get	(const char *);
 extern	void	filegen_register (const char *, const char *, FILEGEN *);
+extern	void	filegen_layout	(FILEGEN *, const struct filegen_field *,
+				 int);
 #ifdef DEBUG
 extern	void	filegen_unregister(const char *);
 #endif
@@ -86,8 +86,22 @@ int ntp_getopt_long(int argc, char* const argv[], const char *optstring,
 		    const struct option *longopts, int *longindex);
 
 /* a_md5encrypt.c */
+struct mac_ctx;			/* precomputed per-key MAC state */
 extern	int	mac_authdecrypt	(int, uint8_t *, uint32_t *, int, int);
 extern	int	mac_authencrypt	(int, uint8_t *, uint32_t *, int);
+extern	int	mac_ctx_authdecrypt(struct mac_ctx *, uint32_t *, int, int);
+extern	int	mac_ctx_authencrypt(struct mac_ctx *, uint32_t *, int);
+extern	struct mac_ctx *mac_keyctx_new(int, const uint8_t *, size_t);
+extern	void	mac_keyctx_free	(struct mac_ctx *);
+
+/* cmac.c */
+#define CMAC_KEYLENGTH	16	/* AES-128 */
+#define CMAC_LENGTH	16
+struct cmac_state;
+extern	struct cmac_state *cmac_new(const uint8_t *, size_t);
+extern	void	cmac_free	(struct cmac_state *);
+extern	size_t	cmac_sign	(struct cmac_state *, const void *, size_t,
+				 uint8_t *);
 extern	void	mac_setkey	(keyid_t, int, const uint8_t *, size_t);
 extern	uint32_t	addr2refid	(sockaddr_u *);
 
@@ -176,6 +190,7 @@ extern keyid_t		cache_keyid;		/* key identifier */
 extern int		cache_type;		/* key type */
 extern uint8_t *	cache_secret;		/* secret */
 extern unsigned short	cache_secretsize;	/* secret octets */
+extern struct mac_ctx *	cache_keyctx;		/* precomputed MAC state */
 extern unsigned short	cache_flags;		/* KEY_ bit flags */
 
 /* getopt.c */
@@ -115,6 +115,12 @@ extern  SOCKET	open_socket	(sockaddr_u *, bool, bool, endpt *);
 extern	void	io_open_sockets	(void);
 extern	void	io_clr_stats	(void);
 extern	void	sendpkt 	(sockaddr_u *, endpt *, void *, int);
+extern	void	sendpkt_queued	(sockaddr_u *, endpt *, void *, int);
+extern	void	flush_xmit_queue(void);
+extern	bool	spoofed_loopback(const endpt *, const sockaddr_u *);
+
+extern	SOCKET	open_worker_socket	(endpt *);
+extern	void	add_handoff_fd	(SOCKET);
 #ifdef DEBUG
 extern	void	collect_timing  (struct recvbuf *, const char *, int, l_fp *);
 #endif
@@ -133,15 +139,20 @@ extern	u_int	sys_tai;
 extern 	int	freq_cnt;
 
 /* ntp_monitor.c */
-#define MON_HASH_SIZE		(1U << mon_hash_bits)
-#define MON_HASH_MASK		(MON_HASH_SIZE - 1)
-#define	MON_HASH(addr)		(sock_hash(addr) & MON_HASH_MASK)
 extern	void	init_mon	(void);
 extern	void	mon_start	(int);
 extern	void	mon_stop	(int);
 extern	u_short	ntp_monitor	(struct recvbuf *, u_short);
 extern	void	mon_clearinterface(endpt *interface);
+extern	void	mon_lock	(void);
+extern	void	mon_unlock	(void);
 extern  int	mon_get_oldest_age(l_fp);
+extern	mon_entry *mon_lookup	(const sockaddr_u *);
+extern	mon_entry *mon_seq_next	(uint64_t);
+extern	double	mon_rate	(const mon_entry *);
+extern	size_t	mon_rank_add	(mon_rank *, size_t, size_t,
+				 mon_entry *, double);
+extern	void	mon_rank_sort	(mon_rank *, size_t);
 
 /* ntp_peer.c */
 extern	void	init_peer	(void);
@@ -171,6 +182,9 @@ extern	void	peer_clear	(struct peer *, const char *, const bool);
 extern	void 	process_packet	(struct peer *, struct pkt *, u_int);
 extern	void	clock_select	(void);
 extern	void	set_sys_leap	(uint8_t);
+extern	void	publish_reply_template(void);
+extern	void	build_reply	(struct pkt *, const struct recvbuf *,
+				 int, int, l_fp);
 
 extern	u_long	leapsec;	/* seconds to next leap (proximity class) */
 extern  int     leapdif;        /* TAI difference step at next leap second*/
@@ -188,6 +202,18 @@ extern	void	set_sys_tick_precision(double);
 extern	void	proto_config	(int, u_long, double);
 extern	void	proto_clr_stats (void);
 
+/* ntp_select.c */
+extern	void	select_intersect(struct endpoint *, int, int *, double *,
+				 double *);
+extern	int	select_cluster	(peer_select *, int, int, int);
+
+/* ntp_netlink.c */
+#ifdef HAVE_LINUX_RTNETLINK_H
+struct nlmsghdr;
+struct isc_interface;
+extern	bool	netlink_ifaddr	(struct nlmsghdr *, struct isc_interface *);
+#endif
+
 /* ntp_refclock.c */
 #ifdef	REFCLOCK
 extern	bool	refclock_newpeer (uint8_t, int, struct peer *);
@@ -208,6 +234,18 @@ extern	u_short	restrictions	(sockaddr_u *);
 extern	void	hack_restrict	(int, sockaddr_u *, sockaddr_u *,
 				 u_short, u_short, u_long);
 extern	void	restrict_source	(sockaddr_u *, bool, u_long);
+extern	void	restrict_expire	(void);
+extern	void	restrict_lock	(void);
+extern	void	restrict_unlock	(void);
+
+/* ntp_threads.c */
+#if defined(HAVE_PTHREAD) && defined(HAVE_SYS_EPOLL_H) && defined(SO_REUSEPORT)
+# define USE_SERVER_THREADS
+#endif
+extern	void	server_threads_add	(endpt *);
+extern	void	server_threads_remove	(endpt *);
+extern	void	server_threads_input	(void);
+extern	void	server_threads_collect	(void);
 
 /* ntp_timer.c */
 extern	void	init_timer	(void);
@@ -283,6 +321,7 @@ extern u_long	numasyncmsgs;		/* number of async messages we've sent */
  * Other statistics of possible interest
  */
 extern u_long packets_dropped;	/* total number of packets dropped on reception */
+extern u_long	packets_nobuf;		/* dropped for want of a receive buffer */
 extern u_long	packets_ignored;	/* received on wild card interface */
 extern u_long	packets_received;	/* total number of packets received */
 extern u_long	packets_sent;		/* total number of packets sent */
@@ -340,8 +379,6 @@ extern double	sys_offset;		/* system offset (s) */
 extern double	sys_jitter;		/* system jitter (s) */
 
 /* ntp_monitor.c */
-extern uint8_t	mon_hash_bits;		/* log2 size of hash table */
-extern mon_entry ** mon_hash;		/* MRU hash table */
 extern mon_entry mon_mru_list;		/* mru listhead */
 extern u_int	mon_enabled;		/* MON_OFF (0) or other MON_* */
 extern u_int	mru_alloc;		/* mru list + free list count */
@@ -358,6 +395,7 @@ extern u_long	mru_new;		/* allocated new slot */
 extern u_long	mru_recycleold;		/* recycle: age > maxage */
 extern u_long	mru_recyclefull;	/* recycle: full and age > minage */
 extern u_long	mru_none;		/* couldn't allocate slot */
+extern u_long	mru_prefixlimited;	/* prefix over its rate */
 extern int	mon_age;		/* preemption limit */
 
 /* ntp_peer.c */
@@ -437,6 +475,8 @@ extern restrict_u *	restrictlist4;	/* IPv4 restriction list */
 extern restrict_u *	restrictlist6;	/* IPv6 restriction list */
 extern int		ntp_minpkt;
 extern uint8_t		ntp_minpoll;
+extern int		mon_pfx_rate;
+extern int		mon_pfx_burst;
 
 /* ntp_scanner.c */
 extern uint32_t		conf_file_sum;	/* Simple sum of characters */
@@ -447,6 +487,9 @@ extern void send_via_ntp_signd(struct recvbuf *, int, keyid_t, int,
 			       struct pkt *);
 #endif
 
+/* ntp_threads.c */
+extern int	server_threads;		/* worker threads, 0 = none */
+
 /* ntp_timer.c */
 extern volatile u_long alarm_overflow;
 extern u_long	current_time;		/* seconds since startup */
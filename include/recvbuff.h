@@ -8,10 +8,9 @@
 /*
  * recvbuf memory management
  */
-#define RECV_INIT	10	/* 10 buffers initially */
-#define RECV_LOWAT	3	/* when we're down to three buffers get more */
-#define RECV_INC	5	/* get 5 more at a time */
-#define RECV_TOOMANY	40	/* this is way too many buffers */
+#define RECV_INIT	10	/* buffers unless "recvbufs" says otherwise */
+#define RECV_MAX	(1024 * 1024)	/* most "recvbufs" will allow */
+#define RECV_BATCH	8	/* most datagrams taken per recvmmsg() */
 
 /*
  * Format of a recvbuf.  Back when ntpd did true asynchronous
@@ -60,7 +59,7 @@ struct recvbuf {
 #endif /* REFCLOCK */
 };
 
-extern	void	init_recvbuff(int);
+extern	void	init_recvbuff(int, bool);
 
 /* freerecvbuf - make a single recvbuf available for reuse
  */
@@ -77,6 +76,9 @@ extern	void	freerecvbuf(struct recvbuf *);
 extern	struct recvbuf *get_free_recv_buffer(void);
 /* signal unsafe - may malloc */
 extern	struct recvbuf *get_free_recv_buffer_alloc(void);
+/* fill a vector of up to n free buffers for a batched read,
+ * returning how many were obtained */
+extern	size_t	get_free_recv_buffers(struct recvbuf **, size_t);
 
 /*   Add a buffer to the full list
  */
@@ -87,6 +89,8 @@ extern u_long free_recvbuffs(void);
 extern u_long full_recvbuffs(void);		
 extern u_long total_recvbuffs(void);
 extern u_long lowater_additions(void);
+extern u_long highwater_recvbuffs(void);	/* most ever in use */
+extern u_long shortfall_recvbuffs(void);	/* times none were free */
 		
 /*  Returns the next buffer in the full list.
  *
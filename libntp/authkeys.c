@@ -27,6 +27,7 @@ struct savekey {
 	unsigned short	type;		/* OpenSSL digest NID */
 	unsigned short	secretsize;	/* secret octets */
 	unsigned short	flags;		/* KEY_ flags that wave */
+	struct mac_ctx *keyctx;	/* precomputed MAC state */
 };
 
 /* define the payload region of symkey beyond the list pointers */
@@ -88,6 +89,7 @@ int authnumfreekeys;
 keyid_t	cache_keyid;			/* key identifier */
 uint8_t *cache_secret;			/* secret */
 unsigned short cache_secretsize;	/* secret length */
+struct mac_ctx *cache_keyctx;	/* MAC state, NULL if none */
 int cache_type;				/* OpenSSL digest NID */
 unsigned short cache_flags;		/* flags that wave */
 
@@ -296,6 +298,7 @@ freesymkey(
 		free(sk->secret);
                 sk->secret = NULL;
 	}
+	mac_keyctx_free(sk->keyctx);
 	UNLINK_SLIST(unlinked, *bucket, sk, hlink, symkey);
 	//DEBUG_ENSURE(sk == unlinked);
 	UNLINK_DLIST(sk, llink);
@@ -393,8 +396,14 @@ authhavekey(
 	}
 
 	/*
-	 * The key is found and trusted. Initialize the key cache.
+	 * The key is found and trusted. Precompute the MAC state once
+	 * so each packet only has to process itself, then initialize
+	 * the key cache.
 	 */
+	if (NULL == sk->keyctx && sk->secret != NULL)
+		sk->keyctx = mac_keyctx_new(sk->type, sk->secret,
+					    sk->secretsize);
+	cache_keyctx = sk->keyctx;
 	cache_keyid = sk->keyid;
 	cache_type = sk->type;
 	cache_flags = sk->flags;
@@ -512,6 +521,8 @@ mac_setkey(
                         free(sk->secret);
                         sk->secret = emalloc(secretsize);
 			memcpy(sk->secret, key, secretsize);
+			mac_keyctx_free(sk->keyctx);
+			sk->keyctx = NULL;
 			if (cache_keyid == keyno) {
 				cache_flags = 0;
 				cache_keyid = 0;
@@ -550,6 +561,10 @@ auth_delkeys(void)
 {
 	symkey *	sk;
 
+	/* the cached secret and digest state are about to go */
+	cache_keyid = 0;
+	cache_flags = 0;
+
 	ITER_DLIST_BEGIN(key_listhead, sk, llink, symkey)
 		/*
 		 * Don't lose info as to which keys are trusted.
@@ -561,6 +576,8 @@ auth_delkeys(void)
 				sk->secret = NULL;
 			}
 			sk->secretsize = 0;
+			mac_keyctx_free(sk->keyctx);
+			sk->keyctx = NULL;
 		} else {
 			freesymkey(sk, &key_hash[KEYHASH(sk->keyid)]);
 		}
@@ -594,6 +611,8 @@ authencrypt(
 		return 0;
 	}
 
+	if (cache_keyctx != NULL)
+		return mac_ctx_authencrypt(cache_keyctx, pkt, length);
 	return mac_authencrypt(cache_type, cache_secret, pkt, length);
 }
 
@@ -621,5 +640,7 @@ authdecrypt(
 		return false;
 	}
 
+	if (cache_keyctx != NULL)
+		return mac_ctx_authdecrypt(cache_keyctx, pkt, length, size);
 	return mac_authdecrypt(cache_type, cache_secret, pkt, length, size);
 }
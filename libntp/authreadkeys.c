@@ -149,18 +149,23 @@ msyslog(LOG_ERR, "authreadkeys: reading %s", file);
 		for (pch = upcased; '\0' != *pch; pch++)
 			*pch = (char)toupper((unsigned char)*pch);
 
-		keytype = OBJ_sn2nid(upcased);
-		if (!keytype && 'm' == tolower((unsigned char)token[0]))
-			keytype = NID_md5;
-		if (keytype == 0) {
-			msyslog(LOG_ERR,
-			    "authreadkeys: invalid type for key %d", keyno);
-			continue;
-		}
-		if (EVP_get_digestbynid(keytype) == NULL) {
-			msyslog(LOG_ERR,
-			    "authreadkeys: no algorithm for key %d", keyno);
-			continue;
+		if (!strcmp(upcased, "AES") || !strcmp(upcased, "AES-128-CMAC")) {
+			/* RFC 8573 AES-CMAC; not a digest at all */
+			keytype = NID_cmac;
+		} else {
+			keytype = OBJ_sn2nid(upcased);
+			if (!keytype && 'm' == tolower((unsigned char)token[0]))
+				keytype = NID_md5;
+			if (keytype == 0) {
+				msyslog(LOG_ERR,
+				    "authreadkeys: invalid type for key %d", keyno);
+				continue;
+			}
+			if (EVP_get_digestbynid(keytype) == NULL) {
+				msyslog(LOG_ERR,
+				    "authreadkeys: no algorithm for key %d", keyno);
+				continue;
+			}
 		}
 
 		/*
@@ -177,6 +182,11 @@ msyslog(LOG_ERR, "authreadkeys: reading %s", file);
 		}
 		len = strlen(token);
 		if (len <= 20) {	/* Bug 2537 */
+			if (NID_cmac == keytype && len != CMAC_KEYLENGTH) {
+				msyslog(LOG_ERR,
+					"authreadkeys: AES key %d must be 16 octets", keyno);
+				continue;
+			}
 			mac_setkey(keyno, keytype, (uint8_t *)token, len);
 			keys++;
 		} else {
@@ -201,6 +211,11 @@ msyslog(LOG_ERR, "authreadkeys: reading %s", file);
 					"authreadkeys: invalid hex digit for key %d", keyno);
 				continue;
 			}
+			if (NID_cmac == keytype && jlim / 2 != CMAC_KEYLENGTH) {
+				msyslog(LOG_ERR,
+					"authreadkeys: AES key %d must be 16 octets", keyno);
+				continue;
+			}
 			mac_setkey(keyno, keytype, keystr, jlim / 2);
 			keys++;
 		}
@@ -0,0 +1,123 @@
+/*
+ * cmac.c - AES-128-CMAC (RFC 4493), the MAC of RFC 8573
+ *
+ * The key schedule and the two CMAC subkeys are computed once by
+ * cmac_new(); each cmac_sign() just restarts from them.  Shared with
+ * the Python extension, so no logging and no libntp dependencies.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+# include <openssl/core_names.h>
+# define USE_EVP_MAC	/* CMAC_* is deprecated from 3.0 on */
+#else
+# include <openssl/cmac.h>
+#endif
+
+#include "ntp_stdlib.h"
+
+struct cmac_state {
+#ifdef USE_EVP_MAC
+	EVP_MAC_CTX	*ctx;
+#else
+	CMAC_CTX	*ctx;
+#endif
+};
+
+
+/*
+ * cmac_new - expand an AES-128 key for CMAC
+ *
+ * Returns NULL if the key is the wrong size or OpenSSL can't do it.
+ */
+struct cmac_state *
+cmac_new(
+	const uint8_t	*key,
+	size_t		keylen
+	)
+{
+	struct cmac_state *cs;
+#ifdef USE_EVP_MAC
+	static EVP_MAC	*mac;
+	OSSL_PARAM	params[2];
+
+	if (keylen != CMAC_KEYLENGTH)
+		return NULL;
+	if (NULL == mac && NULL == (mac = EVP_MAC_fetch(NULL, "CMAC", NULL)))
+		return NULL;
+	cs = malloc(sizeof(*cs));
+	if (NULL == cs)
+		return NULL;
+	cs->ctx = EVP_MAC_CTX_new(mac);
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_CIPHER,
+						     (char *)"AES-128-CBC", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if (NULL == cs->ctx || !EVP_MAC_init(cs->ctx, key, keylen, params)) {
+		cmac_free(cs);
+		return NULL;
+	}
+#else
+	if (keylen != CMAC_KEYLENGTH)
+		return NULL;
+	cs = malloc(sizeof(*cs));
+	if (NULL == cs)
+		return NULL;
+	cs->ctx = CMAC_CTX_new();
+	if (NULL == cs->ctx
+	    || !CMAC_Init(cs->ctx, key, keylen, EVP_aes_128_cbc(), NULL)) {
+		cmac_free(cs);
+		return NULL;
+	}
+#endif
+	return cs;
+}
+
+
+void
+cmac_free(
+	struct cmac_state *cs
+	)
+{
+	if (NULL == cs)
+		return;
+#ifdef USE_EVP_MAC
+	EVP_MAC_CTX_free(cs->ctx);
+#else
+	CMAC_CTX_free(cs->ctx);
+#endif
+	free(cs);
+}
+
+
+/*
+ * cmac_sign - compute the CMAC of data into out
+ *
+ * Returns the MAC length, CMAC_LENGTH, or zero on failure.
+ */
+size_t
+cmac_sign(
+	struct cmac_state *cs,
+	const void	*data,
+	size_t		len,
+	uint8_t		*out	/* CMAC_LENGTH octets */
+	)
+{
+	size_t	maclen = 0;
+
+	/* a NULL key restarts with the key schedule already loaded */
+#ifdef USE_EVP_MAC
+	if (!EVP_MAC_init(cs->ctx, NULL, 0, NULL)
+	    || !EVP_MAC_update(cs->ctx, data, len)
+	    || !EVP_MAC_final(cs->ctx, out, &maclen, CMAC_LENGTH))
+		return 0;
+#else
+	if (!CMAC_Init(cs->ctx, NULL, 0, NULL, NULL)
+	    || !CMAC_Update(cs->ctx, data, len)
+	    || !CMAC_Final(cs->ctx, out, &maclen))
+		return 0;
+#endif
+	return maclen;
+}
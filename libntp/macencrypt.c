@@ -1,5 +1,5 @@
 /*
- *	digest support for NTP, MD5 and with OpenSSL more
+ *	digest support for NTP, MD5 and with OpenSSL more, and AES-CMAC
  */
 #include "config.h"
 
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include <openssl/evp.h>	/* provides OpenSSL digest API */
+#include <openssl/objects.h>	/* NID_cmac */
 
 #include "ntp_fp.h"
 #include "ntp_stdlib.h"
@@ -37,6 +38,152 @@ static bool ctmemeq(const void *s1, const void *s2, size_t n) {
 	return accum == 0;
 }
 
+/*
+ * Per-key MAC state.  For digest keys, a MAC is the digest of the key
+ * followed by the packet, so md holds a context with the key already
+ * hashed in and each packet need only copy it and hash its own bytes.
+ * For AES-CMAC keys the expanded key and subkeys are kept instead.
+ */
+struct mac_ctx {
+	EVP_MD_CTX	*md;		/* digest keys */
+	struct cmac_state *cmac;	/* CMAC keys */
+};
+
+
+/*
+ * mac_keyctx_new - precompute the MAC state for a key
+ *
+ * Returns NULL if the key type can't be initialized.
+ */
+struct mac_ctx *
+mac_keyctx_new(
+	int		type,		/* NID_cmac or digest NID */
+	const uint8_t	*key,		/* key pointer */
+	size_t		keylen		/* key length */
+	)
+{
+	struct mac_ctx *mc;
+
+	ssl_init();
+	mc = emalloc_zero(sizeof(*mc));
+	if (NID_cmac == type) {
+		mc->cmac = cmac_new(key, keylen);
+		if (NULL == mc->cmac) {
+			free(mc);
+			return NULL;
+		}
+		return mc;
+	}
+	mc->md = EVP_MD_CTX_create();
+	if (!EVP_DigestInit_ex(mc->md, EVP_get_digestbynid(type), NULL)) {
+		mac_keyctx_free(mc);
+		return NULL;
+	}
+	EVP_DigestUpdate(mc->md, key, keylen);
+	return mc;
+}
+
+
+void
+mac_keyctx_free(
+	struct mac_ctx *mc
+	)
+{
+	if (NULL == mc)
+		return;
+	if (mc->md != NULL)
+		EVP_MD_CTX_destroy(mc->md);
+	cmac_free(mc->cmac);
+	free(mc);
+}
+
+
+/*
+ * mac_digest - finish the MAC of keyctx's key and the packet.
+ *
+ * Returns the MAC length, zero on failure.
+ */
+static u_int
+mac_digest(
+	struct mac_ctx	*keyctx,	/* key context */
+	uint32_t	*pkt,		/* packet pointer */
+	int		length,		/* packet length */
+	uint8_t		*digest		/* EVP_MAX_MD_SIZE octets */
+	)
+{
+	static EVP_MD_CTX *ctx;		/* reused scratch context */
+	u_int	len;
+
+	if (keyctx->cmac != NULL)
+		return (u_int)cmac_sign(keyctx->cmac, pkt, (size_t)length,
+					digest);
+	if (NULL == ctx)
+		ctx = EVP_MD_CTX_create();
+	if (!EVP_MD_CTX_copy_ex(ctx, keyctx->md))
+		return 0;
+	EVP_DigestUpdate(ctx, (uint8_t *)pkt, (u_int)length);
+	EVP_DigestFinal_ex(ctx, digest, &len);
+	return len;
+}
+
+
+/*
+ * mac_ctx_authencrypt - generate message digest from a key context
+ *
+ * Returns length of MAC including key ID and digest.
+ */
+int
+mac_ctx_authencrypt(
+	struct mac_ctx *keyctx,	/* from mac_keyctx_new() */
+	uint32_t *pkt,		/* packet pointer */
+	int	length		/* packet length */
+	)
+{
+	uint8_t	digest[EVP_MAX_MD_SIZE];
+	u_int	len;
+
+	len = mac_digest(keyctx, pkt, length, digest);
+	if (0 == len) {
+		msyslog(LOG_ERR,
+		    "MAC encrypt: digest init failed");
+		return (0);
+	}
+	memmove((uint8_t *)pkt + length + 4, digest, len);
+	return (len + 4);
+}
+
+
+/*
+ * mac_ctx_authdecrypt - verify message authenticator from a key context
+ *
+ * Returns one if digest valid, zero if invalid.
+ */
+int
+mac_ctx_authdecrypt(
+	struct mac_ctx *keyctx,	/* from mac_keyctx_new() */
+	uint32_t	*pkt,		/* packet pointer */
+	int	length,	 	/* packet length */
+	int	size		/* MAC size */
+	)
+{
+	uint8_t	digest[EVP_MAX_MD_SIZE];
+	u_int	len;
+
+	len = mac_digest(keyctx, pkt, length, digest);
+	if (0 == len) {
+		msyslog(LOG_ERR,
+		    "MAC decrypt: digest init failed");
+		return (0);
+	}
+	if ((u_int)size != len + 4) {
+		msyslog(LOG_ERR,
+		    "MAC decrypt: MAC length error");
+		return (0);
+	}
+	return (int)ctmemeq(digest, (char *)pkt + length + 4, len);
+}
+
+
 /*
  * mac_authencrypt - generate message digest
  *
@@ -50,28 +197,23 @@ mac_authencrypt(
 	int	length		/* packet length */
 	)
 {
-	uint8_t	digest[EVP_MAX_MD_SIZE];
-	u_int	len;
-	EVP_MD_CTX *ctx;
+	struct mac_ctx *keyctx;
+	int	rc;
 
 	/*
 	 * Compute digest of key concatenated with packet. Note: the
 	 * key type and digest type have been verified when the key
 	 * was created.
 	 */
-	ssl_init();
-	ctx = EVP_MD_CTX_create();
-	if (!EVP_DigestInit_ex(ctx, EVP_get_digestbynid(type), NULL)) {
+	keyctx = mac_keyctx_new(type, key, cache_secretsize);
+	if (NULL == keyctx) {
 		msyslog(LOG_ERR,
 		    "MAC encrypt: digest init failed");
 		return (0);
 	}
-	EVP_DigestUpdate(ctx, key, cache_secretsize);
-	EVP_DigestUpdate(ctx, (uint8_t *)pkt, (u_int)length);
-	EVP_DigestFinal_ex(ctx, digest, &len);
-	EVP_MD_CTX_destroy(ctx);
-	memmove((uint8_t *)pkt + length + 4, digest, len);
-	return (len + 4);
+	rc = mac_ctx_authencrypt(keyctx, pkt, length);
+	mac_keyctx_free(keyctx);
+	return rc;
 }
 
 
@@ -89,32 +231,23 @@ mac_authdecrypt(
 	int	size		/* MAC size */
 	)
 {
-	uint8_t	digest[EVP_MAX_MD_SIZE];
-	u_int	len;
-	EVP_MD_CTX *ctx;
+	struct mac_ctx *keyctx;
+	int	rc;
 
 	/*
 	 * Compute digest of key concatenated with packet. Note: the
 	 * key type and digest type have been verified when the key
 	 * was created.
 	 */
-	ssl_init();
-	ctx = EVP_MD_CTX_create();
-	if (!EVP_DigestInit_ex(ctx, EVP_get_digestbynid(type), NULL)) {
+	keyctx = mac_keyctx_new(type, key, cache_secretsize);
+	if (NULL == keyctx) {
 		msyslog(LOG_ERR,
 		    "MAC decrypt: digest init failed");
 		return (0);
 	}
-	EVP_DigestUpdate(ctx, key, cache_secretsize);
-	EVP_DigestUpdate(ctx, (uint8_t *)pkt, (u_int)length);
-	EVP_DigestFinal_ex(ctx, digest, &len);
-	EVP_MD_CTX_destroy(ctx);
-	if ((u_int)size != len + 4) {
-		msyslog(LOG_ERR,
-		    "MAC decrypt: MAC length error");
-		return (0);
-	}
-	return (int)ctmemeq(digest, (char *)pkt + length + 4, len);
+	rc = mac_ctx_authdecrypt(keyctx, pkt, length, size);
+	mac_keyctx_free(keyctx);
+	return rc;
 }
 
 /*
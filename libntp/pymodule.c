@@ -4,6 +4,7 @@
  *
  * Python binding for selected libntp library functions
  */
+#define PY_SSIZE_T_CLEAN	/* lengths for "#" formats are Py_ssize_t */
 #include <Python.h>
 
 #include "config.h"
@@ -136,6 +137,33 @@ ntpc_step_systime(PyObject *self, PyObject *args)
     return Py_BuildValue("d", step_systime(adjustment, ntp_set_tod));
 }
 
+static PyObject *
+ntpc_cmac(PyObject *self, PyObject *args)
+{
+    const char *key, *data;
+    Py_ssize_t keylen, datalen;
+    struct cmac_state *cs;
+    uint8_t mac[CMAC_LENGTH];
+    size_t maclen;
+
+    UNUSED_ARG(self);
+    if (!PyArg_ParseTuple(args, NTPSEC_PY_BYTE_FORMAT NTPSEC_PY_BYTE_FORMAT,
+			  &key, &keylen, &data, &datalen))
+	return NULL;
+    cs = cmac_new((const uint8_t *)key, (size_t)keylen);
+    if (cs == NULL) {
+	PyErr_SetString(PyExc_ValueError, "AES-CMAC key must be 16 octets");
+	return NULL;
+    }
+    maclen = cmac_sign(cs, data, (size_t)datalen, mac);
+    cmac_free(cs);
+    if (maclen == 0) {
+	PyErr_SetString(PyExc_ValueError, "AES-CMAC computation failed");
+	return NULL;
+    }
+    return Py_BuildValue(NTPSEC_PY_BYTE_FORMAT, mac, (Py_ssize_t)maclen);
+}
+
 int32_t ntp_random(void)
 /* stub random function for get_systime() */
 {
@@ -159,6 +187,8 @@ static PyMethodDef ntpc_methods[] = {
      PyDoc_STR("Adjust system time by slewing.")},
     {"step_systime",    ntpc_step_systime,   	METH_VARARGS,
      PyDoc_STR("Adjust system time by stepping.")},
+    {"cmac",    	ntpc_cmac,   		METH_VARARGS,
+     PyDoc_STR("AES-128-CMAC of data under a 16-octet key.")},
     {NULL,		NULL, 0, NULL}		/* sentinel */
 };
 
@@ -1,6 +1,8 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 #include "ntp_assert.h"
 #include "ntp_syslog.h"
@@ -8,20 +10,69 @@
 #include "ntp_lists.h"
 #include "recvbuff.h"
 
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+# define LOCKFREE_FREELIST
+#endif /* HAVE_STDATOMIC_H */
+
 
 /*
  * Memory allocation.
+ *
+ * All recvbufs live in one arena, allocated in a single piece when the
+ * I/O module starts, and again if the configuration asks for another
+ * count or for huge pages.  Buffers are a whole number of cache lines
+ * apart so no two share one, and the arena is zeroed by the thread
+ * which allocates it, so on a NUMA machine it is local to that thread.
+ *
+ * The free list is a stack of arena indexes.  Its head carries a
+ * generation count against ABA, so where <stdatomic.h> is available
+ * buffers can be taken and returned by any thread without a lock.
+ * The full FIFO still belongs to the main thread.
  */
-static u_long full_recvbufs;	/* recvbufs on full_recv_fifo */
-static u_long free_recvbufs;	/* recvbufs on free_recv_list */
-static u_long total_recvbufs;	/* total recvbufs currently in use */
-static u_long lowater_adds;	/* number of times we have added memory */
-static u_long buffer_shortfall;	/* number of missed free receive buffers
-					   between replenishments */
+#define RB_CACHELINE	64
+#define RB_STRIDE	((sizeof(recvbuf_t) + RB_CACHELINE - 1)	\
+			 & ~(size_t)(RB_CACHELINE - 1))
+#define RB_HUGEPAGE	(2 * 1024 * 1024)
+#define RB(idx)		((recvbuf_t *)(void *)(arena + (size_t)(idx) * RB_STRIDE))
+
+#ifdef LOCKFREE_FREELIST
+typedef atomic_uint_least64_t	rb_head;
+typedef atomic_uint_least32_t	rb_link;
+typedef atomic_ulong		rb_count;
+# define COUNT_GET(c)	atomic_load_explicit(&(c), memory_order_relaxed)
+# define COUNT_SET(c, n) atomic_store_explicit(&(c), (n), memory_order_relaxed)
+# define COUNT_INC(c)	atomic_fetch_add_explicit(&(c), 1, memory_order_relaxed)
+# define COUNT_DEC(c)	atomic_fetch_sub_explicit(&(c), 1, memory_order_relaxed)
+#else
+typedef uint_least64_t		rb_head;
+typedef uint_least32_t		rb_link;
+typedef u_long			rb_count;
+# define COUNT_GET(c)	(c)
+# define COUNT_SET(c, n) ((c) = (n))
+# define COUNT_INC(c)	((c)++)
+# define COUNT_DEC(c)	((c)--)
+#endif
+
+static char *	arena;		/* recvbufs, RB_STRIDE apart */
+static size_t	arena_octets;
+static bool	arena_mapped;	/* from mmap(), else posix_memalign() */
+static rb_link *free_next;	/* per buffer, next free index + 1 */
+static rb_head	free_head;	/* generation << 32 | first free index + 1 */
+
+static rb_count	free_recvbufs;	/* recvbufs on the free list */
+static u_long	full_recvbufs;	/* recvbufs on full_recv_fifo */
+static u_long	total_recvbufs;	/* recvbufs in the arena */
+static u_long	lowater_adds;	/* number of times we have added memory */
+static rb_count	buffer_shortfall; /* times the free list was empty */
+static rb_count	highwater;	/* most recvbufs ever in use at once */
 
 static DECL_FIFO_ANCHOR(recvbuf_t) full_recv_fifo;
-static recvbuf_t *		   free_recv_list;
-	
+
+static void		create_arena(u_int, bool);
+static void		free_arena(void);
+static recvbuf_t *	pop_free(void);
+static void		push_free(recvbuf_t *);
 #ifdef DEBUG
 static void uninit_recvbuff(void);
 #endif
@@ -30,7 +81,7 @@ static void uninit_recvbuff(void);
 u_long
 free_recvbuffs (void)
 {
-	return free_recvbufs;
+	return COUNT_GET(free_recvbufs);
 }
 
 u_long
@@ -51,57 +102,215 @@ lowater_additions(void)
 	return lowater_adds;
 }
 
+u_long
+highwater_recvbuffs(void)
+{
+	return COUNT_GET(highwater);
+}
+
+u_long
+shortfall_recvbuffs(void)
+{
+	return COUNT_GET(buffer_shortfall);
+}
+
 static inline void 
 initialise_buffer(recvbuf_t *buff)
 {
 	ZERO(*buff);
 }
 
-static void
-create_buffers(int nbufs)
+
+/*
+ * pop_free - take the buffer on top of the free list, or NULL
+ */
+static recvbuf_t *
+pop_free(void)
 {
-	register recvbuf_t *bufp;
-	int i, abuf;
+	uint_least64_t	head;
+	uint32_t	idx;
+	u_long		used;
+#ifdef LOCKFREE_FREELIST
+	uint_least64_t	next;
+	u_long		high;
+
+	head = atomic_load_explicit(&free_head, memory_order_acquire);
+	do {
+		idx = (uint32_t)head;
+		if (0 == idx)
+			return NULL;
+		next = (((head >> 32) + 1) << 32)
+		       | atomic_load_explicit(&free_next[idx - 1],
+					      memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&free_head, &head,
+			next, memory_order_acquire, memory_order_acquire));
+
+	used = total_recvbufs - (COUNT_DEC(free_recvbufs) - 1);
+	high = COUNT_GET(highwater);
+	while (used > high
+	       && !atomic_compare_exchange_weak_explicit(&highwater, &high,
+			used, memory_order_relaxed, memory_order_relaxed))
+		/* high reloaded */;
+#else
+	head = free_head;
+	idx = (uint32_t)head;
+	if (0 == idx)
+		return NULL;
+	free_head = free_next[idx - 1];
+
+	used = total_recvbufs - --free_recvbufs;
+	if (used > highwater)
+		highwater = used;
+#endif
+	return RB(idx - 1);
+}
 
-	abuf = nbufs + buffer_shortfall;
-	buffer_shortfall = 0;
 
-#ifndef DEBUG
-	bufp = emalloc_zero(abuf * sizeof(*bufp));
+/*
+ * push_free - put a buffer on top of the free list
+ */
+static void
+push_free(
+	recvbuf_t *	rb
+	)
+{
+	uint32_t	idx;
+#ifdef LOCKFREE_FREELIST
+	uint_least64_t	head;
+	uint_least64_t	next;
 #endif
 
-	for (i = 0; i < abuf; i++) {
-#ifdef DEBUG
-		/*
-		 * Allocate each buffer individually so they can be
-		 * free()d during ntpd shutdown on DEBUG builds to
-		 * keep them out of heap leak reports.
-		 */
-		bufp = emalloc_zero(sizeof(*bufp));
+	idx = (uint32_t)(((char *)rb - arena) / RB_STRIDE) + 1;
+#ifdef LOCKFREE_FREELIST
+	head = atomic_load_explicit(&free_head, memory_order_relaxed);
+	do {
+		atomic_store_explicit(&free_next[idx - 1], (uint32_t)head,
+				      memory_order_relaxed);
+		next = (((head >> 32) + 1) << 32) | idx;
+	} while (!atomic_compare_exchange_weak_explicit(&free_head, &head,
+			next, memory_order_release, memory_order_relaxed));
+#else
+	free_next[idx - 1] = (uint32_t)free_head;
+	free_head = idx;
+#endif
+	COUNT_INC(free_recvbufs);
+}
+
+
+/*
+ * create_arena - allocate nbufs recvbufs and put them all on the
+ *		  free list.  With hugepages try explicit huge pages
+ *		  first, then ask for transparent ones.
+ */
+static void
+create_arena(
+	u_int	nbufs,
+	bool	hugepages
+	)
+{
+	size_t	octets;
+	size_t	align;
+	void *	mem;
+	u_int	i;
+
+	octets = nbufs * RB_STRIDE;
+	align = RB_CACHELINE;
+	mem = NULL;
+	arena_mapped = false;
+	if (hugepages) {
+		octets = (octets + RB_HUGEPAGE - 1) & ~(size_t)(RB_HUGEPAGE - 1);
+		align = RB_HUGEPAGE;
+#ifdef MAP_HUGETLB
+		mem = mmap(NULL, octets, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (MAP_FAILED == mem) {
+			msyslog(LOG_WARNING,
+				"recvbuff: no huge pages for %lu octets: %m",
+				(u_long)octets);
+			mem = NULL;
+		} else {
+			arena_mapped = true;
+		}
+#endif
+	}
+	if (NULL == mem) {
+		if (posix_memalign(&mem, align, octets) != 0) {
+			msyslog(LOG_ERR,
+				"fatal out of memory (%lu bytes of recvbufs)",
+				(u_long)octets);
+			exit(1);
+		}
+#ifdef MADV_HUGEPAGE
+		if (hugepages)
+			madvise(mem, octets, MADV_HUGEPAGE);
 #endif
-		LINK_SLIST(free_recv_list, bufp, link);
-		bufp++;
-		free_recvbufs++;
-		total_recvbufs++;
 	}
+	memset(mem, 0, octets);
+
+	arena = mem;
+	arena_octets = octets;
+	free_next = eallocarray(nbufs, sizeof(*free_next));
+	COUNT_SET(free_head, 0);
+	COUNT_SET(free_recvbufs, 0);
+	total_recvbufs = nbufs;
+	/* push in reverse so the lowest addresses go out first */
+	for (i = nbufs; i > 0; i--)
+		push_free(RB(i - 1));
 	lowater_adds++;
-	/* coverity[leaked_storage] */
 }
 
+
+static void
+free_arena(void)
+{
+	if (arena_mapped)
+		munmap(arena, arena_octets);
+	else
+		free(arena);
+	free(free_next);
+	arena = NULL;
+	free_next = NULL;
+	COUNT_SET(free_head, 0);
+	COUNT_SET(free_recvbufs, 0);
+	total_recvbufs = 0;
+}
+
+
+/*
+ * init_recvbuff - set up the arena with nbufs buffers.  Called again
+ * from the configuration to change the count or use huge pages, which
+ * is only possible while no buffer is in use.
+ */
 void
-init_recvbuff(int nbufs)
+init_recvbuff(
+	int	nbufs,
+	bool	hugepages
+	)
 {
+#ifdef DEBUG
+	static bool	registered;
+#endif
 
-	/*
-	 * Init buffer free list and stat counters
-	 */
-	free_recvbufs = total_recvbufs = 0;
-	full_recvbufs = lowater_adds = 0;
+	if (arena != NULL) {
+		if (COUNT_GET(free_recvbufs) != total_recvbufs) {
+			msyslog(LOG_ERR,
+				"recvbuff: %lu buffers in use, keeping %lu",
+				total_recvbufs - COUNT_GET(free_recvbufs),
+				total_recvbufs);
+			return;
+		}
+		free_arena();
+	} else {
+		full_recvbufs = lowater_adds = 0;
+	}
 
-	create_buffers(nbufs);
+	create_arena((u_int)nbufs, hugepages);
 
 #ifdef DEBUG
-	atexit(&uninit_recvbuff);
+	if (!registered) {
+		registered = true;
+		atexit(&uninit_recvbuff);
+	}
 #endif
 }
 
@@ -110,21 +319,7 @@ init_recvbuff(int nbufs)
 static void
 uninit_recvbuff(void)
 {
-	recvbuf_t *rbunlinked;
-
-	for (;;) {
-		UNLINK_FIFO(rbunlinked, full_recv_fifo, link);
-		if (rbunlinked == NULL)
-			break;
-		free(rbunlinked);
-	}
-
-	for (;;) {
-		UNLINK_HEAD_SLIST(rbunlinked, free_recv_list, link);
-		if (rbunlinked == NULL)
-			break;
-		free(rbunlinked);
-	}
+	free_arena();
 }
 #endif	/* DEBUG */
 
@@ -143,8 +338,7 @@ freerecvbuf(recvbuf_t *rb)
 	rb->used--;
 	if (rb->used != 0)
 		msyslog(LOG_ERR, "******** freerecvbuff non-zero usage: %d *******", rb->used);
-	LINK_SLIST(free_recv_list, rb, link);
-	free_recvbufs++;
+	push_free(rb);
 }
 
 	
@@ -165,19 +359,45 @@ get_free_recv_buffer(void)
 {
 	recvbuf_t *buffer;
 
-	UNLINK_HEAD_SLIST(buffer, free_recv_list, link);
+	buffer = pop_free();
 	if (buffer != NULL) {
-		free_recvbufs--;
 		initialise_buffer(buffer);
 		buffer->used++;
 	} else {
-		buffer_shortfall++;
+		COUNT_INC(buffer_shortfall);
 	}
 
 	return buffer;
 }
 
 
+/*
+ * get_free_recv_buffers - take up to nbufs buffers off the free list
+ * at once so a batched read can fill them with a single syscall.
+ * A partial fill is not a shortfall; only count one if we got none.
+ */
+size_t
+get_free_recv_buffers(
+	recvbuf_t **	vec,
+	size_t		nbufs
+	)
+{
+	size_t	n;
+
+	for (n = 0; n < nbufs; n++) {
+		vec[n] = pop_free();
+		if (NULL == vec[n])
+			break;
+		initialise_buffer(vec[n]);
+		vec[n]->used++;
+	}
+	if (0 == n)
+		COUNT_INC(buffer_shortfall);
+
+	return n;
+}
+
+
 recvbuf_t *
 get_full_recv_buffer(void)
 {
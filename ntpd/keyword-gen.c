@@ -52,12 +52,16 @@ struct key_tok ntp_keywords[] = {
 { "reset",		T_Reset,		FOLLBY_TOKEN },
 { "restrict",		T_Restrict,		FOLLBY_TOKEN },
 { "refclock",		T_Refclock,		FOLLBY_STRING },
+{ "recvbufs",		T_Recvbufs,		FOLLBY_TOKEN },
+{ "hugepages",		T_Hugepages,		FOLLBY_TOKEN },
 { "rlimit",		T_Rlimit,		FOLLBY_TOKEN },
 { "server",		T_Server,		FOLLBY_STRING },
 { "setvar",		T_Setvar,		FOLLBY_STRING },
 { "statistics",		T_Statistics,		FOLLBY_TOKEN },
 { "statsdir",		T_Statsdir,		FOLLBY_STRING },
+{ "statsflush",		T_Statsflush,		FOLLBY_TOKEN },
 { "sys",		T_Sys,			FOLLBY_TOKEN },
+{ "threads",		T_Threads,		FOLLBY_TOKEN },
 { "tick",		T_Tick,			FOLLBY_TOKEN },
 { "timer",		T_Timer,		FOLLBY_TOKEN },
 { "tinker",		T_Tinker,		FOLLBY_TOKEN },
@@ -100,9 +104,11 @@ struct key_tok ntp_keywords[] = {
 { "timingstats",	T_Timingstats,		FOLLBY_TOKEN },
 { "usestats",		T_Usestats,		FOLLBY_TOKEN },
 /* filegen_option */
+{ "binary",		T_Binary,		FOLLBY_TOKEN },
 { "file",		T_File,			FOLLBY_STRING },
 { "link",		T_Link,			FOLLBY_TOKEN },
 { "nolink",		T_Nolink,		FOLLBY_TOKEN },
+{ "text",		T_Text,			FOLLBY_TOKEN },
 { "type",		T_Type,			FOLLBY_TOKEN },
 /* filegen_type */
 { "age",		T_Age,			FOLLBY_TOKEN },
@@ -146,6 +152,7 @@ struct key_tok ntp_keywords[] = {
 { "average",		T_Average,		FOLLBY_TOKEN },
 { "minimum",		T_Minimum,		FOLLBY_TOKEN },
 { "monitor",		T_Monitor,		FOLLBY_TOKEN },
+{ "rate",		T_Rate,			FOLLBY_TOKEN },
 /* mru_option */
 { "incalloc",		T_Incalloc,		FOLLBY_TOKEN },
 { "incmem",		T_Incmem,		FOLLBY_TOKEN },
@@ -33,6 +33,7 @@
 #include "lib_strbuf.h"
 #include "ntp_assert.h"
 #include "ntp_random.h"
+#include "recvbuff.h"
 /*
  * [Bug 467]: Some linux headers collide with CONFIG_PHONE and CONFIG_KEYS
  * so #include these later.
@@ -1420,6 +1421,14 @@ config_monitor(
 					filegen_flag &= ~FGEN_FLAG_LINK;
 					break;
 
+				case T_Binary:
+					filegen_flag |= FGEN_FLAG_BINARY;
+					break;
+
+				case T_Text:
+					filegen_flag &= ~FGEN_FLAG_BINARY;
+					break;
+
 				case T_Enable:
 					filegen_flag |= FGEN_FLAG_ENABLED;
 					break;
@@ -1627,6 +1636,24 @@ config_access(
 			mon_age = my_opt->value.i;
 			break;
 
+		case T_Rate:
+			if (0 <= my_opt->value.i)
+				mon_pfx_rate = my_opt->value.i;
+			else
+				msyslog(LOG_ERR,
+					"discard rate %d out of range, ignored.",
+					my_opt->value.i);
+			break;
+
+		case T_Burst:
+			if (0 < my_opt->value.i)
+				mon_pfx_burst = my_opt->value.i;
+			else
+				msyslog(LOG_ERR,
+					"discard burst %d out of range, ignored.",
+					my_opt->value.i);
+			break;
+
 		default:
 			msyslog(LOG_ERR,
 				"Unknown discard option %s (%d)",
@@ -2514,6 +2541,41 @@ config_vars(
 			qos = curr_var->value.i << 2;
 			break;
 
+		case T_Recvbufs:
+		case T_Hugepages:
+			if (curr_var->value.i < 1
+			    || curr_var->value.i > RECV_MAX)
+				msyslog(LOG_ERR,
+					"config: recvbufs %d out of range 1-%d, ignored",
+					curr_var->value.i, RECV_MAX);
+			else
+				init_recvbuff(curr_var->value.i,
+					      T_Hugepages == curr_var->attr);
+			break;
+
+		case T_Statsflush:
+			if (curr_var->value.i < 0 || curr_var->value.i > 3600)
+				msyslog(LOG_ERR,
+					"config: statsflush %d out of range 0-3600, ignored",
+					curr_var->value.i);
+			else
+				stats_flush_latency = curr_var->value.i;
+			break;
+
+		case T_Threads:
+#ifdef USE_SERVER_THREADS
+			if (curr_var->value.i < 0 || curr_var->value.i > 64)
+				msyslog(LOG_ERR,
+					"config: threads %d out of range 0-64, ignored",
+					curr_var->value.i);
+			else
+				server_threads = curr_var->value.i;
+#else
+			msyslog(LOG_WARNING,
+				"config: threads unsupported on this platform, ignored");
+#endif
+			break;
+
 		case T_WanderThreshold:		/* FALLTHROUGH */
 		case T_Nonvolatile:
 			wander_threshold = curr_var->value.d;
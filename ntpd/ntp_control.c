@@ -52,6 +52,9 @@ static	u_short ctlclkstatus	(struct refclockstat *);
 #endif
 static	void	ctl_flushpkt	(uint8_t);
 static	void	ctl_putdata	(const char *, unsigned int, bool);
+static	void	ctl_putrec	(uint8_t, uint8_t *, const uint8_t *);
+static	uint8_t *bin_putu	(uint8_t *, uint64_t, int);
+static	uint8_t *bin_putadr	(uint8_t *, const sockaddr_u *);
 static	void	ctl_putstr	(const char *, const char *, size_t);
 static	void	ctl_putdblf	(const char *, int, int, double);
 #define	ctl_putdbl(tag, d)	ctl_putdblf(tag, 1, 3, d)
@@ -59,6 +62,7 @@ static	void	ctl_putdblf	(const char *, int, int, double);
 #define	ctl_putsfp(tag, sfp)	ctl_putdblf(tag, 0, -1, \
 					    FPTOD(sfp))
 static	void	ctl_putuint	(const char *, u_long);
+static	void	ctl_putseq	(const char *, uint64_t);
 static	void	ctl_puthex	(const char *, u_long);
 static	void	ctl_putint	(const char *, long);
 static	void	ctl_putts	(const char *, l_fp *);
@@ -84,18 +88,23 @@ static	void	write_variables (struct recvbuf *, int);
 static	void	read_clockstatus(struct recvbuf *, int);
 static	void	write_clockstatus(struct recvbuf *, int);
 static	void	configure	(struct recvbuf *, int);
-static	void	send_mru_entry	(mon_entry *, int);
+static	void	send_mru_entry	(mon_entry *, int, bool);
+static	void	send_mru_record	(mon_entry *);
+static	bool	addr_in_prefix	(const sockaddr_u *, const sockaddr_u *,
+				 int);
 #ifdef USE_RANDOMIZE_RESPONSES
 static	void	send_random_tag_value(int);
 #endif /* USE_RANDOMIZE_RESPONSES */
 static	void	read_mru_list	(struct recvbuf *, int);
 static	void	send_ifstats_entry(endpt *, u_int);
-static	void	read_ifstats	(struct recvbuf *);
+static	void	send_ifstats_record(endpt *);
+static	void	read_ifstats	(struct recvbuf *, bool);
 static	void	sockaddrs_from_restrict_u(sockaddr_u *,	sockaddr_u *,
 					  restrict_u *, int);
 static	void	send_restrict_entry(restrict_u *, int, u_int);
-static	void	send_restrict_list(restrict_u *, int, u_int *);
-static	void	read_addr_restrictions(struct recvbuf *);
+static	void	send_restrict_record(restrict_u *, int);
+static	void	send_restrict_list(restrict_u *, int, u_int *, bool);
+static	void	read_addr_restrictions(struct recvbuf *, bool);
 static	void	read_ordlist	(struct recvbuf *, int);
 static	uint32_t	derive_nonce	(sockaddr_u *, uint32_t, uint32_t);
 static	void	generate_nonce	(struct recvbuf *, char *, size_t);
@@ -219,7 +228,11 @@ static const struct ctl_proc control_codes[] = {
 #define	CS_LEAPSMEARINTV	96
 #define	CS_LEAPSMEAROFFS	97
 #define	CS_TICK                 98
-#define	CS_MAXCODE		CS_TICK
+#define	CS_RBUF_HIGHWATER	99
+#define	CS_RBUF_SHORTFALL	100
+#define	CS_RBUF_DROPPED		101
+#define	CS_MRU_PREFIXLIMITED	102
+#define	CS_MAXCODE		CS_MRU_PREFIXLIMITED
 
 /*
  * Peer variables we understand
@@ -398,7 +411,11 @@ static const struct ctl_var sys_var[] = {
 	{ CS_LEAPSMEARINTV,	RO, "leapsmearinterval" },    /* 96 */
 	{ CS_LEAPSMEAROFFS,	RO, "leapsmearoffset" },      /* 97 */
 	{ CS_TICK,		RO, "tick" },		/* 98 */
-	{ 0,                    EOV, "" }		/* 98 */
+	{ CS_RBUF_HIGHWATER,	RO, "rbuf_highwater" },	/* 99 */
+	{ CS_RBUF_SHORTFALL,	RO, "rbuf_shortfall" },	/* 100 */
+	{ CS_RBUF_DROPPED,	RO, "rbuf_dropped" },	/* 101 */
+	{ CS_MRU_PREFIXLIMITED,	RO, "mru_prefixlimited" }, /* 102 */
+	{ 0,                    EOV, "" }		/* 103 */
 };
 
 static struct ctl_var *ext_sys_var = NULL;
@@ -585,6 +602,7 @@ static const uint8_t def_clock_var[] = {
  */
 static const char addr_fmt[] =		"addr.%d";
 static const char last_fmt[] =		"last.%d";
+static const char seq_fmt[] =		"seq.%d";
 
 /*
  * System and processor definitions.
@@ -1074,6 +1092,79 @@ ctl_putdata(
 }
 
 
+/*
+ * ctl_putrec - write a binary record built from rec + 2 up to end
+ *		into the response, starting a new packet rather than
+ *		splitting it.
+ */
+static void
+ctl_putrec(
+	uint8_t		type,
+	uint8_t *	rec,
+	const uint8_t *	end
+	)
+{
+	size_t	len;
+
+	len = (size_t)(end - rec);
+	NTP_INSIST(len <= UINT8_MAX);
+	rec[0] = type;
+	rec[1] = (uint8_t)len;
+	if (datapt + len > &rpkt.data[CTL_MAX_DATA_LEN])
+		ctl_flushpkt(CTL_MORE);
+	ctl_putdata((const char *)rec, (unsigned int)len, true);
+}
+
+
+/*
+ * bin_putu - store the low octets of a value in network byte order
+ */
+static uint8_t *
+bin_putu(
+	uint8_t *	cp,
+	uint64_t	val,
+	int		octets
+	)
+{
+	int	i;
+
+	for (i = octets - 1; i >= 0; i--) {
+		cp[i] = (uint8_t)val;
+		val >>= 8;
+	}
+	return cp + octets;
+}
+
+
+/*
+ * bin_putadr - store an address for a binary record: a family octet
+ *		of 4 or 6, the port, then the address and, for IPv6,
+ *		the scope.  No address is a family octet of 0.
+ */
+static uint8_t *
+bin_putadr(
+	uint8_t *		cp,
+	const sockaddr_u *	addr
+	)
+{
+	if (NULL == addr || !(IS_IPV4(addr) || IS_IPV6(addr))) {
+		*cp++ = 0;
+		return cp;
+	}
+	*cp++ = IS_IPV6(addr) ? 6 : 4;
+	cp = bin_putu(cp, SRCPORT(addr), 2);
+	if (IS_IPV6(addr)) {
+		memcpy(cp, PSOCK_ADDR6(addr), 16);
+		cp += 16;
+		cp = bin_putu(cp, SCOPE_VAR(addr), 4);
+	} else {
+		memcpy(cp, &PSOCK_ADDR4(addr)->s_addr, 4);
+		cp += 4;
+	}
+	return cp;
+}
+
+
 /*
  * ctl_putstr - write a tagged string into the response packet
  *		in the form:
@@ -1192,6 +1283,21 @@ ctl_putuint(
 	ctl_putdata(buffer, (unsigned)( cp - buffer ), false);
 }
 
+/*
+ * ctl_putseq - write a tagged MRU sequence number into the response
+ */
+static void
+ctl_putseq(
+	const char *tag,
+	uint64_t seq
+	)
+{
+	char buffer[32];
+
+	snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)seq);
+	ctl_putunqstr(tag, buffer, strlen(buffer));
+}
+
 /*
  * ctl_putfs - write a decoded filestamp into the response
  */
@@ -1713,10 +1819,18 @@ ctl_putsys(
 		ctl_putuint(sys_var[varid].text, mru_none);
 		break;
 
+	case CS_MRU_PREFIXLIMITED:
+		ctl_putuint(sys_var[varid].text, mru_prefixlimited);
+		break;
+
 	case CS_MRU_OLDEST_AGE: {
 		l_fp now;
+		int age;
 		get_systime(&now);
-		ctl_putuint(sys_var[varid].text, mon_get_oldest_age(now));
+		mon_lock();
+		age = mon_get_oldest_age(now);
+		mon_unlock();
+		ctl_putuint(sys_var[varid].text, age);
 		break;
 		}
 
@@ -1980,6 +2094,18 @@ ctl_putsys(
 		ctl_putuint(sys_var[varid].text, lowater_additions());
 		break;
 
+	case CS_RBUF_HIGHWATER:
+		ctl_putuint(sys_var[varid].text, highwater_recvbuffs());
+		break;
+
+	case CS_RBUF_SHORTFALL:
+		ctl_putuint(sys_var[varid].text, shortfall_recvbuffs());
+		break;
+
+	case CS_RBUF_DROPPED:
+		ctl_putuint(sys_var[varid].text, packets_nobuf);
+		break;
+
 	case CS_IO_DROPPED:
 		ctl_putuint(sys_var[varid].text, packets_dropped);
 		break;
@@ -3155,12 +3281,14 @@ send_random_tag_value(
  * To keep clients honest about not depending on the order of values,
  * and thereby avoid being locked into ugly workarounds to maintain
  * backward compatibility later as new fields are added to the response,
- * the order is random.
+ * the order is random.  The sequence number is sent only to clients
+ * paging by sequence.
  */
 static void
 send_mru_entry(
 	mon_entry *	mon,
-	int		count
+	int		count,
+	bool		withseq
 	)
 {
 	const char first_fmt[] =	"first.%d";
@@ -3168,7 +3296,7 @@ send_mru_entry(
 	const char mv_fmt[] =		"mv.%d";
 	const char rs_fmt[] =		"rs.%d";
 	char	tag[32];
-	bool	sent[6]; /* 6 tag=value pairs */
+	bool	sent[7]; /* 7 tag=value pairs */
 	uint32_t noise;
 	u_int	which = 0;
 	u_int	remaining;
@@ -3176,6 +3304,10 @@ send_mru_entry(
 
 	remaining = COUNTOF(sent);
 	ZERO(sent);
+	if (!withseq) {
+		sent[6] = true;
+		remaining--;
+	}
 	noise = ntp_random();
 	while (remaining > 0) {
 #ifdef USE_RANDOMIZE_RESPONSES
@@ -3217,6 +3349,11 @@ send_mru_entry(
 			snprintf(tag, sizeof(tag), rs_fmt, count);
 			ctl_puthex(tag, mon->flags);
 			break;
+
+		case 6:
+			snprintf(tag, sizeof(tag), seq_fmt, count);
+			ctl_putseq(tag, mon->seq);
+			break;
 		}
 		sent[which] = true;
 		remaining--;
@@ -3224,6 +3361,62 @@ send_mru_entry(
 }
 
 
+/*
+ * addr_in_prefix - is addr within the first bits of net?
+ */
+static bool
+addr_in_prefix(
+	const sockaddr_u *	addr,
+	const sockaddr_u *	net,
+	int			bits
+	)
+{
+	const uint8_t *	a;
+	const uint8_t *	n;
+	int		octets;
+
+	if (AF(addr) != AF(net))
+		return false;
+	if (IS_IPV6(addr)) {
+		a = (const uint8_t *)PSOCK_ADDR6(addr);
+		n = (const uint8_t *)PSOCK_ADDR6(net);
+	} else {
+		a = (const uint8_t *)&PSOCK_ADDR4(addr)->s_addr;
+		n = (const uint8_t *)&PSOCK_ADDR4(net)->s_addr;
+	}
+	octets = bits / 8;
+	if (memcmp(a, n, (size_t)octets))
+		return false;
+	bits %= 8;
+	return 0 == bits || 0 == ((a[octets] ^ n[octets]) & (0xff00 >> bits));
+}
+
+
+/*
+ * Send a MRU list entry as a CTL_BIN_MRU record, for clients which
+ * asked for bin=1.  Field order is fixed, so there is nothing to
+ * randomize; the record length leaves room for new fields instead.
+ */
+static void
+send_mru_record(
+	mon_entry *	mon
+	)
+{
+	uint8_t		rec[64];
+	uint8_t *	cp;
+
+	cp = rec + 2;
+	cp = bin_putu(cp, mon->vn_mode, 1);
+	cp = bin_putu(cp, mon->flags, 2);
+	cp = bin_putu(cp, (uint32_t)mon->count, 4);
+	cp = bin_putu(cp, mon->seq, 8);
+	cp = bin_putu(cp, mon->last, 8);
+	cp = bin_putu(cp, mon->first, 8);
+	cp = bin_putadr(cp, &mon->rmtadr);
+	ctl_putrec(CTL_BIN_MRU, rec, cp);
+}
+
+
 /*
  * read_mru_list - supports ntpq's mrulist command.
  *
@@ -3282,6 +3475,20 @@ send_mru_entry(
  *	resany=		0x-prefixed hex restrict bits, at least one of
  *			which must be list for an MRU entry to be
  *			included.
+ *	prefix=		Return entries from within an address prefix,
+ *			such as 203.0.113.0/24 or 2001:db8::/32.
+ *	minrate=	(decimal) Return entries which have averaged
+ *			at least this many packets per second between
+ *			their first and last packets.
+ *	top=		Return only this many entries (larger values
+ *			are taken as MRU_ROW_LIMIT) with the highest count or rate
+ *			(see topby=) of those passing the other
+ *			filters, highest first.  The whole list is
+ *			ranked in one request, so the response is
+ *			always the last; last./addr. and cursor= are
+ *			ignored, and recent= still limits the ranking
+ *			to the newest entries.
+ *	topby=		"count" (the default) or "rate" for top=.
  *	last.0=		0x-prefixed hex l_fp timestamp of newest entry
  *			which client previously received.
  *	addr.0=		text of newest entry's IP address and port,
@@ -3293,6 +3500,29 @@ send_mru_entry(
  * ntpq provides as many last/addr pairs as will fit in a single request
  * packet, except for the first request in a MRU fetch operation.
  *
+ * Newer clients page by sequence number instead.  Every move of an
+ * entry to the head of the MRU list stamps it with the next sequence
+ * number, so the list is in sequence order, and "the entries after
+ * the ones I have" stays well defined however much it has changed:
+ *
+ *	cursor=		(decimal) sequence number of the newest entry
+ *			the client has seen, 0 to begin with the oldest.
+ *			The entries stamped after it are returned, each
+ *			with a seq.# value.
+ *	addr.0=		address of an entry the client has seen,
+ *	seq.0=		and its sequence number, newest first, as
+ *	[...]		many pairs as fit.  The first one still
+ *			carrying its sequence number is where the walk
+ *			resumes; if none is, the entry after cursor= is
+ *			looked for by sequence number, so an entry
+ *			which has moved costs a search, never a failed
+ *			request.
+ *	recent=		with a cursor= other than 0, the walk starts no
+ *			further back than this many newest entries.
+ *
+ * An entry which moves during the fetch is sent again at the end with
+ * its new sequence number.
+ *
  * The response begins with a new nonce value to be used for any
  * followup request.  Following the nonce is the next newer entry than
  * referred to by last.0 and addr.0, if the "0" entry has not been
@@ -3319,6 +3549,13 @@ send_mru_entry(
  *	ct.#		count of packets received
  *	mv.#		mode and version
  *	rs.#		restriction mask (RES_* bits)
+ *	seq.#		sequence number, only when cursor= was given
+ *
+ * With cursor=, the entries are followed by the entry the walk stopped
+ * at, sent or filtered out, for the client to resume after:
+ *
+ *	seq.cursor=	its sequence number
+ *	addr.cursor=	its address
  *
  * Note the code currently assumes there are no valid three letter
  * tags sent with each row, and needs to be adjusted if that changes.
@@ -3339,6 +3576,10 @@ send_mru_entry(
  *
  *	last.newest=	hex l_fp identical to last.# of the prior
  *			entry.
+ *
+ * A request with bin=1 gets the same response as CTL_BIN_* records:
+ * nonce, entries, cursor and now, without the last.older and
+ * last.newest confirmations and without noise.
  */
 static void read_mru_list(
 	struct recvbuf *rbufp,
@@ -3355,6 +3596,12 @@ static void read_mru_list(
 	static const char	maxlstint_text[] =	"maxlstint";
 	static const char	laddr_text[] =		"laddr";
 	static const char	recent_text[] =		"recent";
+	static const char	cursor_text[] =		"cursor";
+	static const char	bin_text[] =		"bin";
+	static const char	prefix_text[] =		"prefix";
+	static const char	minrate_text[] =	"minrate";
+	static const char	top_text[] =		"top";
+	static const char	topby_text[] =		"topby";
 	static const char	resaxx_fmt[] =		"0x%hx";
 
 	u_int			limit;
@@ -3371,6 +3618,20 @@ static void read_mru_list(
 	u_int			uf;
 	l_fp			last[16];
 	sockaddr_u		addr[COUNTOF(last)];
+	uint64_t		seq[COUNTOF(last)];
+	bool			bycursor;
+	unsigned long long	cursor;
+	unsigned long long	ull;
+	u_int			bin;
+	sockaddr_u		prefix;
+	int			prefixlen;
+	double			minrate;
+	u_int			top;
+	bool			byrate;
+	mon_rank		ranks[MRU_ROW_LIMIT];
+	size_t			ranked;
+	uint8_t			rec[64];
+	uint8_t *		cp;
 	char			buf[128];
 	struct ctl_var *	in_parms;
 	const struct ctl_var *	v;
@@ -3380,9 +3641,10 @@ static void read_mru_list(
 	int			nonce_valid;
 	size_t			i;
 	int			priors;
-	u_short			hash;
 	mon_entry *		mon;
 	mon_entry *		prior_mon;
+	mon_entry *		cursor_mon;
+	mon_entry *		floor_mon;
 	l_fp			now;
 
 	if (RES_NOMRULIST & restrict_mask) {
@@ -3407,11 +3669,19 @@ static void read_mru_list(
 	set_var(&in_parms, maxlstint_text, sizeof(maxlstint_text), 0);
 	set_var(&in_parms, laddr_text, sizeof(laddr_text), 0);
 	set_var(&in_parms, recent_text, sizeof(recent_text), 0);
+	set_var(&in_parms, cursor_text, sizeof(cursor_text), 0);
+	set_var(&in_parms, bin_text, sizeof(bin_text), 0);
+	set_var(&in_parms, prefix_text, sizeof(prefix_text), 0);
+	set_var(&in_parms, minrate_text, sizeof(minrate_text), 0);
+	set_var(&in_parms, top_text, sizeof(top_text), 0);
+	set_var(&in_parms, topby_text, sizeof(topby_text), 0);
 	for (i = 0; i < COUNTOF(last); i++) {
 		snprintf(buf, sizeof(buf), last_fmt, (int)i);
 		set_var(&in_parms, buf, strlen(buf) + 1, 0);
 		snprintf(buf, sizeof(buf), addr_fmt, (int)i);
 		set_var(&in_parms, buf, strlen(buf) + 1, 0);
+		snprintf(buf, sizeof(buf), seq_fmt, (int)i);
+		set_var(&in_parms, buf, strlen(buf) + 1, 0);
 	}
 
 	/* decode input parms */
@@ -3425,8 +3695,16 @@ static void read_mru_list(
 	recent = 0;
 	lcladr = NULL;
 	priors = 0;
+	bycursor = false;
+	cursor = 0;
+	bin = 0;
+	prefixlen = -1;
+	minrate = 0;
+	top = 0;
+	byrate = false;
 	ZERO(last);
 	ZERO(addr);
+	ZERO(seq);
 
 	/* have to go through '(void*)' to drop 'const' property from pointer.
 	 * ctl_getitem()' needs some cleanup, too.... perlinger@ntp.org
@@ -3468,6 +3746,39 @@ static void read_mru_list(
 		} else if (!strcmp(recent_text, v->text)) {
 			if (1 != sscanf(val, "%u", &recent))
 				goto blooper;
+		} else if (!strcmp(cursor_text, v->text)) {
+			if (1 != sscanf(val, "%llu", &cursor))
+				goto blooper;
+			bycursor = true;
+		} else if (!strcmp(bin_text, v->text)) {
+			if (1 != sscanf(val, "%u", &bin))
+				goto blooper;
+		} else if (!strcmp(prefix_text, v->text)) {
+			strlcpy(buf, val, sizeof(buf));
+			pch = strchr(buf, '/');
+			if (NULL == pch ||
+			    1 != sscanf(pch + 1, "%d", &prefixlen))
+				goto blooper;
+			buf[pch - buf] = '\0';
+			if (!decodenetnum(buf, &prefix) || prefixlen < 0 ||
+			    prefixlen > (IS_IPV6(&prefix) ? 128 : 32))
+				goto blooper;
+		} else if (!strcmp(minrate_text, v->text)) {
+			if (1 != sscanf(val, "%lf", &minrate))
+				goto blooper;
+		} else if (!strcmp(top_text, v->text)) {
+			if (1 != sscanf(val, "%u", &top))
+				goto blooper;
+		} else if (!strcmp(topby_text, v->text)) {
+			if (!strcmp(val, "rate"))
+				byrate = true;
+			else if (strcmp(val, "count"))
+				goto blooper;
+		} else if (1 == sscanf(v->text, seq_fmt, &si) &&
+			   (size_t)si < COUNTOF(seq)) {
+			if (1 != sscanf(val, "%llu", &ull))
+				goto blooper;
+			seq[si] = ull;
 		} else if (1 == sscanf(v->text, last_fmt, &si) &&
 			   (size_t)si < COUNTOF(last)) {
 			if (2 != sscanf(val, "0x%08x.%08x", &ui, &uf))
@@ -3521,35 +3832,86 @@ static void read_mru_list(
 		frags = MRU_FRAGS_LIMIT;
 
 	/*
-	 * Find the starting point if one was provided.
+	 * Ranking walks the whole list and answers at once.
+	 */
+	if (top) {
+		if (top > MRU_ROW_LIMIT)
+			top = MRU_ROW_LIMIT;
+		bycursor = false;
+		priors = 0;
+	}
+
+	/*
+	 * Find the starting point if one was provided.  The server
+	 * threads are kept out of the list until we are done with it.
 	 */
+	mon_lock();
 	mon = NULL;
-	for (i = 0; i < (size_t)priors; i++) {
-		hash = MON_HASH(&addr[i]);
-		for (mon = mon_hash[hash];
-		     mon != NULL;
-		     mon = mon->hash_next)
-			if (ADDR_PORT_EQ(&mon->rmtadr, &addr[i]))
-				break;
+	for (i = 0; !bycursor && i < (size_t)priors; i++) {
+		mon = mon_lookup(&addr[i]);
 		if (mon != NULL) {
-			if (mon->last == last[i])
+			if (ADDR_PORT_EQ(&mon->rmtadr, &addr[i])
+			    && mon->last == last[i])
 				break;
 			mon = NULL;
 		}
 	}
 
-	/* If a starting point was provided... */
-	if (priors) {
+	if (bycursor) {
+		/*
+		 * Paging by sequence, resume after the newest entry
+		 * the client has seen which has not moved since.
+		 * Sequence numbers are never reused, so one that
+		 * matches is the same entry.
+		 */
+		for (i = 0; i < COUNTOF(seq) && seq[i] != 0; i++) {
+			mon = mon_lookup(&addr[i]);
+			if (mon != NULL && mon->seq == seq[i])
+				break;
+			mon = NULL;
+		}
+		if (mon != NULL) {
+			do
+				mon = PREV_DLIST(mon_mru_list, mon, mru);
+			while (mon != NULL && mon->seq <= cursor);
+		} else
+			mon = mon_seq_next(cursor);
+		if (0 == cursor)
+			countdown = mru_entries;
+		else if (recent != 0) {
+			/*
+			 * Resuming, recent= instead keeps the walk from
+			 * starting further back than the recent newest
+			 * entries, so a client polling a busy server
+			 * gets what it would have from scratch.
+			 */
+			floor_mon = HEAD_DLIST(mon_mru_list, mru);
+			for (i = 1; floor_mon != NULL && i < recent; i++) {
+				if (NULL == NEXT_DLIST(mon_mru_list,
+						       floor_mon, mru))
+					break;
+				floor_mon = NEXT_DLIST(mon_mru_list,
+						       floor_mon, mru);
+			}
+			if (mon != NULL && floor_mon != NULL &&
+			    floor_mon->seq > mon->seq)
+				mon = floor_mon;
+			recent = 0;
+		}
+	} else if (priors) {	/* If a starting point was provided... */
 		/* and none could be found unmodified... */
 		if (NULL == mon) {
+			mon_unlock();
 			/* tell ntpq to try again with older entries */
 			ctl_error(CERR_UNKNOWNVAR);
 			return;
 		}
 		/* confirm the prior entry used as starting point */
-		ctl_putts("last.older", &mon->last);
-		pch = sockporttoa(&mon->rmtadr);
-		ctl_putunqstr("addr.older", pch, strlen(pch));
+		if (CTL_BIN_VERSION != bin) {
+			ctl_putts("last.older", &mon->last);
+			pch = sockporttoa(&mon->rmtadr);
+			ctl_putunqstr("addr.older", pch, strlen(pch));
+		}
 
 		/*
 		 * Move on to the first entry the client doesn't have,
@@ -3568,12 +3930,20 @@ static void read_mru_list(
 	 */
 	get_systime(&now);
 	generate_nonce(rbufp, buf, sizeof(buf));
-	ctl_putunqstr("nonce", buf, strlen(buf));
+	if (CTL_BIN_VERSION == bin) {
+		i = MIN(strlen(buf), sizeof(rec) - 2);
+		memcpy(rec + 2, buf, i);
+		ctl_putrec(CTL_BIN_NONCE, rec, rec + 2 + i);
+	} else
+		ctl_putunqstr("nonce", buf, strlen(buf));
 	prior_mon = NULL;
+	cursor_mon = NULL;
+	ranked = 0;
 	for (count = 0;
-	     mon != NULL && res_frags < frags && count < limit;
+	     mon != NULL && (top || (res_frags < frags && count < limit));
 	     mon = PREV_DLIST(mon_mru_list, mon, mru)) {
 
+		cursor_mon = mon;
 		if (mon->count < mincount)
 			continue;
 		if (resall && resall != (resall & mon->flags))
@@ -3585,9 +3955,26 @@ static void read_mru_list(
 			continue;
 		if (lcladr != NULL && mon->lcladr != lcladr)
 			continue;
+		if (prefixlen >= 0 &&
+		    !addr_in_prefix(&mon->rmtadr, &prefix, prefixlen))
+			continue;
+		if (minrate > 0 && mon_rate(mon) < minrate)
+			continue;
 		if (recent != 0 && countdown-- > recent)
 			continue;
-		send_mru_entry(mon, count);
+		if (top) {
+			ranked = mon_rank_add(ranks, ranked, top, mon,
+					      byrate ? mon_rate(mon)
+						     : mon->count);
+			continue;
+		}
+		if (CTL_BIN_VERSION == bin) {
+			send_mru_record(mon);
+			count++;
+			prior_mon = mon;
+			continue;
+		}
+		send_mru_entry(mon, count, bycursor);
 #ifdef USE_RANDOMIZE_RESPONSES
 		if (!count)
 			send_random_tag_value(0);
@@ -3596,6 +3983,40 @@ static void read_mru_list(
 		prior_mon = mon;
 	}
 
+	if (top) {
+		mon_rank_sort(ranks, ranked);
+		for (i = 0; i < ranked && res_frags < frags && count < limit;
+		     i++) {
+			if (CTL_BIN_VERSION == bin)
+				send_mru_record(ranks[i].mon);
+			else
+				send_mru_entry(ranks[i].mon, count, false);
+			count++;
+			prior_mon = ranks[i].mon;
+		}
+	}
+
+	if (CTL_BIN_VERSION == bin) {
+		if (bycursor && cursor_mon != NULL) {
+			cp = bin_putu(rec + 2, cursor_mon->seq, 8);
+			cp = bin_putadr(cp, &cursor_mon->rmtadr);
+			ctl_putrec(CTL_BIN_CURSOR, rec, cp);
+		}
+		if (NULL == mon) {
+			cp = bin_putu(rec + 2, now, 8);
+			ctl_putrec(CTL_BIN_NOW, rec, cp);
+		}
+		mon_unlock();
+		ctl_flushpkt(0);
+		return;
+	}
+
+	if (bycursor && cursor_mon != NULL) {
+		ctl_putseq("seq.cursor", cursor_mon->seq);
+		pch = sockporttoa(&cursor_mon->rmtadr);
+		ctl_putunqstr("addr.cursor", pch, strlen(pch));
+	}
+
 	/*
 	 * If this batch completes the MRU list, say so explicitly with
 	 * a now= l_fp timestamp.
@@ -3610,6 +4031,7 @@ static void read_mru_list(
 		if (prior_mon != NULL)
 			ctl_putts("last.newest", &prior_mon->last);
 	}
+	mon_unlock();
 	ctl_flushpkt(0);
 }
 
@@ -3741,13 +4163,46 @@ send_ifstats_entry(
 }
 
 
+/*
+ * Send a ifstats entry as a CTL_BIN_IFSTATS record.  The counters are
+ * sent as their low 32 bits.
+ */
+static void
+send_ifstats_record(
+	endpt *	la
+	)
+{
+	uint8_t		rec[128];
+	uint8_t *	cp;
+
+	cp = rec + 2;
+	cp = bin_putu(cp, la->ifnum, 4);
+	cp = bin_putu(cp, la->flags, 4);
+	cp = bin_putu(cp, !la->ignore_packets, 1);
+	cp = bin_putu(cp, (uint32_t)la->last_ttl, 4);
+	cp = bin_putu(cp, (uint32_t)la->num_mcast, 4);
+	cp = bin_putu(cp, (uint32_t)la->received, 4);
+	cp = bin_putu(cp, (uint32_t)la->sent, 4);
+	cp = bin_putu(cp, (uint32_t)la->notsent, 4);
+	cp = bin_putu(cp, la->peercnt, 4);
+	cp = bin_putu(cp, current_time - la->starttime, 4);
+	memset(cp, '\0', sizeof(la->name));
+	memcpy(cp, la->name, strnlen(la->name, sizeof(la->name)));
+	cp += sizeof(la->name);
+	cp = bin_putadr(cp, &la->sin);
+	cp = bin_putadr(cp, (INT_BCASTOPEN & la->flags) ? &la->bcast : NULL);
+	ctl_putrec(CTL_BIN_IFSTATS, rec, cp);
+}
+
+
 /*
  * read_ifstats - send statistics for each local address, exposed by
  *		  ntpq -c ifstats
  */
 static void
 read_ifstats(
-	struct recvbuf *	rbufp
+	struct recvbuf *	rbufp,
+	bool			binary
 	)
 {
 	u_int	ifidx;
@@ -3766,7 +4221,10 @@ read_ifstats(
 		if (NULL == la)
 			continue;
 		/* return stats for one local address */
-		send_ifstats_entry(la, ifidx);
+		if (binary)
+			send_ifstats_record(la);
+		else
+			send_ifstats_entry(la, ifidx);
 	}
 	ctl_flushpkt(0);
 }
@@ -3891,15 +4349,45 @@ send_restrict_entry(
 }
 
 
+/*
+ * Send a restrict entry as a CTL_BIN_RESLIST record.  The flags go as
+ * bits; the client names them.
+ */
+static void
+send_restrict_record(
+	restrict_u *	pres,
+	int		ipv6
+	)
+{
+	uint8_t		rec[64];
+	uint8_t *	cp;
+	sockaddr_u	addr;
+	sockaddr_u	mask;
+
+	sockaddrs_from_restrict_u(&addr, &mask, pres, ipv6);
+	cp = rec + 2;
+	cp = bin_putu(cp, pres->count, 4);
+	cp = bin_putu(cp, pres->flags, 2);
+	cp = bin_putu(cp, pres->mflags, 2);
+	cp = bin_putadr(cp, &addr);
+	cp = bin_putadr(cp, &mask);
+	ctl_putrec(CTL_BIN_RESLIST, rec, cp);
+}
+
+
 static void
 send_restrict_list(
 	restrict_u *	pres,
 	int		ipv6,
-	u_int *		pidx
+	u_int *		pidx,
+	bool		binary
 	)
 {
 	for ( ; pres != NULL; pres = pres->link) {
-		send_restrict_entry(pres, ipv6, *pidx);
+		if (binary)
+			send_restrict_record(pres, ipv6);
+		else
+			send_restrict_entry(pres, ipv6, *pidx);
 		(*pidx)++;
 	}
 }
@@ -3910,7 +4398,8 @@ send_restrict_list(
  */
 static void
 read_addr_restrictions(
-	struct recvbuf *	rbufp
+	struct recvbuf *	rbufp,
+	bool			binary
 )
 {
 	u_int idx;
@@ -3918,8 +4407,10 @@ read_addr_restrictions(
 	UNUSED_ARG(rbufp);
 
 	idx = 0;
-	send_restrict_list(restrictlist4, false, &idx);
-	send_restrict_list(restrictlist6, true, &idx);
+	restrict_lock();
+	send_restrict_list(restrictlist4, false, &idx, binary);
+	send_restrict_list(restrictlist6, true, &idx, binary);
+	restrict_unlock();
 	ctl_flushpkt(0);
 }
 
@@ -3937,8 +4428,11 @@ read_ordlist(
 	const size_t ifstatint8_ts = COUNTOF(ifstats_s) - 1;
 	const char addr_rst_s[] = "addr_restrictions";
 	const size_t a_r_chars = COUNTOF(addr_rst_s) - 1;
+	const char bin_s[] = ", bin=1";
+	const size_t bin_chars = COUNTOF(bin_s) - 1;
 	struct ntp_control *	cpkt;
 	u_short			qdata_octets;
+	bool			binary;
 
 	UNUSED_ARG(rbufp);
 	UNUSED_ARG(restrict_mask);
@@ -3951,19 +4445,25 @@ read_ordlist(
 	 * contains "ifstats" (not null terminated) to retrieve local
 	 * addresses and associated stats.  It is "addr_restrictions"
 	 * to retrieve the IPv4 then IPv6 remote address restrictions,
-	 * which are access control lists.  Other request data return
+	 * which are access control lists.  Either may be followed by
+	 * ", bin=1" for CTL_BIN_* records.  Other request data return
 	 * CERR_UNKNOWNVAR.
 	 */
 	cpkt = (struct ntp_control *)&rbufp->recv_pkt;
 	qdata_octets = ntohs(cpkt->count);
+	binary = (qdata_octets >= bin_chars &&
+		  !memcmp(bin_s, cpkt->data + qdata_octets - bin_chars,
+			  bin_chars));
+	if (binary)
+		qdata_octets -= bin_chars;
 	if (0 == qdata_octets || (ifstatint8_ts == qdata_octets &&
 	    !memcmp(ifstats_s, cpkt->data, ifstatint8_ts))) {
-		read_ifstats(rbufp);
+		read_ifstats(rbufp, binary);
 		return;
 	}
 	if (a_r_chars == qdata_octets &&
 	    !memcmp(addr_rst_s, cpkt->data, a_r_chars)) {
-		read_addr_restrictions(rbufp);
+		read_addr_restrictions(rbufp, binary);
 		return;
 	}
 	ctl_error(CERR_UNKNOWNVAR);
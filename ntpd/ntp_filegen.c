@@ -12,6 +12,9 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -33,15 +36,54 @@
  */
 
 
+/*
+ * Records are not written as they are made. Each generation set
+ * collects them in a buffer which a writer thread writes out in one
+ * piece, so a busy server does not pay for a write() per packet on
+ * the main thread. The buffer is handed over when it is half full, or
+ * from the timer once its oldest record has waited stats_flush_latency
+ * seconds. While the writer still has the previous lot the buffer
+ * keeps filling; a record which does not fit is dropped and counted.
+ * Whatever is buffered for a file is written before the file is
+ * closed, so rotation still puts each record in its own generation.
+ */
+#define FILEGEN_BUFSIZE	(64 * 1024)
+
+int	stats_flush_latency = 1;	/* 0 writes every record at once */
+
+static pthread_mutex_t	writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	writer_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	writer_done = PTHREAD_COND_INITIALIZER;
+static FILEGEN *	writer_queue;	/* handed over, not yet written */
+static int		writer_state;	/* 0 idle, 1 running, -1 failed */
+
 /*
  * redefine this if your system dislikes filename suffixes like
  * X.19910101 or X.1992W50 or ....
  */
 #define SUFFIX_SEP '.'
 
+/*
+ * filegen registry
+ */
+
+static struct filegen_entry {
+	char *			name;
+	FILEGEN *		filegen;
+	struct filegen_entry *	next;
+} *filegen_registry = NULL;
+
 static	void	filegen_open	(FILEGEN *, uint32_t, const time_t*);
 static	int	valid_fileref	(const char *, const char *);
 static	void	filegen_init	(const char *, const char *, FILEGEN *);
+static	char *	filegen_room	(FILEGEN *, size_t *);
+static	void	filegen_added	(FILEGEN *, size_t);
+static	void	write_header	(FILEGEN *, FILE *);
+static	void	filegen_handover(FILEGEN *);
+static	void	filegen_sync	(FILEGEN *);
+static	void	write_records	(FILE *, const char *, size_t);
+static	bool	start_writer	(void);
+static	void *	writer_main	(void *);
 #ifdef	DEBUG
 static	void	filegen_uninit		(FILEGEN *);
 #endif	/* DEBUG */
@@ -58,6 +100,7 @@ filegen_init(
 	FILEGEN *	fgp
 	)
 {
+	ZERO(*fgp);
 	fgp->fp = NULL;
 	fgp->dir = estrdup(dir);
 	fgp->fname = estrdup(fname);
@@ -77,8 +120,11 @@ filegen_uninit(
 	FILEGEN *fgp
 	)
 {
+	filegen_sync(fgp);
 	free(fgp->dir);
 	free(fgp->fname);
+	free(fgp->buf);
+	free(fgp->wbuf);
 }
 #endif
 
@@ -109,7 +155,8 @@ filegen_open(
 	filename = emalloc(len);
 	fullname = emalloc(len);
 	savename = NULL;
-	snprintf(filename, len, "%s%s", gen->dir, gen->fname);
+	snprintf(filename, len, "%s%s%s", gen->dir, gen->fname,
+		 (gen->flag & FGEN_FLAG_BINARY) ? ".bin" : "");
 
 	/* where to place suffix */
 	suflen = strlcpy(fullname, filename, len);
@@ -288,10 +335,13 @@ filegen_open(
 			msyslog(LOG_ERR, "can't open %s: %m", fullname);
 	} else {
 		if (NULL != gen->fp) {
+			filegen_sync(gen);
 			fclose(gen->fp);
 			gen->fp = NULL;
 		}
 		gen->fp = fp;
+		if (gen->flag & FGEN_FLAG_BINARY)
+			write_header(gen, fp);
 
 		if (gen->flag & FGEN_FLAG_LINK) {
 			/*
@@ -317,6 +367,33 @@ filegen_open(
 	return;
 }
 
+/*
+ * write_header - start an empty binary generation file with the
+ * description of its records
+ */
+static void
+write_header(
+	FILEGEN *	gen,
+	FILE *		fp
+	)
+{
+	int	recsize;
+	int	i;
+
+	if (fseek(fp, 0, SEEK_END) != 0 || ftell(fp) != 0)
+		return;
+	recsize = 0;
+	for (i = 0; i < gen->nfields; i++)
+		recsize += gen->layout[i].size;
+	fprintf(fp, "ntpstats-binary 1 %s %d\n", gen->fname, recsize);
+	for (i = 0; i < gen->nfields; i++)
+		fprintf(fp, "%s %c %d %s\n", gen->layout[i].name,
+			gen->layout[i].type, gen->layout[i].size,
+			gen->layout[i].fmt);
+	fputc('\n', fp);
+	fflush(fp);
+}
+
 /*
  * this function sets up gen->fp to point to the correct
  * generation of the file for the time specified by 'now'
@@ -336,6 +413,7 @@ filegen_setup(
 
 	if (!(gen->flag & FGEN_FLAG_ENABLED)) {
 		if (NULL != gen->fp) {
+			filegen_sync(gen);
 			fclose(gen->fp);
 			gen->fp = NULL;
 		}
@@ -378,6 +456,355 @@ filegen_setup(
 }
 
 
+/*
+ * filegen_start - open the generation file for the first record.
+ * Moving on to the next generation is left to filegen_flush(), which
+ * the timer calls once a second, so records don't each pay for the
+ * check.
+ */
+void
+filegen_start(
+	FILEGEN *	gen,
+	uint32_t	now
+	)
+{
+	if (NULL == gen->fp)
+		filegen_setup(gen, now);
+}
+
+
+/*
+ * filegen_printf - add a record to the generation's buffer
+ *
+ * Call filegen_start() first, as before writing to gen->fp directly.
+ */
+void
+filegen_printf(
+	FILEGEN *	gen,
+	const char *	fmt,
+	...
+	)
+{
+	va_list	ap;
+	char *	rec;
+	size_t	room;
+	int	len;
+
+	rec = filegen_room(gen, &room);
+	if (NULL == rec)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(rec, room, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if ((size_t)len >= room) {
+		/* the writer still has the last lot */
+		gen->dropped++;
+		return;
+	}
+	filegen_added(gen, (size_t)len);
+}
+
+
+/*
+ * filegen_pack - add a binary record to the generation's buffer
+ *
+ * The arguments follow gen->layout: an u_int for I, an int for i, a
+ * double for d, an l_fp for Q, a string for s and a sockaddr_u pointer,
+ * or NULL, for A. Does nothing unless binary records are enabled.
+ */
+void
+filegen_pack(
+	FILEGEN *	gen,
+	...
+	)
+{
+	va_list		ap;
+	char *		rec;
+	char *		p;
+	size_t		room;
+	size_t		size;
+	size_t		len;
+	uint64_t	u;
+	double		d;
+	const char *	str;
+	sockaddr_u *	addr;
+	int		i, b;
+
+	if (!(gen->flag & FGEN_FLAG_BINARY))
+		return;
+	rec = filegen_room(gen, &room);
+	if (NULL == rec)
+		return;
+	size = 0;
+	for (i = 0; i < gen->nfields; i++)
+		size += gen->layout[i].size;
+	if (size > room) {
+		gen->dropped++;
+		return;
+	}
+
+	p = rec;
+	va_start(ap, gen);
+	for (i = 0; i < gen->nfields; i++) {
+		size = gen->layout[i].size;
+		switch (gen->layout[i].type) {
+		case 'I':
+			u = va_arg(ap, u_int);
+			break;
+		case 'i':
+			u = (uint32_t)va_arg(ap, int);
+			break;
+		case 'd':
+			d = va_arg(ap, double);
+			memcpy(&u, &d, sizeof(u));
+			break;
+		case 'Q':
+			u = va_arg(ap, l_fp);
+			break;
+		case 's':
+			str = va_arg(ap, const char *);
+			memset(p, 0, size);
+			len = strlen(str);
+			memcpy(p, str, min(len, size - 1));
+			p += size;
+			continue;
+		case 'A':
+			addr = va_arg(ap, sockaddr_u *);
+			memset(p, 0, size);
+			if (NULL == addr)
+				;
+			else if (IS_IPV6(addr))
+				memcpy(p, PSOCK_ADDR6(addr), 16);
+			else {
+				p[10] = p[11] = (char)0xff;
+				memcpy(p + 12, PSOCK_ADDR4(addr), 4);
+			}
+			p += size;
+			continue;
+		default:
+			INSIST(0);
+		}
+		for (b = 0; b < (int)size; b++) {
+			*p++ = (char)(u & 0xff);
+			u >>= 8;
+		}
+	}
+	va_end(ap);
+	filegen_added(gen, (size_t)(p - rec));
+}
+
+
+/*
+ * filegen_room - where the next record goes in the generation's
+ * buffer, and how much room there is. NULL if the file is not open.
+ */
+static char *
+filegen_room(
+	FILEGEN *	gen,
+	size_t *	room
+	)
+{
+	if (NULL == gen->fp)
+		return NULL;
+	if (NULL == gen->buf) {
+		gen->buf = emalloc(FILEGEN_BUFSIZE);
+		gen->wbuf = emalloc(FILEGEN_BUFSIZE);
+	}
+	*room = FILEGEN_BUFSIZE - gen->buflen;
+	return gen->buf + gen->buflen;
+}
+
+
+/*
+ * filegen_added - account for a record of len bytes put where
+ * filegen_room() said, handing the buffer over if it is time to
+ */
+static void
+filegen_added(
+	FILEGEN *	gen,
+	size_t		len
+	)
+{
+	if (0 == gen->buflen)
+		gen->buftime = current_time;
+	gen->buflen += len;
+
+	if (0 == stats_flush_latency || gen->buflen >= FILEGEN_BUFSIZE / 2)
+		filegen_handover(gen);
+}
+
+
+/*
+ * filegen_flush - move open files on to the next generation when
+ * it is time, hand over records which have waited long enough, and
+ * complain about any dropped since last time. Called once a second
+ * from the timer. With all, write out everything and wait for
+ * it, as before exiting.
+ */
+void
+filegen_flush(
+	bool	all
+	)
+{
+	struct filegen_entry *	f;
+	FILEGEN *		gen;
+	l_fp			now;
+
+	get_systime(&now);
+	for (f = filegen_registry; f != NULL; f = f->next) {
+		gen = f->filegen;
+		if (all) {
+			filegen_sync(gen);
+		} else {
+			/* switch generations at the boundary */
+			if (gen->fp != NULL)
+				filegen_setup(gen, lfpuint(now));
+			if (gen->buflen > 0 &&
+			    current_time - gen->buftime >=
+			    (u_long)stats_flush_latency)
+				filegen_handover(gen);
+		}
+		if (gen->dropped != gen->reported) {
+			msyslog(LOG_WARNING,
+				"statistics: %lu %s records dropped, "
+				"%lu in all",
+				gen->dropped - gen->reported, f->name,
+				gen->dropped);
+			gen->reported = gen->dropped;
+		}
+	}
+}
+
+
+/*
+ * filegen_handover - give the buffered records to the writer thread,
+ * unless it is still busy with the previous lot. Without a writer
+ * thread, or with stats_flush_latency 0, write them here and now.
+ */
+static void
+filegen_handover(
+	FILEGEN *	gen
+	)
+{
+	char *	swap;
+
+	if (0 == gen->buflen || NULL == gen->fp)
+		return;
+	if (0 == stats_flush_latency || !start_writer()) {
+		filegen_sync(gen);
+		return;
+	}
+
+	pthread_mutex_lock(&writer_lock);
+	if (0 == gen->wlen) {
+		swap = gen->wbuf;
+		gen->wbuf = gen->buf;
+		gen->buf = swap;
+		gen->wlen = gen->buflen;
+		gen->wfp = gen->fp;
+		gen->buflen = 0;
+		gen->wnext = writer_queue;
+		writer_queue = gen;
+		pthread_cond_signal(&writer_work);
+	}
+	pthread_mutex_unlock(&writer_lock);
+}
+
+
+/*
+ * filegen_sync - wait for the writer to finish with this generation,
+ * then write out the rest here, before the file is closed or switched.
+ */
+static void
+filegen_sync(
+	FILEGEN *	gen
+	)
+{
+	pthread_mutex_lock(&writer_lock);
+	while (gen->wlen != 0)
+		pthread_cond_wait(&writer_done, &writer_lock);
+	pthread_mutex_unlock(&writer_lock);
+
+	if (gen->buflen > 0 && gen->fp != NULL)
+		write_records(gen->fp, gen->buf, gen->buflen);
+	gen->buflen = 0;
+}
+
+
+static void
+write_records(
+	FILE *		fp,
+	const char *	buf,
+	size_t		len
+	)
+{
+	fwrite(buf, 1, len, fp);
+	fflush(fp);
+}
+
+
+/*
+ * start_writer - start the writer thread the first time it is needed,
+ * which is after ntpd has detached. False if it can't be started.
+ */
+static bool
+start_writer(void)
+{
+	pthread_t	tid;
+	sigset_t	all;
+	sigset_t	saved;
+	int		rc;
+
+	if (writer_state != 0)
+		return writer_state > 0;
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	rc = pthread_create(&tid, NULL, writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (rc != 0) {
+		msyslog(LOG_ERR,
+			"statistics: no writer thread, writing directly: %s",
+			strerror(rc));
+		writer_state = -1;
+		return false;
+	}
+	pthread_detach(tid);
+	writer_state = 1;
+	return true;
+}
+
+
+static void *
+writer_main(
+	void *	arg
+	)
+{
+	FILEGEN *	gen;
+
+	UNUSED_ARG(arg);
+	pthread_mutex_lock(&writer_lock);
+	for (;;) {
+		while (NULL == writer_queue)
+			pthread_cond_wait(&writer_work, &writer_lock);
+		gen = writer_queue;
+		writer_queue = gen->wnext;
+		pthread_mutex_unlock(&writer_lock);
+
+		write_records(gen->wfp, gen->wbuf, gen->wlen);
+
+		pthread_mutex_lock(&writer_lock);
+		gen->wlen = 0;
+		pthread_cond_broadcast(&writer_done);
+	}
+
+	return NULL;
+}
+
+
 /*
  * change settings for filegen files
  */
@@ -406,8 +833,14 @@ filegen_config(
 	 */
 	if (!valid_fileref(dir, fname))
 		return;
+	if ((flag & FGEN_FLAG_BINARY) && NULL == gen->layout) {
+		msyslog(LOG_ERR, "filegen %s has no binary format, "
+			"writing text", fname);
+		flag &= ~FGEN_FLAG_BINARY;
+	}
   
 	if (NULL != gen->fp) {
+		filegen_sync(gen);
 		fclose(gen->fp);
 		gen->fp = NULL;
 		file_existed = true;
@@ -494,16 +927,6 @@ valid_fileref(
 }
 
 
-/*
- * filegen registry
- */
-
-static struct filegen_entry {
-	char *			name;
-	FILEGEN *		filegen;
-	struct filegen_entry *	next;
-} *filegen_registry = NULL;
-
 
 FILEGEN *
 filegen_get(
@@ -564,6 +987,22 @@ filegen_register(
 }
 
 
+/*
+ * filegen_layout - give a generation set the record layout which
+ * filegen_pack() follows and binary files are written in
+ */
+void
+filegen_layout(
+	FILEGEN *			gen,
+	const struct filegen_field *	layout,
+	int				nfields
+	)
+{
+	gen->layout = layout;
+	gen->nfields = nfields;
+}
+
+
 /*
  * filegen_statsdir() - reset each filegen entry's dir to statsdir.
  */
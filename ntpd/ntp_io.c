@@ -2,6 +2,9 @@
  * ntp_io.c - input/output routines for ntpd.
  */
 
+#ifdef __linux__
+# define _GNU_SOURCE	/* for recvmmsg(2) and sendmmsg(2) */
+#endif
 #include "config.h"
 
 #include <stdio.h>
@@ -27,10 +30,17 @@
 #include <isc/netaddr.h>
 #include <isc/sockaddr.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+# define USE_EPOLL
+# include <sys/epoll.h>
+#endif
+
 #ifdef HAVE_NET_ROUTE_H
 # define USE_ROUTING_SOCKET
 # include <net/route.h>
 # ifdef HAVE_LINUX_RTNETLINK_H
+#  include <sys/ioctl.h>
+#  include <net/if.h>
 #  include <linux/rtnetlink.h>
 # endif
 #endif
@@ -107,6 +117,7 @@ static nic_rule *nic_rule_list;
  * Other statistics of possible interest
  */
 u_long packets_dropped;		/* total # of packets dropped on reception */
+u_long packets_nobuf;		/* dropped for want of a receive buffer */
 u_long packets_ignored;		/* packets received on wild card interface */
 u_long packets_received;	/* total # of packets received */
 u_long packets_sent;		/* total # of packets sent */
@@ -140,9 +151,35 @@ static	struct refclockio *refio;
  * File descriptor masks etc. for call to select
  * Not needed for I/O Completion Ports or anything outside this file
  */
+#ifndef USE_EPOLL
 static fd_set activefds;
+#endif
 static int maxactivefd;
 
+#ifdef USE_EPOLL
+/*
+ * With epoll there is no fd_set to scan.  Instead io_slots[], indexed
+ * by descriptor, records what each registered fd belongs to so a
+ * ready event can be handed straight to its owner.
+ */
+#define EPOLL_MAXEVENTS	64	/* most events taken per wakeup */
+
+enum io_kind { IO_NONE, IO_ENDPOINT, IO_REFCLOCK, IO_ASYNCIO, IO_CHILD,
+	       IO_HANDOFF };
+
+struct io_slot {
+	enum io_kind	kind;
+	void *		owner;
+};
+
+static int		epoll_fd = -1;
+static struct io_slot *	io_slots;
+static int		io_slots_alloc;
+
+static void		set_io_owner	(SOCKET, enum io_kind, void *);
+static blocking_child *	find_blocking_child(SOCKET);
+#endif	/* USE_EPOLL */
+
 /*
  * bit alternating value to detect verified interfaces during an update cycle
  */
@@ -226,7 +263,7 @@ struct remaddr {
 	endpt *			ep;
 };
 
-static remaddr_t * remoteaddr_list;
+static remaddr_t * remoteaddr_hash[NTP_HASH_SIZE];	/* by address */
 endpt *		ep_list;	/* complete endpt list */
 
 static endpt *	wildipv4;
@@ -258,8 +295,15 @@ static int		cmp_addr_distance(const sockaddr_u *,
  * Routines to read the ntp packets
  */
 static inline int	read_network_packet	(SOCKET, endpt *, l_fp);
+#ifdef HAVE_RECVMMSG
+static int	read_network_batch	(SOCKET, endpt *, l_fp);
+#endif
 static void ntpd_addremove_io_fd (int, int, int);
+#ifdef USE_EPOLL
+static void input_handler (struct epoll_event *, int, l_fp *);
+#else
 static void input_handler (fd_set *, l_fp *);
+#endif
 #ifdef REFCLOCK
 static inline int	read_refclock_packet	(SOCKET, struct refclockio *, l_fp);
 #endif
@@ -278,6 +322,38 @@ maintain_activefds(
 	int closing
 	)
 {
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+
+	if (fd < 0) {
+		msyslog(LOG_ERR, "maintain_activefds: bad fd %d", fd);
+		exit(1);
+	}
+
+	/* the child process doesn't poll, see kill_asyncio() */
+	if (epoll_fd < 0)
+		return;
+
+	if (!closing) {
+		ZERO(ev);
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0
+		    && EEXIST != errno) {
+			msyslog(LOG_ERR,
+				"epoll_ctl(EPOLL_CTL_ADD) fd %d: %m", fd);
+			exit(1);
+		}
+		maxactivefd = max(fd, maxactivefd);
+	} else {
+		/*
+		 * The descriptor may already be closed, which
+		 * took it out of the epoll set for us.
+		 */
+		(void)epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+		set_io_owner(fd, IO_NONE, NULL);
+	}
+#else
 	int i;
 
 	if (fd < 0 || fd >= (int)FD_SETSIZE) {
@@ -301,9 +377,59 @@ maintain_activefds(
 			NTP_INSIST(fd != maxactivefd);
 		}
 	}
+#endif	/* !USE_EPOLL */
 }
 
 
+#ifdef USE_EPOLL
+/*
+ * set_io_owner - note who gets called when fd becomes readable.
+ */
+static void
+set_io_owner(
+	SOCKET		fd,
+	enum io_kind	kind,
+	void *		owner
+	)
+{
+	int	newalloc;
+
+	if (fd < 0)
+		return;
+	if (fd >= io_slots_alloc) {
+		if (IO_NONE == kind)
+			return;
+		newalloc = max(fd + 1, 2 * io_slots_alloc);
+		io_slots = erealloc_zero(io_slots,
+					 newalloc * sizeof(io_slots[0]),
+					 io_slots_alloc * sizeof(io_slots[0]));
+		io_slots_alloc = newalloc;
+	}
+	io_slots[fd].kind = kind;
+	io_slots[fd].owner = owner;
+}
+
+
+/*
+ * find_blocking_child - map a response pipe back to its child.
+ */
+static blocking_child *
+find_blocking_child(
+	SOCKET	fd
+	)
+{
+	u_int	idx;
+
+	for (idx = 0; idx < blocking_children_alloc; idx++) {
+		blocking_child *c = blocking_children[idx];
+		if (c != NULL && fd == c->resp_read_pipe)
+			return c;
+	}
+	return NULL;
+}
+#endif	/* USE_EPOLL */
+
+
 #ifdef ENABLE_DEBUG_TIMING
 /*
  * collect timing information for various processing
@@ -368,7 +494,7 @@ void
 init_io(void)
 {
 	/* Init buffer free list and stat counters */
-	init_recvbuff(RECV_INIT);
+	init_recvbuff(RECV_INIT, false);
 	/* update interface every 5 minutes as default */
 	interface_interval = 300;
 
@@ -381,6 +507,13 @@ init_io(void)
 	sigaddset(&blockMask, SIGTERM);
 	sigaddset(&blockMask, SIGHUP);
 
+#ifdef USE_EPOLL
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		msyslog(LOG_ERR, "epoll_create1(): %m");
+		exit(1);
+	}
+#endif
 
 #ifdef USE_WORK_PIPE
 	addremove_io_fd = &ntpd_addremove_io_fd;
@@ -398,6 +531,10 @@ ntpd_addremove_io_fd(
 	UNUSED_ARG(is_pipe);
 
 	maintain_activefds(fd, remove_it);
+#ifdef USE_EPOLL
+	if (!remove_it)
+		set_io_owner(fd, IO_CHILD, find_blocking_child(fd));
+#endif
 }
 
 
@@ -543,6 +680,9 @@ add_asyncio_reader(
 {
 	LINK_SLIST(asyncio_reader_list, reader, link);
 	add_fd_to_list(reader->fd, type);
+#ifdef USE_EPOLL
+	set_io_owner(reader->fd, IO_ASYNCIO, reader);
+#endif
 }
 
 /*
@@ -763,6 +903,7 @@ remove_interface(
 
 	UNLINK_SLIST(unlinked, ep_list, ep, elink, endpt);
 	delete_interface_from_list(ep);
+	server_threads_remove(ep);
 
 	if (ep->fd != INVALID_SOCKET) {
 		msyslog(LOG_INFO,
@@ -1225,12 +1366,15 @@ refresh_interface(
 		if (bcast)
 			socket_broadcast_disable(interface, &interface->sin);
 
+		server_threads_remove(interface);
 		close_and_delete_fd_from_list(interface->fd);
 
 		/* create new socket picking up a new first hop binding
 		   at connect() time */
 		interface->fd = open_socket(&interface->sin,
 					    bcast, 0, interface);
+		if (interface->fd != INVALID_SOCKET)
+			server_threads_add(interface);
 		 /*
 		  * reset TTL indication so TTL is is set again
 		  * next time around
@@ -1412,6 +1556,217 @@ is_valid(
 	return check_flags6(psau, name, flags6) ? false : true;
 }
 
+/*
+ * update_address - phase one of update_interfaces() for one address
+ *
+ * Mark the endpt bound to the address of the prototype enumep present,
+ * or bind a new one.  Returns true if a new endpt was created.
+ */
+static bool
+update_address(
+	endpt *			enumep,
+	u_short			port,
+	interface_receiver_t	receiver,
+	void *			data
+	)
+{
+	interface_info_t	ifi;
+	endpt *			ep;
+
+	DPRINT_INTERFACE(4, (enumep, "examining ", "\n"));
+
+	/*
+	 * Check if and how we are going to use the interface.
+	 */
+	switch (interface_action(enumep->name, &enumep->sin,
+				 enumep->flags)) {
+
+	case ACTION_IGNORE:
+		DPRINTF(4, ("ignoring interface %s (%s) - by nic rules\n",
+			    enumep->name, socktoa(&enumep->sin)));
+		return false;
+
+	case ACTION_LISTEN:
+		DPRINTF(4, ("listen interface %s (%s) - by nic rules\n",
+			    enumep->name, socktoa(&enumep->sin)));
+		enumep->ignore_packets = false;
+		break;
+
+	case ACTION_DROP:
+		DPRINTF(4, ("drop on interface %s (%s) - by nic rules\n",
+			    enumep->name, socktoa(&enumep->sin)));
+		enumep->ignore_packets = true;
+		break;
+	}
+
+	 /* interfaces must be UP to be usable */
+	if (!(enumep->flags & INT_UP)) {
+		DPRINTF(4, ("skipping interface %s (%s) - DOWN\n",
+			    enumep->name, socktoa(&enumep->sin)));
+		return false;
+	}
+
+	/*
+	 * skip any interfaces UP and bound to a wildcard
+	 * address - some dhcp clients produce that in the
+	 * wild
+	 */
+	if (is_wildcard_addr(&enumep->sin))
+		return false;
+
+	if (is_anycast(&enumep->sin, enumep->name))
+		return false;
+
+	/*
+	 * skip any address that is an invalid state to be used
+	 */
+	if (!is_valid(&enumep->sin, enumep->name))
+		return false;
+
+	/*
+	 * map to local *address* in order to map all duplicate
+	 * interfaces to an endpt structure with the appropriate
+	 * socket.  Our name space is (ip-address), NOT
+	 * (interface name, ip-address).
+	 */
+	ep = getinterface(&enumep->sin, INT_WILDCARD);
+
+	if (ep != NULL && refresh_interface(ep)) {
+		/*
+		 * found existing and up to date interface -
+		 * mark present.
+		 */
+		if (ep->phase != sys_interphase) {
+			/*
+			 * On a new round we reset the name so
+			 * the interface name shows up again if
+			 * this address is no longer shared.
+			 * We reset ignore_packets from the
+			 * new prototype to respect any runtime
+			 * changes to the nic rules.
+			 */
+			strlcpy(ep->name, enumep->name,
+				sizeof(ep->name));
+			ep->ignore_packets =
+				    enumep->ignore_packets;
+		} else {
+			/* name collision - rename interface */
+			strlcpy(ep->name, "*multiple*",
+				sizeof(ep->name));
+		}
+
+		DPRINT_INTERFACE(4, (ep, "updating ",
+				     " present\n"));
+
+		if (ep->ignore_packets !=
+		    enumep->ignore_packets) {
+			/*
+			 * We have conflicting configurations
+			 * for the interface address. This is
+			 * caused by using -I <interfacename>
+			 * for an interface that shares its
+			 * address with other interfaces. We
+			 * can not disambiguate incoming
+			 * packets delivered to this socket
+			 * without extra syscalls/features.
+			 * These are not (commonly) available.
+			 * Note this is a more unusual
+			 * configuration where several
+			 * interfaces share an address but
+			 * filtering via interface name is
+			 * attempted.  We resolve the
+			 * configuration conflict by disabling
+			 * the processing of received packets.
+			 * This leads to no service on the
+			 * interface address where the conflict
+			 * occurs.
+			 */
+			msyslog(LOG_ERR,
+				"WARNING: conflicting enable configuration for interfaces %s and %s for address %s - unsupported configuration - address DISABLED",
+				enumep->name, ep->name,
+				socktoa(&enumep->sin));
+
+			ep->ignore_packets = true;
+		}
+
+		ep->phase = sys_interphase;
+
+		ifi.action = IFS_EXISTS;
+		ifi.ep = ep;
+		if (receiver != NULL)
+			(*receiver)(data, &ifi);
+	} else {
+		/*
+		 * This is new or refreshing failed - add to
+		 * our interface list.  If refreshing failed we
+		 * will delete the interface structure in phase
+		 * 2 as the interface was not marked current.
+		 * We can bind to the address as the refresh
+		 * code already closed the offending socket
+		 */
+		ep = create_interface(port, enumep);
+
+		if (ep != NULL) {
+			ifi.action = IFS_CREATED;
+			ifi.ep = ep;
+			if (receiver != NULL)
+				(*receiver)(data, &ifi);
+
+			DPRINT_INTERFACE(3,
+				(ep, "updating ",
+				 " new - created\n"));
+			return true;
+		} else {
+			DPRINT_INTERFACE(3,
+				(enumep, "updating ",
+				 " new - creation FAILED"));
+
+			msyslog(LOG_INFO,
+				"failed to init interface for address %s",
+				socktoa(&enumep->sin));
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * drop_interface - delete an endpt whose address has gone away,
+ * disconnecting its peers
+ */
+static void
+drop_interface(
+	endpt *			ep,
+	interface_receiver_t	receiver,
+	void *			data
+	)
+{
+	interface_info_t	ifi;
+
+	DPRINT_INTERFACE(3, (ep, "updating ", "GONE - deleting\n"));
+	remove_interface(ep);
+
+	ifi.action = IFS_DELETED;
+	ifi.ep = ep;
+	if (receiver != NULL)
+		(*receiver)(data, &ifi);
+
+	/* disconnect peers from deleted endpt. */
+	while (ep->peers != NULL)
+		set_peerdstadr(ep->peers, NULL);
+
+	/*
+	 * update globals in case we lose
+	 * a loopback interface
+	 */
+	if (ep == loopback_interface)
+		loopback_interface = NULL;
+
+	delete_interface(ep);
+}
+
+
 /*
  * update_interface strategy
  *
@@ -1445,7 +1800,6 @@ update_interfaces(
 	)
 {
 	isc_mem_t *		mctx = (void *)-1;
-	interface_info_t	ifi;
 	isc_interfaceiter_t *	iter;
 	bool			result;
 	isc_interface_t		isc_if;
@@ -1499,160 +1853,8 @@ update_interfaces(
 
 		convert_isc_if(&isc_if, &enumep, port);
 
-		DPRINT_INTERFACE(4, (&enumep, "examining ", "\n"));
-
-		/*
-		 * Check if and how we are going to use the interface.
-		 */
-		switch (interface_action(enumep.name, &enumep.sin,
-					 enumep.flags)) {
-
-		case ACTION_IGNORE:
-			DPRINTF(4, ("ignoring interface %s (%s) - by nic rules\n",
-				    enumep.name, socktoa(&enumep.sin)));
-			continue;
-
-		case ACTION_LISTEN:
-			DPRINTF(4, ("listen interface %s (%s) - by nic rules\n",
-				    enumep.name, socktoa(&enumep.sin)));
-			enumep.ignore_packets = false;
-			break;
-
-		case ACTION_DROP:
-			DPRINTF(4, ("drop on interface %s (%s) - by nic rules\n",
-				    enumep.name, socktoa(&enumep.sin)));
-			enumep.ignore_packets = true;
-			break;
-		}
-
-		 /* interfaces must be UP to be usable */
-		if (!(enumep.flags & INT_UP)) {
-			DPRINTF(4, ("skipping interface %s (%s) - DOWN\n",
-				    enumep.name, socktoa(&enumep.sin)));
-			continue;
-		}
-
-		/*
-		 * skip any interfaces UP and bound to a wildcard
-		 * address - some dhcp clients produce that in the
-		 * wild
-		 */
-		if (is_wildcard_addr(&enumep.sin))
-			continue;
-
-		if (is_anycast(&enumep.sin, isc_if.name))
-			continue;
-
-		/*
-		 * skip any address that is an invalid state to be used
-		 */
-		if (!is_valid(&enumep.sin, isc_if.name))
-			continue;
-
-		/*
-		 * map to local *address* in order to map all duplicate
-		 * interfaces to an endpt structure with the appropriate
-		 * socket.  Our name space is (ip-address), NOT
-		 * (interface name, ip-address).
-		 */
-		ep = getinterface(&enumep.sin, INT_WILDCARD);
-
-		if (ep != NULL && refresh_interface(ep)) {
-			/*
-			 * found existing and up to date interface -
-			 * mark present.
-			 */
-			if (ep->phase != sys_interphase) {
-				/*
-				 * On a new round we reset the name so
-				 * the interface name shows up again if
-				 * this address is no longer shared.
-				 * We reset ignore_packets from the
-				 * new prototype to respect any runtime
-				 * changes to the nic rules.
-				 */
-				strlcpy(ep->name, enumep.name,
-					sizeof(ep->name));
-				ep->ignore_packets =
-					    enumep.ignore_packets;
-			} else {
-				/* name collision - rename interface */
-				strlcpy(ep->name, "*multiple*",
-					sizeof(ep->name));
-			}
-
-			DPRINT_INTERFACE(4, (ep, "updating ",
-					     " present\n"));
-
-			if (ep->ignore_packets !=
-			    enumep.ignore_packets) {
-				/*
-				 * We have conflicting configurations
-				 * for the interface address. This is
-				 * caused by using -I <interfacename>
-				 * for an interface that shares its
-				 * address with other interfaces. We
-				 * can not disambiguate incoming
-				 * packets delivered to this socket
-				 * without extra syscalls/features.
-				 * These are not (commonly) available.
-				 * Note this is a more unusual
-				 * configuration where several
-				 * interfaces share an address but
-				 * filtering via interface name is
-				 * attempted.  We resolve the
-				 * configuration conflict by disabling
-				 * the processing of received packets.
-				 * This leads to no service on the
-				 * interface address where the conflict
-				 * occurs.
-				 */
-				msyslog(LOG_ERR,
-					"WARNING: conflicting enable configuration for interfaces %s and %s for address %s - unsupported configuration - address DISABLED",
-					enumep.name, ep->name,
-					socktoa(&enumep.sin));
-
-				ep->ignore_packets = true;
-			}
-
-			ep->phase = sys_interphase;
-
-			ifi.action = IFS_EXISTS;
-			ifi.ep = ep;
-			if (receiver != NULL)
-				(*receiver)(data, &ifi);
-		} else {
-			/*
-			 * This is new or refreshing failed - add to
-			 * our interface list.  If refreshing failed we
-			 * will delete the interface structure in phase
-			 * 2 as the interface was not marked current.
-			 * We can bind to the address as the refresh
-			 * code already closed the offending socket
-			 */
-			ep = create_interface(port, &enumep);
-
-			if (ep != NULL) {
-				ifi.action = IFS_CREATED;
-				ifi.ep = ep;
-				if (receiver != NULL)
-					(*receiver)(data, &ifi);
-
-				new_interface_found = true;
-				DPRINT_INTERFACE(3,
-					(ep, "updating ",
-					 " new - created\n"));
-			} else {
-				DPRINT_INTERFACE(3,
-					(&enumep, "updating ",
-					 " new - creation FAILED"));
-
-				msyslog(LOG_INFO,
-					"failed to init interface for address %s",
-					socktoa(&enumep.sin));
-				continue;
-			}
-		}
+		if (update_address(&enumep, port, receiver, data))
+			new_interface_found = true;
 	}
 
 	isc_interfaceiter_destroy(&iter);
@@ -1673,27 +1875,7 @@ update_interfaces(
 		if ((INT_WILDCARD & ep->flags) || ep->phase == sys_interphase)
 			continue;
 
-		DPRINT_INTERFACE(3, (ep, "updating ",
-				     "GONE - deleting\n"));
-		remove_interface(ep);
-
-		ifi.action = IFS_DELETED;
-		ifi.ep = ep;
-		if (receiver != NULL)
-			(*receiver)(data, &ifi);
-
-		/* disconnect peers from deleted endpt. */
-		while (ep->peers != NULL)
-			set_peerdstadr(ep->peers, NULL);
-
-		/*
-		 * update globals in case we lose
-		 * a loopback interface
-		 */
-		if (ep == loopback_interface)
-			loopback_interface = NULL;
-
-		delete_interface(ep);
+		drop_interface(ep, receiver, data);
 	}
 
 	/*
@@ -1718,7 +1900,9 @@ create_sockets(
 	)
 {
 	maxactivefd = 0;
+#ifndef USE_EPOLL
 	FD_ZERO(&activefds);
+#endif
 
 	DPRINTF(2, ("create_sockets(%d)\n", port));
 
@@ -1799,6 +1983,7 @@ create_interface(
 	 */
 	add_addr_to_list(&iface->sin, iface);
 	add_interface(iface);
+	server_threads_add(iface);
 
 	DPRINT_INTERFACE(2, (iface, "created ", "\n"));
 	return iface;
@@ -1944,11 +2129,11 @@ socket_broadcast_disable(
 #endif /* OPEN_BCAST_SOCKET */
 
 /*
- * open_socket - open a socket, returning the file descriptor
+ * bind_socket - create, configure and bind a socket for addr,
+ * returning the file descriptor
  */
-
-SOCKET
-open_socket(
+static SOCKET
+bind_socket(
 	sockaddr_u *	addr,
 	bool		bcast,
 	bool		turn_off_reuse,
@@ -2022,6 +2207,18 @@ open_socket(
 	if (!(interf->flags & INT_WILDCARD))
 		set_excladdruse(fd);
 #endif
+#ifdef USE_SERVER_THREADS
+	/*
+	 * Server threads share each unicast address through a
+	 * SO_REUSEPORT group, which has to be joined before bind().
+	 */
+	if (server_threads > 0 && !(interf->flags & INT_WILDCARD)
+	    && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			  (char *)&on, sizeof(on)))
+		msyslog(LOG_ERR,
+			"setsockopt SO_REUSEPORT on fails for address %s: %m",
+			socktoa(addr));
+#endif
 
 	/*
 	 * IPv4 specific options go here
@@ -2106,8 +2303,6 @@ open_socket(
 
 	make_socket_nonblocking(fd);
 
-	add_fd_to_list(fd, FD_TYPE_SOCKET);
-
 #ifdef F_GETFL
 	/* F_GETFL may not be defined if the underlying OS isn't really Unix */
 	DPRINTF(4, ("flags for fd %d: 0x%x\n", fd, fcntl(fd, F_GETFL, 0)));
@@ -2118,33 +2313,96 @@ open_socket(
 
 
 /*
- * sendpkt - send a packet to the specified destination. Maintain a
- * send error cache so that only the first consecutive error for a
- * destination is logged.
+ * open_socket - open a socket, returning the file descriptor
  */
-void
-sendpkt(
-	sockaddr_u *		dest,
-	endpt *	ep,
-	void *			pkt,
-	int			len
+SOCKET
+open_socket(
+	sockaddr_u *	addr,
+	bool		bcast,
+	bool		turn_off_reuse,
+	endpt *		interf
 	)
 {
-	endpt *	src;
-	ssize_t	cc;
+	SOCKET	fd;
 
-	src = ep;
-	if (NULL == src) {
-		/*
-		 * unbound peer - drop request and wait for better
-		 * network conditions
-		 */
-		DPRINTF(2, ("sendpkt(dst=%s, len=%d): no interface - IGNORED\n",
-			    socktoa(dest), len));
-		return;
-	}
+	fd = bind_socket(addr, bcast, turn_off_reuse, interf);
+	if (INVALID_SOCKET == fd)
+		return fd;
 
-	DPRINTF(2, ("sendpkt(%d, dst=%s, src=%s, len=%d)\n",
+	add_fd_to_list(fd, FD_TYPE_SOCKET);
+#ifdef USE_EPOLL
+	set_io_owner(fd, IO_ENDPOINT, interf);
+#endif
+
+	return fd;
+}
+
+
+#ifdef USE_SERVER_THREADS
+/*
+ * open_worker_socket - open another socket on ep's address for a
+ * server thread.  It is not polled by the main loop; the caller
+ * owns it.  The thread answers from the kernel's receive time
+ * stamp, so ask for one.
+ */
+SOCKET
+open_worker_socket(
+	endpt *	ep
+	)
+{
+	SOCKET	fd;
+
+	fd = bind_socket(&ep->sin, false, false, ep);
+	if (fd != INVALID_SOCKET)
+		enable_packetstamps(fd, &ep->sin);
+	return fd;
+}
+
+
+/*
+ * add_handoff_fd - poll the descriptor the server threads signal
+ * when they have packets waiting for the main thread.
+ */
+void
+add_handoff_fd(
+	SOCKET	fd
+	)
+{
+	add_fd_to_list(fd, FD_TYPE_FILE);
+	set_io_owner(fd, IO_HANDOFF, NULL);
+}
+
+#endif	/* USE_SERVER_THREADS */
+
+
+/*
+ * sendpkt - send a packet to the specified destination. Maintain a
+ * send error cache so that only the first consecutive error for a
+ * destination is logged.
+ */
+void
+sendpkt(
+	sockaddr_u *		dest,
+	endpt *	ep,
+	void *			pkt,
+	int			len
+	)
+{
+	endpt *	src;
+	ssize_t	cc;
+
+	src = ep;
+	if (NULL == src) {
+		/*
+		 * unbound peer - drop request and wait for better
+		 * network conditions
+		 */
+		DPRINTF(2, ("sendpkt(dst=%s, len=%d): no interface - IGNORED\n",
+			    socktoa(dest), len));
+		return;
+	}
+
+	DPRINTF(2, ("sendpkt(%d, dst=%s, src=%s, len=%d)\n",
 		    src->fd, socktoa(dest), socktoa(&src->sin), len));
 
 	cc = sendto(src->fd, pkt, (u_int)len, 0,
@@ -2160,6 +2418,125 @@ sendpkt(
 
 
 
+#ifdef HAVE_SENDMMSG
+/*
+ * Transmit queue for server replies.  While the main loop drains a
+ * batch of recvbufs, fast_xmit() parks its replies here through
+ * sendpkt_queued(); flush_xmit_queue() then hands them to the kernel
+ * with one sendmmsg() per socket.
+ */
+#define XMIT_BATCH	(2 * RECV_BATCH)
+
+struct xmitbuf {
+	endpt *		ep;
+	sockaddr_u	dest;
+	int		len;
+	struct pkt	pkt;
+};
+
+static struct xmitbuf	xmit_queue[XMIT_BATCH];
+static int		xmit_queued;
+#endif	/* HAVE_SENDMMSG */
+
+/*
+ * sendpkt_queued - like sendpkt(), but the packet may be held back
+ * until the next flush_xmit_queue() so replies can go out in bulk.
+ */
+void
+sendpkt_queued(
+	sockaddr_u *		dest,
+	endpt *			ep,
+	void *			pkt,
+	int			len
+	)
+{
+#ifdef HAVE_SENDMMSG
+	struct xmitbuf *	xb;
+
+	if (NULL == ep || len < 0 || (size_t)len > sizeof(xb->pkt)) {
+		sendpkt(dest, ep, pkt, len);
+		return;
+	}
+	if (XMIT_BATCH == xmit_queued)
+		flush_xmit_queue();
+
+	DPRINTF(2, ("sendpkt_queued(%d, dst=%s, src=%s, len=%d)\n",
+		    ep->fd, socktoa(dest), socktoa(&ep->sin), len));
+
+	xb = &xmit_queue[xmit_queued++];
+	xb->ep = ep;
+	xb->dest = *dest;
+	xb->len = len;
+	memcpy(&xb->pkt, pkt, (size_t)len);
+#else
+	sendpkt(dest, ep, pkt, len);
+#endif
+}
+
+/*
+ * flush_xmit_queue - send everything sendpkt_queued() held back.
+ * Packets for the same socket go out together in queue order.
+ */
+void
+flush_xmit_queue(void)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr	msgv[XMIT_BATCH];
+	struct iovec	iovv[XMIT_BATCH];
+	struct xmitbuf *xbv[XMIT_BATCH];
+	bool		done[XMIT_BATCH];
+	endpt *		ep;
+	int		i, j, n, off, cc;
+
+	if (0 == xmit_queued)
+		return;
+
+	ZERO(done);
+	for (i = 0; i < xmit_queued; i++) {
+		if (done[i])
+			continue;
+		ep = xmit_queue[i].ep;
+		n = 0;
+		for (j = i; j < xmit_queued; j++) {
+			if (done[j] || xmit_queue[j].ep != ep)
+				continue;
+			done[j] = true;
+			xbv[n] = &xmit_queue[j];
+			iovv[n].iov_base = &xbv[n]->pkt;
+			iovv[n].iov_len = (size_t)xbv[n]->len;
+			ZERO(msgv[n]);
+			msgv[n].msg_hdr.msg_name = &xbv[n]->dest.sa;
+			msgv[n].msg_hdr.msg_namelen = SOCKLEN(&xbv[n]->dest);
+			msgv[n].msg_hdr.msg_iov = &iovv[n];
+			msgv[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+
+		/*
+		 * sendmmsg() stops at the first message that fails;
+		 * count that one as not sent and carry on after it,
+		 * as sendto() one at a time would have.
+		 */
+		for (off = 0; off < n; off += cc) {
+			cc = sendmmsg(ep->fd, &msgv[off], (u_int)(n - off), 0);
+			if (cc < 0 && EINTR == errno) {
+				cc = 0;
+			} else if (cc <= 0) {
+				ep->notsent++;
+				packets_notsent++;
+				cc = 1;
+			} else {
+				ep->sent += cc;
+				packets_sent += (u_long)cc;
+			}
+		}
+		DPRINTF(3, ("flush_xmit_queue: fd=%d sent %d\n", ep->fd, n));
+	}
+	xmit_queued = 0;
+#endif	/* HAVE_SENDMMSG */
+}
+
+
 #ifdef REFCLOCK
 /*
  * Routine to read the refclock packets for a specific interface
@@ -2189,6 +2566,7 @@ read_refclock_packet(
 
 		buflen = read(fd, buf, sizeof buf);
 		packets_dropped++;
+		packets_nobuf++;
 		return (buflen);
 	}
 
@@ -2230,6 +2608,89 @@ read_refclock_packet(
 }
 #endif	/* REFCLOCK */
 
+/*
+ * spoofed_loopback - true if a packet from src claims to come from
+ * the IPv6 loopback but arrived on some other interface.
+ */
+bool
+spoofed_loopback(
+	const endpt *		itf,
+	const sockaddr_u *	src
+	)
+{
+	/*
+	** Bug 2672: Some OSes (MacOSX and Linux) don't block spoofed ::1
+	*/
+	if (AF_INET6 != itf->family)
+		return false;
+
+	DPRINTF(2, ("Got an IPv6 packet, from <%s> (%d) to <%s> (%d)\n",
+		socktoa(src),
+		IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(src)),
+		socktoa(&itf->sin),
+		!IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(&itf->sin))
+		));
+
+	return (IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(src))
+		&& !IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(&itf->sin)));
+}
+
+/*
+ * Common tail of the single and batched network read paths: screen
+ * a datagram that has landed in rb and queue it for receive().
+ */
+static void
+queue_network_packet(
+	SOCKET			fd,
+	endpt *			itf,
+	struct recvbuf *	rb,
+	struct msghdr *		msghdr,
+	l_fp			ts
+	)
+{
+#ifndef USE_PACKET_TIMESTAMP
+	UNUSED_ARG(msghdr);
+#endif
+
+	DPRINTF(3, ("read_network_packet: fd=%d length %d from %s\n",
+		    fd, (int)rb->recv_length, socktoa(&rb->recv_srcadr)));
+
+	/*
+	 * We used to drop network packets with addresses matching the magic
+	 * refclock format here. Now we do the check in the protocol machine,
+	 * rejecting any source address that matches an active clock.
+	 */
+
+	if (spoofed_loopback(itf, &rb->recv_srcadr)) {
+		packets_dropped++;
+		DPRINTF(2, ("DROPPING that packet\n"));
+		freerecvbuf(rb);
+		return;
+	}
+
+	/*
+	 * Got one.  Mark how and when it got here,
+	 * put it on the full list and do bookkeeping.
+	 */
+	rb->dstadr = itf;
+	rb->cast_flags = (uint8_t)(rb->fd == rb->dstadr->bfd ? MDF_BCAST : MDF_UCAST);
+	rb->fd = fd;
+#ifdef USE_PACKET_TIMESTAMP
+	/* pick up a network time stamp if possible */
+	ts = fetch_packetstamp(rb, msghdr, ts);
+#endif
+	rb->recv_time = ts;
+	rb->receiver = receive;
+#ifdef REFCLOCK
+	rb->network_packet = true;
+#endif /* REFCLOCK */
+
+	add_full_recv_buffer(rb);
+
+	itf->received++;
+	packets_received++;
+}
+
 /*
  * Routine to read the network NTP packets for a specific interface
  * Return the number of bytes read. That way we know if we should
@@ -2274,10 +2735,12 @@ read_network_packet(
 			    ? "ignore"
 			    : "drop",
 			free_recvbuffs(), fd, socktoa(&from)));
-		if (itf->ignore_packets)
+		if (itf->ignore_packets) {
 			packets_ignored++;
-		else
+		} else {
 			packets_dropped++;
+			packets_nobuf++;
+		}
 		return (buflen);
 	}
 
@@ -2319,61 +2782,101 @@ read_network_packet(
 		return (buflen);
 	}
 
-	DPRINTF(3, ("read_network_packet: fd=%d length %d from %s\n",
-		    fd, (int)buflen, socktoa(&rb->recv_srcadr)));
+#ifndef USE_PACKET_TIMESTAMP
+	queue_network_packet(fd, itf, rb, NULL, ts);
+#else
+	queue_network_packet(fd, itf, rb, &msghdr, ts);
+#endif
+	return (buflen);
+}
+
+#ifdef HAVE_RECVMMSG
+/*
+ * Routine to read up to RECV_BATCH network NTP packets for a specific
+ * interface with a single recvmmsg() call.  Return the number of
+ * datagrams read while the batch came back full, so the caller
+ * knows to read again; a short batch means the socket is drained
+ * and we return 0 to save the caller a final EAGAIN round trip.
+ */
+static int
+read_network_batch(
+	SOCKET			fd,
+	endpt *			itf,
+	l_fp			ts
+	)
+{
+	struct recvbuf *	rbv[RECV_BATCH];
+	struct mmsghdr		msgv[RECV_BATCH];
+	struct iovec		iovv[RECV_BATCH];
+#ifdef USE_PACKET_TIMESTAMP
+	char			control[RECV_BATCH][CMSG_BUFSIZE];
+#endif
+	size_t			nbufs;
+	size_t			i;
+	int			nmsgs;
+	int			saved_errno;
 
 	/*
-	 * We used to drop network packets with addresses matching the magic
-	 * refclock format here. Now we do the check in the protocol machine,
-	 * rejecting any source address that matches an active clock.
+	 * Ignored sockets and an empty free list take the
+	 * one-at-a-time path, which knows how to dump packets.
 	 */
+	if (itf->ignore_packets || 0 == free_recvbuffs())
+		return read_network_packet(fd, itf, ts);
+
+	nbufs = get_free_recv_buffers(rbv, RECV_BATCH);
+	ZERO(msgv);
+	for (i = 0; i < nbufs; i++) {
+		iovv[i].iov_base = &rbv[i]->recv_space;
+		iovv[i].iov_len = sizeof(rbv[i]->recv_space);
+		msgv[i].msg_hdr.msg_name = &rbv[i]->recv_srcadr;
+		msgv[i].msg_hdr.msg_namelen = sizeof(rbv[i]->recv_srcadr);
+		msgv[i].msg_hdr.msg_iov = &iovv[i];
+		msgv[i].msg_hdr.msg_iovlen = 1;
+#ifdef USE_PACKET_TIMESTAMP
+		msgv[i].msg_hdr.msg_control = (void *)control[i];
+		msgv[i].msg_hdr.msg_controllen = sizeof(control[i]);
+#endif
+	}
 
-	/*
-	** Bug 2672: Some OSes (MacOSX and Linux) don't block spoofed ::1
-	*/
+	do {
+		nmsgs = recvmmsg(fd, msgv, (u_int)nbufs, 0, NULL);
+	} while (nmsgs < 0 && EINTR == errno);
 
-	if (AF_INET6 == itf->family) {
-		DPRINTF(2, ("Got an IPv6 packet, from <%s> (%d) to <%s> (%d)\n",
-			socktoa(&rb->recv_srcadr),
-			IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(&rb->recv_srcadr)),
-			socktoa(&itf->sin),
-			!IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(&itf->sin))
-			));
-
-		if (   IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(&rb->recv_srcadr))
-		    && !IN6_IS_ADDR_LOOPBACK(PSOCK_ADDR6(&itf->sin))
-		   ) {
-			packets_dropped++;
-			DPRINTF(2, ("DROPPING that packet\n"));
-			freerecvbuf(rb);
-			return buflen;
+	if (nmsgs <= 0) {
+		saved_errno = errno;
+		for (i = 0; i < nbufs; i++)
+			freerecvbuf(rbv[i]);
+		errno = saved_errno;
+		if (nmsgs < 0 && EWOULDBLOCK != errno
+#ifdef EAGAIN
+		    && EAGAIN != errno
+#endif
+		    ) {
+			msyslog(LOG_ERR, "recvmmsg() fd=%d: %m", fd);
+			DPRINTF(5, ("read_network_batch: fd=%d dropped (bad recvmmsg)\n",
+				    fd));
 		}
-		DPRINTF(2, ("processing that packet\n"));
+		return nmsgs;
 	}
 
-	/*
-	 * Got one.  Mark how and when it got here,
-	 * put it on the full list and do bookkeeping.
-	 */
-	rb->dstadr = itf;
-	rb->cast_flags = (uint8_t)(rb->fd == rb->dstadr->bfd ? MDF_BCAST : MDF_UCAST);
-	rb->fd = fd;
-#ifdef USE_PACKET_TIMESTAMP
-	/* pick up a network time stamp if possible */
-	ts = fetch_packetstamp(rb, &msghdr, ts);
-#endif
-	rb->recv_time = ts;
-	rb->receiver = receive;
-#ifdef REFCLOCK
-	rb->network_packet = true;
-#endif /* REFCLOCK */
+	DPRINTF(4, ("read_network_batch: fd=%d got %d of %d\n",
+		    fd, nmsgs, (int)nbufs));
 
-	add_full_recv_buffer(rb);
+	for (i = 0; i < (size_t)nmsgs; i++) {
+		rbv[i]->recv_length = msgv[i].msg_len;
+		if (0 == rbv[i]->recv_length) {
+			freerecvbuf(rbv[i]);
+			continue;
+		}
+		queue_network_packet(fd, itf, rbv[i], &msgv[i].msg_hdr,
+				     ts);
+	}
+	for (; i < nbufs; i++)
+		freerecvbuf(rbv[i]);
 
-	itf->received++;
-	packets_received++;
-	return (buflen);
+	return ((size_t)nmsgs < nbufs) ? 0 : nmsgs;
 }
+#endif	/* HAVE_RECVMMSG */
 
 /*
  * attempt to handle io
@@ -2383,19 +2886,29 @@ io_handler(void)
 {
 	bool flag;
 	sigset_t runMask;
+#ifdef USE_EPOLL
+	struct epoll_event events[EPOLL_MAXEVENTS];
+#else
 	fd_set rdfdes;
+#endif
 	int nfound;
 
 	/*
 	 * Use select() on all input fd's for unlimited
 	 * time.  select() will terminate on SIGALARM or on the
-	 * reception of input.
+	 * reception of input.  With epoll, epoll_pwait() does the
+	 * same job with the same signal mask handling.
 	 */
 	pthread_sigmask(SIG_BLOCK, &blockMask, &runMask);
 	flag = sawALRM || sawQuit || sawHUP;
 	if (!flag) {
+#ifdef USE_EPOLL
+	  nfound = epoll_pwait(epoll_fd, events, EPOLL_MAXEVENTS, -1,
+			       &runMask);
+#else
 	  rdfdes = activefds;
 	  nfound = pselect(maxactivefd+1, &rdfdes, NULL, NULL, NULL, &runMask);
+#endif
 	} else {
 	  nfound = -1;
 	  errno = EINTR;
@@ -2412,7 +2925,11 @@ io_handler(void)
 		 */
 		get_systime(&ts);
 
+#ifdef USE_EPOLL
+		input_handler(events, nfound, &ts);
+#else
 		input_handler(&rdfdes, &ts);
+#endif
 	} else if (nfound == -1 && errno != EINTR) {
 		msyslog(LOG_ERR, "select() error: %m");
 	}
@@ -2425,6 +2942,212 @@ io_handler(void)
 #   endif /* DEBUG */
 }
 
+#ifdef REFCLOCK
+/*
+ * input_refclock - drain a refclock descriptor the poller says
+ * is readable.
+ */
+static void
+input_refclock(
+	struct refclockio *	rp,
+	l_fp			ts
+	)
+{
+	SOCKET		fd;
+	int		buflen;
+	int		saved_errno;
+	const char *	clk;
+
+	fd = rp->fd;
+	buflen = read_refclock_packet(fd, rp, ts);
+	/*
+	 * The first read must succeed after select()
+	 * indicates readability, or we've reached
+	 * a permanent EOF.  http://bugs.ntp.org/1732
+	 * reported ntpd munching CPU after a USB GPS
+	 * was unplugged because select was indicating
+	 * EOF but ntpd didn't remove the descriptor
+	 * from the activefds set.
+	 */
+	if (buflen < 0 && EAGAIN != errno) {
+		saved_errno = errno;
+		clk = refclock_name(rp->srcclock);
+		errno = saved_errno;
+		msyslog(LOG_ERR, "%s read: %m", clk);
+		maintain_activefds(fd, true);
+	} else if (0 == buflen) {
+		clk = refclock_name(rp->srcclock);
+		msyslog(LOG_ERR, "%s read EOF", clk);
+		maintain_activefds(fd, true);
+	} else {
+		/* drain any remaining refclock input */
+		do {
+			buflen = read_refclock_packet(fd, rp, ts);
+		} while (buflen > 0);
+	}
+}
+#endif /* REFCLOCK */
+
+/*
+ * input_network - drain one readable endpoint socket.
+ */
+static void
+input_network(
+	endpt *		ep,
+	SOCKET		fd,
+	l_fp		ts
+	)
+{
+	int	buflen;
+
+	do {
+#ifdef HAVE_RECVMMSG
+		buflen = read_network_batch(fd, ep, ts);
+#else
+		buflen = read_network_packet(fd, ep, ts);
+#endif
+	} while (buflen > 0);
+}
+
+/*
+ * input_done - bookkeeping common to both pollers once a wakeup's
+ * worth of descriptors has been handled.
+ */
+static void
+input_done(
+	size_t	select_count,
+	l_fp	ts
+	)
+{
+#ifdef ENABLE_DEBUG_TIMING
+	l_fp		ts_e;	/* Timestamp at EOselect() gob */
+#else
+	UNUSED_ARG(ts);
+#endif
+
+	/*
+	 * Done everything from that select.
+	 * If nothing to do, just return.
+	 * If an error occurred, complain and return.
+	 */
+	if (select_count == 0) { /* We really had nothing to do */
+#ifdef DEBUG
+		if (debug)
+			msyslog(LOG_DEBUG, "input_handler: select() returned 0");
+#endif /* DEBUG */
+		return;
+	}
+	/* We've done our work */
+#ifdef ENABLE_DEBUG_TIMING
+	get_systime(&ts_e);
+	/*
+	 * (ts_e - ts) is the amount of time we spent processing this
+	 * gob of file descriptors.  Log it.
+	 */
+	ts_e -= ts;
+	collect_timing(NULL, "input handler", 1, &ts_e);
+	if (debug > 3)
+		msyslog(LOG_DEBUG,
+			"input_handler: Processed a gob of fd's in %s msec",
+			lfptoms(&ts_e, 6));
+#endif /* ENABLE_DEBUG_TIMING */
+	/* We're done... */
+	return;
+}
+
+#ifdef USE_EPOLL
+/*
+ * input_handler - receive packets
+ *
+ * Each ready event names its descriptor, and io_slots[] says who
+ * owns it, so we go straight there instead of walking every
+ * endpoint, refclock, reader and child looking for set bits.
+ */
+static void
+input_handler(
+	struct epoll_event *	events,
+	int			nevents,
+	l_fp *			cts
+	)
+{
+	int		i;
+	SOCKET		fd;
+	l_fp		ts;	/* Timestamp at BOselect() gob */
+	size_t		select_count;
+	struct io_slot *slot;
+	blocking_child *c;
+
+	handler_calls++;
+	select_count = 0;
+
+	/*
+	 * If we have something to do, freeze a timestamp.
+	 * See below for the other cases (nothing left to do or error)
+	 */
+	ts = *cts;
+
+	++handler_pkts;
+
+	for (i = 0; i < nevents; i++) {
+		fd = events[i].data.fd;
+		/*
+		 * An earlier event in this batch may have closed
+		 * the descriptor; its slot is cleared when it is.
+		 */
+		if (fd < 0 || fd >= io_slots_alloc)
+			continue;
+		slot = &io_slots[fd];
+
+		switch (slot->kind) {
+
+		case IO_ENDPOINT:
+			++select_count;
+			input_network(slot->owner, fd, ts);
+			break;
+
+#ifdef REFCLOCK
+		case IO_REFCLOCK:
+			++select_count;
+			input_refclock(slot->owner, ts);
+			break;
+#endif
+
+#ifdef USE_ROUTING_SOCKET
+		case IO_ASYNCIO:
+			++select_count;
+			/* callback may unlink and free the reader */
+			(*((struct asyncio_reader *)slot->owner)->receiver)(
+				slot->owner);
+			break;
+#endif
+
+#ifdef USE_SERVER_THREADS
+		case IO_HANDOFF:
+			++select_count;
+			server_threads_input();
+			break;
+#endif
+
+		case IO_CHILD:
+			c = slot->owner;
+			if (NULL == c)
+				c = find_blocking_child(fd);
+			if (c != NULL) {
+				++select_count;
+				process_blocking_resp(c);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	input_done(select_count, ts);
+}
+
+#else	/* !USE_EPOLL follows */
+
 /*
  * input_handler - receive packets
  */
@@ -2434,20 +3157,14 @@ input_handler(
 	l_fp *	cts
 	)
 {
-	int		buflen;
 	u_int		idx;
 	int		doing;
 	SOCKET		fd;
 	l_fp		ts;	/* Timestamp at BOselect() gob */
-#ifdef ENABLE_DEBUG_TIMING
-	l_fp		ts_e;	/* Timestamp at EOselect() gob */
-#endif
 	size_t		select_count;
 	endpt *		ep;
 #ifdef REFCLOCK
 	struct refclockio *rp;
-	int		saved_errno;
-	const char *	clk;
 #endif
 #ifdef USE_ROUTING_SOCKET
 	struct asyncio_reader *	asyncio_reader;
@@ -2477,32 +3194,7 @@ input_handler(
 			if (!FD_ISSET(fd, fds))
 				continue;
 			++select_count;
-			buflen = read_refclock_packet(fd, rp, ts);
-			/*
-			 * The first read must succeed after select()
-			 * indicates readability, or we've reached
-			 * a permanent EOF.  http://bugs.ntp.org/1732
-			 * reported ntpd munching CPU after a USB GPS
-			 * was unplugged because select was indicating
-			 * EOF but ntpd didn't remove the descriptor
-			 * from the activefds set.
-			 */
-			if (buflen < 0 && EAGAIN != errno) {
-				saved_errno = errno;
-				clk = refclock_name(rp->srcclock);
-				errno = saved_errno;
-				msyslog(LOG_ERR, "%s read: %m", clk);
-				maintain_activefds(fd, true);
-			} else if (0 == buflen) {
-				clk = refclock_name(rp->srcclock);
-				msyslog(LOG_ERR, "%s read EOF", clk);
-				maintain_activefds(fd, true);
-			} else {
-				/* drain any remaining refclock input */
-				do {
-					buflen = read_refclock_packet(fd, rp, ts);
-				} while (buflen > 0);
-			}
+			input_refclock(rp, ts);
 		}
 	}
 #endif /* REFCLOCK */
@@ -2521,12 +3213,10 @@ input_handler(
 			}
 			if (fd < 0)
 				continue;
-			if (FD_ISSET(fd, fds))
-				do {
-					++select_count;
-					buflen = read_network_packet(
-							fd, ep, ts);
-				} while (buflen > 0);
+			if (FD_ISSET(fd, fds)) {
+				++select_count;
+				input_network(ep, fd, ts);
+			}
 			/* Check more interfaces */
 		}
 	}
@@ -2561,35 +3251,9 @@ input_handler(
 		}
 	}
 
-	/*
-	 * Done everything from that select.
-	 * If nothing to do, just return.
-	 * If an error occurred, complain and return.
-	 */
-	if (select_count == 0) { /* We really had nothing to do */
-#ifdef DEBUG
-		if (debug)
-			msyslog(LOG_DEBUG, "input_handler: select() returned 0");
-#endif /* DEBUG */
-		return;
-	}
-	/* We've done our work */
-#ifdef ENABLE_DEBUG_TIMING
-	get_systime(&ts_e);
-	/*
-	 * (ts_e - ts) is the amount of time we spent processing this
-	 * gob of file descriptors.  Log it.
-	 */
-	ts_e -= ts;
-	collect_timing(NULL, "input handler", 1, &ts_e);
-	if (debug > 3)
-		msyslog(LOG_DEBUG,
-			"input_handler: Processed a gob of fd's in %s msec",
-			lfptoms(&ts_e, 6));
-#endif /* ENABLE_DEBUG_TIMING */
-	/* We're done... */
-	return;
+	input_done(select_count, ts);
 }
+#endif	/* !USE_EPOLL */
 
 
 /*
@@ -3017,6 +3681,7 @@ void
 io_clr_stats(void)
 {
 	packets_dropped = 0;
+	packets_nobuf = 0;
 	packets_ignored = 0;
 	packets_received = 0;
 	packets_sent = 0;
@@ -3053,6 +3718,9 @@ io_addclock(
 	 * register fd
 	 */
 	add_fd_to_list(rio->fd, FD_TYPE_FILE);
+#ifdef USE_EPOLL
+	set_io_owner(rio->fd, IO_REFCLOCK, rio);
+#endif
 
 	return true;
 }
@@ -3096,8 +3764,17 @@ kill_asyncio(
 	 * In the child process we do not maintain activefds and
 	 * maxactivefd.  Zeroing maxactivefd disables code which
 	 * maintains it in close_and_delete_fd_from_list().
+	 * The epoll set is shared with the parent, so let go of
+	 * it before closing anything lest we deregister the
+	 * parent's descriptors.
 	 */
 	maxactivefd = 0;
+#ifdef USE_EPOLL
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+#endif
 
 	while (fd_list != NULL)
 		close_and_delete_fd_from_list(fd_list->fd);
@@ -3176,7 +3853,8 @@ add_addr_to_list(
 		laddr->addr = *addr;
 		laddr->ep = ep;
 
-		LINK_SLIST(remoteaddr_list, laddr, link);
+		LINK_SLIST(remoteaddr_hash[NTP_HASH_ADDR(addr)], laddr,
+			   link);
 
 		DPRINTF(4, ("Added addr %s to list of addresses\n",
 			    socktoa(addr)));
@@ -3188,15 +3866,23 @@ add_addr_to_list(
 }
 
 
+/*
+ * An endpt is only ever listed under its own address, so only that
+ * bucket needs to be searched.
+ */
 static void
 delete_interface_from_list(
 	endpt *iface
 	)
 {
+	remaddr_t **bucket;
 	remaddr_t *unlinked;
 
+	bucket = &remoteaddr_hash[NTP_HASH_ADDR(&iface->sin)];
 	for (;;) {
-		UNLINK_EXPR_SLIST(unlinked, remoteaddr_list, iface ==
+		/* unlike the whole list, a bucket can run empty */
+		UNLINK_EXPR_SLIST(unlinked, *bucket,
+		    UNLINK_EXPR_SLIST_CURRENT() != NULL && iface ==
 		    UNLINK_EXPR_SLIST_CURRENT()->ep, link,
 		    remaddr_t);
 
@@ -3220,7 +3906,7 @@ find_addr_in_list(
 	DPRINTF(4, ("Searching for addr %s in list of addresses - ",
 		    socktoa(addr)));
 
-	for (entry = remoteaddr_list;
+	for (entry = remoteaddr_hash[NTP_HASH_ADDR(addr)];
 	     entry != NULL;
 	     entry = entry->link)
 		if (SOCK_EQ(&entry->addr, addr)) {
@@ -3248,6 +3934,166 @@ localaddrtoa(
 #  define UPDATE_GRACE	2	/* wait UPDATE_GRACE seconds before scanning */
 # endif
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+ * netlink_ifflags - add the flags of the link an address is on.  Like
+ * the interface iterator, ignore links that are not running.
+ */
+static bool
+netlink_ifflags(
+	isc_interface_t *	isc_if
+	)
+{
+	struct ifreq	ifr;
+	int		fd;
+	int		rc;
+
+	ZERO(ifr);
+	if (NULL == if_indextoname(isc_if->ifindex, ifr.ifr_name))
+		return false;
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return false;
+	rc = ioctl(fd, SIOCGIFFLAGS, &ifr);
+	close(fd);
+	if (rc < 0 || !(ifr.ifr_flags & IFF_RUNNING))
+		return false;
+
+	if (ifr.ifr_flags & IFF_UP)
+		isc_if->flags |= INTERFACE_F_UP;
+	if (ifr.ifr_flags & IFF_POINTOPOINT)
+		isc_if->flags |= INTERFACE_F_POINTTOPOINT;
+	if (ifr.ifr_flags & IFF_LOOPBACK)
+		isc_if->flags |= INTERFACE_F_LOOPBACK;
+	if (ifr.ifr_flags & IFF_BROADCAST)
+		isc_if->flags |= INTERFACE_F_BROADCAST;
+	if (ifr.ifr_flags & IFF_MULTICAST)
+		isc_if->flags |= INTERFACE_F_MULTICAST;
+	return true;
+}
+
+
+/*
+ * netlink_address - bind or drop the one address an RTM_NEWADDR or
+ * RTM_DELADDR message is about.  Returns true if the endpt list
+ * changed.
+ */
+static bool
+netlink_address(
+	struct nlmsghdr *	nh
+	)
+{
+	isc_interface_t	isc_if;
+	endpt		enumep;
+	endpt *		ep;
+
+	if (!netlink_ifaddr(nh, &isc_if))
+		return false;
+	if ((AF_INET == isc_if.af && !ipv4_works) ||
+	    (AF_INET6 == isc_if.af && !ipv6_works))
+		return false;
+	if (RTM_NEWADDR == nh->nlmsg_type && !netlink_ifflags(&isc_if))
+		return false;
+
+	init_interface(&enumep);
+	convert_isc_if(&isc_if, &enumep, NTP_PORT);
+	ep = getinterface(&enumep.sin, INT_WILDCARD);
+
+	if (RTM_DELADDR == nh->nlmsg_type) {
+		if (NULL == ep)
+			return false;
+		if (ep->ifindex != isc_if.ifindex ||
+		    !strcmp(ep->name, "*multiple*")) {
+			/* another interface may still hold the address */
+			DPRINTF(3, ("routing message op = %d: %s is shared, scheduling interface update\n",
+				    nh->nlmsg_type, socktoa(&enumep.sin)));
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
+			return false;
+		}
+		drop_interface(ep, NULL, NULL);
+		return true;
+	}
+
+	/* lifetime and flag changes are reported as new addresses too */
+	if (ep != NULL) {
+		if (ep->ifindex != isc_if.ifindex &&
+		    strcmp(ep->name, "*multiple*")) {
+			/*
+			 * Another interface has the address too.  Mark it
+			 * shared as update_interfaces() would, so that it
+			 * outlives either one losing the address, and let
+			 * a full scan settle any nic rules conflict.
+			 */
+			DPRINTF(3, ("routing message op = %d: %s is shared, scheduling interface update\n",
+				    nh->nlmsg_type, socktoa(&enumep.sin)));
+			strlcpy(ep->name, "*multiple*", sizeof(ep->name));
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
+		}
+		return false;
+	}
+	if (!update_address(&enumep, NTP_PORT, NULL, NULL))
+		return false;
+#ifdef DEBUG
+	msyslog(LOG_DEBUG, "new interface(s) found: waking up resolver");
+#endif
+	interrupt_worker_sleep();
+	return true;
+}
+
+
+/*
+ * netlink_link - follow a link going down, coming up, or going away.
+ * Returns true if the endpt list changed.
+ */
+static bool
+netlink_link(
+	struct nlmsghdr *	nh
+	)
+{
+	const unsigned int	running = IFF_UP | IFF_RUNNING;
+	struct ifinfomsg *	ifi;
+	endpt *			ep;
+	endpt *			next_ep;
+	bool			changed;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return false;
+	ifi = NLMSG_DATA(nh);
+
+	if (RTM_NEWLINK == nh->nlmsg_type &&
+	    (ifi->ifi_flags & running) == running) {
+		for (ep = ep_list; ep != NULL; ep = ep->elink)
+			if (!(INT_WILDCARD & ep->flags) &&
+			    (int)ep->ifindex == ifi->ifi_index)
+				return false;
+		/*
+		 * The addresses a link kept while it was down come
+		 * back with it, but without RTM_NEWADDR.
+		 */
+		DPRINTF(3, ("routing message op = %d: link %d up, scheduling interface update\n",
+			    nh->nlmsg_type, ifi->ifi_index));
+		timer_interfacetimeout(current_time + UPDATE_GRACE);
+		return false;
+	}
+
+	/* the interface iterator would no longer return these */
+	changed = false;
+	for (ep = ep_list; ep != NULL; ep = next_ep) {
+		next_ep = ep->elink;
+		if ((INT_WILDCARD & ep->flags) ||
+		    (int)ep->ifindex != ifi->ifi_index)
+			continue;
+		if (!strcmp(ep->name, "*multiple*")) {
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
+			continue;
+		}
+		drop_interface(ep, NULL, NULL);
+		changed = true;
+	}
+	return changed;
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
 static void
 process_routing_msgs(struct asyncio_reader *reader)
 {
@@ -3256,6 +4102,8 @@ process_routing_msgs(struct asyncio_reader *reader)
         int msg_type;
 #ifdef HAVE_LINUX_RTNETLINK_H
 	struct nlmsghdr *nh;
+	bool done;
+	bool changed;
 #else
 	struct rt_msghdr rtm;
 	char *p;
@@ -3275,8 +4123,13 @@ process_routing_msgs(struct asyncio_reader *reader)
 
 	if (cnt < 0) {
 		if (errno == ENOBUFS) {
+			/*
+			 * messages were lost, so whatever they said
+			 * has to be found out the slow way
+			 */
 			msyslog(LOG_ERR,
-				"routing socket reports: %m");
+				"routing socket reports: %m - scheduling interface update");
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
 		} else {
 			msyslog(LOG_ERR,
 				"routing socket reports: %m - disabling");
@@ -3290,9 +4143,10 @@ process_routing_msgs(struct asyncio_reader *reader)
 	 * process routing message
 	 */
 #ifdef HAVE_LINUX_RTNETLINK_H
+	done = changed = false;
 	for (nh = (struct nlmsghdr *)buffer;
 	     /* Avoid a sign comparison warning on some Linux distributions */
-	     NLMSG_OK(nh, (unsigned) cnt);
+	     !done && NLMSG_OK(nh, (unsigned) cnt);
 	     nh = NLMSG_NEXT(nh, cnt)) {
 		msg_type = nh->nlmsg_type;
 #else
@@ -3312,6 +4166,42 @@ process_routing_msgs(struct asyncio_reader *reader)
 		msg_type = rtm.rtm_type;
 #endif
 		switch (msg_type) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+		/*
+		 * Address and link changes are applied as they come,
+		 * without rescanning the interfaces.
+		 */
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			DPRINTF(3, ("routing message op = %d: updating address\n",
+				    msg_type));
+			if (netlink_address(nh))
+				changed = true;
+			break;
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			DPRINTF(3, ("routing message op = %d: updating link\n",
+				    msg_type));
+			if (netlink_link(nh))
+				changed = true;
+			break;
+		case RTM_NEWROUTE:
+		case RTM_DELROUTE:
+# ifdef OS_MISSES_SPECIFIC_ROUTE_UPDATES
+			DPRINTF(3, ("routing message op = %d: scheduling interface update\n",
+				    msg_type));
+			timer_interfacetimeout(current_time + UPDATE_GRACE);
+# else
+			DPRINTF(3, ("routing message op = %d: rebinding peers\n",
+				    msg_type));
+			changed = true;
+# endif
+			break;
+		case NLMSG_DONE:
+			/* end of multipart message */
+			done = true;
+			break;
+#else /* !HAVE_LINUX_RTNETLINK_H */
 #ifdef RTM_NEWADDR
 		case RTM_NEWADDR:
 #endif
@@ -3360,11 +4250,7 @@ process_routing_msgs(struct asyncio_reader *reader)
 				    msg_type));
 			timer_interfacetimeout(current_time + UPDATE_GRACE);
 			break;
-#ifdef HAVE_LINUX_RTNETLINK_H
-		case NLMSG_DONE:
-			/* end of multipart message */
-			return;
-#endif
+#endif /* !HAVE_LINUX_RTNETLINK_H */
 		default:
 			/*
 			 * the rest doesn't bother us.
@@ -3374,6 +4260,12 @@ process_routing_msgs(struct asyncio_reader *reader)
 			break;
 		}
 	}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+	/* give peers a chance at a better interface */
+	if (changed)
+		refresh_all_peerinterfaces();
+#endif
 }
 
 /*
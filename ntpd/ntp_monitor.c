@@ -7,25 +7,46 @@
 #include "ntpd.h"
 #include "ntp_io.h"
 #include "ntp_lists.h"
+#include "ntp_random.h"
 #include "ntp_stdlib.h"
 
+#ifdef USE_SERVER_THREADS
+# include <pthread.h>
+#endif
+
 /*
  * Record statistics based on source address, mode and version. The
  * receive procedure calls us with the incoming rbufp before it does
  * anything else. While at it, implement rate controls for inbound
  * traffic.
  *
- * Each entry is doubly linked into two lists, a hash table and a most-
- * recently-used (MRU) list. When a packet arrives it is looked up in
- * the hash table. If found, the statistics are updated and the entry
- * relinked at the head of the MRU list. If not found, a new entry is
- * allocated, initialized and linked into both the hash table and at the
- * head of the MRU list.
+ * Each entry is found through an address index and doubly linked
+ * into a most-recently-used (MRU) list. When a packet arrives it is
+ * looked up in the index. If found, the statistics are updated and,
+ * on the first packet in a new second, the entry is relinked at the
+ * head of the MRU list. If not found, a new entry is allocated,
+ * initialized, added to the index and linked at the head of the MRU
+ * list.
+ *
+ * The index is an open-addressing hash table with Robin Hood insertion
+ * and backward-shift deletion, so probe sequences stay short and
+ * contiguous even with millions of entries. Each slot holds the full
+ * 32-bit hash of the address beside the entry pointer, so only a
+ * probable match costs a look at the entry itself. The table doubles
+ * whenever it would pass three quarters full.
+ *
+ * The MRU list is kept in order of the second each entry was last
+ * seen rather than of its very last packet. A busy source is moved
+ * at most once a second instead of on every packet, and the oldest
+ * entry, at the tail, is still the oldest to within that second.
+ * Each move to the head stamps the entry with the next sequence
+ * number, so the list is also in sequence order, and ntpq can page
+ * through it by sequence while it changes.
  *
  * Memory is usually allocated by grabbing a big chunk of new memory and
  * cutting it up into littler pieces. The exception to this when we hit
  * the memory limit. Then we free memory by grabbing entries off the
- * tail for the MRU list, unlinking from the hash table, and
+ * tail for the MRU list, removing them from the index, and
  * reinitializing.
  *
  * INC_MONLIST is the default allocation granularity in entries.
@@ -42,21 +63,51 @@
 #endif
 
 /*
- * Hashing stuff
+ * An index slot, empty if mon is NULL.  The home slot of an entry is
+ * hash & mon_index_mask; how far it sits past that is its probe
+ * distance.
  */
-uint8_t	mon_hash_bits;
+typedef struct mon_slot {
+	uint32_t	hash;		/* mon_hash_addr() of the address */
+	mon_entry *	mon;
+} mon_slot;
+
+#define MON_INDEX_MIN	64		/* initial slots */
 
 /*
- * Pointers to the hash table and the MRU list.  Memory for the hash
- * table is allocated only if monitoring is enabled.
+ * The index and the MRU list.  Memory for the index is allocated only
+ * if monitoring is enabled.
  */
-mon_entry **	mon_hash;	/* MRU hash table */
+static	mon_slot *	mon_index;	/* MRU address index */
+static	u_int		mon_index_mask;	/* slots - 1, slots a power of 2 */
+static	uint32_t	mon_hash_seed;	/* against chosen collisions */
+static	uint64_t	mon_seq;	/* last sequence number stamped */
 mon_entry	mon_mru_list;	/* mru listhead */
 u_int		mru_entries;	/* mru list count */
 
+/*
+ * The per-prefix limiter is a token bucket kept as a count-min
+ * sketch: PFX_ROWS rows of PFX_COLS cells, each prefix hashing to one
+ * cell per row with its own seed.  A cell holds the time at which its
+ * bucket would be full again, in seconds since mon_pfx_epoch, and a
+ * prefix's estimate is the earliest of its cells.  Other prefixes
+ * landing in the same cell can only make that later, so collisions
+ * err towards limiting, and only the cells which were at the estimate
+ * are pushed forward.  The sketch is a fixed size and needs no MRU
+ * entry, so it holds when the MRU list is full of young entries.
+ */
+#define PFX_ROWS	4
+#define PFX_COLS	4096		/* a power of 2 */
+#define PFX_OCTETS4	3		/* /24 */
+#define PFX_OCTETS6	7		/* /56 */
+
+static	double *	mon_pfx;	/* PFX_ROWS * PFX_COLS cells */
+static	uint32_t	mon_pfx_seed[PFX_ROWS];
+static	l_fp		mon_pfx_epoch;	/* time zero of the cells */
+
 /*
  * List of free structures structures, and counters of in-use and total
- * structures. The free structures are linked with the hash_next field.
+ * structures. The free structures are linked with the mru.f field.
  */
 static  mon_entry *mon_free;		/* free list or null if none */
 	u_int mru_alloc;		/* mru list + free list count */
@@ -74,6 +125,15 @@ static	u_int mon_mem_increments;	/* times called malloc() */
 int	ntp_minpkt = NTP_MINPKT;	/* minimum (log 2 s) */
 uint8_t	ntp_minpoll = NTP_MINPOLL;	/* increment (log 2 s) */
 
+/*
+ * Parameters of the per-prefix RES_LIMITED check.  Sources are pooled
+ * by /24 or /56 prefix, and each prefix may send mon_pfx_burst packets
+ * at once and mon_pfx_rate per second on average.  The check is off
+ * until "discard rate" sets a nonzero mon_pfx_rate.
+ */
+int	mon_pfx_rate = 0;		/* packets per second */
+int	mon_pfx_burst = 128;		/* packets */
+
 /*
  * Initialization state.  We may be monitoring, we may not.  If
  * we aren't, we may not even have allocated any memory yet.
@@ -85,7 +145,24 @@ int	mru_minage = 64;	/* recycle if full and older than this */
 u_int	mru_maxdepth = MRU_MAXDEPTH_DEF;	/* MRU count hard limit */
 int	mon_age = 3000;		/* preemption limit */
 
+#ifdef USE_SERVER_THREADS
+/*
+ * Server threads record their clients here too.  mon_mutex covers
+ * the index, the MRU list, the prefix sketch and the counters.  It
+ * may be taken while holding the restrictions' lock.
+ */
+static	pthread_mutex_t	mon_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static	void		mon_getmoremem(void);
+static	u_short		mon_record(struct recvbuf *, u_short);
+static	uint32_t	mon_hash_addr(const sockaddr_u *);
+static	uint32_t	mon_hash_prefix(const sockaddr_u *, uint32_t);
+static	bool		mon_prefix_limited(const sockaddr_u *, l_fp,
+					   bool *);
+static	mon_slot *	mon_index_find(const sockaddr_u *, uint32_t);
+static	void		mon_index_add(mon_entry *, uint32_t);
+static	void		mon_index_grow(void);
 static	void		remove_from_hash(mon_entry *);
 static	inline void	mon_free_entry(mon_entry *);
 static	inline void	mon_reclaim_entry(mon_entry *);
@@ -96,6 +173,7 @@ u_long mru_new = 0;		/* allocate a new slot (2 cases) */
 u_long mru_recycleold = 0;	/* recycle slot: age > mru_maxage */
 u_long mru_recyclefull = 0;	/* recycle slot: full and age > mru_minage */
 u_long mru_none = 0;		/* couldn't get one */
+u_long mru_prefixlimited = 0;	/* prefix over its rate */
 
 
 /*
@@ -114,22 +192,417 @@ init_mon(void)
 
 
 /*
- * remove_from_hash - removes an entry from the address hash table and
- *		      decrements mru_entries.
+ * mon_lock - keep the MRU list still, for looking things up in it
+ *	      or walking it
+ */
+void
+mon_lock(void)
+{
+#ifdef USE_SERVER_THREADS
+	pthread_mutex_lock(&mon_mutex);
+#endif
+}
+
+
+void
+mon_unlock(void)
+{
+#ifdef USE_SERVER_THREADS
+	pthread_mutex_unlock(&mon_mutex);
+#endif
+}
+
+
+/*
+ * mon_hash_addr - hash the family and address, not the port, which
+ *		   is what SOCK_EQ() compares.  FNV-1a, seeded.
+ */
+static uint32_t
+mon_hash_addr(
+	const sockaddr_u *addr
+	)
+{
+	const uint8_t *	pch;
+	size_t		len;
+	uint32_t	hash;
+
+	if (IS_IPV4(addr)) {
+		pch = (const void *)&SOCK_ADDR4(addr);
+		len = sizeof(SOCK_ADDR4(addr));
+	} else {
+		pch = (const void *)&SOCK_ADDR6(addr);
+		len = sizeof(SOCK_ADDR6(addr));
+	}
+	hash = (2166136261U ^ mon_hash_seed ^ (uint32_t)AF(addr))
+	       * 16777619U;
+	while (len-- > 0)
+		hash = (hash ^ *pch++) * 16777619U;
+	return hash;
+}
+
+
+/*
+ * mon_hash_prefix - hash the family and the leading octets of the
+ *		     address which make up its prefix.
+ */
+static uint32_t
+mon_hash_prefix(
+	const sockaddr_u *addr,
+	uint32_t	seed
+	)
+{
+	const uint8_t *	pch;
+	size_t		len;
+	uint32_t	hash;
+
+	if (IS_IPV4(addr)) {
+		pch = (const void *)&SOCK_ADDR4(addr);
+		len = PFX_OCTETS4;
+	} else {
+		pch = (const void *)&SOCK_ADDR6(addr);
+		len = PFX_OCTETS6;
+	}
+	hash = (2166136261U ^ seed ^ (uint32_t)AF(addr)) * 16777619U;
+	while (len-- > 0)
+		hash = (hash ^ *pch++) * 16777619U;
+	return hash;
+}
+
+
+/*
+ * mon_prefix_limited - charge a packet to the prefix of addr.
+ *
+ * This is GCRA, the token bucket stated as a theoretical arrival
+ * time: each packet moves it 1/mon_pfx_rate seconds later, and a
+ * packet is over the limit if that would put it more than
+ * mon_pfx_burst packets ahead of now.  The first packet past the
+ * limit still moves it, and only that one may be answered with a KoD,
+ * so KoDs and replies together stay within the rate.  Others past the
+ * limit are dropped without being charged.  A cell further ahead than
+ * a bucket can reach is left over from a clock step and restarts.
+ */
+static bool
+mon_prefix_limited(
+	const sockaddr_u *addr,
+	l_fp		when,
+	bool *		kod
+	)
+{
+	double *	cell[PFX_ROWS];
+	double		now;
+	double		inc;		/* seconds per packet */
+	double		span;		/* seconds for a full burst */
+	double		tat;
+	u_int		i;
+
+	*kod = false;
+	if (0 == mon_pfx_epoch)
+		mon_pfx_epoch = when;
+	now = lfptod(when - mon_pfx_epoch);
+	inc = 1. / mon_pfx_rate;
+	span = mon_pfx_burst * inc;
+	for (i = 0; i < PFX_ROWS; i++) {
+		cell[i] = &mon_pfx[i * PFX_COLS +
+				   (mon_hash_prefix(addr, mon_pfx_seed[i])
+				    & (PFX_COLS - 1))];
+		if (*cell[i] > now + span + inc)
+			*cell[i] = now;
+	}
+	tat = *cell[0];
+	for (i = 1; i < PFX_ROWS; i++)
+		tat = min(tat, *cell[i]);
+	tat = max(tat, now);
+
+	if (tat - now > span)
+		return true;
+	if (tat - now > span - inc)
+		*kod = true;
+	tat += inc;
+	for (i = 0; i < PFX_ROWS; i++)
+		*cell[i] = max(*cell[i], tat);
+
+	return *kod;
+}
+
+
+/*
+ * mon_index_find - return the slot holding addr, or NULL.
+ *
+ * Robin Hood order means the search can stop at the first slot whose
+ * entry is nearer its home than addr would be at that point.
+ */
+static mon_slot *
+mon_index_find(
+	const sockaddr_u *addr,
+	uint32_t	hash
+	)
+{
+	mon_slot *	slot;
+	u_int		i;
+	u_int		dist;
+
+	if (NULL == mon_index)
+		return NULL;
+	for (i = hash & mon_index_mask, dist = 0;
+	     ;
+	     i = (i + 1) & mon_index_mask, dist++) {
+		slot = &mon_index[i];
+		if (NULL == slot->mon
+		    || dist > ((i - slot->hash) & mon_index_mask))
+			return NULL;
+		if (slot->hash == hash && SOCK_EQ(&slot->mon->rmtadr, addr))
+			return slot;
+	}
+}
+
+
+/*
+ * mon_index_add - add an entry which is not in the index yet.  The
+ *		   newcomer takes the slot of any entry nearer its own
+ *		   home, which moves on in its place.  The caller sees
+ *		   to it there is room.
+ */
+static void
+mon_index_add(
+	mon_entry *	mon,
+	uint32_t	hash
+	)
+{
+	mon_slot	carry;
+	mon_slot	swap;
+	mon_slot *	slot;
+	u_int		i;
+	u_int		dist;
+	u_int		sdist;
+
+	carry.hash = hash;
+	carry.mon = mon;
+	for (i = hash & mon_index_mask, dist = 0;
+	     ;
+	     i = (i + 1) & mon_index_mask, dist++) {
+		slot = &mon_index[i];
+		if (NULL == slot->mon) {
+			*slot = carry;
+			return;
+		}
+		sdist = (i - slot->hash) & mon_index_mask;
+		if (sdist < dist) {
+			swap = *slot;
+			*slot = carry;
+			carry = swap;
+			dist = sdist;
+		}
+	}
+}
+
+
+/*
+ * mon_index_grow - double the index, or create it
+ */
+static void
+mon_index_grow(void)
+{
+	mon_slot *	old;
+	u_int		oldslots;
+	u_int		slots;
+	u_int		i;
+
+	old = mon_index;
+	oldslots = (NULL == old) ? 0 : mon_index_mask + 1;
+	if (NULL == old)
+		mon_hash_seed = (uint32_t)ntp_random();
+	slots = max(MON_INDEX_MIN, 2 * oldslots);
+
+	mon_index = eallocarray(slots, sizeof(*mon_index));
+	zero_mem(mon_index, slots * sizeof(*mon_index));
+	mon_index_mask = slots - 1;
+	for (i = 0; i < oldslots; i++)
+		if (old[i].mon != NULL)
+			mon_index_add(old[i].mon, old[i].hash);
+	free(old);
+	DPRINTF(2, ("mon_index_grow: %u slots\n", slots));
+}
+
+
+/*
+ * mon_lookup - find the entry for an address, ignoring the port
+ */
+mon_entry *
+mon_lookup(
+	const sockaddr_u *addr
+	)
+{
+	mon_slot *	slot;
+
+	slot = mon_index_find(addr, mon_hash_addr(addr));
+	return (NULL == slot) ? NULL : slot->mon;
+}
+
+
+/*
+ * mon_seq_next - find the oldest entry stamped after seq, or NULL if
+ *		  there is none.
+ *
+ * The list is in sequence order, so the answer is where the stamps
+ * pass seq.  Walking in from both ends at once finds it in twice the
+ * distance from the nearer end.
+ */
+mon_entry *
+mon_seq_next(
+	uint64_t	seq
+	)
+{
+	mon_entry *	older;	/* from the tail */
+	mon_entry *	newer;	/* from the head */
+
+	older = TAIL_DLIST(mon_mru_list, mru);
+	newer = HEAD_DLIST(mon_mru_list, mru);
+	if (NULL == newer || newer->seq <= seq)
+		return NULL;
+	while (older->seq <= seq) {
+		if (newer->seq <= seq)
+			return PREV_DLIST(mon_mru_list, newer, mru);
+		older = PREV_DLIST(mon_mru_list, older, mru);
+		newer = NEXT_DLIST(mon_mru_list, newer, mru);
+	}
+	return older;
+}
+
+
+/*
+ * mon_rate - packets per second between an entry's first and last
+ *	      packets, 0 until there are two.
+ */
+double
+mon_rate(
+	const mon_entry *	mon
+	)
+{
+	double	span;
+
+	span = lfptod(mon->last - mon->first);
+	if (mon->count < 2 || span <= 0)
+		return 0;
+	return (mon->count - 1) / span;
+}
+
+
+/*
+ * mon_rank_sift - restore the min-heap order of the n ranks from i
+ *		   down.
+ */
+static void
+mon_rank_sift(
+	mon_rank *	heap,
+	size_t		n,
+	size_t		i
+	)
+{
+	mon_rank	moving;
+	size_t		child;
+
+	moving = heap[i];
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && heap[child + 1].key < heap[child].key)
+			child++;
+		if (moving.key <= heap[child].key)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = moving;
+}
+
+
+/*
+ * mon_rank_add - offer an entry to a min-heap of the k highest keys
+ *		  seen so far, holding n of them.  Returns the new n.
+ *
+ * The lowest of the kept keys is at the root, so an entry which does
+ * not beat it costs one comparison, and the whole MRU list can be
+ * ranked in time proportional to its length.
+ */
+size_t
+mon_rank_add(
+	mon_rank *	heap,
+	size_t		n,
+	size_t		k,
+	mon_entry *	mon,
+	double		key
+	)
+{
+	size_t	i;
+	size_t	parent;
+
+	if (n < k) {
+		for (i = n; i > 0; i = parent) {
+			parent = (i - 1) / 2;
+			if (heap[parent].key <= key)
+				break;
+			heap[i] = heap[parent];
+		}
+		heap[i].mon = mon;
+		heap[i].key = key;
+		return n + 1;
+	}
+	if (0 == k || key <= heap[0].key)
+		return n;
+	heap[0].mon = mon;
+	heap[0].key = key;
+	mon_rank_sift(heap, n, 0);
+	return n;
+}
+
+
+/*
+ * mon_rank_sort - turn a heap from mon_rank_add() into a list by
+ *		   descending key.
+ */
+void
+mon_rank_sort(
+	mon_rank *	heap,
+	size_t		n
+	)
+{
+	mon_rank	lowest;
+
+	while (n > 1) {
+		lowest = heap[0];
+		heap[0] = heap[--n];
+		mon_rank_sift(heap, n, 0);
+		heap[n] = lowest;
+	}
+}
+
+
+/*
+ * remove_from_hash - removes an entry from the address index and
+ *		      decrements mru_entries.  The entries after it
+ *		      which are away from home each move back one slot.
  */
 static void
 remove_from_hash(
 	mon_entry *mon
 	)
 {
-	u_int hash;
-	mon_entry *punlinked;
+	mon_slot *	slot;
+	mon_slot *	next;
+	u_int		i;
 
 	mru_entries--;
-	hash = MON_HASH(&mon->rmtadr);
-	UNLINK_SLIST(punlinked, mon_hash[hash], mon, hash_next,
-		     mon_entry);
-	NTP_ENSURE(punlinked == mon);
+	slot = mon_index_find(&mon->rmtadr, mon_hash_addr(&mon->rmtadr));
+	NTP_INSIST(slot != NULL && slot->mon == mon);
+	i = (u_int)(slot - mon_index);
+	for (;;) {
+		next = &mon_index[(i + 1) & mon_index_mask];
+		if (NULL == next->mon
+		    || 0 == ((i + 1 - next->hash) & mon_index_mask))
+			break;
+		*slot = *next;
+		slot = next;
+		i = (i + 1) & mon_index_mask;
+	}
+	ZERO(*slot);
 }
 
 
@@ -139,13 +612,13 @@ mon_free_entry(
 	)
 {
 	ZERO(*m);
-	LINK_SLIST(mon_free, m, hash_next);
+	LINK_SLIST(mon_free, m, mru.f);
 }
 
 
 /*
  * mon_reclaim_entry - Remove an entry from the MRU list and from the
- *		       hash array, then zero-initialize it.  Indirectly
+ *		       index, then zero-initialize it.  Indirectly
  *		       decrements mru_entries.
 
  * The entry is prepared to be reused.  Before return, in
@@ -198,32 +671,31 @@ mon_start(
 	int mode
 	)
 {
-	size_t octets;
-	u_int min_hash_slots;
+	u_int	i;
 
 	if (MON_OFF == mode)		/* MON_OFF is 0 */
 		return;
+	mon_lock();
 	if (mon_enabled) {
 		mon_enabled |= mode;
+		mon_unlock();
 		return;
 	}
 	if (0 == mon_mem_increments)
 		mon_getmoremem();
-	/*
-	 * Select the MRU hash table size to limit the average count
-	 * per bucket at capacity (mru_maxdepth) to 8, if possible
-	 * given our hash is limited to 16 bits.
-	 */
-	min_hash_slots = (mru_maxdepth / 8) + 1;
-	mon_hash_bits = 0;
-	while (min_hash_slots >>= 1)
-		mon_hash_bits++;
-	mon_hash_bits = max(4, mon_hash_bits);
-	mon_hash_bits = min(16, mon_hash_bits);
-	octets = sizeof(*mon_hash) * MON_HASH_SIZE;
-	mon_hash = erealloc_zero(mon_hash, octets, 0);
+	/* the index grows with the MRU list, from MON_INDEX_MIN */
+	if (NULL == mon_index)
+		mon_index_grow();
+	if (NULL == mon_pfx) {
+		mon_pfx = eallocarray(PFX_ROWS * PFX_COLS, sizeof(*mon_pfx));
+		for (i = 0; i < PFX_ROWS; i++)
+			mon_pfx_seed[i] = (uint32_t)ntp_random();
+	}
+	zero_mem(mon_pfx, PFX_ROWS * PFX_COLS * sizeof(*mon_pfx));
+	mon_pfx_epoch = 0;
 
 	mon_enabled = mode;
+	mon_unlock();
 }
 
 
@@ -237,28 +709,33 @@ mon_stop(
 {
 	mon_entry *mon;
 
-	if (MON_OFF == mon_enabled)
-		return;
-	if ((mon_enabled & mode) == 0 || mode == MON_OFF)
+	mon_lock();
+	if (MON_OFF == mon_enabled ||
+	    (mon_enabled & mode) == 0 || mode == MON_OFF) {
+		mon_unlock();
 		return;
+	}
 
 	mon_enabled &= ~mode;
-	if (mon_enabled != MON_OFF)
+	if (mon_enabled != MON_OFF) {
+		mon_unlock();
 		return;
-	
+	}
+
 	/*
 	 * Move everything on the MRU list to the free list quickly,
 	 * without bothering to remove each from either the MRU list or
-	 * the hash table.
+	 * the index.
 	 */
 	ITER_DLIST_BEGIN(mon_mru_list, mon, mru, mon_entry)
 		mon_free_entry(mon);
 	ITER_DLIST_END()
 
-	/* empty the MRU list and hash table. */
+	/* empty the MRU list and index. */
 	mru_entries = 0;
 	INIT_DLIST(mon_mru_list, mru);
-	zero_mem(mon_hash, sizeof(*mon_hash) * MON_HASH_SIZE);
+	zero_mem(mon_index, sizeof(*mon_index) * (mon_index_mask + 1));
+	mon_unlock();
 }
 
 
@@ -273,17 +750,19 @@ mon_clearinterface(
 {
 	mon_entry *mon;
 
+	mon_lock();
 	/* iterate mon over mon_mru_list */
 	ITER_DLIST_BEGIN(mon_mru_list, mon, mru, mon_entry)
 		if (mon->lcladr == lcladr) {
 			/* remove from mru list */
 			UNLINK_DLIST(mon, mru);
-			/* remove from hash list, adjust mru_entries */
+			/* remove from index, adjust mru_entries */
 			remove_from_hash(mon);
 			/* put on free list */
 			mon_free_entry(mon);
 		}
 	ITER_DLIST_END()
+	mon_unlock();
 }
 
 int mon_get_oldest_age(l_fp now)
@@ -317,13 +796,32 @@ ntp_monitor(
 	struct recvbuf *rbufp,
 	u_short	flags
 	)
+{
+	u_short	restrict_mask;
+
+	mon_lock();
+	restrict_mask = mon_record(rbufp, flags);
+	mon_unlock();
+	return restrict_mask;
+}
+
+
+/*
+ * mon_record - the work of ntp_monitor(), with mon_mutex held
+ */
+static u_short
+mon_record(
+	struct recvbuf *rbufp,
+	u_short	flags
+	)
 {
 	l_fp		interval_fp;
 	struct pkt *	pkt;
 	mon_entry *	mon;
 	mon_entry *	oldest;
+	mon_slot *	slot;
 	int		oldest_age;
-	u_int		hash;
+	uint32_t	hash;
 	u_short		restrict_mask;
 	uint8_t		mode;
 	uint8_t		version;
@@ -331,24 +829,35 @@ ntp_monitor(
 	int		head;		/* headway increment */
 	int		leak;		/* new headway */
 	int		limit;		/* average threshold */
+	bool		kod;
+	u_short		pfx_mask;	/* lit by the prefix check */
 
 	if (mon_enabled == MON_OFF)
 		return ~(RES_LIMITED | RES_KOD) & flags;
 
+	/*
+	 * Charge the prefix first, whatever becomes of the MRU entry.
+	 */
+	pfx_mask = 0;
+	if ((RES_LIMITED & flags) && mon_pfx_rate > 0 &&
+	    mon_prefix_limited(&rbufp->recv_srcadr, rbufp->recv_time,
+			       &kod)) {
+		mru_prefixlimited++;
+		pfx_mask = (kod ? (RES_LIMITED | RES_KOD) : RES_LIMITED)
+			   & flags;
+	}
+
 	pkt = &rbufp->recv_pkt;
-	hash = MON_HASH(&rbufp->recv_srcadr);
+	hash = mon_hash_addr(&rbufp->recv_srcadr);
 	mode = PKT_MODE(pkt->li_vn_mode);
 	version = PKT_VERSION(pkt->li_vn_mode);
-	mon = mon_hash[hash];
 
 	/*
 	 * We keep track of all traffic for a given IP in one entry,
 	 * otherwise cron'ed ntpdate or similar evades RES_LIMITED.
 	 */
-
-	for (; mon != NULL; mon = mon->hash_next)
-		if (SOCK_EQ(&mon->rmtadr, &rbufp->recv_srcadr))
-			break;
+	slot = mon_index_find(&rbufp->recv_srcadr, hash);
+	mon = (NULL == slot) ? NULL : slot->mon;
 
 	if (mon != NULL) {
 		mru_exists++;
@@ -357,20 +866,25 @@ ntp_monitor(
 		/* add one-half second to round up */
 		interval_fp += 0x80000000;
 		interval = lfpsint(interval_fp);
+
+		/*
+		 * Shuffle to the head of the MRU list, unless already
+		 * seen this second and so among the entries there.
+		 */
+		if (lfpuint(mon->last) != lfpuint(rbufp->recv_time)) {
+			UNLINK_DLIST(mon, mru);
+			LINK_DLIST(mon_mru_list, mon, mru);
+			mon->seq = ++mon_seq;
+		}
 		mon->last = rbufp->recv_time;
 		NSRCPORT(&mon->rmtadr) = NSRCPORT(&rbufp->recv_srcadr);
 		mon->count++;
 		restrict_mask = flags;
 		mon->vn_mode = VN_MODE(version, mode);
 
-		/* Shuffle to the head of the MRU list. */
-		UNLINK_DLIST(mon, mru);
-		LINK_DLIST(mon_mru_list, mon, mru);
-
 		/*
-		 * At this point the most recent arrival is first in the
-		 * MRU list.  Decrease the counter by the headway, but
-		 * not less than zero.
+		 * Decrease the counter by the headway, but not less
+		 * than zero.
 		 */
 		mon->leak -= interval;
 		mon->leak = max(0, mon->leak);
@@ -403,7 +917,7 @@ ntp_monitor(
 		else
 			restrict_mask &= ~RES_KOD;
 
-		mon->flags = restrict_mask;
+		mon->flags = restrict_mask | pfx_mask;
 
 		return mon->flags;
 	}
@@ -445,7 +959,7 @@ ntp_monitor(
 		mru_new++;
 		if (NULL == mon_free)
 			mon_getmoremem();
-		UNLINK_HEAD_SLIST(mon, mon_free, hash_next);
+		UNLINK_HEAD_SLIST(mon, mon_free, mru.f);
 	} else {
 		oldest = TAIL_DLIST(mon_mru_list, mru);
 		oldest_age = mon_get_oldest_age(rbufp->recv_time);
@@ -457,10 +971,10 @@ ntp_monitor(
 			mru_new++;
 			if (NULL == mon_free)
 				mon_getmoremem();
-			UNLINK_HEAD_SLIST(mon, mon_free, hash_next);
+			UNLINK_HEAD_SLIST(mon, mon_free, mru.f);
 		} else if (oldest_age < mru_minage) {
 			mru_none++;
-			return ~(RES_LIMITED | RES_KOD) & flags;
+			return (~(RES_LIMITED | RES_KOD) & flags) | pfx_mask;
 		} else {
 			mru_recyclefull++;
 			/* coverity[var_deref_model] */
@@ -477,7 +991,7 @@ ntp_monitor(
 	mon->last = rbufp->recv_time;
 	mon->first = mon->last;
 	mon->count = 1;
-	mon->flags = ~(RES_LIMITED | RES_KOD) & flags;
+	mon->flags = (~(RES_LIMITED | RES_KOD) & flags) | pfx_mask;
 	mon->leak = 0;
 	memcpy(&mon->rmtadr, &rbufp->recv_srcadr, sizeof(mon->rmtadr));
 	mon->vn_mode = VN_MODE(version, mode);
@@ -485,11 +999,13 @@ ntp_monitor(
 	mon->cast_flags = rbufp->cast_flags;
 
 	/*
-	 * Drop him into front of the hash table. Also put him on top of
-	 * the MRU list.
+	 * Add him to the index. Also put him on top of the MRU list.
 	 */
-	LINK_SLIST(mon_hash[hash], mon, hash_next);
+	if (4 * mru_entries > 3 * (mon_index_mask + 1))
+		mon_index_grow();
+	mon_index_add(mon, hash);
 	LINK_DLIST(mon_mru_list, mon, mru);
+	mon->seq = ++mon_seq;
 
 	return mon->flags;
 }
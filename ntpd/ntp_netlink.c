@@ -0,0 +1,140 @@
+/*
+ * ntp_netlink.c - decode Linux rtnetlink address messages
+ *
+ * process_routing_msgs() in ntp_io.c applies each RTM_NEWADDR and
+ * RTM_DELADDR as it comes instead of rescanning every interface.  The
+ * parsing here turns one such message into what the interface
+ * iterator would have returned for the address, and needs no socket,
+ * so it can be tested against crafted messages.
+ */
+#include "config.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+#include <string.h>
+#include <net/if.h>
+#include <linux/rtnetlink.h>
+
+#include <isc/interfaceiter.h>
+
+#include "ntpd.h"
+#include "ntp_stdlib.h"
+
+/*
+ * netlink_ifaddr - fill in isc_if from the payload of an RTM_NEWADDR
+ * or RTM_DELADDR message the way the interface iterator would have.
+ * The link flags are left for the caller.  Returns false if the
+ * address is of no use to us.
+ */
+bool
+netlink_ifaddr(
+	struct nlmsghdr *	nh,
+	struct isc_interface *	isc_if
+	)
+{
+	struct ifaddrmsg *	ifa;
+	struct rtattr *		rta;
+	int			len;
+	size_t			alen;
+	const void *		address;
+	const void *		local;
+	const void *		remote;
+	const void *		broadcast;
+	const char *		label;
+	uint32_t		flags;
+	uint8_t			mask[16];
+	size_t			bits;
+	size_t			i;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return false;
+	ifa = NLMSG_DATA(nh);
+	if (AF_INET == ifa->ifa_family)
+		alen = sizeof(struct in_addr);
+	else if (AF_INET6 == ifa->ifa_family)
+		alen = sizeof(struct in6_addr);
+	else
+		return false;
+
+	address = local = remote = broadcast = NULL;
+	label = NULL;
+	flags = ifa->ifa_flags;
+	len = (int)IFA_PAYLOAD(nh);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (IFA_LABEL == rta->rta_type) {
+			if (memchr(RTA_DATA(rta), '\0', RTA_PAYLOAD(rta)))
+				label = RTA_DATA(rta);
+			continue;
+		}
+#ifdef IFA_FLAGS
+		if (IFA_FLAGS == rta->rta_type &&
+		    RTA_PAYLOAD(rta) >= sizeof(flags)) {
+			memcpy(&flags, RTA_DATA(rta), sizeof(flags));
+			continue;
+		}
+#endif
+		if (RTA_PAYLOAD(rta) < alen)
+			continue;
+		if (IFA_ADDRESS == rta->rta_type)
+			address = RTA_DATA(rta);
+		else if (IFA_LOCAL == rta->rta_type)
+			local = RTA_DATA(rta);
+		else if (IFA_BROADCAST == rta->rta_type)
+			broadcast = RTA_DATA(rta);
+	}
+
+	/*
+	 * On point-to-point links IFA_ADDRESS is the far end.  Like
+	 * getifaddrs(), use it as the broadcast address when there is
+	 * no IFA_BROADCAST.
+	 */
+	if (local != NULL) {
+		if (address != NULL && memcmp(address, local, alen))
+			remote = address;
+		if (NULL == broadcast)
+			broadcast = address;
+		address = local;
+	}
+	if (NULL == address)
+		return false;
+
+	/*
+	 * We can't bind to an IPv6 address until duplicate address
+	 * detection is done; another RTM_NEWADDR comes when it is.
+	 */
+	if (flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED))
+		return false;
+
+	ZERO(*isc_if);
+	isc_if->af = ifa->ifa_family;
+	isc_if->ifindex = ifa->ifa_index;
+	if (label != NULL)
+		strlcpy(isc_if->name, label, sizeof(isc_if->name));
+	else if (NULL == if_indextoname(ifa->ifa_index, isc_if->name))
+		isc_if->name[0] = '\0';
+
+	ZERO(mask);
+	bits = min((size_t)ifa->ifa_prefixlen, alen * 8);
+	for (i = 0; i < bits / 8; i++)
+		mask[i] = 0xff;
+	if (bits % 8)
+		mask[i] = (uint8_t)(0xff << (8 - bits % 8));
+
+	isc_if->address.family = isc_if->af;
+	isc_if->netmask.family = isc_if->af;
+	isc_if->broadcast.family = isc_if->af;
+	isc_if->dstaddress.family = isc_if->af;
+	memcpy(&isc_if->address.type, address, alen);
+	memcpy(&isc_if->netmask.type, mask, alen);
+	if (broadcast != NULL)
+		memcpy(&isc_if->broadcast.type, broadcast, alen);
+	if (remote != NULL)
+		memcpy(&isc_if->dstaddress.type, remote, alen);
+	if (AF_INET6 == isc_if->af &&
+	    IN6_IS_ADDR_LINKLOCAL(&isc_if->address.type.in6))
+		isc_if->address.zone = isc_if->ifindex;
+
+	return true;
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
@@ -218,6 +218,21 @@ fetch_packetstamp(
 	}
 	return ts;
 }
+#else	/* !USE_PACKET_TIMESTAMP follows */
+/*
+ * no time stamps here; callers keep the time they read themselves
+ */
+l_fp
+fetch_packetstamp(
+	struct recvbuf *	rb,
+	struct msghdr *		msghdr,
+	l_fp			ts
+	)
+{
+	UNUSED_ARG(rb);
+	UNUSED_ARG(msghdr);
+	return ts;
+}
 #endif	/* USE_PACKET_TIMESTAMP */
 
 // end
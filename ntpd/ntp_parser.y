@@ -57,6 +57,7 @@
 %token	<Integer>	T_Auth
 %token	<Integer>	T_Average
 %token	<Integer>	T_Baud
+%token	<Integer>	T_Binary
 %token	<Integer>	T_Broadcast
 %token	<Integer>	T_Burst
 %token	<Integer>	T_Calibrate
@@ -91,6 +92,7 @@
 %token	<Integer>	T_Fudge
 %token	<Integer>	T_Holdover
 %token	<Integer>	T_Huffpuff
+%token	<Integer>	T_Hugepages
 %token	<Integer>	T_Iburst
 %token	<Integer>	T_Ignore
 %token	<Integer>	T_Incalloc
@@ -171,7 +173,9 @@
 %token	<Integer>	T_Preempt
 %token	<Integer>	T_Prefer
 %token	<Integer>	T_Protostats
+%token	<Integer>	T_Rate
 %token	<Integer>	T_Rawstats
+%token	<Integer>	T_Recvbufs
 %token	<Integer>	T_Refclock
 %token	<Integer>	T_Refid
 %token	<Integer>	T_Requestkey
@@ -186,6 +190,7 @@
 %token	<Integer>	T_Statistics
 %token	<Integer>	T_Stats
 %token	<Integer>	T_Statsdir
+%token	<Integer>	T_Statsflush
 %token	<Integer>	T_Step
 %token	<Integer>	T_Stepback
 %token	<Integer>	T_Stepfwd
@@ -195,6 +200,8 @@
 %token	<String>	T_String		/* not a token */
 %token	<Integer>	T_Sys
 %token	<Integer>	T_Sysstats
+%token	<Integer>	T_Text
+%token	<Integer>	T_Threads
 %token	<Integer>	T_Tick
 %token	<Integer>	T_Time1
 %token	<Integer>	T_Time2
@@ -225,6 +232,7 @@
 %type	<Int_fifo>	ac_flag_list
 %type	<Address_node>	address
 %type	<Integer>	address_fam
+%type	<Integer>	binary_text
 %type	<Integer>	boolean
 %type	<Integer>	client_type
 %type	<Integer>	counter_set_keyword
@@ -270,6 +278,7 @@
 %type	<Attr_val>	option_int
 %type	<Integer>	option_int_keyword
 %type	<Attr_val>	option_string
+%type	<Integer>	optional_hugepages
 %type	<Integer>	optional_unit
 %type	<Integer>	reset_command
 %type	<Integer>	rlimit_option_keyword
@@ -672,6 +681,21 @@ filegen_option
 				yyerror(err);
 			}
 		}
+	|	binary_text
+		{
+			const char *err;
+			
+			if (lex_from_file()) {
+				$$ = create_attr_ival(T_Flag, $1);
+			} else {
+				$$ = NULL;
+				if (T_Binary == $1)
+					err = "filegen binary remote config ignored";
+				else
+					err = "filegen text remote config ignored";
+				yyerror(err);
+			}
+		}
 	|	enable_disable
 			{ $$ = create_attr_ival(T_Flag, $1); }
 	;
@@ -686,6 +710,11 @@ enable_disable
 	|	T_Disable
 	;
 
+binary_text
+	:	T_Binary
+	|	T_Text
+	;
+
 filegen_type
 	:	T_None
 	|	T_Pid
@@ -822,8 +851,10 @@ discard_option
 
 discard_option_keyword
 	:	T_Average
+	|	T_Burst
 	|	T_Minimum
 	|	T_Monitor
+	|	T_Rate
 	;
 
 mru_option_list
@@ -1152,6 +1183,20 @@ miscellaneous_command
 			{ CONCAT_G_FIFOS(cfgt.phone, $2); }
 	|	T_Setvar variable_assign
 			{ APPEND_G_FIFO(cfgt.setvar, $2); }
+	|	T_Recvbufs T_Integer optional_hugepages
+		{
+			attr_val *av;
+
+			/* the keyword says whether to use huge pages */
+			av = create_attr_ival($3, $2);
+			APPEND_G_FIFO(cfgt.vars, av);
+		}
+	;
+
+optional_hugepages
+	:	/* empty */
+			{ $$ = T_Recvbufs; }
+	|	T_Hugepages
 	;
 
 misc_cmd_dbl_keyword
@@ -1161,6 +1206,8 @@ misc_cmd_dbl_keyword
 
 misc_cmd_int_keyword
 	:	T_Dscp
+	|	T_Statsflush
+	|	T_Threads
 	;
 
 misc_cmd_int_keyword
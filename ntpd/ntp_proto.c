@@ -12,6 +12,9 @@
 
 #include <string.h>
 #include <stdio.h>
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+# include <stdatomic.h>
+#endif /* HAVE_STDATOMIC_H */
 #ifdef HAVE_LIBSCF_H
 #include <libscf.h>
 #endif
@@ -64,17 +67,6 @@
 #define	STRATUM_TO_PKT(s)	((uint8_t)(((s) == (STRATUM_UNSPEC)) ?\
 				(STRATUM_PKT_UNSPEC) : (s)))
 
-/*
- * peer_select groups statistics for a peer used by clock_select() and
- * clock_cluster().
- */
-typedef struct peer_select_tag {
-	struct peer *	peer;
-	double		synch;	/* sync distance */
-	double		error;	/* jitter */
-	double		seljit;	/* selection jitter */
-} peer_select;
-
 /*
  * System variables are declared here. Unless specified otherwise, all
  * times are in seconds.
@@ -94,6 +86,28 @@ struct leap_smear_info leap_smear;
 #endif
 bool leap_sec_in_progress;
 
+/*
+ * The system variables a server reply carries, already in wire
+ * format.  publish_reply_template() rebuilds this whenever they
+ * change and fast_xmit() takes a copy, so a reply never mixes
+ * values from before and after an update.  The sequence count is a
+ * seqlock: odd while the writer is busy, readers retry if it moved.
+ */
+struct reply_template {
+	uint8_t		leap;		/* leap indicator */
+	uint8_t		stratum;	/* packet stratum */
+	int8_t		precision;	/* log2 s */
+	uint32_t	refid;		/* network byte order */
+	u_fp		rootdelay;	/* network byte order */
+	u_fp		rootdisp;	/* network byte order */
+	l_fp_w		reftime;	/* network byte order */
+	bool		smearing;	/* leap smear in progress */
+	l_fp		smear;		/* offset added to rec and xmt */
+};
+
+static struct reply_template	reply_tmpl;
+static volatile u_int		reply_seq;
+
 /*
  * Rate controls. Leaky buckets are used to throttle the packet
  * transmission rates in order to protect busy servers such as at NIST
@@ -155,6 +169,7 @@ static	double	root_distance	(struct peer *);
 static	void	clock_combine	(peer_select *, int, int);
 static	void	peer_xmit	(struct peer *);
 static	void	fast_xmit	(struct recvbuf *, int, keyid_t, int);
+static	void	get_reply_template(struct reply_template *);
 static	void	pool_xmit	(struct peer *);
 static	void	clock_update	(struct peer *);
 static	void	measure_precision(const bool);
@@ -194,6 +209,82 @@ set_sys_leap(u_char new_sys_leap) {
 		}
 #endif	/* ENABLE_LEAP_SMEAR */
 	}
+	publish_reply_template();
+}
+
+
+static inline void
+memory_barrier(void)
+{
+#if defined(HAVE_STDATOMIC_H) && !defined(__COVERITY__)
+	atomic_thread_fence(memory_order_seq_cst);
+#endif /* HAVE_STDATOMIC_H */
+}
+
+
+/*
+ * publish_reply_template - rebuild the reply template from the
+ * system variables.  Only the main line code changes those, so
+ * there is never more than one writer.
+ */
+void
+publish_reply_template(void)
+{
+	struct reply_template rt;
+	l_fp	reftime = sys_reftime;
+
+	ZERO(rt);
+	rt.leap = sys_leap;
+	rt.stratum = STRATUM_TO_PKT(sys_stratum);
+	rt.precision = sys_precision;
+	rt.refid = sys_refid;
+	rt.rootdelay = HTONS_FP(DTOFP(sys_rootdelay));
+	rt.rootdisp = HTONS_FP(DTOUFP(sys_rootdisp));
+#ifdef ENABLE_LEAP_SMEAR
+	/*
+	 * Inside the leap smear interval the smear offset goes on the
+	 * receive and transmit times, and on the reftime too so that it
+	 * isn't later than them.  The refid shows the offset.
+	 */
+	if (leap_smear.in_progress) {
+		rt.smearing = true;
+		rt.smear = leap_smear.offset;
+		reftime += leap_smear.offset;
+		rt.refid = convertLFPToRefID(leap_smear.offset);
+		DPRINTF(2, ("publish_reply_template: leap smear refid %8x, smear %s\n",
+			ntohl(rt.refid), lfptoa(leap_smear.offset, 8)));
+	}
+#endif
+	rt.reftime = htonl_fp(reftime);
+
+	reply_seq++;
+	memory_barrier();
+	reply_tmpl = rt;
+	memory_barrier();
+	reply_seq++;
+}
+
+
+/*
+ * get_reply_template - take a consistent copy of the reply template
+ */
+static void
+get_reply_template(
+	struct reply_template *rt
+	)
+{
+	u_int	seq;
+
+	for (;;) {
+		seq = reply_seq;
+		memory_barrier();
+		if (!(seq & 1)) {
+			*rt = reply_tmpl;
+			memory_barrier();
+			if (seq == reply_seq)
+				return;
+		}
+	}
 }
 
 /* Returns false for packets we want to reject out of hand: those with an
@@ -1182,6 +1273,7 @@ clock_update(
 	default:
 		break;
 	}
+	publish_reply_template();
 }
 
 
@@ -1554,15 +1646,13 @@ void
 clock_select(void)
 {
 	struct peer *peer;
-	int	i, j, k, n;
+	int	i, j;
 	int	nlist, nl2;
-	int	allow;
 	int	speer;
-	double	d, e, f, g;
+	double	e, f;
 	double	high, low;
 	double	speermet;
 	double	orphmet = 2.0 * UINT32_MAX; /* 2x is greater than */
-	struct endpoint endp;
 	struct peer *osys_peer;
 	struct peer *sys_prefer = NULL;	/* prefer peer */
 	struct peer *typesystem = NULL;
@@ -1573,15 +1663,15 @@ clock_select(void)
 	struct peer *typepps = NULL;
 #endif /* REFCLOCK */
 	static struct endpoint *endpoint = NULL;
-	static int *indx = NULL;
+	static int *reach = NULL;
 	static peer_select *peers = NULL;
 	static u_int endpoint_size = 0;
 	static u_int peers_size = 0;
-	static u_int indx_size = 0;
+	static u_int reach_size = 0;
 	size_t octets;
 
 	/*
-	 * Initialize and create endpoint, index and peer lists big
+	 * Initialize and create endpoint, scratch and peer lists big
 	 * enough to handle all associations.
 	 */
 	osys_peer = sys_peer;
@@ -1590,6 +1680,7 @@ clock_select(void)
 	set_sys_leap(LEAP_NOTINSYNC);
 	sys_stratum = STRATUM_UNSPEC;
 	memcpy(&sys_refid, "DOWN", REFIDLEN);
+	publish_reply_template();
 #endif /* ENABLE_LOCKCLOCK */
 
 	/*
@@ -1602,11 +1693,11 @@ clock_select(void)
 	endpoint_size = ALIGNED_SIZE(
                              (unsigned long)(nlist * 2 * sizeof(*endpoint)));
 	peers_size = ALIGNED_SIZE((unsigned long)(nlist * sizeof(*peers)));
-	indx_size = ALIGNED_SIZE((unsigned long)(nlist * 2 * sizeof(*indx)));
-	octets = endpoint_size + peers_size + indx_size;
+	reach_size = ALIGNED_SIZE((unsigned long)(nlist * 2 * sizeof(*reach)));
+	octets = endpoint_size + peers_size + reach_size;
 	endpoint = erealloc(endpoint, octets);
 	peers = INC_ALIGNED_PTR(endpoint, endpoint_size);
-	indx = INC_ALIGNED_PTR(peers, peers_size);
+	reach = INC_ALIGNED_PTR(peers, peers_size);
 
 	/*
 	 * Initially, we populate the island with all the rifraff peers
@@ -1712,85 +1803,12 @@ clock_select(void)
 		nl2++;
 	}
 	/*
-	 * Construct sorted indx[] of endpoint[] indexes ordered by
-	 * offset.
+	 * Find the intersection interval; see select_intersect() for
+	 * the algorithm. Upon return, the truechimers are the survivors
+	 * with offsets not less than low and not greater than high.
+	 * There may be none of them.
 	 */
-	for (i = 0; i < nl2; i++)
-		indx[i] = i;
-	for (i = 0; i < nl2; i++) {
-		endp = endpoint[indx[i]];
-		e = endp.val;
-		k = i;
-		for (j = i + 1; j < nl2; j++) {
-			endp = endpoint[indx[j]];
-			if (endp.val < e) {
-				e = endp.val;
-				k = j;
-			}
-		}
-		if (k != i) {
-			j = indx[k];
-			indx[k] = indx[i];
-			indx[i] = j;
-		}
-	}
-	for (i = 0; i < nl2; i++)
-		DPRINTF(3, ("select: endpoint %2d %.6f\n",
-			endpoint[indx[i]].type, endpoint[indx[i]].val));
-
-	/*
-	 * This is the actual algorithm that cleaves the truechimers
-	 * from the falsetickers. The original algorithm was described
-	 * in Keith Marzullo's dissertation, but has been modified for
-	 * better accuracy.
-	 *
-	 * Briefly put, we first assume there are no falsetickers, then
-	 * scan the candidate list first from the low end upwards and
-	 * then from the high end downwards. The scans stop when the
-	 * number of intersections equals the number of candidates less
-	 * the number of falsetickers. If this doesn't happen for a
-	 * given number of falsetickers, we bump the number of
-	 * falsetickers and try again. If the number of falsetickers
-	 * becomes equal to or greater than half the number of
-	 * candidates, the Albanians have won the Byzantine wars and
-	 * correct synchronization is not possible.
-	 *
-	 * Here, nlist is the number of candidates and allow is the
-	 * number of falsetickers. Upon exit, the truechimers are the
-	 * survivors with offsets not less than low and not greater than
-	 * high. There may be none of them.
-	 */
-	low = 1e9;
-	high = -1e9;
-	for (allow = 0; 2 * allow < nlist; allow++) {
-
-		/*
-		 * Bound the interval (low, high) as the smallest
-		 * interval containing points from the most sources.
-		 */
-		n = 0;
-		for (i = 0; i < nl2; i++) {
-			low = endpoint[indx[i]].val;
-			n -= endpoint[indx[i]].type;
-			if (n >= nlist - allow)
-				break;
-		}
-		n = 0;
-		for (j = nl2 - 1; j >= 0; j--) {
-			high = endpoint[indx[j]].val;
-			n += endpoint[indx[j]].type;
-			if (n >= nlist - allow)
-				break;
-		}
-
-		/*
-		 * If an interval containing truechimers is found, stop.
-		 * If not, increase the number of falsetickers and go
-		 * around again.
-		 */
-		if (high > low)
-			break;
-	}
+	select_intersect(endpoint, nlist, reach, &low, &high);
 
 	/*
 	 * Clustering algorithm. Whittle candidate list of falsetickers,
@@ -1869,46 +1887,10 @@ clock_select(void)
 
 	/*
 	 * Now, vote outliers off the island by select jitter weighted
-	 * by root distance. Continue voting as long as there are more
-	 * than sys_minclock survivors and the select jitter of the peer
-	 * with the worst metric is greater than the minimum peer
-	 * jitter. Stop if we are about to discard a TRUE or PREFER
-	 * peer, who of course have the immunity idol.
+	 * by root distance until sys_minclock remain, or the rest agree
+	 * well enough; see select_cluster().
 	 */
-	while (1) {
-		d = 1e9;
-		e = -1e9;
-		g = 0;
-		k = 0;
-		for (i = 0; i < nlist; i++) {
-			if (peers[i].error < d)
-				d = peers[i].error;
-			peers[i].seljit = 0;
-			if (nlist > 1) {
-				f = 0;
-				for (j = 0; j < nlist; j++)
-					f += DIFF(peers[j].peer->offset,
-					    peers[i].peer->offset);
-				peers[i].seljit = SQRT(f / (nlist - 1));
-			}
-			if (peers[i].seljit * peers[i].synch > e) {
-				g = peers[i].seljit;
-				e = peers[i].seljit * peers[i].synch;
-				k = i;
-			}
-		}
-		if (nlist <= max(1, sys_minclock) || g <= d ||
-		    ((FLAG_TRUE | FLAG_PREFER) & peers[k].peer->flags))
-			break;
-
-		DPRINTF(3, ("select: drop %s seljit %.6f jit %.6f\n",
-			socktoa(&peers[k].peer->srcadr), g, d));
-		if (nlist > sys_maxclock)
-			peers[k].peer->new_status = CTL_PST_SEL_EXCESS;
-		for (j = k + 1; j < nlist; j++)
-			peers[j - 1] = peers[j];
-		nlist--;
-	}
+	nlist = select_cluster(peers, nlist, sys_minclock, sys_maxclock);
 
 	/*
 	 * What remains is a list usually not greater than sys_minclock
@@ -2240,32 +2222,21 @@ peer_xmit(
 }
 
 
-#ifdef ENABLE_LEAP_SMEAR
-
-static void
-leap_smear_add_offs(l_fp *t, l_fp *t_recv) {
-	UNUSED_ARG(t_recv);
-	t += leap_smear.offset;
-}
-
-#endif	/* ENABLE_LEAP_SMEAR */
-
 /*
- * fast_xmit - Send packet for nonpersistent association. Note that
- * neither the source or destination can be a broadcast address.
+ * build_reply - fill in the reply to the client request in rbufp,
+ * a KoD if flags has RES_KOD, sent at xmt.  Only the request and the
+ * reply template are read, so the server threads can use it too.
  */
-static void
-fast_xmit(
-	struct recvbuf *rbufp,	/* receive packet pointer */
-	int	xmode,		/* receive mode */
-	keyid_t	xkeyid,		/* transmit key ID */
-	int	flags		/* restrict mask */
+void
+build_reply(
+	struct pkt *		xpkt,	/* transmit packet structure */
+	const struct recvbuf *	rbufp,	/* receive packet pointer */
+	int			xmode,	/* receive mode */
+	int			flags,	/* restrict mask */
+	l_fp			xmt	/* transmit time */
 	)
 {
-	struct pkt xpkt;	/* transmit packet structure */
-	struct pkt *rpkt;	/* receive packet structure */
-	l_fp	xmt_tx, xmt_ty;
-	size_t	sendlen;
+	const struct pkt *rpkt;	/* receive packet structure */
 
 	/*
 	 * Initialize transmit packet header fields from the receive
@@ -2285,81 +2256,72 @@ fast_xmit(
 	 * synchronization.
 	 */
 	if (flags & RES_KOD) {
-		sys_kodsent++;
-		xpkt.li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC,
+		xpkt->li_vn_mode = PKT_LI_VN_MODE(LEAP_NOTINSYNC,
 		    PKT_VERSION(rpkt->li_vn_mode), xmode);
-		xpkt.stratum = STRATUM_PKT_UNSPEC;
-		xpkt.ppoll = max(rpkt->ppoll, ntp_minpoll);
-		xpkt.precision = rpkt->precision;
-		memcpy(&xpkt.refid, "RATE", REFIDLEN);
-		xpkt.rootdelay = rpkt->rootdelay;
-		xpkt.rootdisp = rpkt->rootdisp;
-		xpkt.reftime = rpkt->reftime;
-		xpkt.org = rpkt->xmt;
-		xpkt.rec = rpkt->xmt;
-		xpkt.xmt = rpkt->xmt;
-
-	/*
-	 * This is a normal packet. Use the system variables.
+		xpkt->stratum = STRATUM_PKT_UNSPEC;
+		xpkt->ppoll = max(rpkt->ppoll, ntp_minpoll);
+		xpkt->precision = rpkt->precision;
+		memcpy(&xpkt->refid, "RATE", REFIDLEN);
+		xpkt->rootdelay = rpkt->rootdelay;
+		xpkt->rootdisp = rpkt->rootdisp;
+		xpkt->reftime = rpkt->reftime;
+		xpkt->org = rpkt->xmt;
+		xpkt->rec = rpkt->xmt;
+		xpkt->xmt = rpkt->xmt;
+
+	/*
+	 * This is a normal packet. Use the system variables, as
+	 * last published, and fill in only the timestamps.
 	 */
 	} else {
-#ifdef ENABLE_LEAP_SMEAR
-		/*
-		 * Make copies of the variables which can be affected by smearing.
-		 */
-		l_fp this_ref_time;
-		l_fp this_recv_time;
-#endif
+		struct reply_template rt;
+		l_fp	this_recv_time;
 
-		/*
-		 * If we are inside the leap smear interval we add the
-		 * current smear offset to the packet receive time, to
-		 * the packet transmit time, and eventually to the
-		 * reftime to make sure the reftime isn't later than
-		 * the transmit/receive times.
-		 */
-		xpkt.li_vn_mode = PKT_LI_VN_MODE(sys_leap,
+		get_reply_template(&rt);
+		xpkt->li_vn_mode = PKT_LI_VN_MODE(rt.leap,
 		    PKT_VERSION(rpkt->li_vn_mode), xmode);
-		xpkt.stratum = STRATUM_TO_PKT(sys_stratum);
-		xpkt.ppoll = max(rpkt->ppoll, ntp_minpoll);
-		xpkt.precision = sys_precision;
-		xpkt.refid = sys_refid;
-		xpkt.rootdelay = HTONS_FP(DTOFP(sys_rootdelay));
-		xpkt.rootdisp = HTONS_FP(DTOUFP(sys_rootdisp));
+		xpkt->stratum = rt.stratum;
+		xpkt->ppoll = max(rpkt->ppoll, ntp_minpoll);
+		xpkt->precision = rt.precision;
+		xpkt->refid = rt.refid;
+		xpkt->rootdelay = rt.rootdelay;
+		xpkt->rootdisp = rt.rootdisp;
+		xpkt->reftime = rt.reftime;
+		xpkt->org = rpkt->xmt;
 
-#ifdef ENABLE_LEAP_SMEAR
-		this_ref_time = sys_reftime;
-		if (leap_smear.in_progress) {
-			leap_smear_add_offs(&this_ref_time, NULL);
-			xpkt.refid = convertLFPToRefID(leap_smear.offset);
-			DPRINTF(2, ("fast_xmit: leap_smear.in_progress: refid %8x, smear %s\n",
-				ntohl(xpkt.refid),
-				lfptoa(leap_smear.offset, 8)
-				));
+		this_recv_time = rbufp->recv_time;
+		if (rt.smearing) {
+			this_recv_time += rt.smear;
+			xmt += rt.smear;
 		}
-		xpkt.reftime = htonl_fp(this_ref_time);
-#else
-		xpkt.reftime = htonl_fp(sys_reftime);
-#endif
+		xpkt->rec = htonl_fp(this_recv_time);
+		xpkt->xmt = htonl_fp(xmt);
+	}
+}
 
-		xpkt.org = rpkt->xmt;
 
-#ifdef ENABLE_LEAP_SMEAR
-		this_recv_time = rbufp->recv_time;
-		if (leap_smear.in_progress)
-			leap_smear_add_offs(&this_recv_time, NULL);
-		xpkt.rec = htonl_fp(this_recv_time);
-#else
-		xpkt.rec = htonl_fp(rbufp->recv_time);
-#endif
+/*
+ * fast_xmit - Send packet for nonpersistent association. Note that
+ * neither the source or destination can be a broadcast address.
+ * Replies are queued; the main loop flushes them once it has
+ * drained the current batch of receive buffers.
+ */
+static void
+fast_xmit(
+	struct recvbuf *rbufp,	/* receive packet pointer */
+	int	xmode,		/* receive mode */
+	keyid_t	xkeyid,		/* transmit key ID */
+	int	flags		/* restrict mask */
+	)
+{
+	struct pkt xpkt;	/* transmit packet structure */
+	l_fp	xmt_tx, xmt_ty;
+	size_t	sendlen;
 
-		get_systime(&xmt_tx);
-#ifdef ENABLE_LEAP_SMEAR
-		if (leap_smear.in_progress)
-			leap_smear_add_offs(&xmt_tx, &this_recv_time);
-#endif
-		xpkt.xmt = htonl_fp(xmt_tx);
-	}
+	if (flags & RES_KOD)
+		sys_kodsent++;
+	get_systime(&xmt_tx);
+	build_reply(&xpkt, rbufp, xmode, flags, xmt_tx);
 
 #ifdef ENABLE_MSSNTP
 	if (flags & RES_MSSNTP) {
@@ -2375,7 +2337,8 @@ fast_xmit(
 	 */
 	sendlen = LEN_PKT_NOMAC;
 	if (rbufp->recv_length == sendlen) {
-		sendpkt(&rbufp->recv_srcadr, rbufp->dstadr, &xpkt, sendlen);
+		sendpkt_queued(&rbufp->recv_srcadr, rbufp->dstadr, &xpkt,
+			       (int)sendlen);
 #ifdef DEBUG
 		if (debug)
 			printf(
@@ -2394,10 +2357,15 @@ fast_xmit(
 	 */
 	get_systime(&xmt_tx);
 	sendlen += authencrypt(xkeyid, (uint32_t *)&xpkt, sendlen);
-	sendpkt(&rbufp->recv_srcadr, rbufp->dstadr, &xpkt, sendlen);
+	/*
+	 * The reply may only be queued here and sent with others
+	 * later, so authdelay is the time taken by the MAC alone.
+	 */
 	get_systime(&xmt_ty);
 	xmt_ty -= xmt_tx;
 	sys_authdelay = xmt_ty;
+	sendpkt_queued(&rbufp->recv_srcadr, rbufp->dstadr, &xpkt,
+		       (int)sendlen);
 #ifdef DEBUG
 	if (debug)
 		printf(
@@ -2764,6 +2732,7 @@ set_sys_tick_precision(
 		i++;
 
 	sys_precision = (int8_t)i;
+	publish_reply_template();
 }
 
 
@@ -12,22 +12,29 @@
 #include "ntp_stdlib.h"
 #include "ntp_assert.h"
 
+#ifdef USE_SERVER_THREADS
+# include <pthread.h>
+#endif
+
 /*
  * This code keeps a simple address-and-mask list of hosts we want
  * to place restrictions on (or remove them from). The restrictions
  * are implemented as a set of flags which tell you what the host
  * can't do. There is a subroutine entry to return the flags. The
- * list is kept sorted to reduce the average number of comparisons
- * and make sure you get the set of restrictions most specific to
- * the address.
+ * list is kept sorted so that the first entry matching an address
+ * is the set of restrictions most specific to it.
  *
- * The algorithm is that, when looking up a host, it is first assumed
- * that the default set of restrictions will apply. It then searches
- * down through the list. Whenever it finds a match it adopts the
- * match's flags instead. When you hit the point where the sorted
- * address is greater than the target, you return with the last set of
- * flags you found. Because of the ordering of the list, the most
- * specific match will provide the final set of flags.
+ * Walking the list for every packet gets slow once it holds
+ * thousands of entries, so the entries are also indexed by a
+ * path-compressed binary trie keyed on address prefix.  With
+ * contiguous masks, sorting first by descending address and then by
+ * descending mask puts longer matching prefixes first, so the first
+ * match in the list is the longest matching prefix in the trie, and
+ * a lookup costs at most one node per prefix length whatever the
+ * length of the list.  Each trie node points at the first of the
+ * (adjacent, mflags ordered) list entries sharing its prefix.  The
+ * rare non-contiguous mask cannot be put in a trie; while any such
+ * entry exists lookups in its address family fall back to the list.
  *
  * This was originally intended to restrict you from sync'ing to your
  * own broadcasts when you are doing that, by restricting yourself from
@@ -50,6 +57,22 @@
 		}							\
 	} while (0)
 
+/*
+ * A trie node.  Children extend the node's prefix and differ from
+ * each other at bit plen.  Nodes without entries only join two
+ * subtries and are removed when they no longer do.
+ */
+#define RES_KEYLEN	16	/* octets in a key, enough for IPv6 */
+
+typedef struct res_node res_node;
+struct res_node {
+	res_node *	child[2];
+	res_node *	parent;
+	restrict_u *	entries;	/* first list entry with the prefix */
+	int		plen;		/* prefix length in bits */
+	uint8_t		key[RES_KEYLEN]; /* prefix, network order */
+};
+
 /*
  * We allocate INC_RESLIST{4|6} entries to the free list whenever empty.
  * Auto-tune these to be just less than 1KB (leaving at least 16 bytes
@@ -72,6 +95,16 @@ static int restrictcount;	/* count in the restrict lists */
 static restrict_u *resfree4;	/* available entries (free list) */
 static restrict_u *resfree6;
 
+/*
+ * The trie indexes, count of entries with non-contiguous masks left
+ * out of them, and count of entries waiting for restrict_expire().
+ */
+static res_node *restrict_trie4;
+static res_node *restrict_trie6;
+static u_int res_noncontig4;
+static u_int res_noncontig6;
+static u_int res_expiring;
+
 static u_long res_calls;
 static u_long res_found;
 static u_long res_not_found;
@@ -88,6 +121,15 @@ static	u_long res_limited_refcnt;
 static	restrict_u	restrict_def4;
 static	restrict_u	restrict_def6;
 
+#ifdef USE_SERVER_THREADS
+/*
+ * Server threads look up restrictions while the main thread changes
+ * them.  res_mutex covers the lists, the tries and the counters, and
+ * is taken before the monitor's lock, never while holding it.
+ */
+static	pthread_mutex_t	res_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /*
  * "restrict source ..." enabled knob and restriction bits.
  */
@@ -109,6 +151,20 @@ static restrict_u *	match_restrict6_addr(const struct in6_addr *,
 static restrict_u *	match_restrict_entry(const restrict_u *, int);
 static int		res_sorts_before4(restrict_u *, restrict_u *);
 static int		res_sorts_before6(restrict_u *, restrict_u *);
+static bool		res_applies(const restrict_u *, u_short);
+static bool		same_prefix(const restrict_u *, const restrict_u *,
+				    int);
+static int		res_key(const restrict_u *, int, uint8_t *);
+static void		addr4_key(uint32_t, uint8_t *);
+static int		key_bit(const uint8_t *, int);
+static int		common_bits(const uint8_t *, const uint8_t *, int);
+static res_node *	new_node(const uint8_t *, int, restrict_u *,
+				 res_node *);
+static void		free_trie(res_node *);
+static void		index_res(restrict_u *, int);
+static void		unindex_res(restrict_u *, int);
+static restrict_u *	match_restrict_trie(res_node *, const uint8_t *,
+					    int, u_short, int);
 
 
 /*
@@ -143,14 +199,74 @@ init_restrict(void)
 	 * RESM_NTPONLY are sorted earlier so they take precedence over
 	 * any otherwise similar entry without.  Again, this is the same
 	 * behavior as but reversed implementation compared to the docs.
-	 * 
+	 *
+	 * The default entries are the roots of the tries.
 	 */
+	free_trie(restrict_trie4);
+	free_trie(restrict_trie6);
+	restrict_trie4 = NULL;
+	restrict_trie6 = NULL;
+	res_noncontig4 = 0;
+	res_noncontig6 = 0;
+	res_expiring = 0;
+
 	LINK_SLIST(restrictlist4, &restrict_def4, link);
 	LINK_SLIST(restrictlist6, &restrict_def6, link);
+	index_res(&restrict_def4, false);
+	index_res(&restrict_def6, true);
 	restrictcount = 2;
 }
 
 
+/*
+ * restrict_lock - keep the restriction lists still, for walking them
+ */
+void
+restrict_lock(void)
+{
+#ifdef USE_SERVER_THREADS
+	pthread_mutex_lock(&res_mutex);
+#endif
+}
+
+
+void
+restrict_unlock(void)
+{
+#ifdef USE_SERVER_THREADS
+	pthread_mutex_unlock(&res_mutex);
+#endif
+}
+
+
+/*
+ * restrict_expire - free entries whose time is up.  Called once a
+ * second from timer(), so lookups need not do it.
+ */
+void
+restrict_expire(void)
+{
+	restrict_u *	res;
+	restrict_u *	next;
+
+	if (!res_expiring)
+		return;
+
+	restrict_lock();
+	for (res = restrictlist4; res != NULL; res = next) {
+		next = res->link;
+		if (res->expire && res->expire <= current_time)
+			free_res(res, false);
+	}
+	for (res = restrictlist6; res != NULL; res = next) {
+		next = res->link;
+		if (res->expire && res->expire <= current_time)
+			free_res(res, true);
+	}
+	restrict_unlock();
+}
+
+
 static restrict_u *
 alloc_res4(void)
 {
@@ -215,7 +331,11 @@ free_res(
 	restrictcount--;
 	if (RES_LIMITED & res->flags)
 		dec_res_limited();
+	if (res->expire)
+		res_expiring--;
 
+	/* before unlinking, the trie may move on to res->link */
+	unindex_res(res, v6);
 	if (v6)
 		plisthead = &restrictlist6;
 	else
@@ -258,20 +378,19 @@ match_restrict4_addr(
 	u_short	port
 	)
 {
-	const int	v6 = 0;
 	restrict_u *	res;
-	restrict_u *	next;
+	uint8_t		key[RES_KEYLEN];
 
-	for (res = restrictlist4; res != NULL; res = next) {
-		next = res->link;
-		if (res->expire &&
-		    res->expire <= current_time)
-			free_res(res, v6);
+	if (!res_noncontig4) {
+		addr4_key(addr, key);
+		return match_restrict_trie(restrict_trie4, key, 32, port,
+					   false);
+	}
+
+	for (res = restrictlist4; res != NULL; res = res->link)
 		if (res->u.v4.addr == (addr & res->u.v4.mask)
-		    && (!(RESM_NTPONLY & res->mflags)
-			|| NTP_PORT == port))
+		    && res_applies(res, port))
 			break;
-	}
 	return res;
 }
 
@@ -282,27 +401,339 @@ match_restrict6_addr(
 	u_short			port
 	)
 {
-	const int	v6 = 1;
 	restrict_u *	res;
-	restrict_u *	next;
 	struct in6_addr	masked;
 
-	for (res = restrictlist6; res != NULL; res = next) {
-		next = res->link;
-		NTP_INSIST(next != res);
-		if (res->expire &&
-		    res->expire <= current_time)
-			free_res(res, v6);
+	if (!res_noncontig6)
+		return match_restrict_trie(restrict_trie6, addr->s6_addr,
+					   128, port, true);
+
+	for (res = restrictlist6; res != NULL; res = res->link) {
 		MASK_IPV6_ADDR(&masked, addr, &res->u.v6.mask);
 		if (ADDR6_EQ(&masked, &res->u.v6.addr)
-		    && (!(RESM_NTPONLY & res->mflags)
-			|| NTP_PORT == (int)port))
+		    && res_applies(res, port))
 			break;
 	}
 	return res;
 }
 
 
+/*
+ * match_restrict_trie - find the first list entry matching an address
+ *
+ * Descends the trie remembering each node on the way whose prefix
+ * matches, then tries their entries from the longest prefix back.
+ */
+static restrict_u *
+match_restrict_trie(
+	res_node *	root,
+	const uint8_t *	key,
+	int		bits,
+	u_short		port,
+	int		v6
+	)
+{
+	res_node *	path[RES_KEYLEN * 8 + 1];
+	res_node *	node;
+	restrict_u *	res;
+	int		depth;
+
+	depth = 0;
+	for (node = root; node != NULL;
+	     node = node->child[key_bit(key, node->plen)]) {
+		if (common_bits(node->key, key, node->plen) < node->plen)
+			break;
+		if (node->entries != NULL)
+			path[depth++] = node;
+		if (node->plen >= bits)
+			break;
+	}
+
+	while (depth-- > 0)
+		for (res = path[depth]->entries;
+		     res != NULL && same_prefix(res, path[depth]->entries, v6);
+		     res = res->link)
+			if (res_applies(res, port))
+				return res;
+	return NULL;
+}
+
+
+/*
+ * res_applies - entry is not yet expired, and if it is for NTP only,
+ * the port is the NTP port.
+ */
+static bool
+res_applies(
+	const restrict_u *	res,
+	u_short			port
+	)
+{
+	if (res->expire && res->expire <= current_time)
+		return false;
+	return !(RESM_NTPONLY & res->mflags) || NTP_PORT == (int)port;
+}
+
+
+/*
+ * same_prefix - entries have the same address and mask
+ */
+static bool
+same_prefix(
+	const restrict_u *	r1,
+	const restrict_u *	r2,
+	int			v6
+	)
+{
+	return !memcmp(&r1->u, &r2->u,
+		       v6 ? sizeof(r1->u.v6) : sizeof(r1->u.v4));
+}
+
+
+static void
+addr4_key(
+	uint32_t	addr,	/* host order */
+	uint8_t *	key
+	)
+{
+	key[0] = (uint8_t)(addr >> 24);
+	key[1] = (uint8_t)(addr >> 16);
+	key[2] = (uint8_t)(addr >> 8);
+	key[3] = (uint8_t)addr;
+}
+
+
+/*
+ * res_key - get an entry's trie key
+ *
+ * Returns the prefix length, or -1 if the mask is not contiguous.
+ */
+static int
+res_key(
+	const restrict_u *	res,
+	int			v6,
+	uint8_t *		key
+	)
+{
+	uint8_t	mask[RES_KEYLEN];
+	size_t	len;
+	size_t	i;
+	int	bits;
+
+	if (v6) {
+		memcpy(key, res->u.v6.addr.s6_addr, RES_KEYLEN);
+		memcpy(mask, res->u.v6.mask.s6_addr, RES_KEYLEN);
+		len = RES_KEYLEN;
+	} else {
+		addr4_key(res->u.v4.addr, key);
+		addr4_key(res->u.v4.mask, mask);
+		len = 4;
+	}
+
+	bits = 0;
+	for (i = 0; i < len && 0xff == mask[i]; i++)
+		bits += 8;
+	if (i < len) {
+		for (; mask[i] & 0x80; mask[i] <<= 1)
+			bits++;
+		if (mask[i])
+			return -1;
+		for (i++; i < len; i++)
+			if (mask[i])
+				return -1;
+	}
+	return bits;
+}
+
+
+static int
+key_bit(
+	const uint8_t *	key,
+	int		bit
+	)
+{
+	return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+
+/*
+ * common_bits - length of the common prefix of two keys, up to limit
+ */
+static int
+common_bits(
+	const uint8_t *	k1,
+	const uint8_t *	k2,
+	int		limit
+	)
+{
+	int	bit;
+
+	for (bit = 0; bit + 8 <= limit && k1[bit >> 3] == k2[bit >> 3];
+	     bit += 8)
+		/* do nothing */;
+	while (bit < limit && key_bit(k1, bit) == key_bit(k2, bit))
+		bit++;
+	return bit;
+}
+
+
+static res_node *
+new_node(
+	const uint8_t *	key,
+	int		plen,
+	restrict_u *	entries,
+	res_node *	parent
+	)
+{
+	res_node *	node;
+
+	node = emalloc_zero(sizeof(*node));
+	memcpy(node->key, key, sizeof(node->key));
+	node->plen = plen;
+	node->entries = entries;
+	node->parent = parent;
+	return node;
+}
+
+
+static void
+free_trie(
+	res_node *	node
+	)
+{
+	if (NULL == node)
+		return;
+	free_trie(node->child[0]);
+	free_trie(node->child[1]);
+	free(node);
+}
+
+
+/*
+ * index_res - add an entry, already on its list, to the trie
+ */
+static void
+index_res(
+	restrict_u *	res,
+	int		v6
+	)
+{
+	res_node **	pnode;
+	res_node *	parent;
+	res_node *	node;
+	res_node *	leaf;
+	res_node *	split;
+	uint8_t		key[RES_KEYLEN];
+	int		plen;
+	int		common;
+
+	plen = res_key(res, v6, key);
+	if (plen < 0) {
+		if (v6)
+			res_noncontig6++;
+		else
+			res_noncontig4++;
+		return;
+	}
+
+	pnode = (v6) ? &restrict_trie6 : &restrict_trie4;
+	parent = NULL;
+	common = 0;
+	while ((node = *pnode) != NULL) {
+		common = common_bits(node->key, key, min(node->plen, plen));
+		if (common < node->plen)
+			break;		/* the keys part within node's prefix */
+		if (node->plen == plen) {
+			/* may be a node which only joined subtries */
+			if (NULL == node->entries
+			    || ((v6)
+				  ? res_sorts_before6(res, node->entries)
+				  : res_sorts_before4(res, node->entries)))
+				node->entries = res;
+			return;
+		}
+		parent = node;
+		pnode = &node->child[key_bit(key, node->plen)];
+	}
+
+	leaf = new_node(key, plen, res, parent);
+	if (NULL == node) {
+		*pnode = leaf;
+	} else if (common == plen) {
+		/* node extends the new prefix */
+		leaf->child[key_bit(node->key, plen)] = node;
+		node->parent = leaf;
+		*pnode = leaf;
+	} else {
+		split = new_node(key, common, NULL, parent);
+		split->child[key_bit(key, common)] = leaf;
+		split->child[key_bit(node->key, common)] = node;
+		leaf->parent = split;
+		node->parent = split;
+		*pnode = split;
+	}
+}
+
+
+/*
+ * unindex_res - take an entry about to leave its list out of the trie
+ */
+static void
+unindex_res(
+	restrict_u *	res,
+	int		v6
+	)
+{
+	res_node **	proot;
+	res_node *	node;
+	res_node *	child;
+	res_node *	parent;
+	uint8_t		key[RES_KEYLEN];
+	int		plen;
+
+	plen = res_key(res, v6, key);
+	if (plen < 0) {
+		if (v6)
+			res_noncontig6--;
+		else
+			res_noncontig4--;
+		return;
+	}
+
+	proot = (v6) ? &restrict_trie6 : &restrict_trie4;
+	for (node = *proot; node != NULL && node->plen < plen;
+	     node = node->child[key_bit(key, node->plen)])
+		/* do nothing */;
+	if (NULL == node || node->plen != plen
+	    || common_bits(node->key, key, plen) < plen
+	    || node->entries != res)
+		return;		/* not first for its prefix */
+
+	if (res->link != NULL && same_prefix(res->link, res, v6)) {
+		node->entries = res->link;
+		return;
+	}
+
+	/* prune nodes no longer holding entries or joining subtries */
+	node->entries = NULL;
+	while (node != NULL && NULL == node->entries
+	       && (NULL == node->child[0] || NULL == node->child[1])) {
+		child = (node->child[0] != NULL)
+			    ? node->child[0]
+			    : node->child[1];
+		parent = node->parent;
+		if (child != NULL)
+			child->parent = parent;
+		if (NULL == parent)
+			*proot = child;
+		else
+			parent->child[parent->child[1] == node] = child;
+		free(node);
+		node = parent;
+	}
+}
+
+
 /*
  * match_restrict_entry - find an exact match on a restrict list.
  *
@@ -310,7 +741,8 @@ match_restrict6_addr(
  * In order to use more common code for IPv4 and IPv6, this routine
  * requires the caller to populate a restrict_u with mflags and either
  * the v4 or v6 address and mask as appropriate.  Other fields in the
- * input restrict_u are ignored.
+ * input restrict_u are ignored.  An expired match is freed, not
+ * returned.
  */
 static restrict_u *
 match_restrict_entry(
@@ -334,6 +766,16 @@ match_restrict_entry(
 		if (res->mflags == pmatch->mflags &&
 		    !memcmp(&res->u, &pmatch->u, cb))
 			break;
+
+	/*
+	 * An entry whose time is up but which restrict_expire() has
+	 * not got to yet is gone as far as lookups are concerned, and
+	 * must not be brought back with its old expire time.
+	 */
+	if (res != NULL && res->expire && res->expire <= current_time) {
+		free_res(res, v6);
+		res = NULL;
+	}
 	return res;
 }
 
@@ -419,18 +861,21 @@ restrictions(
 	struct in6_addr *pin6;
 	u_short flags;
 
+	/*
+	 * Ignore any packets with a multicast source address
+	 * (this should be done early in the receive process,
+	 * not later!)
+	 */
+	if (IS_IPV4(srcadr) && IN_CLASSD(SRCADR(srcadr)))
+		return (int)RES_IGNORE;
+	if (IS_IPV6(srcadr) && IN6_IS_ADDR_MULTICAST(PSOCK_ADDR6(srcadr)))
+		return (int)RES_IGNORE;
+
+	restrict_lock();
 	res_calls++;
 	flags = 0;
 	/* IPv4 source address */
 	if (IS_IPV4(srcadr)) {
-		/*
-		 * Ignore any packets with a multicast source address
-		 * (this should be done early in the receive process,
-		 * not later!)
-		 */
-		if (IN_CLASSD(SRCADR(srcadr)))
-			return (int)RES_IGNORE;
-
 		match = match_restrict4_addr(SRCADR(srcadr),
 					     SRCPORT(srcadr));
 		match->count++;
@@ -449,15 +894,6 @@ restrictions(
 	/* IPv6 source address */
 	if (IS_IPV6(srcadr)) {
 		pin6 = PSOCK_ADDR6(srcadr);
-
-		/*
-		 * Ignore any packets with a multicast source address
-		 * (this should be done early in the receive process,
-		 * not later!)
-		 */
-		if (IN6_IS_ADDR_MULTICAST(pin6))
-			return (int)RES_IGNORE;
-
 		match = match_restrict6_addr(pin6, SRCPORT(srcadr));
 		match->count++;
 		if (&restrict_def6 == match)
@@ -466,6 +902,7 @@ restrictions(
 			res_found++;
 		flags = match->flags;
 	}
+	restrict_unlock();
 	return (flags);
 }
 
@@ -531,6 +968,7 @@ hack_restrict(
 	match.flags = flags;
 	match.mflags = mflags;
 	match.expire = expire;
+	restrict_lock();
 	res = match_restrict_entry(&match, v6);
 
 	switch (op) {
@@ -558,7 +996,10 @@ hack_restrict(
 				  ? res_sorts_before6(res, L_S_S_CUR())
 				  : res_sorts_before4(res, L_S_S_CUR()),
 				link, restrict_u);
+			index_res(res, v6);
 			restrictcount++;
+			if (res->expire)
+				res_expiring++;
 			if (RES_LIMITED & flags)
 				inc_res_limited();
 		} else {
@@ -601,7 +1042,7 @@ hack_restrict(
 		NTP_INSIST(0);
 		break;
 	}
-
+	restrict_unlock();
 }
 
 
@@ -642,6 +1083,7 @@ restrict_source(
 	 * immediately regardless of the expire value to make way
 	 * for the more persistent entry.
 	 */
+	restrict_lock();
 	if (IS_IPV4(addr)) {
 		res = match_restrict4_addr(SRCADR(addr), SRCPORT(addr));
 		found_specific = (SRCADR(&onesmask) == res->u.v4.mask);
@@ -655,6 +1097,7 @@ restrict_source(
 		found_specific = 0;
 		free_res(res, IS_IPV6(addr));
 	}
+	restrict_unlock();
 	if (found_specific)
 		return;
 
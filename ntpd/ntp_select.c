@@ -0,0 +1,234 @@
+/*
+ * ntp_select.c - intersection and clustering for clock_select()
+ *
+ * clock_select() in ntp_proto.c decides which associations are fit
+ * to be candidates at all; the two steps here pick the truechimers
+ * and then the survivors among them.  With pool and a high maxclock
+ * there can be hundreds of candidates, so neither step does more
+ * than O(n log n) and O(n^2) work respectively.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "ntpd.h"
+#include "ntp_stdlib.h"
+
+#define DIFF(x, y) (SQUARE((x) - (y)))
+
+/*
+ * A running sum of squares which has shrunk by this factor since it
+ * was last added up from scratch has lost too many bits to the
+ * subtractions, so it is added up again.
+ */
+#define SUMSQ_STALE	1e-6
+
+static int	endpoint_cmp	(const void *, const void *);
+static void	sumsq_fresh	(peer_select *, int, int);
+
+
+/*
+ * endpoint_cmp - order endpoints by offset, a lower end ahead of an
+ * upper end at the same offset.
+ */
+static int
+endpoint_cmp(
+	const void *	a,
+	const void *	b
+	)
+{
+	const struct endpoint *ea = a;
+	const struct endpoint *eb = b;
+
+	if (ea->val < eb->val)
+		return -1;
+	if (ea->val > eb->val)
+		return 1;
+	return ea->type - eb->type;
+}
+
+
+/*
+ * select_intersect - find the intersection interval
+ *
+ * This is the actual algorithm that cleaves the truechimers from the
+ * falsetickers. The original algorithm was described in Keith
+ * Marzullo's dissertation, but has been modified for better accuracy.
+ *
+ * Briefly put, we first assume there are no falsetickers, then scan
+ * the candidate list first from the low end upwards and then from the
+ * high end downwards. The scans stop when the number of intersections
+ * equals the number of candidates less the number of falsetickers. If
+ * this doesn't happen for a given number of falsetickers, we bump the
+ * number of falsetickers and try again. If the number of falsetickers
+ * becomes equal to or greater than half the number of candidates, the
+ * Albanians have won the Byzantine wars and correct synchronization is
+ * not possible.
+ *
+ * The count of overlapping intervals changes by one at each endpoint,
+ * so a single scan from each end records where the count first
+ * reaches every level, and each number of falsetickers is then a
+ * lookup rather than another scan.
+ *
+ * endpoint[] holds 2 * nlist entries and is sorted here; reach[] is
+ * scratch space for 2 * nlist + 2 ints.  Upon return the truechimers
+ * are the candidates with offsets not less than *lowp and not greater
+ * than *highp; if *highp <= *lowp there are none.
+ */
+void
+select_intersect(
+	struct endpoint *endpoint,
+	int		nlist,
+	int *		reach,
+	double *	lowp,
+	double *	highp
+	)
+{
+	int *	lowreach = reach;		/* first index at level n */
+	int *	highreach = reach + nlist + 1;	/* same, from the top */
+	int	nl2 = 2 * nlist;
+	int	lowmax, highmax;
+	int	allow;
+	int	i, n;
+	double	low, high;
+
+	qsort(endpoint, (size_t)nl2, sizeof(*endpoint), endpoint_cmp);
+	for (i = 0; i < nl2; i++)
+		DPRINTF(3, ("select: endpoint %2d %.6f\n",
+			endpoint[i].type, endpoint[i].val));
+
+	n = lowmax = 0;
+	for (i = 0; i < nl2; i++) {
+		n -= endpoint[i].type;
+		if (n > lowmax)
+			lowreach[lowmax = n] = i;
+	}
+	n = highmax = 0;
+	for (i = nl2 - 1; i >= 0; i--) {
+		n += endpoint[i].type;
+		if (n > highmax)
+			highreach[highmax = n] = i;
+	}
+
+	/*
+	 * Bound the interval (low, high) as the smallest interval
+	 * containing points from the most sources. If an interval
+	 * containing truechimers is found, stop. If not, increase the
+	 * number of falsetickers and go around again.
+	 */
+	low = 1e9;
+	high = -1e9;
+	for (allow = 0; 2 * allow < nlist; allow++) {
+		n = nlist - allow;
+		low = endpoint[n <= lowmax ? lowreach[n] : nl2 - 1].val;
+		high = endpoint[n <= highmax ? highreach[n] : 0].val;
+		if (high > low)
+			break;
+	}
+	*lowp = low;
+	*highp = high;
+}
+
+
+/*
+ * sumsq_fresh - add up the squared offset differences between peer i
+ * and every peer on the list, itself included.
+ */
+static void
+sumsq_fresh(
+	peer_select *	peers,
+	int		nlist,
+	int		i
+	)
+{
+	double	f;
+	int	j;
+
+	f = 0;
+	for (j = 0; j < nlist; j++)
+		f += DIFF(peers[j].peer->offset, peers[i].peer->offset);
+	peers[i].sumsq = peers[i].sumsq_ref = f;
+}
+
+
+/*
+ * select_cluster - vote outliers off the island
+ *
+ * Vote outliers off the island by select jitter weighted by root
+ * distance. Continue voting as long as there are more than minclock
+ * survivors and the select jitter of the peer with the worst metric
+ * is greater than the minimum peer jitter. Stop if we are about to
+ * discard a TRUE or PREFER peer, who of course have the immunity idol.
+ * Peers dropped while there are more than maxclock are marked excess.
+ *
+ * Each peer's sum of squared differences to the others is added up
+ * once and then only has the departing peer's term taken out of it,
+ * so a round costs O(n) rather than O(n^2). The survivors' select
+ * jitter is added up afresh at the end, in list order, so it comes
+ * out exactly as if it had been computed directly.
+ *
+ * Returns the number of survivors, which stay in their original order
+ * at the start of peers[].
+ */
+int
+select_cluster(
+	peer_select *	peers,
+	int		nlist,
+	int		minclock,
+	int		maxclock
+	)
+{
+	double	d, e, g, x;
+	int	i, k;
+	bool	dropped;
+
+	for (i = 0; i < nlist; i++)
+		sumsq_fresh(peers, nlist, i);
+
+	dropped = false;
+	while (1) {
+		d = 1e9;
+		e = -1e9;
+		g = 0;
+		k = 0;
+		for (i = 0; i < nlist; i++) {
+			if (peers[i].error < d)
+				d = peers[i].error;
+			peers[i].seljit = 0;
+			if (nlist > 1) {
+				if (peers[i].sumsq <
+				    peers[i].sumsq_ref * SUMSQ_STALE)
+					sumsq_fresh(peers, nlist, i);
+				peers[i].seljit = SQRT(peers[i].sumsq /
+						       (nlist - 1));
+			}
+			if (peers[i].seljit * peers[i].synch > e) {
+				g = peers[i].seljit;
+				e = peers[i].seljit * peers[i].synch;
+				k = i;
+			}
+		}
+		if (nlist <= max(1, minclock) || g <= d ||
+		    ((FLAG_TRUE | FLAG_PREFER) & peers[k].peer->flags))
+			break;
+
+		DPRINTF(3, ("select: drop %s seljit %.6f jit %.6f\n",
+			socktoa(&peers[k].peer->srcadr), g, d));
+		if (nlist > maxclock)
+			peers[k].peer->new_status = CTL_PST_SEL_EXCESS;
+		x = peers[k].peer->offset;
+		for (i = 0; i < nlist; i++)
+			peers[i].sumsq -= DIFF(x, peers[i].peer->offset);
+		nlist--;
+		memmove(&peers[k], &peers[k + 1],
+			(size_t)(nlist - k) * sizeof(*peers));
+		dropped = true;
+	}
+
+	if (dropped && nlist > 1)
+		for (i = 0; i < nlist; i++) {
+			sumsq_fresh(peers, nlist, i);
+			peers[i].seljit = SQRT(peers[i].sumsq / (nlist - 1));
+		}
+	return nlist;
+}
@@ -0,0 +1,659 @@
+/*
+ * ntp_threads.c - worker threads answering client requests
+ *
+ * With "threads N" in the configuration every unicast endpoint gets N
+ * extra sockets bound to its address and port through SO_REUSEPORT,
+ * and the kernel spreads arriving datagrams across them and the
+ * endpoint's own socket.  Worker i polls socket i of every endpoint.
+ *
+ * A worker answers plain client requests itself.  A mode 3 packet
+ * without a MAC needs only the restrictions, the MRU list and the
+ * reply template, and each of those has its own lock or none.
+ * Anything else may touch associations, keys or the clock, so the
+ * worker queues it for the main thread and pokes the main loop
+ * through an eventfd; receive() then gets it as if it had come in
+ * on the endpoint's own socket.
+ *
+ * Each worker has a mutex covering its sockets, its queue and its
+ * counters.  The main thread takes it only to drain the queue, to
+ * add the counters into the endpoints and the global statistics, and
+ * to take sockets away.  A worker holds it while it reads, answers
+ * and queues, so an endpoint cannot go away in the middle.  The lock
+ * order is worker, restrictions, monitor.
+ */
+#include "config.h"
+
+#include "ntpd.h"
+#include "ntp_io.h"
+#include "ntp_lists.h"
+#include "ntp_random.h"
+#include "ntp_stdlib.h"
+#include "recvbuff.h"
+#include "timespecops.h"
+
+int server_threads;		/* worker threads, 0 = none */
+
+#ifdef USE_SERVER_THREADS
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+typedef struct worker worker;
+
+/* one worker's socket on one endpoint */
+struct srvsock {
+	struct srvsock *link;		/* next on the endpoint */
+	struct srvsock *wlink;		/* next of the worker's */
+	endpt *		ep;		/* only valid while !dead */
+	SOCKET		fd;
+	worker *	w;
+	bool		dead;		/* endpoint has gone away */
+	long		received;	/* not yet added to ep */
+	long		sent;
+	long		notsent;
+};
+
+/* what a worker counted since the main thread last looked */
+struct worker_stats {
+	u_long	received;	/* sys_received */
+	u_long	restricted;	/* sys_restricted */
+	u_long	limitrejected;	/* sys_limitrejected */
+	u_long	kodsent;	/* sys_kodsent */
+	u_long	newversion;	/* sys_newversion */
+	u_long	oldversion;	/* sys_oldversion */
+	u_long	badauth;	/* sys_badauth */
+	u_long	ignored;	/* packets_ignored */
+	u_long	dropped;	/* packets_dropped */
+};
+
+struct worker {
+	pthread_t	tid;
+	int		epfd;
+	pthread_mutex_t	lock;		/* all of the below */
+	struct srvsock *socks;		/* live sockets */
+	struct srvsock *graveyard;	/* removed, not yet freed */
+	DECL_FIFO_ANCHOR(recvbuf_t) handoff; /* for the main thread */
+	struct worker_stats stats;
+	struct recvbuf	rbuf;
+};
+
+static worker *		workers;
+static int		nworkers;
+static bool		threads_running;
+static volatile bool	stopping;
+static int		stop_fd = -1;	/* wakes the workers to exit */
+static int		handoff_fd = -1; /* wakes the main thread */
+
+static void	start_workers	(void);
+static void	stop_workers	(void);
+static void *	worker_main	(void *);
+static void	worker_input	(worker *, struct srvsock *);
+static bool	worker_reply	(worker *, struct srvsock *,
+				 struct recvbuf *);
+static void	worker_handoff	(worker *, const struct recvbuf *);
+static void	worker_collect	(worker *);
+static l_fp	worker_time	(void);
+
+
+/*
+ * server_threads_add - open the worker sockets for a new endpoint.
+ * Called from the main thread.
+ */
+void
+server_threads_add(
+	endpt *	ep
+	)
+{
+	struct srvsock *	ss;
+	struct epoll_event	ev;
+	worker *		w;
+	SOCKET			fd;
+	int			i;
+
+	if (server_threads <= 0 || (INT_WILDCARD & ep->flags)
+	    || INVALID_SOCKET == ep->fd)
+		return;
+	if (!threads_running)
+		start_workers();
+	if (!threads_running)
+		return;
+
+	for (i = 0; i < nworkers; i++) {
+		w = &workers[i];
+		fd = open_worker_socket(ep);
+		if (INVALID_SOCKET == fd) {
+			msyslog(LOG_ERR,
+				"threads: no worker socket for %s, %d of %d opened",
+				socktoa(&ep->sin), i, nworkers);
+			return;
+		}
+		ss = emalloc_zero(sizeof(*ss));
+		ss->ep = ep;
+		ss->fd = fd;
+		ss->w = w;
+
+		pthread_mutex_lock(&w->lock);
+		ZERO(ev);
+		ev.events = EPOLLIN;
+		ev.data.ptr = ss;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			pthread_mutex_unlock(&w->lock);
+			msyslog(LOG_ERR, "threads: epoll_ctl(%d) failed: %m",
+				fd);
+			close(fd);
+			free(ss);
+			return;
+		}
+		LINK_SLIST(w->socks, ss, wlink);
+		LINK_SLIST(ep->srvsocks, ss, link);
+		pthread_mutex_unlock(&w->lock);
+	}
+	DPRINTF(2, ("server_threads_add: %d sockets for %s\n",
+		    nworkers, socktoa(&ep->sin)));
+}
+
+
+/*
+ * server_threads_remove - close the worker sockets of an endpoint
+ * about to be closed, and forget whatever they queued.  The worker
+ * may still be holding an event for a socket, so it frees the
+ * srvsock itself once it is done with the batch.
+ */
+void
+server_threads_remove(
+	endpt *	ep
+	)
+{
+	struct srvsock *	ss;
+	struct srvsock *	unlinked;
+	recvbuf_t *		rb;
+	worker *		w;
+	int			n;
+
+	while (ep->srvsocks != NULL) {
+		UNLINK_HEAD_SLIST(ss, ep->srvsocks, link);
+		w = ss->w;
+		pthread_mutex_lock(&w->lock);
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, ss->fd, NULL);
+		close(ss->fd);
+		ss->fd = INVALID_SOCKET;
+		ep->received += ss->received;
+		ep->sent += ss->sent;
+		ep->notsent += ss->notsent;
+		packets_received += (u_long)ss->received;
+		packets_sent += (u_long)ss->sent;
+		packets_notsent += (u_long)ss->notsent;
+		ss->dead = true;
+		ss->ep = NULL;
+		UNLINK_SLIST(unlinked, w->socks, ss, wlink, struct srvsock);
+		LINK_SLIST(w->graveyard, ss, wlink);
+
+		/* go round the queue once, dropping what came for ep */
+		n = 0;
+		for (rb = HEAD_FIFO(w->handoff); rb != NULL; rb = rb->link)
+			n++;
+		while (n-- > 0) {
+			UNLINK_FIFO(rb, w->handoff, link);
+			if (rb->dstadr == ep)
+				freerecvbuf(rb);
+			else
+				LINK_FIFO(w->handoff, rb, link);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+
+/*
+ * server_threads_input - move what the workers queued onto the full
+ * list for receive().  Called by the main loop when handoff_fd is
+ * readable.
+ */
+void
+server_threads_input(void)
+{
+	eventfd_t	count;
+	recvbuf_t *	rb;
+	worker *	w;
+	int		i;
+
+	(void)eventfd_read(handoff_fd, &count);
+	for (i = 0; i < nworkers; i++) {
+		w = &workers[i];
+		pthread_mutex_lock(&w->lock);
+		for (;;) {
+			UNLINK_FIFO(rb, w->handoff, link);
+			if (NULL == rb)
+				break;
+			add_full_recv_buffer(rb);
+		}
+		worker_collect(w);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+
+/*
+ * server_threads_collect - add in the workers' counters.  Called
+ * once a second from timer().
+ */
+void
+server_threads_collect(void)
+{
+	worker *	w;
+	int		i;
+
+	for (i = 0; i < nworkers; i++) {
+		w = &workers[i];
+		pthread_mutex_lock(&w->lock);
+		worker_collect(w);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+
+/*
+ * worker_collect - add one worker's counters into the endpoints and
+ * the global statistics.  Called with the worker's lock held.
+ */
+static void
+worker_collect(
+	worker *	w
+	)
+{
+	struct worker_stats *	st = &w->stats;
+	struct srvsock *	ss;
+
+	for (ss = w->socks; ss != NULL; ss = ss->wlink) {
+		ss->ep->received += ss->received;
+		ss->ep->sent += ss->sent;
+		ss->ep->notsent += ss->notsent;
+		packets_received += (u_long)ss->received;
+		packets_sent += (u_long)ss->sent;
+		packets_notsent += (u_long)ss->notsent;
+		ss->received = ss->sent = ss->notsent = 0;
+	}
+	sys_received += st->received;
+	sys_restricted += st->restricted;
+	sys_limitrejected += st->limitrejected;
+	sys_kodsent += st->kodsent;
+	sys_newversion += st->newversion;
+	sys_oldversion += st->oldversion;
+	sys_badauth += st->badauth;
+	packets_ignored += st->ignored;
+	packets_dropped += st->dropped;
+	ZERO(*st);
+}
+
+
+static void
+start_workers(void)
+{
+	struct epoll_event	ev;
+	sigset_t		all;
+	sigset_t		saved;
+	int			i;
+	int			rc;
+
+	stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	handoff_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stop_fd < 0 || handoff_fd < 0) {
+		msyslog(LOG_ERR, "threads: eventfd failed: %m");
+		if (stop_fd >= 0)
+			close(stop_fd);
+		if (handoff_fd >= 0)
+			close(handoff_fd);
+		stop_fd = handoff_fd = -1;
+		server_threads = 0;
+		return;
+	}
+
+	workers = emalloc_zero(server_threads * sizeof(*workers));
+	for (i = 0; i < server_threads; i++) {
+		workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (workers[i].epfd < 0) {
+			msyslog(LOG_ERR, "threads: epoll_create1 failed: %m");
+			break;
+		}
+		ZERO(ev);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, stop_fd,
+			      &ev) < 0) {
+			msyslog(LOG_ERR, "threads: epoll_ctl(%d) failed: %m",
+				stop_fd);
+			close(workers[i].epfd);
+			break;
+		}
+		pthread_mutex_init(&workers[i].lock, NULL);
+	}
+	nworkers = i;
+
+	/* signals are for the main thread's pselect()/epoll_pwait() */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	for (i = 0; i < nworkers; i++) {
+		rc = pthread_create(&workers[i].tid, NULL, worker_main,
+				    &workers[i]);
+		if (rc != 0) {
+			msyslog(LOG_ERR, "threads: pthread_create: %s",
+				strerror(rc));
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	/* sockets past the last started worker would never be read */
+	for (rc = i; rc < nworkers; rc++)
+		close(workers[rc].epfd);
+	nworkers = i;
+	if (0 == nworkers) {
+		server_threads = 0;
+		return;
+	}
+
+	add_handoff_fd(handoff_fd);
+	threads_running = true;
+	atexit(&stop_workers);
+	msyslog(LOG_INFO, "threads: %d server threads running", nworkers);
+}
+
+
+/*
+ * stop_workers - tell the workers to finish and wait for them, on
+ * the way out.  exit() called on a worker gets no further than this.
+ */
+static void
+stop_workers(void)
+{
+	int	i;
+
+	if (!threads_running)
+		return;
+	for (i = 0; i < nworkers; i++)
+		if (pthread_equal(pthread_self(), workers[i].tid))
+			return;
+
+	stopping = true;
+	(void)eventfd_write(stop_fd, 1);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].tid, NULL);
+	threads_running = false;
+	DPRINTF(1, ("stop_workers: %d server threads joined\n", nworkers));
+}
+
+
+static void *
+worker_main(
+	void *	arg
+	)
+{
+	worker *		w = arg;
+	struct epoll_event	events[RECV_BATCH];
+	struct srvsock *	ss;
+	int			n;
+	int			i;
+
+	while (!stopping) {
+		n = epoll_wait(w->epfd, events, COUNTOF(events), -1);
+		for (i = 0; i < n && !stopping; i++)
+			if (events[i].data.ptr != NULL)
+				worker_input(w, events[i].data.ptr);
+
+		/* no event of this batch can point at these now */
+		pthread_mutex_lock(&w->lock);
+		while (w->graveyard != NULL) {
+			UNLINK_HEAD_SLIST(ss, w->graveyard, wlink);
+			free(ss);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * worker_input - read what is waiting on one socket and answer or
+ * queue each datagram.
+ */
+static void
+worker_input(
+	worker *		w,
+	struct srvsock *	ss
+	)
+{
+	struct recvbuf *	rb = &w->rbuf;
+	struct msghdr		msghdr;
+	struct iovec		iovec;
+	union {
+		struct cmsghdr	align;
+		char		buf[256];
+	}			control;
+	endpt *			ep;
+	ssize_t			buflen;
+	int			count;
+
+	pthread_mutex_lock(&w->lock);
+	if (ss->dead) {
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+	ep = ss->ep;
+
+	for (count = 0; count < RECV_BATCH; count++) {
+		ZERO(*rb);
+		iovec.iov_base = &rb->recv_space;
+		iovec.iov_len = sizeof(rb->recv_space);
+		ZERO(msghdr);
+		msghdr.msg_name = &rb->recv_srcadr;
+		msghdr.msg_namelen = sizeof(rb->recv_srcadr);
+		msghdr.msg_iov = &iovec;
+		msghdr.msg_iovlen = 1;
+		msghdr.msg_control = &control;
+		msghdr.msg_controllen = sizeof(control);
+		buflen = recvmsg(ss->fd, &msghdr, 0);
+		if (buflen < 0)
+			break;		/* EAGAIN */
+
+		/* the kernel's time stamp if it gave one */
+		rb->recv_time = fetch_packetstamp(rb, &msghdr, 0);
+		if (0 == rb->recv_time)
+			rb->recv_time = worker_time();
+		ss->received++;
+
+		if (ep->ignore_packets) {
+			w->stats.ignored++;
+			continue;
+		}
+		if (spoofed_loopback(ep, &rb->recv_srcadr)) {
+			w->stats.dropped++;
+			continue;
+		}
+
+		rb->recv_length = (size_t)buflen;
+		rb->dstadr = ep;
+		rb->fd = ep->fd;
+		rb->cast_flags = MDF_UCAST;
+		rb->receiver = receive;
+#ifdef REFCLOCK
+		rb->network_packet = true;
+#endif
+		DPRINTF(3, ("worker_input: fd=%d length %d from %s\n",
+			    ss->fd, (int)buflen, socktoa(&rb->recv_srcadr)));
+
+		if (!worker_reply(w, ss, rb))
+			worker_handoff(w, rb);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+/*
+ * worker_reply - deal with rb if it is a plain client request, the
+ * way receive() and fast_xmit() would.  Returns false if the main
+ * thread must have it.
+ */
+static bool
+worker_reply(
+	worker *		w,
+	struct srvsock *	ss,
+	struct recvbuf *	rb
+	)
+{
+	struct worker_stats *	st = &w->stats;
+	struct pkt		xpkt;
+	u_short			restrict_mask;
+	uint8_t			version;
+	ssize_t			cc;
+
+	version = PKT_VERSION(rb->recv_pkt.li_vn_mode);
+	if (LEN_PKT_NOMAC != rb->recv_length
+	    || MODE_CLIENT != PKT_MODE(rb->recv_pkt.li_vn_mode)
+	    || version < NTP_OLDVERSION || version > NTP_VERSION
+	    || (INT_MCASTOPEN & rb->dstadr->flags))
+		return false;
+
+	restrict_mask = restrictions(&rb->recv_srcadr);
+#ifdef ENABLE_MSSNTP
+	/* signing goes through ntp_signd, which is the main thread's */
+	if (RES_MSSNTP & restrict_mask)
+		return false;
+#endif
+	st->received++;
+
+	/* check_early_restrictions() for anything but a control packet */
+	if ((RES_IGNORE & restrict_mask)
+	    || ((RES_FLAKE & restrict_mask)
+		&& (double)ntp_random() / 0x7fffffff < .1)
+	    || (RES_DONTSERVE & restrict_mask)
+	    || ((RES_VERSION & restrict_mask) && NTP_VERSION != version)) {
+		st->restricted++;
+		return true;
+	}
+
+	restrict_mask = ntp_monitor(rb, restrict_mask);
+	if (RES_LIMITED & restrict_mask) {
+		st->limitrejected++;
+		if (!(RES_KOD & restrict_mask))
+			return true;
+	}
+
+	if (NTP_VERSION == version)
+		st->newversion++;
+	else
+		st->oldversion++;
+
+	/* no MAC, so it can't satisfy a "notrust" restriction */
+	if (RES_DONTTRUST & restrict_mask) {
+		st->badauth++;
+		return true;
+	}
+
+	if (RES_KOD & restrict_mask)
+		st->kodsent++;
+	build_reply(&xpkt, rb, MODE_SERVER, restrict_mask, worker_time());
+	cc = sendto(ss->fd, (char *)&xpkt, LEN_PKT_NOMAC, 0,
+		    &rb->recv_srcadr.sa, SOCKLEN(&rb->recv_srcadr));
+	if (LEN_PKT_NOMAC == cc)
+		ss->sent++;
+	else
+		ss->notsent++;
+	DPRINTF(2, ("worker_reply: fd=%d to %s %s\n", ss->fd,
+		    socktoa(&rb->recv_srcadr),
+		    (LEN_PKT_NOMAC == cc) ? "sent" : "not sent"));
+
+	return true;
+}
+
+
+/*
+ * worker_handoff - queue a copy of rb for the main thread, waking it
+ * if the queue was empty.
+ */
+static void
+worker_handoff(
+	worker *		w,
+	const struct recvbuf *	rb
+	)
+{
+	recvbuf_t *	nb;
+	bool		wake;
+
+	nb = get_free_recv_buffer();
+	if (NULL == nb) {
+		w->stats.dropped++;
+		return;
+	}
+	nb->recv_srcadr = rb->recv_srcadr;
+	nb->dstadr = rb->dstadr;
+	nb->fd = rb->fd;
+	nb->cast_flags = rb->cast_flags;
+	nb->recv_time = rb->recv_time;
+	nb->receiver = rb->receiver;
+	nb->recv_length = rb->recv_length;
+	memcpy(&nb->recv_space, &rb->recv_space, rb->recv_length);
+#ifdef REFCLOCK
+	nb->network_packet = rb->network_packet;
+#endif
+
+	wake = (NULL == HEAD_FIFO(w->handoff));
+	LINK_FIFO(w->handoff, nb, link);
+	if (wake)
+		(void)eventfd_write(handoff_fd, 1);
+}
+
+
+/*
+ * worker_time - the time now, fuzzed like get_systime() but without
+ * the state that keeps the main thread's readings in order
+ */
+static l_fp
+worker_time(void)
+{
+	struct timespec	ts;
+	l_fp		now;
+
+	get_ostime(&ts);
+	now = tspec_stamp_to_lfp(ts);
+	if (sys_fuzz > 0.0)
+		now += dtolfp(ntp_random() * 2. / FRAC * sys_fuzz);
+	return now;
+}
+
+#else	/* !USE_SERVER_THREADS follows */
+
+void
+server_threads_add(
+	endpt *	ep
+	)
+{
+	UNUSED_ARG(ep);
+}
+
+
+void
+server_threads_remove(
+	endpt *	ep
+	)
+{
+	UNUSED_ARG(ep);
+}
+
+
+void
+server_threads_input(void)
+{
+}
+
+
+void
+server_threads_collect(void)
+{
+}
+
+#endif	/* USE_SERVER_THREADS */
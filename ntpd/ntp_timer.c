@@ -8,6 +8,7 @@
 #include "ntp_stdlib.h"
 #include "ntp_calendar.h"
 #include "ntp_leapsec.h"
+#include "ntp_filegen.h"
 
 #include <stdio.h>
 #include <signal.h>
@@ -286,6 +287,9 @@ timer(void)
                 }
 	}
 
+	/* orphan mode, leap warnings and smearing all change replies */
+	publish_reply_template();
+
 	/*
 	 * Update huff-n'-puff filter.
 	 */
@@ -294,6 +298,22 @@ timer(void)
 		huffpuff();
 	}
 
+	/*
+	 * Drop restrict entries which have expired.
+	 */
+	restrict_expire();
+
+	/*
+	 * Add in what the server threads have counted.
+	 */
+	server_threads_collect();
+
+	/*
+	 * Hand statistics records which have waited long enough to
+	 * the writer.
+	 */
+	filegen_flush(false);
+
 	/*
 	 * Interface update timer
 	 */
@@ -62,6 +62,52 @@ static FILEGEN sysstats;
 static FILEGEN timingstats;
 static FILEGEN usestats;
 
+/*
+ * Layouts of the records which can be written in binary, in the same
+ * order as the text records. See ntp_filegen.h.
+ */
+static const struct filegen_field peerstats_layout[] = {
+	{ "day",	'I',	4,	"%lu" },
+	{ "time",	'd',	8,	"%.3f" },
+	{ "addr",	'A',	16,	"%s" },
+	{ "status",	'I',	4,	"%x" },
+	{ "offset",	'd',	8,	"%.9f" },
+	{ "delay",	'd',	8,	"%.9f" },
+	{ "disp",	'd',	8,	"%.9f" },
+	{ "jitter",	'd',	8,	"%.9f" },
+};
+
+static const struct filegen_field loopstats_layout[] = {
+	{ "day",	'I',	4,	"%lu" },
+	{ "time",	'd',	8,	"%.3f" },
+	{ "offset",	'd',	8,	"%.9f" },
+	{ "freq",	'd',	8,	"%.6f" },
+	{ "jitter",	'd',	8,	"%.9f" },
+	{ "wander",	'd',	8,	"%.6f" },
+	{ "poll",	'i',	4,	"%d" },
+};
+
+static const struct filegen_field rawstats_layout[] = {
+	{ "day",	'I',	4,	"%lu" },
+	{ "time",	'd',	8,	"%.3f" },
+	{ "srcadr",	'A',	16,	"%s" },
+	{ "dstadr",	'A',	16,	"%s" },
+	{ "t1",		'Q',	8,	"%.9f" },
+	{ "t2",		'Q',	8,	"%.9f" },
+	{ "t3",		'Q',	8,	"%.9f" },
+	{ "t4",		'Q',	8,	"%.9f" },
+	{ "leap",	'i',	4,	"%d" },
+	{ "version",	'i',	4,	"%d" },
+	{ "mode",	'i',	4,	"%d" },
+	{ "stratum",	'i',	4,	"%d" },
+	{ "ppoll",	'i',	4,	"%d" },
+	{ "precision",	'i',	4,	"%d" },
+	{ "rootdelay",	'd',	8,	"%.6f" },
+	{ "rootdisp",	'd',	8,	"%.6f" },
+	{ "refid",	's',	16,	"%s" },
+	{ "outcount",	'I',	4,	"%d" },
+};
+
 /*
  * This controls whether stats are written to the fileset. Provided
  * so that ntpq can turn off stats when the file system fills up. 
@@ -84,6 +130,7 @@ static  void	check_leap_expiration(int, uint32_t, const time_t*);
 /* 
  * Prototypes
  */
+static	void	flush_stats(void);
 #ifdef DEBUG
 void	uninit_util(void);
 #endif
@@ -115,6 +162,17 @@ uninit_util(void)
 #endif /* DEBUG */
 
 
+/*
+ * flush_stats - write out buffered statistics records on the way out,
+ * whichever exit() path is taken
+ */
+static void
+flush_stats(void)
+{
+	filegen_flush(true);
+}
+
+
 /*
  * init_util - initialize the util module of ntpd
  */
@@ -129,6 +187,12 @@ init_util(void)
 	filegen_register(statsdir, "protostats",  &protostats);
 	filegen_register(statsdir, "timingstats", &timingstats);
 	filegen_register(statsdir, "usestats",	  &usestats);
+	filegen_layout(&peerstats, peerstats_layout,
+		       (int)COUNTOF(peerstats_layout));
+	filegen_layout(&loopstats, loopstats_layout,
+		       (int)COUNTOF(loopstats_layout));
+	filegen_layout(&rawstats, rawstats_layout,
+		       (int)COUNTOF(rawstats_layout));
 
 	/*
 	 * register with libntp ntp_set_tod() to call us back
@@ -138,6 +202,8 @@ init_util(void)
 #ifdef DEBUG
 	atexit(&uninit_util);
 #endif /* DEBUG */
+	/* registered last so it runs before uninit_util() */
+	atexit(&flush_stats);
 }
 
 
@@ -374,15 +440,18 @@ record_peer_stats(
 		return;
 
 	get_systime(&now);
-	filegen_setup(&peerstats, lfpuint(now));
+	filegen_start(&peerstats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
-	if (peerstats.fp != NULL) {
-		fprintf(peerstats.fp,
+	if (peerstats.flag & FGEN_FLAG_BINARY) {
+		filegen_pack(&peerstats, (u_int)day, lfptod(now),
+		    &peer->srcadr, (u_int)status, peer->offset, peer->delay,
+		    peer->disp, peer->jitter);
+	} else if (peerstats.fp != NULL) {
+		filegen_printf(&peerstats,
 		    "%lu %s %s %x %.9f %.9f %.9f %.9f\n", day,
 		    ulfptoa(now, 3), socktoa(&peer->srcadr), status, peer->offset,
 		    peer->delay, peer->disp, peer->jitter);
-		fflush(peerstats.fp);
 	}
 }
 
@@ -425,14 +494,16 @@ record_loop_stats(
 		return;
 
 	get_systime(&now);
-	filegen_setup(&loopstats, lfpuint(now));
+	filegen_start(&loopstats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
-	if (loopstats.fp != NULL) {
-		fprintf(loopstats.fp, "%lu %s %.9f %.6f %.9f %.6f %d\n",
+	if (loopstats.flag & FGEN_FLAG_BINARY) {
+		filegen_pack(&loopstats, (u_int)day, lfptod(now), offset,
+		    freq * 1e6, jitter, wander * 1e6, spoll);
+	} else if (loopstats.fp != NULL) {
+		filegen_printf(&loopstats, "%lu %s %.9f %.6f %.9f %.6f %d\n",
 		    day, ulfptoa(now, 3), offset, freq * 1e6, jitter,
 		    wander * 1e6, spoll);
-		fflush(loopstats.fp);
 	}
 }
 
@@ -459,13 +530,12 @@ record_clock_stats(
 		return;
 
 	get_systime(&now);
-	filegen_setup(&clockstats, lfpuint(now));
+	filegen_start(&clockstats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
 	if (clockstats.fp != NULL) {
-		fprintf(clockstats.fp, "%lu %s %s %s\n", day,
+		filegen_printf(&clockstats, "%lu %s %s %s\n", day,
 		    ulfptoa(now, 3), peerlabel(peer), text);
-		fflush(clockstats.fp);
 	}
 }
 
@@ -532,11 +602,16 @@ record_raw_stats(
 		return;
 
 	get_systime(&now);
-	filegen_setup(&rawstats, lfpuint(now));
+	filegen_start(&rawstats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
-	if (rawstats.fp != NULL) {
-		fprintf(rawstats.fp, "%lu %s %s %s %s %s %s %s %d %d %d %d %d %d %.6f %.6f %s %d\n",
+	if (rawstats.flag & FGEN_FLAG_BINARY) {
+		filegen_pack(&rawstats, (u_int)day, lfptod(now), srcadr,
+		    dstadr, *t1, *t2, *t3, *t4, leap, version, mode, stratum,
+		    ppoll, precision, root_delay, root_dispersion,
+		    refid_str(refid, stratum), outcount);
+	} else if (rawstats.fp != NULL) {
+		filegen_printf(&rawstats, "%lu %s %s %s %s %s %s %s %d %d %d %d %d %d %.6f %.6f %s %d\n",
 		    day, ulfptoa(now, 3),
 		    socktoa(srcadr), dstadr ?  socktoa(dstadr) : "-",
 		    ulfptoa(*t1, 9), ulfptoa(*t2, 9),
@@ -544,7 +619,6 @@ record_raw_stats(
 		    leap, version, mode, stratum, ppoll, precision,
 		    root_delay, root_dispersion, refid_str(refid, stratum),
 		    outcount);
-		fflush(rawstats.fp);
 	}
 }
 
@@ -577,18 +651,17 @@ record_sys_stats(void)
 		return;
 
 	get_systime(&now);
-	filegen_setup(&sysstats, lfpuint(now));
+	filegen_start(&sysstats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
 	if (sysstats.fp != NULL) {
-		fprintf(sysstats.fp,
+		filegen_printf(&sysstats,
 		    "%lu %s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n",
 		    day, ulfptoa(now, 3), current_time - sys_stattime,
 		    sys_received, sys_processed, sys_newversion,
 		    sys_oldversion, sys_restricted, sys_badlength,
 		    sys_badauth, sys_declined, sys_limitrejected,
 		    sys_kodsent);
-		fflush(sysstats.fp);
 		proto_clr_stats();
 	}
 }
@@ -616,7 +689,7 @@ void record_use_stats(void)
 		return;
 
 	get_systime(&now);
-	filegen_setup(&usestats, lfpuint(now));
+	filegen_start(&usestats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
 	if (usestats.fp != NULL) {
@@ -628,7 +701,7 @@ void record_use_stats(void)
 		stime =  usage.ru_stime.tv_usec - oldusage.ru_stime.tv_usec;
 		stime /= 1E6;
 		stime += usage.ru_stime.tv_sec -  oldusage.ru_stime.tv_sec;
-		fprintf(usestats.fp,
+		filegen_printf(&usestats,
 		    "%lu %s %lu %.3f %.3f %lu %lu %lu %lu %lu %lu %lu %lu %lu\n",
 		    day, ulfptoa(now, 3), current_time - use_stattime,
 		    utime, stime,
@@ -641,7 +714,6 @@ void record_use_stats(void)
 		    usage.ru_nivcsw -   oldusage.ru_nivcsw,
 		    usage.ru_nsignals - oldusage.ru_nsignals,
 		    usage.ru_maxrss );
-		fflush(usestats.fp);
 		oldusage = usage;
 		use_stattime = current_time;
 	}
@@ -669,13 +741,12 @@ record_proto_stats(
 		return;
 
 	get_systime(&now);
-	filegen_setup(&protostats, lfpuint(now));
+	filegen_start(&protostats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
 	if (protostats.fp != NULL) {
-		fprintf(protostats.fp, "%lu %s %s\n", day,
+		filegen_printf(&protostats, "%lu %s %s\n", day,
 		    ulfptoa(now, 3), str);
-		fflush(protostats.fp);
 	}
 }
 
@@ -693,7 +764,6 @@ record_timing_stats(
 	const char *text	/* text message */
 	)
 {
-	static unsigned int flshcnt;
 	l_fp	now;
 	u_long	day;
 
@@ -701,14 +771,12 @@ record_timing_stats(
 		return;
 
 	get_systime(&now);
-	filegen_setup(&timingstats, lfpuint(now));
+	filegen_start(&timingstats, lfpuint(now));
 	day = lfpuint(now) / 86400 + MJD_1900;
 	setlfpuint(now, lfpuint(now) % 86400);
 	if (timingstats.fp != NULL) {
-		fprintf(timingstats.fp, "%lu %s %s\n", day, lfptoa(now,
+		filegen_printf(&timingstats, "%lu %s %s\n", day, lfptoa(now,
 		    3), text);
-		if (++flshcnt % 100 == 0)
-			fflush(timingstats.fp);
 	}
 }
 #endif
@@ -11,6 +11,7 @@
 #include "ntp_random.h"
 
 #include "ntp_config.h"
+#include "ntp_filegen.h"
 #include "ntp_syslog.h"
 #include "ntp_assert.h"
 #include "isc/error.h"
@@ -882,6 +883,7 @@ static void mainloop(void)
 
 				if (sawALRM) {
 					/* avoid timer starvation during lengthy I/O handling */
+					flush_xmit_queue();
 					timer();
 					sawALRM = false;
 				}
@@ -908,6 +910,8 @@ static void mainloop(void)
 				freerecvbuf(rbuf);
 				rbuf = get_full_recv_buffer();
 			}
+			/* replies queued by fast_xmit() go out in bulk */
+			flush_xmit_queue();
 # ifdef ENABLE_DEBUG_TIMING
 			get_systime(&tsb);
 			tsb -= tsa;
@@ -983,6 +987,7 @@ finish_safe(
 		DNSServiceRefDeallocate(mdns);
 # endif
 	peer_cleanup();
+	filegen_flush(true);
 	exit(0);
 }
 
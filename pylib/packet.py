@@ -180,6 +180,8 @@ A Mode 6 packet cannot have extension fields.
 """
 # SPDX-License-Identifier: BSD-2-clause
 from __future__ import print_function, division
+import binascii
+import collections
 import getpass
 import hashlib
 import select
@@ -324,6 +326,9 @@ MAXFRAGS = 32
 # "mrulist", so the cumulative timeouts are even longer for those.
 DEFTIMEOUT = 5000
 DEFSTIMEOUT = 3000
+# A request on a reused MRU nonce is tried once only, and briefly: ntpd
+# drops it without a word once the nonce has gone stale.
+REUSETIMEOUT = 1000
 
 
 class Packet:
@@ -680,6 +685,7 @@ SERR_STALL = "***No response, probably high-traffic server with low MRU limit"
 SERR_BADTAG = "***Bad MRU tag %s"
 SERR_BADSORT = "***Sort order %s is not implemented"
 SERR_NOTRUST = "***No trusted keys have been declared"
+SERR_BADRECORD = "***Malformed binary record in response"
 
 
 def dump_hex_printable(xdata, outfp=sys.stdout):
@@ -717,6 +723,7 @@ class MRUEntry:
         self.ct = 0             # count of packets received
         self.mv = None          # mode and version
         self.rs = None          # restriction mask (RES_* bits)
+        self.seq = None         # sequence number, when paging by cursor
 
     def avgint(self):
         last = ntp.ntpc.lfptofloat(self.last)
@@ -751,6 +758,7 @@ class MRUList:
     def __init__(self):
         self.entries = []       # A list of MRUEntry objects
         self.now = None         # server timestamp marking end of operation
+        self.cursor = None      # where to resume, if ntpd pages by cursor
 
     def is_complete(self):
         "Is the server done shipping entries for this span?"
@@ -770,6 +778,86 @@ class ControlException(BaseException):
         return self.message
 
 
+# Names for the restriction bits of a binary reslist record, in the
+# order ntpd's res_match_flags() and res_access_flags() give them.
+RES_MATCH_NAMES = (
+    (ntp.magic.RESM_NTPONLY, "ntpport"),
+    (ntp.magic.RESM_INTERFACE, "interface"),
+    (ntp.magic.RESM_SOURCE, "source"),
+)
+RES_ACCESS_NAMES = (
+    (ntp.magic.RES_IGNORE, "ignore"),
+    (ntp.magic.RES_DONTSERVE, "noserve"),
+    (ntp.magic.RES_DONTTRUST, "notrust"),
+    (ntp.magic.RES_NOQUERY, "noquery"),
+    (ntp.magic.RES_NOMODIFY, "nomodify"),
+    (ntp.magic.RES_NOPEER, "nopeer"),
+    (ntp.magic.RES_LIMITED, "limited"),
+    (ntp.magic.RES_VERSION, "version"),
+    (ntp.magic.RES_KOD, "kod"),
+    (ntp.magic.RES_FLAKE, "flake"),
+)
+
+
+def bin_records(data):
+    "Split a binary bulk response into (type, record) pairs."
+    data = polybytes(data)
+    offset = 0
+    while offset < len(data):
+        if offset + 2 > len(data):
+            raise ControlException(SERR_BADRECORD)
+        (rtype, rlen) = struct.unpack_from("!BB", data, offset)
+        if rlen < 2 or offset + rlen > len(data):
+            raise ControlException(SERR_BADRECORD)
+        yield (rtype, data[offset:offset + rlen])
+        offset += rlen
+
+
+def bin_address(rec, offset):
+    "Decode an address in a binary record as (host, port, next offset)."
+    try:
+        family = polyord(rec[offset])
+        if family == 0:
+            return ("", None, offset + 1)
+        (port,) = struct.unpack_from("!H", rec, offset + 1)
+        if family == 4:
+            host = socket.inet_ntop(socket.AF_INET, rec[offset+3:offset+7])
+            return (host, port, offset + 7)
+        if family == 6:
+            host = socket.inet_ntop(socket.AF_INET6,
+                                    rec[offset+3:offset+19])
+            (scope,) = struct.unpack_from("!I", rec, offset + 19)
+            if scope and '%' not in host:
+                host += "%%%d" % scope
+            return (host, port, offset + 23)
+    except (IndexError, ValueError, struct.error, socket.error):
+        pass
+    raise ControlException(SERR_BADRECORD)
+
+
+def bin_hostport(host, port):
+    "Format a decoded address the way ntpd's sockporttoa() does."
+    if not host:
+        return ""
+    if ':' in host:
+        return "[%s]:%d" % (host, port)
+    return "%s:%d" % (host, port)
+
+
+def bin_lfp(rec, offset):
+    "Format a binary l_fp the way ntpd's ctl_putts() does."
+    return "0x%08x.%08x" % struct.unpack_from("!II", rec, offset)
+
+
+def bin_resflags(mflags, flags):
+    "Name restriction bits the way ntpd's reslist varlist does."
+    match = " ".join([name for (bit, name) in RES_MATCH_NAMES
+                      if mflags & bit])
+    access = " ".join([name for (bit, name) in RES_ACCESS_NAMES
+                       if flags & bit])
+    return " ".join([words for words in (match, access) if words])
+
+
 class ControlSession:
     "A session to a host"
     MRU_ROW_LIMIT = 256
@@ -802,10 +890,17 @@ class ControlSession:
         self.port = 0
         self.sequence = 0
         self.response = ""
+        self.__fragments = []
+        self.__seenlastfrag = False
         self.rstatus = 0
         self.ntpd_row_limit = ControlSession.MRU_ROW_LIMIT
+        self.bin_bulk = True    # ask for binary MRU, ifstats and reslist
         self.logfp = sys.stdout
         self.nonce_xmit = 0
+        self.mru_nonce = None   # (nonce, when) from the last MRU response
+        self.requests = 0       # traffic so far, for monitors to report
+        self.octets_sent = 0
+        self.octets_received = 0
 
     def close(self):
         if self.sock:
@@ -936,6 +1031,8 @@ class ControlSession:
             # On failure, we don't know how much data was actually received
             self.logfp.write("Write to %s failed\n" % self.hostname)
             return -1
+        self.requests += 1
+        self.octets_sent += len(xdata)
         if self.debug >= 5:
             self.logfp.write("Request packet:\n")
             dump_hex_printable(xdata, self.logfp)
@@ -998,16 +1095,13 @@ class ControlSession:
         # each packet and collect it in one long block.  When the last
         # packet in the sequence is received we'll know how much data we
         # should have had.  Note we use one long time out, should reconsider.
-        fragments = []
-        self.response = ''
-        seenlastfrag = False
+        self.beginresponse()
         bail = 0
         warn = self.logfp.write
 
         if self.debug:
             warn("Fragment collection begins\n")
-        # Loop until we have an error or a complete response.  Nearly all
-        # code paths to loop again use continue.
+        # Loop until we have an error or a complete response.
         while True:
             # Discarding various invalid packets can cause us to
             #  loop more than MAXFRAGS times, but enforce a sane bound
@@ -1016,7 +1110,7 @@ class ControlSession:
             if bail >= (2*MAXFRAGS):
                 raise ControlException(SERR_TOOMUCH)
 
-            if len(fragments) == 0:
+            if len(self.__fragments) == 0:
                 tvo = self.primary_timeout / 1000
             else:
                 tvo = self.secondary_timeout / 1000
@@ -1034,179 +1128,199 @@ class ControlSession:
 
             if not rd:
                 # Timed out.  Return what we have
-                if len(fragments) == 0:
+                if len(self.__fragments) == 0:
                     if timeo:
                         raise ControlException(SERR_TIMEOUT)
                 if timeo:
                     if self.debug:
                         self.logfp.write(
                             "ERR_INCOMPLETE: Received fragments:\n")
-                        for (i, frag) in enumerate(fragments):
+                        for (i, frag) in enumerate(self.__fragments):
                             self.logfp.write("%d: %s" % (i+1, frag.stats(i)))
                         self.logfp.write("last fragment %sreceived\n"
-                                         % ("not ", "")[seenlastfrag])
+                                         % ("not ", "")[self.__seenlastfrag])
                 raise ControlException(SERR_INCOMPLETE)
 
             if self.debug > 3:
                 warn("At %s, socket read begins\n" % time.asctime())
-            rawdata = polybytes(self.sock.recv(4096))
-            if self.debug >= 3:
-                warn("Received %d octets\n" % len(rawdata))
-            rpkt = ControlPacket(self)
-            try:
-                rpkt.analyze(rawdata)
-            except struct.error:
-                raise ControlException(SERR_UNSPEC)
-
-            if ((rpkt.version() > ntp.magic.NTP_VERSION
-                 or rpkt.version() < ntp.magic.NTP_OLDVERSION)):
-                if self.debug:
-                    warn("Fragment received with version %d\n"
-                         % rpkt.version())
-                continue
-            if rpkt.mode() != ntp.magic.MODE_CONTROL:
-                if self.debug:
-                    warn("Fragment received with mode %d\n" % rpkt.mode())
-                continue
-            if not rpkt.is_response():
-                if self.debug:
-                    warn("Received request, wanted response\n")
-                # continue
+            if self.takefragment(self.sock.recv(4096), opcode, associd):
+                return None
 
-            # Check opcode and sequence number for a match.
-            # Could be old data getting to us.
-            if rpkt.sequence != self.sequence:
-                if self.debug:
-                    warn("Received sequence number %d, wanted %d\n" %
-                         (rpkt.sequence, self.sequence))
-                    continue
-            if rpkt.opcode() != opcode:
-                if self.debug:
-                    warn("Received opcode %d, wanted %d\n" %
-                         (rpkt.opcode(), opcode))
-                    continue
-
-            # Check the error code.  If non-zero, return it.
-            if rpkt.is_error():
-                if rpkt.more():
-                    warn("Error %d received on non-final fragment\n"
-                         % rpkt.errcode())
-                self.keyid = self.passwd = None
-                raise ControlException(
-                    SERR_SERVER
-                    % ControlSession.server_errors[rpkt.errcode()],
-                    rpkt.errcode())
-
-            # Check the association ID to make sure it matches what we expect
-            if rpkt.associd != associd:
-                warn("Association ID %d doesn't match expected %d\n"
-                     % (rpkt.associd, associd))
-
-            # validate received payload size is padded to next 32-bit
-            # boundary and no smaller than claimed by rpkt.count
-            if len(rawdata) & 0x3:
-                warn("Response fragment not padded, size = %d\n"
-                     % len(rawdata))
-                continue
-
-            shouldbesize = (ControlPacket.HEADER_LEN + rpkt.count + 3) & ~3
-            if len(rawdata) < shouldbesize:
-                warn("Response fragment claims %u octets payload, "
-                     "above %d received\n"
-                     % (rpkt.count, len(rawdata) - ControlPacket.HEADER_LEN))
-                raise ControlException(SERR_INCOMPLETE)
+    def beginresponse(self):
+        "Forget any partial response, ready to collect a new one."
+        self.response = ''
+        self.__fragments = []
+        self.__seenlastfrag = False
+
+    def hasfragments(self):
+        "Has any part of the response being collected arrived?"
+        return len(self.__fragments) > 0
+
+    def takefragment(self, rawdata, opcode, associd):
+        """Add one received datagram to the response being collected.
+Return True once the response is complete, in self.response; raise
+ControlException if the server reported an error."""
+        fragments = self.__fragments
+        warn = self.logfp.write
+        rawdata = polybytes(rawdata)
+        self.octets_received += len(rawdata)
+        if self.debug >= 3:
+            warn("Received %d octets\n" % len(rawdata))
+        rpkt = ControlPacket(self)
+        try:
+            rpkt.analyze(rawdata)
+        except struct.error:
+            raise ControlException(SERR_UNSPEC)
+
+        if ((rpkt.version() > ntp.magic.NTP_VERSION
+             or rpkt.version() < ntp.magic.NTP_OLDVERSION)):
+            if self.debug:
+                warn("Fragment received with version %d\n"
+                     % rpkt.version())
+            return False
+        if rpkt.mode() != ntp.magic.MODE_CONTROL:
+            if self.debug:
+                warn("Fragment received with mode %d\n" % rpkt.mode())
+            return False
+        if not rpkt.is_response():
+            if self.debug:
+                warn("Received request, wanted response\n")
+            # return False
+
+        # Check opcode and sequence number for a match.
+        # Could be old data getting to us.
+        if rpkt.sequence != self.sequence:
+            if self.debug:
+                warn("Received sequence number %d, wanted %d\n" %
+                     (rpkt.sequence, self.sequence))
+            return False
+        if rpkt.opcode() != opcode:
+            if self.debug:
+                warn("Received opcode %d, wanted %d\n" %
+                     (rpkt.opcode(), opcode))
+            return False
 
-            if rpkt.count > (len(rawdata) - ControlPacket.HEADER_LEN):
-                    warn("Received count of %u octets, data in "
-                         " fragment is %ld\n"
-                         % (rpkt.count,
-                            len(rawdata) - ControlPacket.HEADER_LEN))
-                    continue
+        # Check the error code.  If non-zero, return it.
+        if rpkt.is_error():
+            if rpkt.more():
+                warn("Error %d received on non-final fragment\n"
+                     % rpkt.errcode())
+            self.keyid = self.passwd = None
+            raise ControlException(
+                SERR_SERVER
+                % ControlSession.server_errors[rpkt.errcode()],
+                rpkt.errcode())
+
+        # Check the association ID to make sure it matches what we expect
+        if rpkt.associd != associd:
+            warn("Association ID %d doesn't match expected %d\n"
+                 % (rpkt.associd, associd))
+
+        # validate received payload size is padded to next 32-bit
+        # boundary and no smaller than claimed by rpkt.count
+        if len(rawdata) & 0x3:
+            warn("Response fragment not padded, size = %d\n"
+                 % len(rawdata))
+            return False
 
-            # Someday, perhaps, check authentication here
+        shouldbesize = (ControlPacket.HEADER_LEN + rpkt.count + 3) & ~3
+        if len(rawdata) < shouldbesize:
+            warn("Response fragment claims %u octets payload, "
+                 "above %d received\n"
+                 % (rpkt.count, len(rawdata) - ControlPacket.HEADER_LEN))
+            raise ControlException(SERR_INCOMPLETE)
 
-            # Clip off the MAC, if any
-            rpkt.data = rpkt.data[:rpkt.count]
+        if rpkt.count > (len(rawdata) - ControlPacket.HEADER_LEN):
+                warn("Received count of %u octets, data in "
+                     " fragment is %ld\n"
+                     % (rpkt.count,
+                        len(rawdata) - ControlPacket.HEADER_LEN))
+                return False
 
-            if rpkt.count == 0 and rpkt.more():
-                warn("Received count of 0 in non-final fragment\n")
-                continue
+        # Someday, perhaps, check authentication here
 
-            if seenlastfrag and rpkt.more():
-                warn("Received second last fragment\n")
-                continue
+        # Clip off the MAC, if any
+        rpkt.data = rpkt.data[:rpkt.count]
 
-            # Find the most recent fragment with a
-            not_earlier = [frag for frag in fragments
-                           if frag.offset >= rpkt.offset]
-            if len(not_earlier):
-                not_earlier = not_earlier[0]
-                if not_earlier.offset == rpkt.offset:
-                    warn("duplicate %d octets at %d ignored, prior "
-                         " %d at %d\n"
-                         % (rpkt.count, rpkt.offset,
-                            not_earlier.count, not_earlier.offset))
-                    continue
+        if rpkt.count == 0 and rpkt.more():
+            warn("Received count of 0 in non-final fragment\n")
+            return False
 
-            if len(fragments) > 0:
-                last = fragments[-1]
-                if last.end() > rpkt.offset:
-                    warn("received frag at %d overlaps with %d octet "
-                         "frag at %d\n"
-                         % (rpkt.offset, last.count, last.offset))
-                    continue
+        if self.__seenlastfrag and not rpkt.more():
+            warn("Received second last fragment\n")
+            return False
 
-            if not_earlier and rpkt.end() > not_earlier.offset:
-                warn("received %d octet frag at %d overlaps with "
+        # Find the most recent fragment with a
+        not_earlier = [frag for frag in fragments
+                       if frag.offset >= rpkt.offset]
+        if len(not_earlier):
+            not_earlier = not_earlier[0]
+            if not_earlier.offset == rpkt.offset:
+                warn("duplicate %d octets at %d ignored, prior "
+                     " %d at %d\n"
+                     % (rpkt.count, rpkt.offset,
+                        not_earlier.count, not_earlier.offset))
+                return False
+
+        earlier = [frag for frag in fragments if frag.offset < rpkt.offset]
+        if len(earlier) > 0:
+            last = earlier[-1]
+            if last.end() > rpkt.offset:
+                warn("received frag at %d overlaps with %d octet "
                      "frag at %d\n"
-                     % (rpkt.count, rpkt.offset, not_earlier.offset))
-                continue
+                     % (rpkt.offset, last.count, last.offset))
+                return False
 
-            if self.debug > 2:
-                warn("Recording fragment %d, size = %d offset = %d, "
-                     " end = %d, more=%s\n"
-                     % (len(fragments)+1, rpkt.count,
-                        rpkt.offset, rpkt.end(), rpkt.more()))
-
-            # Passed all tests, insert it into the frag list.
-            fragments.append(rpkt)
-            fragments.sort(key=lambda frag: frag.offset)
-
-            # Figure out if this was the last.
-            # Record status info out of the last packet.
-            if not rpkt.more():
-                seenlastfrag = True
-                self.rstatus = rpkt.status
-
-            # If we've seen the last fragment, look for holes in the sequence.
-            # If there aren't any, we're done.
-            if seenlastfrag and fragments[0].offset == 0:
-                for f in range(1, len(fragments)):
-                    if fragments[f-1].end() != fragments[f].offset:
-                        if self.debug:
-                            warn("Hole in fragment sequence, %d of %d\n"
-                                 % (f, len(fragments)))
-                        break
-                else:
-                    self.response = polybytes(
-                        "".join([polystr(frag.data) for frag in fragments]))
+        if not_earlier and rpkt.end() > not_earlier.offset:
+            warn("received %d octet frag at %d overlaps with "
+                 "frag at %d\n"
+                 % (rpkt.count, rpkt.offset, not_earlier.offset))
+            return False
+
+        if self.debug > 2:
+            warn("Recording fragment %d, size = %d offset = %d, "
+                 " end = %d, more=%s\n"
+                 % (len(fragments)+1, rpkt.count,
+                    rpkt.offset, rpkt.end(), rpkt.more()))
+
+        # Passed all tests, insert it into the frag list.
+        fragments.append(rpkt)
+        fragments.sort(key=lambda frag: frag.offset)
+
+        # Figure out if this was the last.
+        # Record status info out of the last packet.
+        if not rpkt.more():
+            self.__seenlastfrag = True
+            self.rstatus = rpkt.status
+
+        # If we've seen the last fragment, look for holes in the sequence.
+        # If there aren't any, we're done.
+        if self.__seenlastfrag and fragments[0].offset == 0:
+            for f in range(1, len(fragments)):
+                if fragments[f-1].end() != fragments[f].offset:
                     if self.debug:
-                        warn("Fragment collection ends. %d bytes "
-                             " in %d fragments\n"
-                             % (len(self.response), len(fragments)))
-                    if self.debug >= 5:
-                        warn("Response packet:\n")
-                        dump_hex_printable(self.response, self.logfp)
-                    elif self.debug >= 3:
-                        # FIXME: Garbage when retrieving assoc list (binary)
-                        warn("Response packet:\n%s\n" % self.response)
-                    elif self.debug >= 2:
-                        # FIXME: Garbage when retrieving assoc list (binary)
-                        eol = self.response.find("\n")
-                        firstline = self.response[:eol]
-                        warn("First line:\n%s\n" % firstline)
-                    return None
-                break
+                        warn("Hole in fragment sequence, %d of %d\n"
+                             % (f, len(fragments)))
+                    return False
+            self.response = polybytes(
+                "".join([polystr(frag.data) for frag in fragments]))
+            if self.debug:
+                warn("Fragment collection ends. %d bytes "
+                     " in %d fragments\n"
+                     % (len(self.response), len(fragments)))
+            if self.debug >= 5:
+                warn("Response packet:\n")
+                dump_hex_printable(self.response, self.logfp)
+            elif self.debug >= 3:
+                # FIXME: Garbage when retrieving assoc list (binary)
+                warn("Response packet:\n%s\n" % self.response)
+            elif self.debug >= 2:
+                # FIXME: Garbage when retrieving assoc list (binary)
+                eol = self.response.find("\n")
+                firstline = self.response[:eol]
+                warn("First line:\n%s\n" % firstline)
+            return True
+        return False
 
     def doquery(self, opcode, associd=0, qdata="", auth=False):
         "send a request and save the response"
@@ -1229,21 +1343,38 @@ class ControlSession:
         # Return data on success
         return res
 
+    def tryquery(self, opcode, associd=0, qdata="", timeout=REUSETIMEOUT):
+        "Send a request once, waiting at most timeout ms for the response."
+        if not self.havehost():
+            raise ControlException(SERR_NOHOST)
+        saved = self.primary_timeout
+        self.primary_timeout = min(saved, timeout)
+        try:
+            self.sendrequest(opcode, associd, qdata)
+            return self.getresponse(opcode, associd, False)
+        finally:
+            self.primary_timeout = saved
+
     def readstat(self, associd=0):
         "Read peer status, or throw an exception."
         self.doquery(opcode=ntp.control.CTL_OP_READSTAT, associd=associd)
+        if associd != 0:
+            return []
+        return self.parse_assoclist()
+
+    def parse_assoclist(self):
+        "Parse a READSTAT response into Peers, or throw an exception."
         if len(self.response) % 4:
             raise ControlException(SERR_BADLENGTH)
         idlist = []
-        if associd == 0:
-            for i in range(len(self.response)//4):
-                data = self.response[4*i:4*i+4]
-                (associd, status) = struct.unpack("!HH", data)
-                idlist.append(Peer(self, associd, status))
+        for i in range(len(self.response)//4):
+            data = self.response[4*i:4*i+4]
+            (associd, status) = struct.unpack("!HH", data)
+            idlist.append(Peer(self, associd, status))
         idlist.sort(key=lambda a: a.associd)
         return idlist
 
-    def __parse_varlist(self):
+    def parse_varlist(self):
         "Parse a response as a textual varlist."
         # Strip out NULs and binary garbage from text;
         # ntpd seems prone to generate these, especially
@@ -1287,6 +1418,68 @@ class ControlSession:
                     items.append((pair, ""))
         return ntp.util.OrderedDict(items)
 
+    def __parse_mru_records(self):
+        "Parse a binary READ_MRU response into the varlist it stands for."
+        items = []
+        idx = 0
+        try:
+            for (rtype, rec) in bin_records(self.response):
+                if rtype == ntp.control.CTL_BIN_NONCE:
+                    items.append(("nonce", polystr(rec[2:])))
+                elif rtype == ntp.control.CTL_BIN_MRU:
+                    (mv, rs, ct, seq) = struct.unpack_from("!BHIQ", rec, 2)
+                    (host, port, _) = bin_address(rec, 33)
+                    items += [("addr.%d" % idx, bin_hostport(host, port)),
+                              ("last.%d" % idx, bin_lfp(rec, 17)),
+                              ("first.%d" % idx, bin_lfp(rec, 25)),
+                              ("ct.%d" % idx, ct),
+                              ("mv.%d" % idx, mv),
+                              ("rs.%d" % idx, rs),
+                              ("seq.%d" % idx, seq)]
+                    idx += 1
+                elif rtype == ntp.control.CTL_BIN_CURSOR:
+                    (seq,) = struct.unpack_from("!Q", rec, 2)
+                    (host, port, _) = bin_address(rec, 10)
+                    items += [("seq.cursor", seq),
+                              ("addr.cursor", bin_hostport(host, port))]
+                elif rtype == ntp.control.CTL_BIN_NOW:
+                    items.append(("now", bin_lfp(rec, 2)))
+        except struct.error:
+            raise ControlException(SERR_BADRECORD)
+        return ntp.util.OrderedDict(items)
+
+    def __parse_ordlist_records(self):
+        "Parse a binary READ_ORDLIST_A response into stanzas."
+        stanzas = []
+        try:
+            for (rtype, rec) in bin_records(self.response):
+                stanza = ntp.util.OrderedDict()
+                if rtype == ntp.control.CTL_BIN_IFSTATS:
+                    (ifnum, stanza["flags"], stanza["en"], stanza["tl"],
+                     stanza["mc"], stanza["rx"], stanza["tx"],
+                     stanza["txerr"], stanza["pc"], stanza["up"]) = \
+                        struct.unpack_from("!IIBiiIIIII", rec, 2)
+                    name = polystr(rec[39:71])
+                    stanza["name"] = name.split("\0")[0]
+                    (host, port, offset) = bin_address(rec, 71)
+                    stanza["addr"] = bin_hostport(host, port)
+                    (host, port, _) = bin_address(rec, offset)
+                    stanza["bcast"] = bin_hostport(host, port)
+                    # ifstats rows are numbered by interface
+                    while len(stanzas) < ifnum:
+                        stanzas.append(ntp.util.OrderedDict())
+                    stanzas[ifnum:ifnum + 1] = [stanza]
+                elif rtype == ntp.control.CTL_BIN_RESLIST:
+                    (stanza["hits"], flags, mflags) = \
+                        struct.unpack_from("!IHH", rec, 2)
+                    (stanza["addr"], _, offset) = bin_address(rec, 10)
+                    (stanza["mask"], _, _) = bin_address(rec, offset)
+                    stanza["flags"] = bin_resflags(mflags, flags)
+                    stanzas.append(stanza)
+        except struct.error:
+            raise ControlException(SERR_BADRECORD)
+        return stanzas
+
     def readvar(self, associd=0, varlist=None,
                 opcode=ntp.control.CTL_OP_READVAR):
         "Read system vars from the host as a dict, or throw an exception."
@@ -1295,7 +1488,7 @@ class ControlSession:
         else:
             qdata = ",".join(varlist)
         self.doquery(opcode, associd=associd, qdata=qdata)
-        return self.__parse_varlist()
+        return self.parse_varlist()
 
     def config(self, configtext):
         "Send configuration text to the daemon. Return True if accepted."
@@ -1321,8 +1514,9 @@ Receive a nonce that can be replayed - combats source address spoofing
             raise ControlException(SERR_BADNONCE)
         return polystr(self.response.strip())
 
-    def mrulist(self, variables=None, rawhook=None, direct=None):
-        "Retrieve MRU list data"
+    def mrulist(self, variables=None, rawhook=None, direct=None, cursor=0):
+        """Retrieve MRU list data.  Given the cursor of an earlier span,
+        retrieve only the entries which have moved since."""
         restarted_count = 0
         cap_frags = True
         warn = self.logfp.write
@@ -1331,6 +1525,8 @@ Receive a nonce that can be replayed - combats source address spoofing
         self.slots = 0
         if variables is None:
             variables = {}
+        # A top= list comes highest first, in one response
+        ranked = bool(variables.get("top"))
 
         if variables:
             if "sort" in variables:
@@ -1360,7 +1556,7 @@ Receive a nonce that can be replayed - combats source address spoofing
                     # hit count descending
                     "-count": lambda e: e.ct,
                 }
-                if sortkey == "lstint":
+                if sortkey == "lstint" and not ranked:
                     sortkey = None   # normal/default case, no need to sort
                 if sortkey is not None:
                     sorter = sortdict.get(sortkey)
@@ -1369,7 +1565,8 @@ Receive a nonce that can be replayed - combats source address spoofing
             for k in list(variables.keys()):
                 if k in ("mincount", "resall", "resany",
                          "maxlstint", "laddr", "recent", "sort",
-                         "frags", "limit"):
+                         "frags", "limit", "prefix", "minrate",
+                         "top", "topby"):
                     continue
                 else:
                     raise ControlException(SERR_BADPARAM % k)
@@ -1385,9 +1582,23 @@ Receive a nonce that can be replayed - combats source address spoofing
                     | ntp.magic.RES_LIMITED
                 del variables['limited']
 
-        nonce = self.fetch_nonce()
+        # The last MRU response carried a nonce which is good for a
+        # while yet, and using it saves a round trip when polling.
+        reused = self.mru_nonce is not None and \
+            time.time() - self.mru_nonce[1] < ntp.control.NONCE_TIMEOUT / 2
+        if reused:
+            (nonce, self.nonce_xmit) = self.mru_nonce
+        else:
+            nonce = self.fetch_nonce()
+        self.mru_nonce = None
 
         span = MRUList()
+        # Page by sequence number where ntpd can.  The cursor is the
+        # entry the last response stopped at, the anchors the newest
+        # entries received; an older ntpd ignores them and never
+        # sends seq.cursor, and then we fall back to last./addr.
+        bycursor = True
+        cursor_addr = None
         try:
             # Form the initial request
             limit = min(3 * MAXFRAGS, self.ntpd_row_limit)
@@ -1397,16 +1608,32 @@ Receive a nonce that can be replayed - combats source address spoofing
                                          for it in list(variables.items())])
             else:
                 parms = ""
-            req_buf += parms
+            if self.bin_bulk:
+                parms += ", bin=%d" % ntp.control.CTL_BIN_VERSION
+            req_buf += parms + ", cursor=%d" % cursor
             first_time_only = "recent=%s" % variables.get("recent")
 
             while True:
                 # Request additions to the MRU list
                 try:
-                    self.doquery(opcode=ntp.control.CTL_OP_READ_MRU,
-                                 qdata=req_buf)
+                    if reused:
+                        self.tryquery(opcode=ntp.control.CTL_OP_READ_MRU,
+                                      qdata=req_buf)
+                    else:
+                        self.doquery(opcode=ntp.control.CTL_OP_READ_MRU,
+                                     qdata=req_buf)
                     recoverable_read_errors = False
+                    reused = False
                 except ControlException as e:
+                    if reused and e.message in (SERR_TIMEOUT,
+                                                SERR_INCOMPLETE):
+                        # ntpd ignores a request with a stale nonce,
+                        # as it is after its hourly salt change
+                        reused = False
+                        fresh = self.fetch_nonce()
+                        req_buf = req_buf.replace(nonce, fresh)
+                        nonce = fresh
+                        continue
                     recoverable_read_errors = True
                     if e.errorcode is None:
                         raise e
@@ -1456,7 +1683,11 @@ Receive a nonce that can be replayed - combats source address spoofing
                         raise e
 
                 # Parse the response
-                variables = self.__parse_varlist()
+                if self.response[:1] == \
+                   polybytes(chr(ntp.control.CTL_BIN_NONCE)):
+                    variables = self.__parse_mru_records()
+                else:
+                    variables = self.parse_varlist()
 
                 # Comment from the C code:
                 # This is a cheap cop-out implementation of rawmode
@@ -1472,6 +1703,7 @@ Receive a nonce that can be replayed - combats source address spoofing
                 # Analyze the contents of this response into a span structure
                 curidx = -1
                 mru = None
+                seen_cursor = False
                 for (tag, val) in variables.items():
                     if self.debug >= 4:
                         warn("tag=%s, val=%s\n" % (tag, val))
@@ -1481,6 +1713,13 @@ Receive a nonce that can be replayed - combats source address spoofing
                         continue
                     elif tag == "addr.older":
                         continue
+                    elif tag == "seq.cursor":
+                        cursor = val
+                        seen_cursor = True
+                        continue
+                    elif tag == "addr.cursor":
+                        cursor_addr = val
+                        continue
                     if tag == "now":
                         # finished marker
                         span.now = ntp.ntpc.lfptofloat(val)
@@ -1488,7 +1727,8 @@ Receive a nonce that can be replayed - combats source address spoofing
                     elif tag == "last.newest":
                         # more finished
                         continue
-                    for prefix in ("addr", "last", "first", "ct", "mv", "rs"):
+                    for prefix in ("addr", "last", "first", "ct", "mv", "rs",
+                                   "seq"):
                         if tag.startswith(prefix + "."):
                             (member, idx) = tag.split(".")
                             try:
@@ -1514,6 +1754,11 @@ Receive a nonce that can be replayed - combats source address spoofing
                 # If we've seen the end sentinel on the span, break out
                 if span.is_complete():
                     break
+                if bycursor and not seen_cursor and \
+                   not recoverable_read_errors:
+                    if self.debug:
+                        warn("ntpd does not page by cursor\n")
+                    bycursor = False
 
                 # The C version of ntpq used to snooze for a bit
                 # between MRU queries to let ntpd catch up with other
@@ -1552,14 +1797,32 @@ Receive a nonce that can be replayed - combats source address spoofing
                            "frags" if cap_frags else "limit",
                            frags if cap_frags else limit,
                            parms)
-                for i in range(len(span.entries)):
-                    e = span.entries[len(span.entries) - i - 1]
-                    incr = ", addr.%d=%s, last.%d=%s" % (i, e.addr, i, e.last)
-                    if ((len(req_buf) + len(incr)
-                         >= ntp.control.CTL_MAX_DATA_LEN)):
-                        break
-                    else:
+                if bycursor:
+                    req_buf += ", cursor=%d" % cursor
+                    anchors = []
+                    if cursor_addr is not None:
+                        anchors.append((cursor_addr, cursor))
+                    for e in reversed(span.entries):
+                        if len(anchors) >= 16:
+                            break
+                        if e.seq is not None and e.seq != cursor:
+                            anchors.append((e.addr, e.seq))
+                    for (i, (addr, seq)) in enumerate(anchors):
+                        incr = ", addr.%d=%s, seq.%d=%d" % (i, addr, i, seq)
+                        if ((len(req_buf) + len(incr)
+                             >= ntp.control.CTL_MAX_DATA_LEN)):
+                            break
                         req_buf += incr
+                else:
+                    for i in range(len(span.entries)):
+                        e = span.entries[len(span.entries) - i - 1]
+                        incr = ", addr.%d=%s, last.%d=%s" \
+                               % (i, e.addr, i, e.last)
+                        if ((len(req_buf) + len(incr)
+                             >= ntp.control.CTL_MAX_DATA_LEN)):
+                            break
+                        else:
+                            req_buf += incr
                 if direct is not None:
                     span.entries = []
         except KeyboardInterrupt:
@@ -1571,20 +1834,24 @@ Receive a nonce that can be replayed - combats source address spoofing
         # Much simpler to just run through the final list throwing
         # out every entry with an IP address that is duplicated
         # with a later most-recent-transmission time.
-        addrdict = {}
-        deletia = []
+        newest = {}
         for (i, entry) in enumerate(span.entries):
-            if entry.addr not in addrdict:
-                addrdict[entry.addr] = []
-            addrdict[entry.addr].append((i, entry.last))
-        for addr in addrdict:
-            deletia += sorted(addrdict[addr], key=lambda x: x[1])[:-1]
-        deletia = [x[0] for x in deletia]
-        deletia.sort(reverse=True)
-        for i in deletia:
-            span.entries.pop(i)
+            prior = newest.get(entry.addr)
+            if prior is None or span.entries[prior].last <= entry.last:
+                newest[entry.addr] = i
+        span.entries = [entry for (i, entry) in enumerate(span.entries)
+                        if newest[entry.addr] == i]
+
+        if span.is_complete():
+            self.mru_nonce = (nonce, time.time())
+        if bycursor and span.is_complete() and \
+           all(e.seq is not None for e in span.entries):
+            span.cursor = cursor
 
         # Sort for presentation
+        if ranked and not sorter:
+            # Printed in reverse, so highest first
+            span.entries.reverse()
         if sorter:
             span.entries.sort(key=sorter)
             if sortkey == "addr":
@@ -1595,10 +1862,24 @@ Receive a nonce that can be replayed - combats source address spoofing
 
     def __ordlist(self, listtype):
         "Retrieve ordered-list data."
+        if self.bin_bulk:
+            (keyid, passwd) = (self.keyid, self.passwd)
+            try:
+                self.doquery(opcode=ntp.control.CTL_OP_READ_ORDLIST_A,
+                             qdata="%s, bin=%d"
+                             % (listtype, ntp.control.CTL_BIN_VERSION),
+                             auth=True)
+                return self.__parse_ordlist_records()
+            except ControlException as e:
+                if e.errorcode != ntp.control.CERR_UNKNOWNVAR:
+                    raise e
+                # An older ntpd; the error cost us the credentials
+                self.bin_bulk = False
+                (self.keyid, self.passwd) = (keyid, passwd)
         self.doquery(opcode=ntp.control.CTL_OP_READ_ORDLIST_A,
                      qdata=listtype, auth=True)
         stanzas = []
-        for (key, value) in self.__parse_varlist().items():
+        for (key, value) in self.parse_varlist().items():
             if key[-1].isdigit() and key[-2] == '.':
                 (stem, stanza) = key.split(".")
                 stanza = int(stanza)
@@ -1619,6 +1900,278 @@ Receive a nonce that can be replayed - combats source address spoofing
 DEFAULT_KEYFILE = "/usr/local/etc/ntp.keys"
 
 
+class ControlMultiplexer:
+    """Run queries on many ControlSessions at once from one select loop.
+
+Each job is a generator tied to a session.  It yields a tuple of
+(opcode, associd, qdata) for each query it wants made, and when it is
+resumed the response is in session.response, as after doquery().  A
+query which fails is thrown into the job as a ControlException; one
+the job lets escape just ends it.  Jobs may open their session when
+they start and should close it when they end, and may add() further
+jobs.  At most maxflight jobs have a query outstanding, and the rest
+wait their turn, so the sockets in use stay bounded.
+"""
+
+    def __init__(self, maxflight=32):
+        self.maxflight = max(1, maxflight)
+        self.waiting = collections.deque()
+        self.flight = {}        # socket -> _Query
+
+    class _Query:
+        "A query in flight."
+
+        def __init__(self, session, job, request):
+            self.session = session
+            self.job = job
+            self.request = request
+            self.retried = False
+            self.deadline = 0
+
+    def add(self, session, job):
+        "Queue a job to be run on session."
+        self.waiting.append((session, job))
+
+    def __send(self, query):
+        "Ship or reship the query's request."
+        (opcode, associd, qdata) = query.request
+        query.session.beginresponse()
+        query.session.sendrequest(opcode, associd, qdata)
+        query.deadline = time.time() + query.session.primary_timeout / 1000
+
+    def __step(self, session, job, error=None):
+        "Resume a job, and send whatever query it asks for next."
+        try:
+            if error is None:
+                request = job.send(None)
+            else:
+                request = job.throw(error)
+        except (StopIteration, ControlException):
+            return
+        query = ControlMultiplexer._Query(session, job, request)
+        self.flight[session.sock] = query
+        self.__send(query)
+
+    def __finish(self, query, error=None):
+        del self.flight[query.session.sock]
+        self.__step(query.session, query.job, error)
+
+    def run(self):
+        "Run jobs until all of them have ended."
+        while self.waiting or self.flight:
+            while self.waiting and len(self.flight) < self.maxflight:
+                (session, job) = self.waiting.popleft()
+                self.__step(session, job)
+            if not self.flight:
+                continue
+            timeout = min(q.deadline for q in self.flight.values())
+            timeout = max(0, timeout - time.time())
+            try:
+                (rd, _, _) = select.select(list(self.flight), [], [],
+                                           timeout)
+            except select.error:
+                raise ControlException(SERR_SELECT)
+            for sock in rd:
+                query = self.flight[sock]
+                (opcode, associd, _) = query.request
+                try:
+                    done = query.session.takefragment(sock.recv(4096),
+                                                      opcode, associd)
+                except socket.error as e:
+                    self.__finish(query, ControlException(
+                        "***Read from %s failed: %s\n"
+                        % (query.session.hostname, e.strerror)))
+                    continue
+                except ControlException as e:
+                    self.__finish(query, e)
+                    continue
+                if done:
+                    self.__finish(query)
+                else:
+                    query.deadline = time.time() + \
+                        query.session.secondary_timeout / 1000
+            now = time.time()
+            for query in [q for q in self.flight.values()
+                          if q.deadline <= now]:
+                # Like doquery(), give each query one more try
+                if not query.retried:
+                    query.retried = True
+                    self.__send(query)
+                elif query.session.hasfragments():
+                    self.__finish(query, ControlException(SERR_INCOMPLETE))
+                else:
+                    self.__finish(query, ControlException(SERR_TIMEOUT))
+
+
+class SyncMultiplexer:
+    """Take time samples from many server addresses at once.
+
+Each target is sent up to samples requests, one at a time, gap seconds
+after the previous reply; a request not answered within timeout seconds
+counts as lost.  All requests go out over one socket per address
+family, and a reply is matched to its request by source address and
+origin timestamp, so stray and replayed packets are ignored.  If
+requests are signed with key, replies whose MAC the credentials do not
+verify are marked untrusted.  With a
+deadline, run() returns once that many seconds have passed whatever is
+still outstanding.  Otherwise it lasts as long as the slowest target,
+not the sum of them all.
+"""
+
+    def __init__(self, samples=1, gap=0, timeout=5, deadline=None,
+                 credentials=None, key=None):
+        self.samples = max(1, samples)
+        self.gap = gap
+        self.timeout = timeout
+        self.deadline = deadline
+        self.credentials = credentials
+        self.key = key          # (keyid, keytype, passwd) to sign with
+        self.targets = []
+        self.sockets = {}       # address family -> socket
+        self.pending = {}       # (address, port, origin) -> Target
+        self.debug = 0
+        self.logfp = sys.stderr
+
+    class Target:
+        "One server address, and the samples taken from it."
+
+        def __init__(self, hostname, family, sockaddr):
+            self.hostname = hostname
+            self.family = family
+            self.sockaddr = sockaddr
+            self.resolved = sockaddr[0]
+            self.sent = 0
+            self.samples = []   # SyncPackets received, in order
+            self.error = None
+            self.origin = None  # transmit timestamp of request in flight
+            self.due = 0        # when to send next, or give up on origin
+
+    def add(self, hostname, family, sockaddr):
+        "Queue an address of hostname to be sampled."
+        target = SyncMultiplexer.Target(hostname, family, sockaddr)
+        self.targets.append(target)
+        return target
+
+    def __done(self, target):
+        return target.error is not None or \
+            (target.origin is None and target.sent >= self.samples)
+
+    def __send(self, target):
+        "Send target its next request."
+        if target.family not in self.sockets:
+            sock = socket.socket(target.family, socket.SOCK_DGRAM)
+            sock.setblocking(False)
+            self.sockets[target.family] = sock
+        request = SyncPacket()
+        # Stamp the request as late as we can; run() may have sent to
+        # many other targets since it last read the clock.
+        now = time.time()
+        request.transmit_timestamp = SyncPacket.posix_to_ntp(now)
+        # The same address may have been added under two names
+        while (target.sockaddr[0], target.sockaddr[1],
+               request.transmit_timestamp) in self.pending:
+            request.transmit_timestamp += 1
+        packet = request.flatten()
+        if self.key is not None:
+            (keyid, keytype, passwd) = self.key
+            mac = Authenticator.compute_mac(packet, keyid, keytype, passwd)
+            if mac is None:
+                target.error = "MAC generation failed"
+                return
+            packet += mac
+        try:
+            self.sockets[target.family].sendto(packet, target.sockaddr)
+        except socket.error as e:
+            target.error = "send failed: %s" % e
+            return
+        if self.debug >= 2:
+            self.logfp.write("Sent to %s:\n" % target.resolved)
+            dump_hex_printable(packet, self.logfp)
+        target.sent += 1
+        target.origin = request.transmit_timestamp
+        target.due = now + self.timeout
+        self.pending[(target.sockaddr[0], target.sockaddr[1],
+                      target.origin)] = target
+
+    def __receive(self, sock):
+        "Take every reply waiting on sock."
+        while True:
+            try:
+                (data, address) = sock.recvfrom(1024)
+            except socket.error:
+                return
+            try:
+                pkt = SyncPacket(data)
+            except SyncException:
+                continue
+            target = self.pending.pop((address[0], address[1],
+                                       pkt.origin_timestamp), None)
+            if target is None:
+                if self.debug:
+                    self.logfp.write("ignoring unexpected packet from %s\n"
+                                     % address[0])
+                continue
+            if self.debug >= 2:
+                self.logfp.write("Received from %s:\n" % target.resolved)
+                dump_hex_printable(data, self.logfp)
+            if self.key is not None and self.credentials and \
+                    not self.credentials.verify_mac(data):
+                pkt.trusted = False
+            pkt.hostname = target.hostname
+            pkt.resolved = target.resolved
+            target.samples.append(pkt)
+            target.origin = None
+            target.due = time.time() + self.gap
+
+    def run(self):
+        "Sample every target until all are done or the deadline passes."
+        start = time.time()
+        deadline = None
+        if self.deadline is not None:
+            deadline = start + self.deadline
+        for target in self.targets:
+            target.due = start
+        active = list(self.targets)
+        try:
+            while active:
+                now = time.time()
+                if deadline is not None and now >= deadline:
+                    break
+                for target in active:
+                    if target.due > now:
+                        continue
+                    if target.origin is not None:
+                        if self.debug:
+                            self.logfp.write("no reply from %s\n"
+                                             % target.resolved)
+                        del self.pending[(target.sockaddr[0],
+                                          target.sockaddr[1],
+                                          target.origin)]
+                        target.origin = None
+                    if target.sent < self.samples:
+                        self.__send(target)
+                active = [t for t in active if not self.__done(t)]
+                if not active:
+                    break
+                wake = min(t.due for t in active)
+                if deadline is not None:
+                    wake = min(wake, deadline)
+                try:
+                    (rd, _, _) = select.select(list(self.sockets.values()),
+                                               [], [],
+                                               max(0, wake - time.time()))
+                except select.error:
+                    raise SyncException(SERR_SELECT)
+                for sock in rd:
+                    self.__receive(sock)
+                active = [t for t in active if not self.__done(t)]
+        finally:
+            for sock in self.sockets.values():
+                sock.close()
+            self.sockets = {}
+            self.pending = {}
+
+
 class Authenticator:
     "MAC authentication manager for NTP packets."
 
@@ -1659,8 +2212,24 @@ class Authenticator:
         else:
             raise ValueError
 
+    @staticmethod
+    def is_cmac(keytype):
+        "Is this an RFC 8573 AES-CMAC key type rather than a digest?"
+        return keytype.upper() in ("AES", "AES-128-CMAC")
+
+    @staticmethod
+    def cmac_key(passwd):
+        "AES-CMAC key octets; as in ntpd, keys over 20 chars are hex."
+        if len(passwd) > 20:
+            return binascii.unhexlify(polybytes(passwd))
+        return polybytes(passwd)
+
     @staticmethod
     def compute_mac(payload, keyid, keytype, passwd):
+        if Authenticator.is_cmac(keytype):
+            mac = ntp.ntpc.cmac(Authenticator.cmac_key(passwd),
+                                polybytes(payload))
+            return struct.pack("!I", keyid) + mac
         hasher = hashlib.new(keytype)
         hasher.update(polybytes(passwd))
         hasher.update(payload)
@@ -1680,7 +2249,7 @@ class Authenticator:
     def verify_mac(self, packet):
         "Does the MAC on this packet verify according to credentials we have?"
         # FIXME: Someday, figure out how to handle SHA1?
-        HASHLEN = 16    # Length of MD5 hash.
+        HASHLEN = 16    # Length of MD5 hash, and of AES-CMAC.
         payload = packet[:-HASHLEN-4]
         keyid = packet[-HASHLEN-4:-HASHLEN]
         mac = packet[-HASHLEN:]
@@ -1688,6 +2257,9 @@ class Authenticator:
         if keyid not in self.passwords:
             return False
         (keytype, passwd) = self.passwords[keyid]
+        if Authenticator.is_cmac(keytype):
+            return ntp.ntpc.cmac(Authenticator.cmac_key(passwd),
+                                 polybytes(payload)) == mac
         hasher = hashlib.new(keytype)
         hasher.update(passwd)
         hasher.update(payload)
@@ -7,24 +7,185 @@ Requires gnuplot and liberation fonts installed.
 # SPDX-License-Identifier: BSD-2-Clause
 from __future__ import print_function, division
 
+import array
 import calendar
 import glob
+import datetime
 import gzip
+import heapq
+import math
+import mmap
+import re
 import os
 import socket
+import struct
 import sys
 import time
 
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+
+class BinaryStats:
+    "Memory-mapped statistics file written by a binary filegen"
+    # See include/ntp_filegen.h for the layout
+    MAGIC = b"ntpstats-binary "
+    codes = {"I": "I", "i": "i", "d": "d", "Q": "Q", "A": "16s"}
+
+    @staticmethod
+    def is_binary(path):
+        "Does the file at path start with a binary stats header?"
+        try:
+            with open(path, "rb") as fp:
+                return fp.read(len(BinaryStats.MAGIC)) == BinaryStats.MAGIC
+        except IOError:
+            return False
+
+    def __init__(self, path):
+        "Map the file and read its header."
+        self.fields = []
+        self.nrecords = 0
+        self.map = None
+        with open(path, "rb") as fp:
+            head = fp.read(4096)
+            end = head.find(b"\n\n")
+            if not head.startswith(BinaryStats.MAGIC) or 0 > end:
+                raise ValueError("%s: not a binary stats file" % path)
+            lines = str(head[:end].decode("ascii")).split("\n")
+            words = lines[0].split()
+            (version, recsize) = (words[1], words[-1])
+            self.name = " ".join(words[2:-1])
+            if "1" != version:
+                raise ValueError("%s: binary stats version %s"
+                                 % (path, version))
+            fmt = "<"
+            for line in lines[1:]:
+                (name, ftype, size, text) = line.split(" ", 3)
+                self.fields.append((name, ftype, int(size), text))
+                fmt += self.codes.get(ftype, size + "s")
+            self.record = struct.Struct(fmt)
+            if self.record.size != int(recsize) or \
+               ["day", "time"] != [f[0] for f in self.fields[:2]]:
+                raise ValueError("%s: bad binary stats header" % path)
+            self.offset = end + 2
+            size = os.fstat(fp.fileno()).st_size
+            # a record being written may be incomplete
+            self.nrecords = (size - self.offset) // self.record.size
+            if self.nrecords:
+                self.map = mmap.mmap(fp.fileno(), 0,
+                                     access=mmap.ACCESS_READ)
+        # the day and time fields, to find records without the rest
+        self.stamp = struct.Struct("<Id")
+
+    def __len__(self):
+        return self.nrecords
+
+    def time(self, i):
+        "POSIX time of record i."
+        (mjd, second) = self.stamp.unpack_from(
+            self.map, self.offset + i * self.record.size)
+        return NTPStats.SecondsInDay * mjd + second - 3506716800
+
+    def bisect(self, t):
+        "Index of the first record not before t, the file being in order."
+        lo = 0
+        hi = self.nrecords
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.time(mid) < t:
+                lo = mid + 1
+            else:
+                hi = mid
+        return lo
+
+    def records(self, starttime, endtime):
+        "Unpacked records from starttime to endtime."
+        if not self.nrecords:
+            return []
+        first = self.bisect(starttime)
+        last = self.bisect(endtime)
+        while last < self.nrecords and self.time(last) <= endtime:
+            last += 1
+        size = self.record.size
+        if hasattr(self.record, "iter_unpack"):
+            view = memoryview(self.map)[self.offset + first * size:
+                                        self.offset + last * size]
+            return self.record.iter_unpack(view)
+        return (self.record.unpack_from(self.map, self.offset + i * size)
+                for i in range(first, last))
+
+    @staticmethod
+    def address(raw):
+        "Print an address field as socktoa() does."
+        if raw == b"\0" * 16:
+            return "-"
+        if raw[:12] == b"\0" * 10 + b"\xff\xff":
+            return socket.inet_ntop(socket.AF_INET, raw[12:])
+        return socket.inet_ntop(socket.AF_INET6, raw)
+
+    @staticmethod
+    def lfp(value, digits):
+        "Print an l_fp field as ulfptoa() does."
+        scale = 10 ** digits
+        frac = ((value & 0xffffffff) * scale + 0x80000000) >> 32
+        seconds = value >> 32
+        if frac == scale:
+            seconds += 1
+            frac = 0
+        return "%d.%0*d" % (seconds, digits, frac)
+
+    def rows(self, starttime, endtime):
+        "Rows from starttime to endtime, as NTPStats.unixize() makes them."
+        return list(self.iterrows(starttime, endtime))
+
+    def iterrows(self, starttime, endtime):
+        "Generate the rows from starttime to endtime one at a time."
+        # One format for the whole record, the fields which printf()
+        # can't do converted first
+        text = []
+        convert = []
+        for (i, (_, ftype, _, fmt)) in enumerate(self.fields[2:]):
+            if "A" == ftype:
+                convert.append((i, BinaryStats.address))
+                fmt = "%s"
+            elif "Q" == ftype:
+                convert.append((i, lambda v, d=int(fmt[2:-1]):
+                                BinaryStats.lfp(v, d)))
+                fmt = "%s"
+            elif "s" == ftype:
+                convert.append((i, lambda v:
+                                str(v.split(b"\0", 1)[0].decode("ascii"))))
+            text.append(fmt)
+        text = " ".join(text)
+        for record in self.records(starttime, endtime):
+            # rounded as the text record has it
+            t = NTPStats.SecondsInDay * record[0] + \
+                round(record[1], 3) - 3506716800
+            values = list(record[2:])
+            for (i, conv) in convert:
+                values[i] = conv(values[i])
+            row = (text % tuple(values)).split(" ")
+            row[:0] = [int(t * 1000), str(t)]
+            yield row
+
 
 class NTPStats:
     "Gather statistics for a specified NTP site"
     SecondsInDay = 24*60*60
     DefaultPeriod = 7*24*60*60  # default 7 days, 604800 secs
     peermap = {}    # cached result of peersplit()
+    gpsmap = None   # cached result of gpssplit()
+    tempsmap = None  # cached result of tempssplit()
     period = None
     starttime = None
     endtime = None
     sitename = ''
+    stems = ("clockstats", "peerstats", "loopstats", "rawstats",
+             "temps", "gpsd")
+    # temps and gpsd are already in UNIX time
+    unixtime_stems = ("temps", "gpsd")
 
     @staticmethod
     def unixize(lines, starttime, endtime):
@@ -59,7 +220,7 @@ class NTPStats:
 
     def __init__(self, statsdir, sitename=None,
                  period=None, starttime=None, endtime=None):
-        "Grab content of logfiles, sorted by timestamp."
+        "Find the logfiles; each stem is read when it is first used."
         if period is None:
             period = NTPStats.DefaultPeriod
         self.period = period
@@ -84,80 +245,134 @@ class NTPStats:
             sys.stderr.write("ntpviz: ERROR: %s is not a directory\n"
                              % statsdir)
             raise SystemExit(1)
+        self.statsdir = statsdir
+        # one cache per directory
+        self.peermap = {}
+
+    def __getattr__(self, name):
+        "Read a stem, sorted by timestamp, the first time it is asked for."
+        if name not in NTPStats.stems or "statsdir" not in self.__dict__:
+            raise AttributeError(name)
+        rows = list(self.stream(name))
+        setattr(self, name, rows)
+        return rows
 
-        for stem in ("clockstats", "peerstats", "loopstats", "rawstats",
-                     "temps", "gpsd"):
-            lines = []
+    def logfiles(self, stem):
+        "The files of a stem which may hold rows in the time range."
+        pattern = os.path.join(self.statsdir, stem)
+        if stem not in NTPStats.unixtime_stems:
+            pattern += "."
+        seen = set()
+        for logpart in sorted(glob.glob(pattern + "*")):
             try:
-                pattern = os.path.join(statsdir, stem)
-                if stem != "temps" and stem != "gpsd":
-                    pattern += "."
-                for logpart in glob.glob(pattern + "*"):
-                    # skip files older than starttime
-                    if starttime > os.path.getmtime(logpart):
-                        continue
-                    if logpart.endswith("gz"):
-                        lines += gzip.open(logpart, 'rt').readlines()
-                    else:
-                        lines += open(logpart, 'r').readlines()
-            except IOError:
+                st = os.stat(logpart)
+            except OSError:
+                continue
+            # skip files older than starttime
+            if self.starttime > st.st_mtime:
+                continue
+            # a binary generation is linked to stem.bin
+            if (st.st_dev, st.st_ino) in seen:
+                continue
+            seen.add((st.st_dev, st.st_ino))
+            span = file_span(logpart[len(pattern):])
+            if span is not None and \
+               (span[1] <= self.starttime or span[0] > self.endtime):
+                continue
+            yield logpart
+
+    def stream(self, stem):
+        "Generate the rows of a stem in the time range, in time order."
+        # Each file is in time order already, so they are merged as
+        # they are read rather than read whole and sorted.
+        parts = []
+        for logpart in self.logfiles(stem):
+            try:
+                if BinaryStats.is_binary(logpart):
+                    parts.append(BinaryStats(logpart).iterrows(
+                        self.starttime, self.endtime))
+                else:
+                    # open here, where a failure can be caught
+                    parts.append(self.text_rows(
+                        self.open_text(logpart, stem), stem))
+            except (IOError, ValueError):
                 sys.stderr.write("ntpviz: WARNING: could not read %s\n"
                                  % logpart)
-                pass
+        return heapq.merge(*parts)
 
-            lines1 = []
-            if stem == "temps" or stem == "gpsd":
-                # temps and gpsd are already in UNIX time
-                for line in lines:
-                    split = line.split()
-                    if 3 > len(split):
-                        # skip short lines
-                        continue
+    def open_text(self, logpart, stem):
+        "Open a text logfile at about the start of the time range."
+        if logpart.endswith("gz"):
+            return gzip.open(logpart, 'rt')
+        fp = open(logpart, 'r')
+        try:
+            offset = seek_text(logpart, NTPStats.unix_time
+                               if stem in NTPStats.unixtime_stems
+                               else NTPStats.mjd_time, self.starttime)
+            if offset:
+                fp.seek(offset)
+                fp.readline()
+        except (IOError, ValueError):
+            fp.close()
+            raise
+        return fp
 
-                    try:
+    def text_rows(self, fp, stem):
+        "Generate the rows of an open text logfile in the time range."
+        starttime = self.starttime
+        endtime = self.endtime
+        unixtime = stem in NTPStats.unixtime_stems
+        with fp:
+            # HOT LOOP!  Do not change w/o profiling before and after
+            for line in fp:
+                split = line.split()
+                try:
+                    if unixtime:
+                        if 3 > len(split):
+                            # skip short lines
+                            continue
                         t = float(split[0])
-                    except:
-                        # ignore comment lines, lines with no time
-                        continue
-
-                    if starttime <= t <= endtime:
+                    else:
+                        t = NTPStats.SecondsInDay * int(split[0]) + \
+                            float(split[1]) - 3506716800
+                except (ValueError, IndexError):
+                    # unparseable, comment lines, lines with no time
+                    continue
+                if t > endtime:
+                    # the rest of the file is later still
+                    break
+                if starttime <= t:
+                    if unixtime:
                         # prefix with int milli sec.
                         split.insert(0, int(t * 1000))
-                        lines1.append(split)
-            else:
-                # Morph first fields into Unix time with fractional seconds
-                # ut into nice dictionary of dictionary rows
-                lines1 = NTPStats.unixize(lines, starttime, endtime)
+                    else:
+                        split[0] = int(t * 1000)
+                        split[1] = str(t)
+                    yield split
+
+    @staticmethod
+    def mjd_time(line):
+        "POSIX time of a line starting with MJD and seconds, or None."
+        split = line.split(None, 2)
+        try:
+            return NTPStats.SecondsInDay * int(split[0]) + \
+                float(split[1]) - 3506716800
+        except (ValueError, IndexError):
+            return None
 
-            # Sort by datestamp
-            # by default, a tuple sort()s on the 1st item, which is a nice
-            # integer of milli seconds.  This is faster than using
-            # cmp= or key=
-            lines1.sort()
-            setattr(self, stem, lines1)
+    @staticmethod
+    def unix_time(line):
+        "POSIX time of a line starting with it, or None."
+        split = line.split(None, 1)
+        try:
+            return float(split[0])
+        except (ValueError, IndexError):
+            return None
 
     def percentiles(self, percents, values):
         "Return given percentiles of a given row in a given set of entries."
         "assuming values are already split and sorted"
-        ret = {}
-        length = len(values)
-        if 1 >= length:
-            # uh, oh...
-            if 1 == length:
-                # just one data value, set all to that one value
-                v = values[0]
-            else:
-                # no data, set all to zero
-                v = 0
-            for perc in percents:
-                ret["p" + str(perc)] = v
-        else:
-            for perc in percents:
-                if perc == 100:
-                    ret["p100"] = values[length - 1]
-                else:
-                    ret["p" + str(perc)] = values[int(length * (perc/100))]
-        return ret
+        return percentiles(percents, values)
 
     def peersplit(self):
         "Return a dictionary mapping peerstats IPs to entry subsets."
@@ -178,7 +393,9 @@ class NTPStats:
 
     def gpssplit(self):
         "Return a dictionary mapping gps sources to entry subsets."
-        gpsmap = {}
+        if self.gpsmap is not None:
+            return self.gpsmap
+        gpsmap = self.gpsmap = {}
         for row in self.gpsd:
             try:
                 source = row[2]
@@ -192,7 +409,9 @@ class NTPStats:
 
     def tempssplit(self):
         "Return a dictionary mapping temperature sources to entry subsets."
-        tempsmap = {}
+        if self.tempsmap is not None:
+            return self.tempsmap
+        tempsmap = self.tempsmap = {}
         for row in self.temps:
             try:
                 source = row[2]
@@ -227,6 +446,126 @@ class NTPStats:
         return key      # Someday, be smarter than this.
 
 
+def percentiles(percents, values):
+    "Return given percentiles of sorted values, as a dictionary."
+    ret = {}
+    length = len(values)
+    if 1 >= length:
+        # uh, oh...
+        if 1 == length:
+            # just one data value, set all to that one value
+            v = values[0]
+        else:
+            # no data, set all to zero
+            v = 0
+        for perc in percents:
+            ret["p" + str(perc)] = v
+    else:
+        for perc in percents:
+            if perc == 100:
+                ret["p100"] = values[length - 1]
+            else:
+                ret["p" + str(perc)] = values[int(length * (perc/100))]
+    return ret
+
+
+class Summary:
+    "Percentiles, mean and population standard deviation of some values"
+    # The values are sorted once, into an array of doubles (numpy's when
+    # it is installed), and every percentile is read off that one order.
+    # The mean and variance are correctly rounded sums, which do not
+    # depend on the order of the additions, so numpy and the plain array
+    # give the same numbers to the last bit.
+
+    def __init__(self, values):
+        if numpy is not None:
+            self.values = numpy.sort(numpy.array(values, dtype=numpy.float64))
+        else:
+            self.values = array.array('d', sorted(values))
+        n = len(self.values)
+        self.mean = 0
+        self.pstdev = 0
+        if 1 <= n:
+            # fsum() walks a list faster than a numpy array
+            if numpy is not None:
+                self.mean = math.fsum(self.values.tolist()) / n
+            else:
+                self.mean = math.fsum(self.values) / n
+        if 2 <= n:
+            mu = self.mean
+            if numpy is not None:
+                d = self.values - mu
+                ss = math.fsum((d * d).tolist())
+            else:
+                ss = math.fsum((x - mu) * (x - mu) for x in self.values)
+            self.pstdev = (ss / n) ** 0.5
+
+    def __len__(self):
+        return len(self.values)
+
+    def percentiles(self, percents):
+        "Return given percentiles of the values, as Python floats."
+        ret = percentiles(percents, self.values)
+        for (k, v) in ret.items():
+            ret[k] = float(v)
+        return ret
+
+
+def file_span(suffix):
+    "POSIX time range of a filegen generation, from its filename suffix."
+    # suffix is what follows "stem.": maybe "bin.", then the generation
+    suffix = suffix.lower()
+    if suffix.startswith("bin."):
+        suffix = suffix[4:]
+    if suffix.endswith(".gz"):
+        suffix = suffix[:-3]
+    match = re.match(r"(\d{4})(\d{2})(\d{2})$", suffix)
+    if match:
+        start = datetime.date(*[int(x) for x in match.groups()])
+        end = start + datetime.timedelta(days=1)
+    else:
+        match = re.match(r"(\d{4})w(\d{2})$", suffix)
+        if match:
+            # ISO week; the week with 4 January in it is week 1
+            jan4 = datetime.date(int(match.group(1)), 1, 4)
+            start = jan4 + datetime.timedelta(
+                days=-jan4.weekday(), weeks=int(match.group(2)) - 1)
+            end = start + datetime.timedelta(weeks=1)
+        else:
+            match = re.match(r"(\d{4})(\d{2})?$", suffix)
+            if not match:
+                return None
+            year = int(match.group(1))
+            if match.group(2) is None:
+                start = datetime.date(year, 1, 1)
+                end = datetime.date(year + 1, 1, 1)
+            else:
+                month = int(match.group(2))
+                start = datetime.date(year, month, 1)
+                end = datetime.date(year + month // 12, month % 12 + 1, 1)
+    return (calendar.timegm(start.timetuple()),
+            calendar.timegm(end.timetuple()))
+
+
+def seek_text(path, line_time, starttime):
+    "Offset in a logfile after which the rows from starttime are."
+    # Bisect on byte offsets, timing the first whole line after each
+    # offset, until the stretch left is short enough to just read.
+    lo = 0
+    with open(path, 'rb') as fp:
+        hi = os.fstat(fp.fileno()).st_size
+        while hi - lo > 65536:
+            mid = (lo + hi) // 2
+            fp.seek(mid)
+            fp.readline()
+            t = line_time(fp.readline().decode("ascii", "replace"))
+            if t is None or t >= starttime:
+                hi = mid
+            else:
+                lo = mid
+    return lo
+
+
 def iso_to_posix(s):
     "Accept timestamps in ISO 8661 format or numeric POSIX time. UTC only."
     if str(s).isdigit():
@@ -66,6 +66,12 @@ static void RunAllTests(void)
 #ifdef TEST_NTPD
 	RUN_TEST_GROUP(leapsec);
 	RUN_TEST_GROUP(hackrestrict);
+	RUN_TEST_GROUP(monitor);
+	RUN_TEST_GROUP(select);
+	RUN_TEST_GROUP(filegen);
+#ifdef HAVE_LINUX_RTNETLINK_H
+	RUN_TEST_GROUP(netlink);
+#endif
 #endif
 
 }
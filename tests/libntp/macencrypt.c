@@ -57,6 +57,54 @@ TEST(macencrypt, DecryptInvalid) {
 	TEST_ASSERT_FALSE(mac_authdecrypt(keytype, (u_char*)key, (uint32_t*)invalidPacket, packetLength, 20));
 }
 
+TEST(macencrypt, KeyContext) {
+	struct mac_ctx *keyctx;
+	char packetPtr[totalLength];
+
+	keyctx = mac_keyctx_new(keytype, (const uint8_t *)key, keyLength);
+	TEST_ASSERT_NOT_NULL(keyctx);
+
+	/* the context is reusable: verify, then sign, then verify again */
+	TEST_ASSERT_TRUE(mac_ctx_authdecrypt(keyctx, (uint32_t*)expectedPacket, packetLength, 20));
+
+	memset(packetPtr, 0, sizeof(packetPtr));
+	memcpy(packetPtr, packet, packetLength);
+	TEST_ASSERT_EQUAL(20, mac_ctx_authencrypt(keyctx, (uint32_t*)packetPtr, packetLength));
+	TEST_ASSERT_TRUE(memcmp(expectedPacket + packetLength + keyIdLength, packetPtr + packetLength + keyIdLength, digestLength) == 0);
+
+	TEST_ASSERT_TRUE(mac_ctx_authdecrypt(keyctx, (uint32_t*)expectedPacket, packetLength, 20));
+	mac_keyctx_free(keyctx);
+}
+
+TEST(macencrypt, CMAC) {
+	/* RFC 4493 section 4, example 2 */
+	const uint8_t cmackey[16] = {
+		0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+		0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+	};
+	const uint8_t expected[16] = {
+		0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44,
+		0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c
+	};
+	uint32_t msg[9] = {
+		htonl(0x6bc1bee2), htonl(0x2e409f96),
+		htonl(0xe93d7e11), htonl(0x7393172a)
+	};
+	struct mac_ctx *keyctx;
+
+	TEST_ASSERT_NULL(mac_keyctx_new(NID_cmac, cmackey, 15));
+
+	keyctx = mac_keyctx_new(NID_cmac, cmackey, sizeof(cmackey));
+	TEST_ASSERT_NOT_NULL(keyctx);
+	/* twice, since the subkeys are reused */
+	TEST_ASSERT_EQUAL(20, mac_ctx_authencrypt(keyctx, msg, 16));
+	TEST_ASSERT_TRUE(memcmp(expected, &msg[5], 16) == 0);
+	TEST_ASSERT_TRUE(mac_ctx_authdecrypt(keyctx, msg, 16, 20));
+	msg[0] ^= htonl(1);
+	TEST_ASSERT_FALSE(mac_ctx_authdecrypt(keyctx, msg, 16, 20));
+	mac_keyctx_free(keyctx);
+}
+
 TEST(macencrypt, IPv4AddressToRefId) {
 	sockaddr_u addr;
 	SET_AF(&addr, AF_INET);
@@ -89,6 +137,8 @@ TEST_GROUP_RUNNER(macencrypt) {
 	RUN_TEST_CASE(macencrypt, Encrypt);
 	RUN_TEST_CASE(macencrypt, DecryptValid);
 	RUN_TEST_CASE(macencrypt, DecryptInvalid);
+	RUN_TEST_CASE(macencrypt, KeyContext);
+	RUN_TEST_CASE(macencrypt, CMAC);
 	RUN_TEST_CASE(macencrypt, IPv4AddressToRefId);
 	RUN_TEST_CASE(macencrypt, IPv6AddressToRefId);
 }
@@ -9,7 +9,7 @@
 TEST_GROUP(recvbuff);
 
 TEST_SETUP(recvbuff) {
-	init_recvbuff(RECV_INIT);
+	init_recvbuff(RECV_INIT, false);
 }
 
 TEST_TEAR_DOWN(recvbuff) {}
@@ -38,10 +38,66 @@ TEST(recvbuff, GetAndFill) {
 	TEST_ASSERT_EQUAL(1, full_recvbuffs());
 	TEST_ASSERT_TRUE(has_full_recv_buffer());
 	TEST_ASSERT_EQUAL(buf, get_full_recv_buffer());
+	freerecvbuf(buf);
+}
+
+TEST(recvbuff, GetBatch) {
+	u_long initial = free_recvbuffs();
+	recvbuf_t* bufs[3];
+	size_t i, n;
+
+	n = get_free_recv_buffers(bufs, 3);
+	TEST_ASSERT_EQUAL(3, n);
+	TEST_ASSERT_EQUAL(initial - 3, free_recvbuffs());
+	TEST_ASSERT_TRUE(bufs[0] != bufs[1] && bufs[1] != bufs[2]);
+	for (i = 0; i < n; i++)
+		freerecvbuf(bufs[i]);
+	TEST_ASSERT_EQUAL(initial, free_recvbuffs());
+}
+
+TEST(recvbuff, ShortfallAndHighwater) {
+	u_long shortfall = shortfall_recvbuffs();
+	recvbuf_t* bufs[RECV_INIT];
+	size_t i, n;
+
+	n = get_free_recv_buffers(bufs, RECV_INIT);
+	TEST_ASSERT_EQUAL(RECV_INIT, n);
+	TEST_ASSERT_EQUAL(RECV_INIT, highwater_recvbuffs());
+	TEST_ASSERT_NULL(get_free_recv_buffer());
+	TEST_ASSERT_EQUAL(shortfall + 1, shortfall_recvbuffs());
+	for (i = 0; i < n; i++)
+		freerecvbuf(bufs[i]);
+	TEST_ASSERT_EQUAL(RECV_INIT, free_recvbuffs());
+}
+
+TEST(recvbuff, ResizeWhenIdle) {
+	recvbuf_t* a;
+	recvbuf_t* b;
+
+	init_recvbuff(100, false);
+	TEST_ASSERT_EQUAL(100, total_recvbuffs());
+	TEST_ASSERT_EQUAL(100, free_recvbuffs());
+
+	/* each buffer starts on its own cache line */
+	a = get_free_recv_buffer();
+	b = get_free_recv_buffer();
+	TEST_ASSERT_EQUAL(0, (uintptr_t)a % 64);
+	TEST_ASSERT_EQUAL(0, (uintptr_t)b % 64);
+
+	/* not while buffers are out */
+	init_recvbuff(RECV_INIT, false);
+	TEST_ASSERT_EQUAL(100, total_recvbuffs());
+	freerecvbuf(a);
+	freerecvbuf(b);
+	init_recvbuff(RECV_INIT, false);
+	TEST_ASSERT_EQUAL(RECV_INIT, total_recvbuffs());
 }
 
 TEST_GROUP_RUNNER(recvbuff) {
 	RUN_TEST_CASE(recvbuff, Initialization);
 	RUN_TEST_CASE(recvbuff, GetAndFree);
 	RUN_TEST_CASE(recvbuff, GetAndFill);
+	RUN_TEST_CASE(recvbuff, GetBatch);
+	RUN_TEST_CASE(recvbuff, ShortfallAndHighwater);
+	RUN_TEST_CASE(recvbuff, ResizeWhenIdle);
 }
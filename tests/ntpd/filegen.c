@@ -0,0 +1,277 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ntpd.h"
+#include "ntp_filegen.h"
+#include "ntp_calendar.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+char	statsdir[MAXFILENAME];	/* not used - filegen code needs it */
+
+static FILEGEN	teststats;
+static char	dir[] = "/tmp/filegen-testXXXXXX";
+static char	path[sizeof(dir) + 16];
+static char	binpath[sizeof(dir) + 16];
+static int	saved_latency;
+
+static const struct filegen_field testlayout[] = {
+	{ "day",	'I',	4,	"%lu" },
+	{ "time",	'd',	8,	"%.3f" },
+	{ "addr",	'A',	16,	"%s" },
+	{ "t1",		'Q',	8,	"%.9f" },
+	{ "poll",	'i',	4,	"%d" },
+	{ "refid",	's',	8,	"%s" },
+};
+
+/* Helper functions */
+
+static long
+file_size(void)
+{
+	FILE *	fp;
+	long	size;
+
+	fp = fopen(path, "r");
+	if (NULL == fp)
+		return -1;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+static size_t
+read_file(
+	const char *	name,
+	char *		buf,
+	size_t		size
+	)
+{
+	FILE *	fp;
+	size_t	len;
+
+	fp = fopen(name, "r");
+	if (NULL == fp)
+		return 0;
+	len = fread(buf, 1, size, fp);
+	fclose(fp);
+	return len;
+}
+
+static void
+config_binary(void)
+{
+	char	dirslash[sizeof(dir) + 1];
+
+	snprintf(dirslash, sizeof(dirslash), "%s/", dir);
+	filegen_layout(&teststats, testlayout, (int)COUNTOF(testlayout));
+	filegen_config(&teststats, dirslash, "teststats", FILEGEN_NONE,
+		       FGEN_FLAG_ENABLED | FGEN_FLAG_BINARY);
+	filegen_setup(&teststats, 0);
+}
+
+TEST_GROUP(filegen);
+
+TEST_SETUP(filegen) {
+	char	dirslash[sizeof(dir) + 1];
+
+	saved_latency = stats_flush_latency;
+	strlcpy(dir, "/tmp/filegen-testXXXXXX", sizeof(dir));
+	TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+	snprintf(dirslash, sizeof(dirslash), "%s/", dir);
+	snprintf(path, sizeof(path), "%s/teststats", dir);
+	snprintf(binpath, sizeof(binpath), "%s/teststats.bin", dir);
+	filegen_register(dirslash, "teststats", &teststats);
+	filegen_config(&teststats, dirslash, "teststats", FILEGEN_NONE,
+		       FGEN_FLAG_ENABLED);
+	filegen_setup(&teststats, 0);
+	TEST_ASSERT_NOT_NULL(teststats.fp);
+}
+
+TEST_TEAR_DOWN(filegen) {
+	teststats.flag = 0;
+	filegen_setup(&teststats, 0);
+#ifdef DEBUG
+	filegen_unregister("teststats");
+#endif
+	unlink(path);
+	unlink(binpath);
+	rmdir(dir);
+	stats_flush_latency = saved_latency;
+}
+
+/* Tests */
+
+TEST(filegen, RecordsWaitForFlush) {
+	stats_flush_latency = 3600;
+	filegen_printf(&teststats, "%d %s\n", 1, "first");
+	filegen_printf(&teststats, "%d %s\n", 2, "second");
+	TEST_ASSERT_EQUAL(0, file_size());
+
+	filegen_flush(true);
+	TEST_ASSERT_EQUAL(17, file_size());
+}
+
+
+TEST(filegen, ZeroLatencyWritesAtOnce) {
+	stats_flush_latency = 0;
+	filegen_printf(&teststats, "%d\n", 12345);
+	TEST_ASSERT_EQUAL(6, file_size());
+}
+
+
+TEST(filegen, HalfFullBufferIsWritten) {
+	char	line[101];
+	int	i;
+
+	stats_flush_latency = 3600;
+	memset(line, 'x', 99);
+	line[99] = '\n';
+	line[100] = '\0';
+	/* a little over half of the 64 KiB buffer */
+	for (i = 0; i < 330; i++)
+		filegen_printf(&teststats, "%s", line);
+
+	/* the writer thread has it; syncing waits for it */
+	filegen_flush(true);
+	TEST_ASSERT_EQUAL(33000, file_size());
+	TEST_ASSERT_EQUAL(0, teststats.dropped);
+}
+
+
+TEST(filegen, DisableWritesBuffered) {
+	stats_flush_latency = 3600;
+	filegen_printf(&teststats, "pending\n");
+	teststats.flag = 0;
+	filegen_setup(&teststats, 0);
+	TEST_ASSERT_NULL(teststats.fp);
+	TEST_ASSERT_EQUAL(8, file_size());
+}
+
+
+TEST(filegen, FlushSwitchesGeneration) {
+	char	dirslash[sizeof(dir) + 1];
+	char	first[sizeof(dir) + 32];
+	char	second[sizeof(dir) + 32];
+	char	buf[64];
+	u_long	saved_time = current_time;
+
+	stats_flush_latency = 0;
+	snprintf(dirslash, sizeof(dirslash), "%s/", dir);
+	snprintf(first, sizeof(first), "%s/teststats.a%08d", dir, 0);
+	snprintf(second, sizeof(second), "%s/teststats.a%08d", dir,
+		 SECSPERDAY);
+	current_time = 0;
+	filegen_config(&teststats, dirslash, "teststats", FILEGEN_AGE,
+		       FGEN_FLAG_ENABLED);
+	filegen_start(&teststats, 0);
+	filegen_printf(&teststats, "1\n");
+
+	/* records don't check for the boundary ... */
+	current_time = SECSPERDAY;
+	filegen_start(&teststats, 0);
+	filegen_printf(&teststats, "2\n");
+	TEST_ASSERT_EQUAL(4, read_file(first, buf, sizeof(buf)));
+
+	/* ... the timer does */
+	filegen_flush(false);
+	filegen_printf(&teststats, "3\n");
+	TEST_ASSERT_EQUAL(4, read_file(first, buf, sizeof(buf)));
+	TEST_ASSERT_EQUAL(2, read_file(second, buf, sizeof(buf)));
+
+	teststats.flag = 0;
+	filegen_setup(&teststats, 0);
+	unlink(first);
+	unlink(second);
+	current_time = saved_time;
+}
+
+
+TEST(filegen, BinaryHeaderAndRecord) {
+	static const char header[] =
+		"ntpstats-binary 1 teststats 48\n"
+		"day I 4 %lu\n"
+		"time d 8 %.3f\n"
+		"addr A 16 %s\n"
+		"t1 Q 8 %.9f\n"
+		"poll i 4 %d\n"
+		"refid s 8 %s\n"
+		"\n";
+	const size_t	hlen = sizeof(header) - 1;
+	char		buf[512];
+	const char *	rec;
+	sockaddr_u	addr;
+	double		d;
+	uint64_t	u;
+	size_t		len;
+
+	stats_flush_latency = 0;
+	config_binary();
+	TEST_ASSERT_NOT_NULL(teststats.fp);
+	ZERO(addr);
+	SET_AF(&addr, AF_INET);
+	SET_ADDR4N(&addr, htonl(0xc0000201));
+	filegen_pack(&teststats, 60000U, 3600.5, &addr,
+		     ((l_fp)3900000000U << 32) | 0x80000000U, -6, ".GPS.");
+
+	len = read_file(binpath, buf, sizeof(buf));
+	TEST_ASSERT_EQUAL(hlen + 48, len);
+	TEST_ASSERT_EQUAL_MEMORY(header, buf, hlen);
+	rec = buf + hlen;
+	TEST_ASSERT_EQUAL_HEX8(0x60, rec[0]);	/* 60000 is 0xea60 */
+	TEST_ASSERT_EQUAL_HEX8(0xea, (uint8_t)rec[1]);
+	TEST_ASSERT_EQUAL_HEX8(0, rec[3]);
+	u = 0;
+	for (len = 0; len < 8; len++)
+		u |= (uint64_t)(uint8_t)rec[4 + len] << (8 * len);
+	memcpy(&d, &u, sizeof(d));
+	TEST_ASSERT_TRUE(3600.5 == d);
+	TEST_ASSERT_EQUAL_HEX8(0xff, (uint8_t)rec[12 + 10]);
+	TEST_ASSERT_EQUAL_HEX8(192, (uint8_t)rec[12 + 12]);
+	TEST_ASSERT_EQUAL_HEX8(1, rec[12 + 15]);
+	TEST_ASSERT_EQUAL_HEX8(0x80, (uint8_t)rec[28 + 3]);
+	TEST_ASSERT_EQUAL_HEX8(0xe8, (uint8_t)rec[28 + 7]); /* 0xe8754700 */
+	TEST_ASSERT_EQUAL_HEX8(0xfa, (uint8_t)rec[36]);
+	TEST_ASSERT_EQUAL_HEX8(0xff, (uint8_t)rec[39]);
+	TEST_ASSERT_EQUAL_STRING(".GPS.", rec + 40);
+
+	/* reopened, the file gets no second header */
+	teststats.flag = 0;
+	filegen_setup(&teststats, 0);
+	config_binary();
+	filegen_pack(&teststats, 60000U, 3601.5, NULL, (l_fp)0, 0, "");
+	TEST_ASSERT_EQUAL(hlen + 96, read_file(binpath, buf, sizeof(buf)));
+}
+
+
+TEST(filegen, PackNeedsBinary) {
+	stats_flush_latency = 0;
+	filegen_layout(&teststats, testlayout, (int)COUNTOF(testlayout));
+	filegen_pack(&teststats, 60000U, 0., NULL, (l_fp)0, 0, "");
+	TEST_ASSERT_EQUAL(0, file_size());
+}
+
+
+TEST(filegen, BinaryNeedsLayout) {
+	char	dirslash[sizeof(dir) + 1];
+
+	snprintf(dirslash, sizeof(dirslash), "%s/", dir);
+	filegen_config(&teststats, dirslash, "teststats", FILEGEN_NONE,
+		       FGEN_FLAG_ENABLED | FGEN_FLAG_BINARY);
+	TEST_ASSERT_EQUAL(FGEN_FLAG_ENABLED, teststats.flag);
+}
+
+TEST_GROUP_RUNNER(filegen) {
+	RUN_TEST_CASE(filegen, RecordsWaitForFlush);
+	RUN_TEST_CASE(filegen, ZeroLatencyWritesAtOnce);
+	RUN_TEST_CASE(filegen, HalfFullBufferIsWritten);
+	RUN_TEST_CASE(filegen, DisableWritesBuffered);
+	RUN_TEST_CASE(filegen, FlushSwitchesGeneration);
+	RUN_TEST_CASE(filegen, BinaryHeaderAndRecord);
+	RUN_TEST_CASE(filegen, PackNeedsBinary);
+	RUN_TEST_CASE(filegen, BinaryNeedsLayout);
+}
@@ -0,0 +1,325 @@
+#include "config.h"
+
+#include "ntpd.h"
+#include "ntp_lists.h"
+#include "recvbuff.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+/* Helper functions */
+
+static endpt	iface_a;
+static endpt	iface_b;
+
+static void
+from_addr4(struct recvbuf *rb, uint32_t addr, int secs)
+{
+	memset(rb, 0, sizeof(*rb));
+	SET_AF(&rb->recv_srcadr, AF_INET);
+	SET_PORT(&rb->recv_srcadr, 12345);
+	PSOCK_ADDR4(&rb->recv_srcadr)->s_addr = htonl(addr);
+	rb->recv_time = lfpinit(secs, 0);
+	rb->recv_pkt.li_vn_mode = PKT_LI_VN_MODE(0, NTP_VERSION, MODE_CLIENT);
+	rb->dstadr = &iface_a;
+	rb->cast_flags = MDF_UCAST;
+}
+
+static void
+from_addr6(struct recvbuf *rb, uint32_t low, int secs)
+{
+	from_addr4(rb, 0, secs);
+	SET_AF(&rb->recv_srcadr, AF_INET6);
+	PSOCK_ADDR6(&rb->recv_srcadr)->s6_addr[0] = 0x20;
+	PSOCK_ADDR6(&rb->recv_srcadr)->s6_addr[1] = 0x01;
+	PSOCK_ADDR6(&rb->recv_srcadr)->s6_addr[12] = (uint8_t)(low >> 24);
+	PSOCK_ADDR6(&rb->recv_srcadr)->s6_addr[13] = (uint8_t)(low >> 16);
+	PSOCK_ADDR6(&rb->recv_srcadr)->s6_addr[14] = (uint8_t)(low >> 8);
+	PSOCK_ADDR6(&rb->recv_srcadr)->s6_addr[15] = (uint8_t)low;
+}
+
+static u_int	saved_mindepth;
+static u_int	saved_maxdepth;
+static int	saved_pfx_rate;
+static int	saved_pfx_burst;
+
+TEST_GROUP(monitor);
+
+TEST_SETUP(monitor) {
+	saved_mindepth = mru_mindepth;
+	saved_maxdepth = mru_maxdepth;
+	saved_pfx_rate = mon_pfx_rate;
+	saved_pfx_burst = mon_pfx_burst;
+	init_mon();
+	mon_start(MON_ON);
+}
+
+TEST_TEAR_DOWN(monitor) {
+	mon_stop(MON_ON);
+	mru_mindepth = saved_mindepth;
+	mru_maxdepth = saved_maxdepth;
+	mon_pfx_rate = saved_pfx_rate;
+	mon_pfx_burst = saved_pfx_burst;
+}
+
+/* Tests */
+
+TEST(monitor, NewSourceIsFound) {
+	struct recvbuf rb;
+
+	from_addr4(&rb, 0x0a000001, 100);
+	ntp_monitor(&rb, 0);
+
+	TEST_ASSERT_EQUAL(1, mru_entries);
+	TEST_ASSERT_NOT_NULL(mon_lookup(&rb.recv_srcadr));
+	TEST_ASSERT_EQUAL(1, mon_lookup(&rb.recv_srcadr)->count);
+
+	from_addr4(&rb, 0x0a000002, 100);
+	TEST_ASSERT_NULL(mon_lookup(&rb.recv_srcadr));
+}
+
+
+TEST(monitor, RepeatedSourceIsCounted) {
+	struct recvbuf rb;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		from_addr4(&rb, 0x0a000001, 100 + 64 * i);
+		ntp_monitor(&rb, 0);
+	}
+
+	TEST_ASSERT_EQUAL(1, mru_entries);
+	TEST_ASSERT_EQUAL(3, mon_lookup(&rb.recv_srcadr)->count);
+}
+
+
+TEST(monitor, ManySourcesSurviveGrowthAndRemoval) {
+	struct recvbuf rb;
+	uint32_t i;
+
+	mru_mindepth = 20000;
+	mru_maxdepth = 20000;
+	for (i = 0; i < 5000; i++) {
+		from_addr4(&rb, 0x0a000000 + i * 7919, 100);
+		rb.dstadr = (i & 1) ? &iface_b : &iface_a;
+		ntp_monitor(&rb, 0);
+		from_addr6(&rb, i, 100);
+		rb.dstadr = (i & 1) ? &iface_b : &iface_a;
+		ntp_monitor(&rb, 0);
+	}
+	TEST_ASSERT_EQUAL(10000, mru_entries);
+
+	/* removal shifts neighbours back, all must still be found */
+	mon_clearinterface(&iface_b);
+	TEST_ASSERT_EQUAL(5000, mru_entries);
+	for (i = 0; i < 5000; i++) {
+		from_addr4(&rb, 0x0a000000 + i * 7919, 100);
+		TEST_ASSERT_EQUAL(!(i & 1),
+				  NULL != mon_lookup(&rb.recv_srcadr));
+		from_addr6(&rb, i, 100);
+		TEST_ASSERT_EQUAL(!(i & 1),
+				  NULL != mon_lookup(&rb.recv_srcadr));
+	}
+}
+
+
+TEST(monitor, MruListIsOrderedBySecond) {
+	struct recvbuf a, b, c;
+
+	from_addr4(&a, 0x0a000001, 101);
+	from_addr4(&b, 0x0a000002, 102);
+	from_addr4(&c, 0x0a000003, 103);
+	ntp_monitor(&a, 0);
+	ntp_monitor(&b, 0);
+	ntp_monitor(&c, 0);
+
+	/* a comes back in a new second and moves to the head */
+	a.recv_time = lfpinit(104, 0);
+	ntp_monitor(&a, 0);
+	TEST_ASSERT_EQUAL_PTR(mon_lookup(&a.recv_srcadr),
+			      HEAD_DLIST(mon_mru_list, mru));
+
+	/* b too, and then a again within the same second stays put */
+	b.recv_time = lfpinit(104, 0x40000000);
+	ntp_monitor(&b, 0);
+	a.recv_time = lfpinit(104, 0x80000000);
+	ntp_monitor(&a, 0);
+	TEST_ASSERT_EQUAL_PTR(mon_lookup(&b.recv_srcadr),
+			      HEAD_DLIST(mon_mru_list, mru));
+	TEST_ASSERT_EQUAL_PTR(mon_lookup(&c.recv_srcadr),
+			      TAIL_DLIST(mon_mru_list, mru));
+	TEST_ASSERT_EQUAL(3, mon_lookup(&a.recv_srcadr)->count);
+}
+
+
+TEST(monitor, OldestIsRecycledPastMaxage) {
+	struct recvbuf rb;
+
+	mru_mindepth = 2;
+	from_addr4(&rb, 0x0a000001, 100);
+	ntp_monitor(&rb, 0);
+	from_addr4(&rb, 0x0a000002, 200);
+	ntp_monitor(&rb, 0);
+
+	from_addr4(&rb, 0x0a000003, 100 + mru_maxage + 1);
+	ntp_monitor(&rb, 0);
+
+	TEST_ASSERT_EQUAL(2, mru_entries);
+	TEST_ASSERT_NOT_NULL(mon_lookup(&rb.recv_srcadr));
+	from_addr4(&rb, 0x0a000001, 0);
+	TEST_ASSERT_NULL(mon_lookup(&rb.recv_srcadr));
+}
+
+TEST(monitor, SequenceFollowsMruOrder) {
+	struct recvbuf rb;
+	mon_entry *mon;
+	uint64_t seq;
+	uint32_t i;
+
+	mru_mindepth = 1000;
+	for (i = 0; i < 100; i++) {
+		from_addr4(&rb, 0x0a000000 + i, 100);
+		ntp_monitor(&rb, 0);
+	}
+	/* every third comes back a second later */
+	for (i = 0; i < 100; i += 3) {
+		from_addr4(&rb, 0x0a000000 + i, 101);
+		ntp_monitor(&rb, 0);
+	}
+
+	seq = 0;
+	for (mon = TAIL_DLIST(mon_mru_list, mru); mon != NULL;
+	     mon = PREV_DLIST(mon_mru_list, mon, mru)) {
+		TEST_ASSERT_TRUE(mon->seq > seq);
+		seq = mon->seq;
+	}
+}
+
+
+TEST(monitor, SeqNextFindsResumePoint) {
+	struct recvbuf rb;
+	mon_entry *mon;
+	mon_entry *next;
+	uint64_t seq;
+	uint32_t i;
+
+	TEST_ASSERT_NULL(mon_seq_next(0));
+	mru_mindepth = 1000;
+	for (i = 0; i < 50; i++) {
+		from_addr4(&rb, 0x0a000000 + i, 100);
+		ntp_monitor(&rb, 0);
+	}
+	for (i = 0; i < 50; i += 7) {
+		from_addr4(&rb, 0x0a000000 + i, 101);
+		ntp_monitor(&rb, 0);
+	}
+
+	TEST_ASSERT_EQUAL_PTR(TAIL_DLIST(mon_mru_list, mru), mon_seq_next(0));
+	/* from just below every stamp, and from gaps left by moves */
+	for (mon = TAIL_DLIST(mon_mru_list, mru); mon != NULL; mon = next) {
+		next = PREV_DLIST(mon_mru_list, mon, mru);
+		for (seq = mon->seq; next != NULL && seq < next->seq; seq++)
+			TEST_ASSERT_EQUAL_PTR(next, mon_seq_next(seq));
+	}
+	seq = HEAD_DLIST(mon_mru_list, mru)->seq;
+	TEST_ASSERT_NULL(mon_seq_next(seq));
+}
+
+
+TEST(monitor, RankKeepsHighestKeys) {
+	mon_entry	entries[50];
+	mon_rank	ranks[5];
+	size_t		n;
+	size_t		i;
+
+	/* keys 0..49 in a scrambled order */
+	n = 0;
+	for (i = 0; i < COUNTOF(entries); i++)
+		n = mon_rank_add(ranks, n, COUNTOF(ranks), &entries[i],
+				 (double)((i * 17) % 50));
+	TEST_ASSERT_EQUAL(5, n);
+	mon_rank_sort(ranks, n);
+	for (i = 0; i < n; i++) {
+		TEST_ASSERT_TRUE(49. - i == ranks[i].key);
+		TEST_ASSERT_TRUE(ranks[i].key ==
+				 (double)(((ranks[i].mon - entries) * 17) % 50));
+	}
+
+	/* fewer entries than places */
+	n = mon_rank_add(ranks, 0, COUNTOF(ranks), &entries[0], 1.);
+	n = mon_rank_add(ranks, n, COUNTOF(ranks), &entries[1], 3.);
+	mon_rank_sort(ranks, n);
+	TEST_ASSERT_EQUAL(2, n);
+	TEST_ASSERT_EQUAL_PTR(&entries[1], ranks[0].mon);
+}
+
+
+TEST(monitor, RateIsPacketsPerSecond) {
+	struct recvbuf rb;
+	int i;
+
+	from_addr4(&rb, 0x0a000001, 100);
+	ntp_monitor(&rb, 0);
+	TEST_ASSERT_TRUE(0. == mon_rate(mon_lookup(&rb.recv_srcadr)));
+	for (i = 1; i <= 10; i++) {
+		from_addr4(&rb, 0x0a000001, 100 + 2 * i);
+		ntp_monitor(&rb, 0);
+	}
+	TEST_ASSERT_TRUE(0.5 == mon_rate(mon_lookup(&rb.recv_srcadr)));
+}
+
+
+TEST(monitor, PrefixIsLimitedAcrossAddresses) {
+	struct recvbuf rb;
+	u_short flags = RES_LIMITED | RES_KOD;
+	int i;
+
+	mon_pfx_rate = 2;
+	mon_pfx_burst = 4;
+
+	/* each address is new, so only the /24 as a whole can be over */
+	for (i = 1; i <= 4; i++) {
+		from_addr4(&rb, 0x0a010200 + i, 100);
+		TEST_ASSERT_EQUAL(0, ntp_monitor(&rb, flags) & flags);
+	}
+	from_addr4(&rb, 0x0a010205, 100);
+	TEST_ASSERT_EQUAL(flags, ntp_monitor(&rb, flags) & flags);
+	from_addr4(&rb, 0x0a010206, 100);
+	TEST_ASSERT_EQUAL(RES_LIMITED, ntp_monitor(&rb, flags) & flags);
+	TEST_ASSERT_EQUAL(RES_LIMITED,
+			  mon_lookup(&rb.recv_srcadr)->flags & flags);
+
+	/* other prefixes and unlimited sources are untouched */
+	from_addr4(&rb, 0x0a010301, 100);
+	TEST_ASSERT_EQUAL(0, ntp_monitor(&rb, flags) & flags);
+	from_addr4(&rb, 0x0a010207, 100);
+	TEST_ASSERT_EQUAL(0, ntp_monitor(&rb, RES_KOD) & flags);
+
+	/* the KoD was charged, so the next waits for another token */
+	from_addr4(&rb, 0x0a010208, 100);
+	rb.recv_time = lfpinit(100, 0x40000000);
+	TEST_ASSERT_EQUAL(RES_LIMITED, ntp_monitor(&rb, flags) & flags);
+	rb.recv_time = lfpinit(100, 0x80000000);
+	TEST_ASSERT_EQUAL(flags, ntp_monitor(&rb, flags) & flags);
+	from_addr4(&rb, 0x0a010209, 102);
+	TEST_ASSERT_EQUAL(0, ntp_monitor(&rb, flags) & flags);
+
+	mon_pfx_rate = 0;
+	for (i = 0; i < 10; i++) {
+		from_addr4(&rb, 0x0a010210 + i, 102);
+		TEST_ASSERT_EQUAL(0, ntp_monitor(&rb, flags) & flags);
+	}
+}
+
+TEST_GROUP_RUNNER(monitor) {
+	RUN_TEST_CASE(monitor, NewSourceIsFound);
+	RUN_TEST_CASE(monitor, RepeatedSourceIsCounted);
+	RUN_TEST_CASE(monitor, ManySourcesSurviveGrowthAndRemoval);
+	RUN_TEST_CASE(monitor, MruListIsOrderedBySecond);
+	RUN_TEST_CASE(monitor, OldestIsRecycledPastMaxage);
+	RUN_TEST_CASE(monitor, SequenceFollowsMruOrder);
+	RUN_TEST_CASE(monitor, SeqNextFindsResumePoint);
+	RUN_TEST_CASE(monitor, RankKeepsHighestKeys);
+	RUN_TEST_CASE(monitor, RateIsPacketsPerSecond);
+	RUN_TEST_CASE(monitor, PrefixIsLimitedAcrossAddresses);
+}
@@ -0,0 +1,210 @@
+#include "config.h"
+
+#include "ntpd.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+#include <linux/rtnetlink.h>
+
+#include <isc/interfaceiter.h>
+
+#define NO_SUCH_IFINDEX	99999
+
+/* a message as the kernel would send it, with room for attributes */
+static union {
+	struct nlmsghdr	nh;
+	char		buf[512];
+} msg;
+
+/* Helper functions */
+
+static void
+new_msg(int type, int family, int prefixlen, int flags)
+{
+	struct ifaddrmsg *ifa;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nh.nlmsg_type = (uint16_t)type;
+	msg.nh.nlmsg_len = NLMSG_LENGTH(sizeof(*ifa));
+	ifa = NLMSG_DATA(&msg.nh);
+	ifa->ifa_family = (uint8_t)family;
+	ifa->ifa_prefixlen = (uint8_t)prefixlen;
+	ifa->ifa_flags = (uint8_t)flags;
+	ifa->ifa_index = NO_SUCH_IFINDEX;
+}
+
+static void
+add_attr(int type, const void *data, size_t len)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr *)(msg.buf + NLMSG_ALIGN(msg.nh.nlmsg_len));
+	rta->rta_type = (uint16_t)type;
+	rta->rta_len = (uint16_t)RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	msg.nh.nlmsg_len = NLMSG_ALIGN(msg.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static void
+add_addr(int type, int family, const char *text)
+{
+	uint8_t addr[16];
+
+	TEST_ASSERT_EQUAL(1, inet_pton(family, text, addr));
+	add_attr(type, addr, (AF_INET == family) ? 4 : 16);
+}
+
+static void
+assert_addr(const char *expected, const isc_netaddr_t *addr)
+{
+	char text[INET6_ADDRSTRLEN];
+
+	TEST_ASSERT_NOT_NULL(inet_ntop((int)addr->family, &addr->type,
+				       text, sizeof(text)));
+	TEST_ASSERT_EQUAL_STRING(expected, text);
+}
+
+TEST_GROUP(netlink);
+
+TEST_SETUP(netlink) {}
+
+TEST_TEAR_DOWN(netlink) {}
+
+/* Tests */
+
+TEST(netlink, IPv4AddressWithLabel) {
+	isc_interface_t isc_if;
+
+	new_msg(RTM_NEWADDR, AF_INET, 24, 0);
+	add_addr(IFA_ADDRESS, AF_INET, "192.0.2.10");
+	add_addr(IFA_LOCAL, AF_INET, "192.0.2.10");
+	add_addr(IFA_BROADCAST, AF_INET, "192.0.2.255");
+	add_attr(IFA_LABEL, "eth0:1", sizeof("eth0:1"));
+
+	TEST_ASSERT_TRUE(netlink_ifaddr(&msg.nh, &isc_if));
+	TEST_ASSERT_EQUAL(AF_INET, isc_if.af);
+	TEST_ASSERT_EQUAL(NO_SUCH_IFINDEX, isc_if.ifindex);
+	TEST_ASSERT_EQUAL_STRING("eth0:1", isc_if.name);
+	assert_addr("192.0.2.10", &isc_if.address);
+	assert_addr("255.255.255.0", &isc_if.netmask);
+	assert_addr("192.0.2.255", &isc_if.broadcast);
+	assert_addr("0.0.0.0", &isc_if.dstaddress);
+}
+
+TEST(netlink, PointToPointUsesLocalAddress) {
+	isc_interface_t isc_if;
+
+	/* IFA_ADDRESS is the far end; the label has no terminator */
+	new_msg(RTM_NEWADDR, AF_INET, 32, 0);
+	add_addr(IFA_ADDRESS, AF_INET, "198.51.100.2");
+	add_addr(IFA_LOCAL, AF_INET, "198.51.100.1");
+	add_attr(IFA_LABEL, "ppp0", 4);
+
+	TEST_ASSERT_TRUE(netlink_ifaddr(&msg.nh, &isc_if));
+	TEST_ASSERT_EQUAL_STRING("", isc_if.name);
+	assert_addr("198.51.100.1", &isc_if.address);
+	assert_addr("255.255.255.255", &isc_if.netmask);
+	assert_addr("198.51.100.2", &isc_if.dstaddress);
+	assert_addr("198.51.100.2", &isc_if.broadcast);
+}
+
+TEST(netlink, IPv6LinkLocalGetsZone) {
+	isc_interface_t isc_if;
+
+	new_msg(RTM_NEWADDR, AF_INET6, 64, IFA_F_PERMANENT);
+	add_addr(IFA_ADDRESS, AF_INET6, "fe80::1");
+
+	TEST_ASSERT_TRUE(netlink_ifaddr(&msg.nh, &isc_if));
+	TEST_ASSERT_EQUAL(AF_INET6, isc_if.af);
+	assert_addr("fe80::1", &isc_if.address);
+	assert_addr("ffff:ffff:ffff:ffff::", &isc_if.netmask);
+	TEST_ASSERT_EQUAL(NO_SUCH_IFINDEX, isc_if.address.zone);
+
+	new_msg(RTM_NEWADDR, AF_INET6, 56, 0);
+	add_addr(IFA_ADDRESS, AF_INET6, "2001:db8::1");
+
+	TEST_ASSERT_TRUE(netlink_ifaddr(&msg.nh, &isc_if));
+	assert_addr("ffff:ffff:ffff:ff00::", &isc_if.netmask);
+	TEST_ASSERT_EQUAL(0, isc_if.address.zone);
+}
+
+TEST(netlink, TentativeAddressIsRejected) {
+	isc_interface_t isc_if;
+	uint32_t flags = IFA_F_TENTATIVE;
+
+	new_msg(RTM_NEWADDR, AF_INET6, 64, IFA_F_TENTATIVE);
+	add_addr(IFA_ADDRESS, AF_INET6, "2001:db8::2");
+	TEST_ASSERT_FALSE(netlink_ifaddr(&msg.nh, &isc_if));
+
+	new_msg(RTM_NEWADDR, AF_INET6, 64, IFA_F_DADFAILED);
+	add_addr(IFA_ADDRESS, AF_INET6, "2001:db8::2");
+	TEST_ASSERT_FALSE(netlink_ifaddr(&msg.nh, &isc_if));
+
+#ifdef IFA_FLAGS
+	/* the full flags word, when present, overrides ifa_flags */
+	new_msg(RTM_NEWADDR, AF_INET6, 64, 0);
+	add_addr(IFA_ADDRESS, AF_INET6, "2001:db8::2");
+	add_attr(IFA_FLAGS, &flags, sizeof(flags));
+	TEST_ASSERT_FALSE(netlink_ifaddr(&msg.nh, &isc_if));
+#else
+	UNUSED_LOCAL(flags);
+#endif
+}
+
+TEST(netlink, PrefixLengthBecomesMask) {
+	isc_interface_t isc_if;
+
+	new_msg(RTM_DELADDR, AF_INET, 20, 0);
+	add_addr(IFA_LOCAL, AF_INET, "10.1.2.3");
+	TEST_ASSERT_TRUE(netlink_ifaddr(&msg.nh, &isc_if));
+	assert_addr("255.255.240.0", &isc_if.netmask);
+
+	new_msg(RTM_DELADDR, AF_INET, 0, 0);
+	add_addr(IFA_LOCAL, AF_INET, "10.1.2.3");
+	TEST_ASSERT_TRUE(netlink_ifaddr(&msg.nh, &isc_if));
+	assert_addr("0.0.0.0", &isc_if.netmask);
+
+	/* a prefix longer than the address is clamped */
+	new_msg(RTM_DELADDR, AF_INET, 40, 0);
+	add_addr(IFA_LOCAL, AF_INET, "10.1.2.3");
+	TEST_ASSERT_TRUE(netlink_ifaddr(&msg.nh, &isc_if));
+	assert_addr("255.255.255.255", &isc_if.netmask);
+}
+
+TEST(netlink, MalformedMessageIsRejected) {
+	isc_interface_t isc_if;
+	uint8_t shortaddr[2] = { 10, 1 };
+
+	/* no address at all */
+	new_msg(RTM_NEWADDR, AF_INET, 24, 0);
+	TEST_ASSERT_FALSE(netlink_ifaddr(&msg.nh, &isc_if));
+
+	/* an address too short for the family */
+	add_attr(IFA_ADDRESS, shortaddr, sizeof(shortaddr));
+	TEST_ASSERT_FALSE(netlink_ifaddr(&msg.nh, &isc_if));
+
+	/* a family we don't serve */
+	new_msg(RTM_NEWADDR, AF_UNIX, 0, 0);
+	add_addr(IFA_ADDRESS, AF_INET, "10.1.2.3");
+	TEST_ASSERT_FALSE(netlink_ifaddr(&msg.nh, &isc_if));
+
+	/* truncated before the ifaddrmsg ends */
+	new_msg(RTM_NEWADDR, AF_INET, 24, 0);
+	add_addr(IFA_ADDRESS, AF_INET, "10.1.2.3");
+	msg.nh.nlmsg_len = NLMSG_LENGTH(1);
+	TEST_ASSERT_FALSE(netlink_ifaddr(&msg.nh, &isc_if));
+}
+
+TEST_GROUP_RUNNER(netlink) {
+	RUN_TEST_CASE(netlink, IPv4AddressWithLabel);
+	RUN_TEST_CASE(netlink, PointToPointUsesLocalAddress);
+	RUN_TEST_CASE(netlink, IPv6LinkLocalGetsZone);
+	RUN_TEST_CASE(netlink, TentativeAddressIsRejected);
+	RUN_TEST_CASE(netlink, PrefixLengthBecomesMask);
+	RUN_TEST_CASE(netlink, MalformedMessageIsRejected);
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
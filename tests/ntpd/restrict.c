@@ -21,6 +21,19 @@ create_sockaddr_u(unsigned short sin_port, const char* ip_addr)
 	return sockaddr;
 }
 
+static sockaddr_u
+create_sockaddr6_u(unsigned short sin_port, const char* ip_addr)
+{
+	sockaddr_u sockaddr;
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	SET_AF(&sockaddr, AF_INET6);
+	NSRCPORT(&sockaddr) = htons(sin_port);
+	inet_pton(AF_INET6, ip_addr, PSOCK_ADDR6(&sockaddr));
+
+	return sockaddr;
+}
+
 TEST_GROUP(hackrestrict);
 
 TEST_SETUP(hackrestrict) {
@@ -184,6 +197,190 @@ TEST(hackrestrict, RestrictUnflagWorks) {
 	TEST_ASSERT_EQUAL(1, restrictions(&resaddr));
 }
 
+
+TEST(hackrestrict, NtpOnlyNeedsNtpPort) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "11.22.0.0");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.255.0.0");
+	sockaddr_u from_ntp = create_sockaddr_u(NTP_PORT, "11.22.33.44");
+	sockaddr_u from_other = create_sockaddr_u(54321, "11.22.33.44");
+
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 2, 0);
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, RESM_NTPONLY, 4, 0);
+
+	TEST_ASSERT_EQUAL(4, restrictions(&from_ntp));
+	TEST_ASSERT_EQUAL(2, restrictions(&from_other));
+
+	/* without the plain entry the next shorter prefix applies */
+	hack_restrict(RESTRICT_REMOVE, &resaddr, &resmask, 0, 0, 0);
+
+	TEST_ASSERT_EQUAL(4, restrictions(&from_ntp));
+	TEST_ASSERT_EQUAL(0, restrictions(&from_other));
+}
+
+
+TEST(hackrestrict, LongestPrefixWins) {
+	static const char *masks[] = {
+		"255.0.0.0", "255.255.0.0", "255.255.255.0",
+		"255.255.255.255", "255.255.240.0", "255.128.0.0"
+	};
+	sockaddr_u target = create_sockaddr_u(54321, "11.22.33.44");
+	sockaddr_u resaddr = target;
+	sockaddr_u resmask;
+	sockaddr_u sibling = create_sockaddr_u(54321, "11.22.33.45");
+	size_t i;
+
+	/* entries of each length, added out of order, each bit its own */
+	for (i = 0; i < COUNTOF(masks); i++) {
+		resmask = create_sockaddr_u(54321, masks[i]);
+		hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0,
+			      (u_short)(1 << i), 0);
+	}
+
+	TEST_ASSERT_EQUAL(1 << 3, restrictions(&target));
+	TEST_ASSERT_EQUAL(1 << 2, restrictions(&sibling));
+
+	resmask = create_sockaddr_u(54321, masks[3]);
+	hack_restrict(RESTRICT_REMOVE, &resaddr, &resmask, 0, 0, 0);
+	resmask = create_sockaddr_u(54321, masks[2]);
+	hack_restrict(RESTRICT_REMOVE, &resaddr, &resmask, 0, 0, 0);
+
+	TEST_ASSERT_EQUAL(1 << 4, restrictions(&target));
+}
+
+
+TEST(hackrestrict, NonContiguousMaskMatches) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "11.0.33.0");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.0.255.0");
+	sockaddr_u prefix = create_sockaddr_u(54321, "11.0.0.0");
+	sockaddr_u prefixmask = create_sockaddr_u(54321, "255.0.0.0");
+	sockaddr_u target = create_sockaddr_u(54321, "11.22.33.44");
+	sockaddr_u other = create_sockaddr_u(54321, "11.22.34.44");
+
+	hack_restrict(RESTRICT_FLAGS, &prefix, &prefixmask, 0, 2, 0);
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 4, 0);
+
+	TEST_ASSERT_EQUAL(4, restrictions(&target));
+	TEST_ASSERT_EQUAL(2, restrictions(&other));
+
+	hack_restrict(RESTRICT_REMOVE, &resaddr, &resmask, 0, 0, 0);
+
+	TEST_ASSERT_EQUAL(2, restrictions(&target));
+}
+
+
+TEST(hackrestrict, ExpiredEntryIsNotMatched) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "11.22.33.44");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.255.255.255");
+
+	current_time = 100;
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 8, 110);
+
+	TEST_ASSERT_EQUAL(8, restrictions(&resaddr));
+
+	current_time = 110;
+	TEST_ASSERT_EQUAL(0, restrictions(&resaddr));
+
+	restrict_expire();
+	TEST_ASSERT_NULL(restrictlist4->link);
+	current_time = 0;
+}
+
+
+TEST(hackrestrict, ReaddingExpiredEntryRenewsIt) {
+	sockaddr_u resaddr = create_sockaddr_u(54321, "11.22.33.44");
+	sockaddr_u resmask = create_sockaddr_u(54321, "255.255.255.255");
+
+	current_time = 100;
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 8, 110);
+
+	/* added again before restrict_expire() has freed it */
+	current_time = 120;
+	hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask, 0, 4, 130);
+	restrict_expire();
+	TEST_ASSERT_EQUAL(4, restrictions(&resaddr));
+
+	current_time = 130;
+	restrict_expire();
+	TEST_ASSERT_NULL(restrictlist4->link);
+	current_time = 0;
+}
+
+
+TEST(hackrestrict, Ipv6PrefixMatches) {
+	sockaddr_u net = create_sockaddr6_u(54321, "2001:db8::");
+	sockaddr_u netmask = create_sockaddr6_u(54321, "ffff:ffff::");
+	sockaddr_u sub = create_sockaddr6_u(54321, "2001:db8:1::");
+	sockaddr_u submask = create_sockaddr6_u(54321, "ffff:ffff:ffff::");
+	sockaddr_u in_sub = create_sockaddr6_u(54321, "2001:db8:1::7");
+	sockaddr_u in_net = create_sockaddr6_u(54321, "2001:db8:2::7");
+	sockaddr_u outside = create_sockaddr6_u(54321, "2001:db9::7");
+
+	hack_restrict(RESTRICT_FLAGS, &sub, &submask, 0, 4, 0);
+	hack_restrict(RESTRICT_FLAGS, &net, &netmask, 0, 2, 0);
+
+	TEST_ASSERT_EQUAL(4, restrictions(&in_sub));
+	TEST_ASSERT_EQUAL(2, restrictions(&in_net));
+	TEST_ASSERT_EQUAL(0, restrictions(&outside));
+}
+
+
+/* the first entry on the sorted list is the one that should match */
+static u_short
+list_restrictions(sockaddr_u *addr)
+{
+	restrict_u *res;
+
+	for (res = restrictlist4; res != NULL; res = res->link)
+		if (res->u.v4.addr == (SRCADR(addr) & res->u.v4.mask)
+		    && (!(RESM_NTPONLY & res->mflags)
+			|| NTP_PORT == SRCPORT(addr)))
+			return res->flags;
+	return 0;
+}
+
+
+TEST(hackrestrict, TrieAgreesWithList) {
+	uint32_t seed = 12345;
+	sockaddr_u resaddr, resmask, target;
+	restrict_u *res;
+	int i, plen;
+
+#define NEXT_RAND()	(seed = seed * 1103515245 + 12345)
+	for (i = 0; i < 4000; i++) {
+		/* few distinct bits so prefixes nest, and no multicast */
+		NEXT_RAND();
+		plen = (int)(seed >> 8) % 33;
+		resaddr = create_sockaddr_u(NTP_PORT, "0.0.0.0");
+		resmask = resaddr;
+		NEXT_RAND();
+		PSOCK_ADDR4(&resaddr)->s_addr = htonl(seed & 0xd0f0f0ff);
+		PSOCK_ADDR4(&resmask)->s_addr =
+		    htonl(plen ? ~0U << (32 - plen) : 0);
+		if (i % 3 == 2) {
+			/* remove some entry already on the list */
+			for (res = restrictlist4; res->link != NULL
+			     && (seed & 0x700); seed -= 0x100)
+				res = res->link;
+			PSOCK_ADDR4(&resaddr)->s_addr = htonl(res->u.v4.addr);
+			PSOCK_ADDR4(&resmask)->s_addr = htonl(res->u.v4.mask);
+			hack_restrict(RESTRICT_REMOVE, &resaddr, &resmask,
+				      res->mflags, 0, 0);
+		} else
+			hack_restrict(RESTRICT_FLAGS, &resaddr, &resmask,
+				      (seed & 0x100) ? RESM_NTPONLY : 0,
+				      (u_short)(1 << (i % 16)), 0);
+
+		NEXT_RAND();
+		target = create_sockaddr_u((seed & 1) ? NTP_PORT : 54321,
+					   "0.0.0.0");
+		NEXT_RAND();
+		PSOCK_ADDR4(&target)->s_addr = htonl(seed & 0xd0f0f0ff);
+		TEST_ASSERT_EQUAL(list_restrictions(&target),
+				  restrictions(&target));
+	}
+#undef NEXT_RAND
+}
+
 TEST_GROUP_RUNNER(hackrestrict) {
 	RUN_TEST_CASE(hackrestrict, RestrictionsAreEmptyAfterInit);
 	RUN_TEST_CASE(hackrestrict, ReturnsCorrectDefaultRestrictions);
@@ -193,4 +390,11 @@ TEST_GROUP_RUNNER(hackrestrict) {
 	RUN_TEST_CASE(hackrestrict, TheMostFittingRestrictionIsMatched);
 	RUN_TEST_CASE(hackrestrict, DeletedRestrictionIsNotMatched);
 	RUN_TEST_CASE(hackrestrict, RestrictUnflagWorks);
+	RUN_TEST_CASE(hackrestrict, NtpOnlyNeedsNtpPort);
+	RUN_TEST_CASE(hackrestrict, LongestPrefixWins);
+	RUN_TEST_CASE(hackrestrict, NonContiguousMaskMatches);
+	RUN_TEST_CASE(hackrestrict, ExpiredEntryIsNotMatched);
+	RUN_TEST_CASE(hackrestrict, ReaddingExpiredEntryRenewsIt);
+	RUN_TEST_CASE(hackrestrict, Ipv6PrefixMatches);
+	RUN_TEST_CASE(hackrestrict, TrieAgreesWithList);
 }
@@ -0,0 +1,293 @@
+#include "config.h"
+
+#include "ntpd.h"
+
+#include "unity.h"
+#include "unity_fixture.h"
+
+#define DIFF(x, y) (SQUARE((x) - (y)))
+
+#define MAXPEERS	400
+
+static struct peer	peerstore[MAXPEERS];
+static uint32_t		lcg;
+
+/* Helper functions */
+
+static uint32_t
+next_random(void)
+{
+	lcg = lcg * 1103515245 + 12345;
+	return lcg >> 8;
+}
+
+static double
+uniform(double lo, double hi)
+{
+	return lo + (hi - lo) * (next_random() & 0xffffff) / 16777216.;
+}
+
+/*
+ * Fill n candidates, most of them scattered around a common offset
+ * and the rest anywhere within a second of it.
+ */
+static void
+make_candidates(peer_select *peers, int n)
+{
+	double	center = uniform(-0.5, 0.5);
+	double	spread = uniform(1e-6, 1e-2);
+	int	i;
+
+	for (i = 0; i < n; i++) {
+		struct peer *p = &peerstore[i];
+
+		ZERO(*p);
+		if (next_random() % 5)
+			p->offset = center + uniform(-spread, spread);
+		else
+			p->offset = center + uniform(-1., 1.);
+		p->jitter = uniform(1e-6, 1e-2);
+		if (0 == next_random() % 50)
+			p->flags |= FLAG_TRUE;
+		if (0 == next_random() % 50)
+			p->flags |= FLAG_PREFER;
+		peers[i].peer = p;
+		peers[i].error = p->jitter;
+		peers[i].synch = uniform(1e-3, 1e-1);
+	}
+}
+
+static void
+make_endpoints(const peer_select *peers, int n, struct endpoint *endpoint)
+{
+	int	i;
+
+	for (i = 0; i < n; i++) {
+		endpoint[2 * i].type = -1;
+		endpoint[2 * i].val = peers[i].peer->offset - peers[i].synch;
+		endpoint[2 * i + 1].type = 1;
+		endpoint[2 * i + 1].val = peers[i].peer->offset + peers[i].synch;
+	}
+}
+
+/*
+ * What clock_select() did before select_intersect(): a selection sort
+ * of indexes, then a scan from each end per number of falsetickers.
+ */
+static void
+reference_intersect(const struct endpoint *endpoint, int nlist,
+		    double *lowp, double *highp)
+{
+	int	indx[2 * MAXPEERS];
+	int	nl2 = 2 * nlist;
+	int	allow;
+	int	i, j, k, n;
+	double	e, low, high;
+
+	for (i = 0; i < nl2; i++)
+		indx[i] = i;
+	for (i = 0; i < nl2; i++) {
+		e = endpoint[indx[i]].val;
+		k = i;
+		for (j = i + 1; j < nl2; j++) {
+			if (endpoint[indx[j]].val < e) {
+				e = endpoint[indx[j]].val;
+				k = j;
+			}
+		}
+		if (k != i) {
+			j = indx[k];
+			indx[k] = indx[i];
+			indx[i] = j;
+		}
+	}
+
+	low = 1e9;
+	high = -1e9;
+	for (allow = 0; 2 * allow < nlist; allow++) {
+		n = 0;
+		for (i = 0; i < nl2; i++) {
+			low = endpoint[indx[i]].val;
+			n -= endpoint[indx[i]].type;
+			if (n >= nlist - allow)
+				break;
+		}
+		n = 0;
+		for (j = nl2 - 1; j >= 0; j--) {
+			high = endpoint[indx[j]].val;
+			n += endpoint[indx[j]].type;
+			if (n >= nlist - allow)
+				break;
+		}
+		if (high > low)
+			break;
+	}
+	*lowp = low;
+	*highp = high;
+}
+
+/*
+ * What clock_select() did before select_cluster(): every round
+ * recomputes every select jitter from scratch.
+ */
+static int
+reference_cluster(peer_select *peers, int nlist, int minclock, int maxclock)
+{
+	double	d, e, f, g;
+	int	i, j, k;
+
+	while (1) {
+		d = 1e9;
+		e = -1e9;
+		g = 0;
+		k = 0;
+		for (i = 0; i < nlist; i++) {
+			if (peers[i].error < d)
+				d = peers[i].error;
+			peers[i].seljit = 0;
+			if (nlist > 1) {
+				f = 0;
+				for (j = 0; j < nlist; j++)
+					f += DIFF(peers[j].peer->offset,
+					    peers[i].peer->offset);
+				peers[i].seljit = SQRT(f / (nlist - 1));
+			}
+			if (peers[i].seljit * peers[i].synch > e) {
+				g = peers[i].seljit;
+				e = peers[i].seljit * peers[i].synch;
+				k = i;
+			}
+		}
+		if (nlist <= max(1, minclock) || g <= d ||
+		    ((FLAG_TRUE | FLAG_PREFER) & peers[k].peer->flags))
+			break;
+
+		if (nlist > maxclock)
+			peers[k].peer->new_status = CTL_PST_SEL_EXCESS;
+		for (j = k + 1; j < nlist; j++)
+			peers[j - 1] = peers[j];
+		nlist--;
+	}
+	return nlist;
+}
+
+static void
+reset_status(int n)
+{
+	int	i;
+
+	for (i = 0; i < n; i++)
+		peerstore[i].new_status = CTL_PST_SEL_SELCAND;
+}
+
+TEST_GROUP(select);
+
+TEST_SETUP(select) {
+	lcg = 1;
+}
+
+TEST_TEAR_DOWN(select) {}
+
+/* Tests */
+
+TEST(select, NoCandidates) {
+	struct endpoint	endpoint[2];
+	int		reach[2];
+	double		low, high;
+
+	select_intersect(endpoint, 0, reach, &low, &high);
+	TEST_ASSERT_TRUE(high <= low);
+}
+
+
+TEST(select, IntersectionIsMajority) {
+	/* [0,2] [1,3] [10,12]: the first two agree on [1,2] */
+	struct endpoint	endpoint[6] = {
+		{ 10, -1 }, { 12, 1 }, { 0, -1 }, { 2, 1 }, { 1, -1 }, { 3, 1 }
+	};
+	int		reach[8];
+	double		low, high;
+
+	select_intersect(endpoint, 3, reach, &low, &high);
+	TEST_ASSERT_TRUE(1 == low);
+	TEST_ASSERT_TRUE(2 == high);
+}
+
+
+TEST(select, IntersectionMatchesReference) {
+	static peer_select	peers[MAXPEERS];
+	static struct endpoint	endpoint[2 * MAXPEERS];
+	static int		reach[2 * MAXPEERS + 2];
+	double			low, high, rlow, rhigh;
+	int			trial, n;
+
+	for (trial = 0; trial < 300; trial++) {
+		n = (trial < 100) ? trial % 10 : (int)(next_random() % MAXPEERS);
+		make_candidates(peers, n);
+		make_endpoints(peers, n, endpoint);
+		reference_intersect(endpoint, n, &rlow, &rhigh);
+		select_intersect(endpoint, n, reach, &low, &high);
+		TEST_ASSERT_TRUE(rlow == low);
+		TEST_ASSERT_TRUE(rhigh == high);
+	}
+}
+
+
+TEST(select, ClusterMatchesReference) {
+	static peer_select	peers[MAXPEERS];
+	static peer_select	rpeers[MAXPEERS];
+	static uint8_t		rstatus[MAXPEERS];
+	int			trial, n, i, nsurv, rsurv;
+	int			minclock, maxclock;
+
+	for (trial = 0; trial < 300; trial++) {
+		n = (trial < 100) ? trial % 12 : (int)(next_random() % MAXPEERS);
+		minclock = 1 + (int)(next_random() % 10);
+		maxclock = minclock + (int)(next_random() % 30);
+		make_candidates(peers, n);
+		memcpy(rpeers, peers, sizeof(peers));
+
+		reset_status(n);
+		rsurv = reference_cluster(rpeers, n, minclock, maxclock);
+		for (i = 0; i < n; i++)
+			rstatus[i] = peerstore[i].new_status;
+
+		reset_status(n);
+		nsurv = select_cluster(peers, n, minclock, maxclock);
+
+		TEST_ASSERT_EQUAL(rsurv, nsurv);
+		for (i = 0; i < nsurv; i++) {
+			TEST_ASSERT_EQUAL_PTR(rpeers[i].peer, peers[i].peer);
+			TEST_ASSERT_TRUE(rpeers[i].seljit == peers[i].seljit);
+		}
+		for (i = 0; i < n; i++)
+			TEST_ASSERT_EQUAL(rstatus[i], peerstore[i].new_status);
+	}
+}
+
+
+TEST(select, DuplicateOffsetsAgree) {
+	static peer_select	peers[MAXPEERS];
+	static peer_select	rpeers[MAXPEERS];
+	int			i, nsurv, n = 200;
+
+	/* identical sources, and a few pairs far out */
+	make_candidates(peers, n);
+	for (i = 0; i < n; i++) {
+		peers[i].peer->flags = 0;
+		peers[i].peer->offset = (i % 10) ? 0.001 : 0.25 * (i % 20);
+	}
+	memcpy(rpeers, peers, sizeof(peers));
+	nsurv = select_cluster(peers, n, 3, 10);
+	TEST_ASSERT_EQUAL(reference_cluster(rpeers, n, 3, 10), nsurv);
+	for (i = 0; i < nsurv; i++)
+		TEST_ASSERT_EQUAL_PTR(rpeers[i].peer, peers[i].peer);
+}
+
+TEST_GROUP_RUNNER(select) {
+	RUN_TEST_CASE(select, NoCandidates);
+	RUN_TEST_CASE(select, IntersectionIsMajority);
+	RUN_TEST_CASE(select, IntersectionMatchesReference);
+	RUN_TEST_CASE(select, ClusterMatchesReference);
+	RUN_TEST_CASE(select, DuplicateOffsetsAgree);
+}
@@ -0,0 +1,166 @@
+import socket
+import struct
+import threading
+import time
+import unittest
+import ntp.control
+import ntp.magic
+import ntp.packet
+
+
+def record(rtype, body):
+    return struct.pack("!BB", rtype, len(body) + 2) + body
+
+
+def v4(host, port):
+    return struct.pack("!BH", 4, port) + socket.inet_aton(host)
+
+
+def fragment(sequence, data, offset=0, more=False):
+    "A READVAR response fragment, as ntpd would send it."
+    r_e_m_op = 0x80 | (0x20 if more else 0) | ntp.control.CTL_OP_READVAR
+    data = ntp.packet.polybytes(data)
+    return struct.pack("!BBHHHHH", 0x16, r_e_m_op, sequence, 0, 0,
+                       offset, len(data)) \
+        + data + b"\x00" * (-len(data) % 4)
+
+
+class TestPylibPacketBinary(unittest.TestCase):
+
+    def test_records(self):
+        data = record(1, b"ab") + record(2, b"")
+        self.assertEqual(list(ntp.packet.bin_records(data)),
+                         [(1, b"\x01\x04ab"), (2, b"\x02\x02")])
+        # a length running past the end is refused
+        self.assertRaises(ntp.packet.ControlException, list,
+                          ntp.packet.bin_records(data + b"\x03\x09"))
+
+    def test_address(self):
+        rec = v4("192.0.2.1", 123)
+        self.assertEqual(ntp.packet.bin_address(rec, 0),
+                         ("192.0.2.1", 123, 7))
+        rec = b"\x00" + struct.pack("!BH", 6, 4460) \
+            + socket.inet_pton(socket.AF_INET6, "fe80::1") \
+            + struct.pack("!I", 3)
+        (host, port, offset) = ntp.packet.bin_address(rec, 1)
+        self.assertEqual(ntp.packet.bin_hostport(host, port),
+                         "[fe80::1%3]:4460")
+        self.assertEqual(offset, 24)
+        self.assertEqual(ntp.packet.bin_address(b"\x00", 0), ("", None, 1))
+        self.assertRaises(ntp.packet.ControlException,
+                          ntp.packet.bin_address, b"\x05", 0)
+
+    def test_resflags(self):
+        self.assertEqual(ntp.packet.bin_resflags(
+            ntp.magic.RESM_NTPONLY | ntp.magic.RESM_INTERFACE,
+            ntp.magic.RES_IGNORE), "ntpport interface ignore")
+        self.assertEqual(ntp.packet.bin_resflags(ntp.magic.RESM_NTPONLY, 0),
+                         "ntpport")
+        self.assertEqual(ntp.packet.bin_resflags(0, 0), "")
+
+    def test_mru_records(self):
+        session = ntp.packet.ControlSession()
+        session.response = (
+            record(ntp.control.CTL_BIN_NONCE, b"0123abcd") +
+            record(ntp.control.CTL_BIN_MRU,
+                   struct.pack("!BHIQIIII", 0x23, 0x80, 5, 42,
+                               0xee7ced50, 0x221492de, 0xee7ced49, 0) +
+                   v4("192.0.2.1", 40000)) +
+            record(ntp.control.CTL_BIN_CURSOR,
+                   struct.pack("!Q", 42) + v4("192.0.2.1", 40000)) +
+            record(ntp.control.CTL_BIN_NOW, struct.pack("!II", 1, 2)))
+        varlist = session._ControlSession__parse_mru_records()
+        self.assertEqual(list(varlist.items()), [
+            ("nonce", "0123abcd"),
+            ("addr.0", "192.0.2.1:40000"),
+            ("last.0", "0xee7ced50.221492de"),
+            ("first.0", "0xee7ced49.00000000"),
+            ("ct.0", 5),
+            ("mv.0", 0x23),
+            ("rs.0", 0x80),
+            ("seq.0", 42),
+            ("seq.cursor", 42),
+            ("addr.cursor", "192.0.2.1:40000"),
+            ("now", "0x00000001.00000002"),
+        ])
+
+    def test_multiplexer(self):
+        server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        server.bind(("127.0.0.1", 0))
+        results = []
+
+        def job(session, n):
+            try:
+                yield (ntp.control.CTL_OP_READVAR, 0, "")
+                results.append((n, ntp.packet.polystr(session.response)))
+            except ntp.packet.ControlException as e:
+                results.append((n, e.message))
+            finally:
+                session.close()
+
+        mux = ntp.packet.ControlMultiplexer(maxflight=2)
+        sessions = []
+        for n in range(3):
+            session = ntp.packet.ControlSession()
+            session.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            session.sock.connect(server.getsockname())
+            session.primary_timeout = session.secondary_timeout = 50
+            sessions.append(session)
+            mux.add(session, job(session, n))
+        # The replies can wait in the sockets before the requests go out.
+        # The second comes in two fragments, out of order; the third
+        # never comes.
+        server.sendto(fragment(1, "a=1"), sessions[0].sock.getsockname())
+        server.sendto(fragment(1, "c=3", offset=4),
+                      sessions[1].sock.getsockname())
+        server.sendto(fragment(1, "b=2,", more=True),
+                      sessions[1].sock.getsockname())
+        mux.run()
+        server.close()
+        self.assertEqual(sorted(results), [
+            (0, "a=1"),
+            (1, "b=2,c=3"),
+            (2, ntp.packet.SERR_TIMEOUT),
+        ])
+        self.assertFalse(any(s.havehost() for s in sessions))
+
+    def test_sync_multiplexer(self):
+        server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        server.bind(("127.0.0.1", 0))
+        silent = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        silent.bind(("127.0.0.1", 0))
+
+        def reply(origin):
+            return struct.pack("!BBBbIIIQQQQ", 0x24, 2, 6, -20, 0, 0, 0,
+                               0, origin, 1, 2)
+
+        def serve():
+            for n in range(2):
+                (data, address) = server.recvfrom(1024)
+                origin = struct.unpack("!Q", data[40:48])[0]
+                # A reply to nothing we asked must be ignored
+                server.sendto(reply(origin + 1), address)
+                server.sendto(reply(origin), address)
+
+        thread = threading.Thread(target=serve)
+        thread.start()
+        mux = ntp.packet.SyncMultiplexer(samples=2, timeout=0.2)
+        answered = mux.add("a", socket.AF_INET, server.getsockname())
+        unanswered = mux.add("b", socket.AF_INET, silent.getsockname())
+        mux.run()
+        thread.join()
+        self.assertEqual((answered.sent, len(answered.samples)), (2, 2))
+        self.assertEqual([p.hostname for p in answered.samples], ["a", "a"])
+        self.assertEqual((unanswered.sent, unanswered.samples), (2, []))
+
+        # Nothing is waited for past the deadline
+        mux = ntp.packet.SyncMultiplexer(timeout=5, deadline=0.1)
+        mux.add("b", socket.AF_INET, silent.getsockname())
+        start = time.time()
+        mux.run()
+        self.assertTrue(time.time() - start < 1)
+        server.close()
+        silent.close()
+
+if __name__ == '__main__':
+    unittest.main()
@@ -1,6 +1,38 @@
+import os
+import shutil
+import socket
+import struct
+import sys
+import tempfile
 import unittest
 import ntp.statfiles
 
+LOOPSTATS_HEADER = b"""ntpstats-binary 1 loopstats 48
+day I 4 %lu
+time d 8 %.3f
+offset d 8 %.9f
+freq d 8 %.6f
+jitter d 8 %.9f
+wander d 8 %.6f
+poll i 4 %d
+
+"""
+
+RAWSTATS_HEADER = b"""ntpstats-binary 1 rawstats 64
+day I 4 %lu
+time d 8 %.3f
+srcadr A 16 %s
+dstadr A 16 %s
+t1 Q 8 %.9f
+refid s 12 %s
+
+"""
+
+
+def loop_record(mjd, second, offset):
+    return struct.pack("<Idddddi", mjd, second, offset, -15.25, 1e-6,
+                       0.01, 6)
+
 
 class TestPylibStatfilesMethods(unittest.TestCase):
 
@@ -23,5 +55,209 @@ class TestPylibStatfilesMethods(unittest.TestCase):
             ntp.statfiles.iso_to_posix("2016-12-06T04:49:46")),
             "2016-12-06T04:49:46")
 
+
+
+class TestPylibStatfilesSummary(unittest.TestCase):
+
+    def test_percentiles(self):
+        summary = ntp.statfiles.Summary([float(x) for x in range(99, -1, -1)])
+        self.assertEqual(len(summary), 100)
+        self.assertEqual(summary.percentiles((100, 99, 50, 5, 0)),
+                         {"p100": 99.0, "p99": 99.0, "p50": 50.0,
+                          "p5": 5.0, "p0": 0.0})
+        self.assertEqual(ntp.statfiles.Summary([]).percentiles((50,)),
+                         {"p50": 0.0})
+        self.assertEqual(ntp.statfiles.Summary([3.5]).percentiles((1, 99)),
+                         {"p1": 3.5, "p99": 3.5})
+
+    def test_mean_pstdev(self):
+        summary = ntp.statfiles.Summary([2, 4, 4, 4, 5, 5, 7, 9])
+        self.assertEqual(summary.mean, 5.0)
+        self.assertEqual(summary.pstdev, 2.0)
+        summary = ntp.statfiles.Summary([1e-6])
+        self.assertEqual(summary.mean, 1e-6)
+        self.assertEqual(summary.pstdev, 0)
+        # far from zero, where a sum of squares would lose the spread
+        summary = ntp.statfiles.Summary([1e9 + 0.5, 1e9 - 0.5] * 1000)
+        self.assertEqual(summary.mean, 1e9)
+        self.assertEqual(summary.pstdev, 0.5)
+
+    @unittest.skipIf(ntp.statfiles.numpy is None, "numpy not installed")
+    def test_numpy_matches_array(self):
+        values = [((i * 7919) % 10007 - 5000) * 1.3e-9 + 1e-3
+                  for i in range(20000)]
+        with_numpy = ntp.statfiles.Summary(values)
+        saved = ntp.statfiles.numpy
+        try:
+            ntp.statfiles.numpy = None
+            without = ntp.statfiles.Summary(values)
+        finally:
+            ntp.statfiles.numpy = saved
+        percents = (100, 99, 95, 50, 5, 1, 0)
+        self.assertEqual(with_numpy.percentiles(percents),
+                         without.percentiles(percents))
+        self.assertEqual(with_numpy.mean, without.mean)
+        self.assertEqual(with_numpy.pstdev, without.pstdev)
+
+
+class TestPylibStatfilesBinary(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def write(self, name, data):
+        path = os.path.join(self.dir, name)
+        with open(path, "wb") as fp:
+            fp.write(data)
+        return path
+
+    def test_loopstats_rows(self):
+        # 60000 is 2023-02-25, 1677283200 POSIX
+        data = LOOPSTATS_HEADER
+        for i in range(100):
+            data += loop_record(60000, 64.0 * i + 0.0004, i * 1e-6)
+        data += loop_record(60000, 7000.0, 0)[:20]   # still being written
+        path = self.write("loopstats.bin.20230225", data)
+        self.assertTrue(ntp.statfiles.BinaryStats.is_binary(path))
+        stats = ntp.statfiles.BinaryStats(path)
+        self.assertEqual(len(stats), 100)
+        self.assertAlmostEqual(stats.time(1), 1677283264.0004, 6)
+
+        rows = stats.rows(1677283200 + 640, 1677283200 + 1280)
+        self.assertEqual(len(rows), 10)
+        self.assertEqual(rows[0], [1677283840000, "1677283840.0",
+                                   "0.000010000", "-15.250000",
+                                   "0.000001000", "0.010000", "6"])
+        self.assertEqual(stats.rows(0, 1), [])
+        self.assertEqual(len(stats.rows(0, 2e9)), 100)
+
+    def test_rawstats_fields(self):
+        data = RAWSTATS_HEADER + struct.pack(
+            "<Id16s16sQ12s", 60000, 1.5,
+            b"\0" * 10 + b"\xff\xff" + socket.inet_aton("192.0.2.1"),
+            b"\0" * 16, (3900000000 << 32) | 0xffffffff, b".GPS.")
+        stats = ntp.statfiles.BinaryStats(
+            self.write("rawstats.bin", data))
+        self.assertEqual(stats.rows(0, 2e9)[0][2:],
+                         ["192.0.2.1", "-", "3900000001.000000000",
+                          ".GPS."])
+
+    def test_not_binary(self):
+        path = self.write("loopstats.20230225",
+                          b"60000 64.000 0.0 0.0 0.0 0.0 6\n")
+        self.assertFalse(ntp.statfiles.BinaryStats.is_binary(path))
+        self.assertRaises(ValueError, ntp.statfiles.BinaryStats, path)
+
+    def test_ntpstats_mixes_text_and_binary(self):
+        self.write("loopstats.20230225",
+                   b"60000 0.000 0.000000001 -15.250000 0.000001000 "
+                   b"0.010000 6\n")
+        self.write("loopstats.bin.20230225",
+                   LOOPSTATS_HEADER + loop_record(60000, 64.0, 2e-9))
+        os.utime(self.dir, None)
+        stats = ntp.statfiles.NTPStats(self.dir, sitename="test",
+                                       starttime=1677283200,
+                                       endtime=1677283200 + 86400)
+        self.assertEqual([row[2] for row in stats.loopstats],
+                         ["0.000000001", "0.000000002"])
+
+
+class TestPylibStatfilesLoader(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def write(self, name, lines):
+        path = os.path.join(self.dir, name)
+        with open(path, "w") as fp:
+            fp.write("".join(lines))
+        return path
+
+    def test_file_span(self):
+        span = ntp.statfiles.file_span
+        day = 86400
+        # 2023-02-25 is 1677283200 POSIX
+        self.assertEqual(span("20230225"), (1677283200, 1677283200 + day))
+        self.assertEqual(span("bin.20230225"), span("20230225"))
+        self.assertEqual(span("20230225.gz"), span("20230225"))
+        # ISO week 8 of 2023 runs from Monday 20 February
+        self.assertEqual(span("2023w08"),
+                         (1677283200 - 5 * day, 1677283200 + 2 * day))
+        self.assertEqual(span("2023W08"), span("2023w08"))
+        self.assertEqual(span("202302"),
+                         (1675209600, 1675209600 + 28 * day))
+        self.assertEqual(span("202312")[1], span("2024")[0])
+        self.assertEqual(span("2023"), (1672531200, 1704067200))
+        self.assertEqual(span(""), None)
+        self.assertEqual(span("#1234"), None)
+        self.assertEqual(span("a00086400"), None)
+
+    def test_seek_text(self):
+        lines = ["60000 %d.000 x\n" % i for i in range(0, 86400, 4)]
+        path = self.write("loopstats.20230225", lines)
+        start = 1677283200 + 43200
+        offset = ntp.statfiles.seek_text(path, ntp.statfiles.NTPStats.mjd_time,
+                                         start)
+        self.assertTrue(0 < offset < os.path.getsize(path) // 2)
+        with open(path) as fp:
+            fp.seek(offset)
+            fp.readline()
+            rest = fp.read()
+        self.assertTrue(rest.find("60000 43200.000 x\n") < 65536)
+
+    def test_range_merge_and_laziness(self):
+        # two days of loopstats, one a day early, a line out of range
+        self.write("loopstats.20230224",
+                   ["59999 %d.000 %d\n" % (i, i) for i in range(0, 86400, 60)])
+        self.write("loopstats.20230225",
+                   ["60000 %d.000 %d\n" % (i, i) for i in range(0, 86400, 16)])
+        self.write("loopstats.20230301", ["60004 0.000 bad\n"])
+        self.write("temps", ["1677283260 cpu 41\n", "1677283300 cpu 40\n",
+                             "# comment\n", "1677369600.5 cpu 42\n"])
+        stats = ntp.statfiles.NTPStats(self.dir, sitename="test",
+                                       starttime=1677283200 - 600,
+                                       endtime=1677283200 + 86399)
+        self.assertNotIn("loopstats", stats.__dict__)
+        self.assertEqual(list(stats.logfiles("loopstats")),
+                         [os.path.join(self.dir, "loopstats.20230224"),
+                          os.path.join(self.dir, "loopstats.20230225")])
+        rows = stats.loopstats
+        self.assertIn("loopstats", stats.__dict__)
+        self.assertNotIn("peerstats", stats.__dict__)
+        self.assertEqual(len(rows), 10 + 5400)
+        self.assertEqual(rows[0][0], (1677283200 - 600) * 1000)
+        self.assertEqual(rows[-1][2], "86384")
+        self.assertEqual([r[0] for r in rows], sorted(r[0] for r in rows))
+        self.assertEqual([r[3] for r in stats.temps], ["41", "40"])
+        self.assertEqual(stats.gpsd, [])
+        self.assertRaises(AttributeError, getattr, stats, "nosuchstats")
+
+    def test_unreadable_file_is_skipped(self):
+        self.write("loopstats.20230224", ["59999 0.000 1\n"])
+        os.mkdir(os.path.join(self.dir, "loopstats.20230225"))
+        stats = ntp.statfiles.NTPStats(self.dir, sitename="test",
+                                       starttime=1677283200 - 86400,
+                                       endtime=1677283200 + 86399)
+        warnings = []
+
+        class Stderr:
+            def write(self, text):
+                warnings.append(text)
+        saved = sys.stderr
+        sys.stderr = Stderr()
+        try:
+            rows = stats.loopstats
+        finally:
+            sys.stderr = saved
+        self.assertEqual(len(rows), 1)
+        self.assertEqual(len(warnings), 1)
+        self.assertIn("could not read", warnings[0])
+
 if __name__ == '__main__':
     unittest.main()
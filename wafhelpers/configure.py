@@ -501,6 +501,26 @@ int main(int argc, char **argv) {
                                               prerequisites=ft[1],
                                               use=ft[2])
 
+    # Batched datagram I/O.  glibc only declares these under
+    # _GNU_SOURCE, so the generic function probe can't see them.
+    for func in ("recvmmsg", "sendmmsg"):
+        ctx.check_cc(
+            comment="Whether %s() exists" % func,
+            define_name="HAVE_%s" % func.upper(),
+            fragment="""
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <sys/socket.h>
+int main(void) {
+        void *p = (void*)(%s);
+        return p != NULL;
+}
+""" % func,
+            includes=ctx.env.PLATFORM_INCLUDES,
+            mandatory=False,
+            msg="Checking for function %s" % func,
+        )
+
     # Nobody uses the symbol, but this seems like a good sanity check.
     ctx.check_cc(header_name="stdbool.h", mandatory=True,
                  comment="Sanity check.")
@@ -532,6 +552,7 @@ int main(int argc, char **argv) {
         "semaphore.h",
         "stdatomic.h",
         "sys/clockctl.h",       # NetBSD
+        "sys/epoll.h",          # Linux
         "sys/ioctl.h",
         "sys/modem.h",      # Apple
         "sys/sockio.h",